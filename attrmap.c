@@ -0,0 +1,301 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "attrmap.h"
+#include "utils.h"
+#include <ctype.h>
+#include <strings.h>
+
+/* The field names, the classes they are valid for, and if they are integers. */
+static const struct {
+    const char *name;
+    int class;
+    bool integer;
+} attrmap_fields[FIELD_COUNT] = {
+    [FIELD_CONST] = {"-", ATTRMAP_PASSWD | ATTRMAP_GROUP, false},
+    [FIELD_PW_NAME] = {"pw_name", ATTRMAP_PASSWD, false},
+    [FIELD_PW_PASSWD] = {"pw_passwd", ATTRMAP_PASSWD, false},
+    [FIELD_PW_UID] = {"pw_uid", ATTRMAP_PASSWD, true},
+    [FIELD_PW_GID] = {"pw_gid", ATTRMAP_PASSWD, true},
+    [FIELD_PW_GECOS] = {"pw_gecos", ATTRMAP_PASSWD, false},
+    [FIELD_PW_CN] = {"pw_cn", ATTRMAP_PASSWD, false},
+    [FIELD_PW_DIR] = {"pw_dir", ATTRMAP_PASSWD, false},
+    [FIELD_PW_SHELL] = {"pw_shell", ATTRMAP_PASSWD, false},
+    [FIELD_SP_NAMP] = {"sp_namp", ATTRMAP_PASSWD, false},
+    [FIELD_SP_LSTCHG] = {"sp_lstchg", ATTRMAP_PASSWD, true},
+    [FIELD_SP_MIN] = {"sp_min", ATTRMAP_PASSWD, true},
+    [FIELD_SP_MAX] = {"sp_max", ATTRMAP_PASSWD, true},
+    [FIELD_SP_WARN] = {"sp_warn", ATTRMAP_PASSWD, true},
+    [FIELD_SP_INACT] = {"sp_inact", ATTRMAP_PASSWD, true},
+    [FIELD_SP_EXPIRE] = {"sp_expire", ATTRMAP_PASSWD, true},
+    [FIELD_SP_FLAG] = {"sp_flag", ATTRMAP_PASSWD, true},
+    [FIELD_GR_NAME] = {"gr_name", ATTRMAP_GROUP, false},
+    [FIELD_GR_PASSWD] = {"gr_passwd", ATTRMAP_GROUP, false},
+    [FIELD_GR_GID] = {"gr_gid", ATTRMAP_GROUP, true},
+    [FIELD_GR_MEM] = {"gr_mem", ATTRMAP_GROUP, false},
+};
+
+/* The default RFC2307 posixAccount and shadowAccount map. Note shadowAccount
+ * uses a shadow field so it is only there with a shadow entry. */
+static const attrmap_desc attrmap_passwd_default[] = {
+    {ATTR_OBJECTCLASS, FIELD_CONST, "top"},
+    {ATTR_OBJECTCLASS, FIELD_CONST, "account"},
+    {ATTR_OBJECTCLASS, FIELD_CONST, "posixAccount"},
+    {ATTR_OBJECTCLASS, FIELD_SP_NAMP, "shadowAccount"},
+    {ATTR_UID, FIELD_PW_NAME, NULL},
+    {ATTR_CN, FIELD_PW_CN, NULL},
+    {ATTR_USERPASSWORD, FIELD_PW_PASSWD, "{crypt}%s"},
+    {ATTR_UIDNUMBER, FIELD_PW_UID, NULL},
+    {ATTR_GIDNUMBER, FIELD_PW_GID, NULL},
+    {ATTR_GECOS, FIELD_PW_GECOS, NULL},
+    {ATTR_HOMEDIRECTORY, FIELD_PW_DIR, NULL},
+    {ATTR_LOGINSHELL, FIELD_PW_SHELL, NULL},
+    {ATTR_SHADOWLASTCHANGE, FIELD_SP_LSTCHG, NULL},
+    {ATTR_SHADOWMIN, FIELD_SP_MIN, NULL},
+    {ATTR_SHADOWMAX, FIELD_SP_MAX, NULL},
+    {ATTR_SHADOWWARNING, FIELD_SP_WARN, NULL},
+    {ATTR_SHADOWINACTIVE, FIELD_SP_INACT, NULL},
+    {ATTR_SHADOWEXPIRE, FIELD_SP_EXPIRE, NULL},
+    {ATTR_SHADOWFLAG, FIELD_SP_FLAG, NULL},
+};
+
+/* The default RFC2307 posixGroup map. */
+static const attrmap_desc attrmap_group_default[] = {
+    {ATTR_OBJECTCLASS, FIELD_CONST, "top"},
+    {ATTR_OBJECTCLASS, FIELD_CONST, "posixGroup"},
+    {ATTR_CN, FIELD_GR_NAME, NULL},
+    {ATTR_USERPASSWORD, FIELD_GR_PASSWD, "{crypt}%s"},
+    {ATTR_GIDNUMBER, FIELD_GR_GID, NULL},
+    {ATTR_MEMBERUID, FIELD_GR_MEM, NULL},
+};
+
+#define countof(a) (sizeof(a) / sizeof(*(a)))
+attrmap attrmap_passwd = { ATTRMAP_PASSWD, attrmap_passwd_default, countof(attrmap_passwd_default) };
+attrmap attrmap_group = { ATTRMAP_GROUP, attrmap_group_default, countof(attrmap_group_default) };
+
+/* Check a format only has "%s" and "%%" conversions. */
+static bool attrmap_isformat(const char *format)
+{
+    for (; (format = strchr(format, '%')); format += 2)
+        if (format[1] != 's' && format[1] != '%')
+            return false;
+    return true;
+}
+
+int attrmap_add(attrmap *map, const char *name, const char *field, const char *format)
+{
+    assert(map);
+    assert(name);
+    assert(field);
+    attrmap_desc *desc;
+    attrmap_field f;
+    attr_id id;
+    int i;
+
+    for (f = 0; f < FIELD_COUNT && strcmp(attrmap_fields[f].name, field); f++) ;
+    if (f == FIELD_COUNT || !(attrmap_fields[f].class & map->class) || (f == FIELD_CONST && !format)
+        || (format && !attrmap_isformat(format)))
+        return -1;
+    id = schema_id(name, strlen(name));
+    /* The virtual attributes are generated from the group memberships. */
+    if (id == ATTR_MEMBEROF || id == ATTR_MEMBER)
+        return -1;
+    /* The objectClass values must be constants for resolving filters. */
+    if (id == ATTR_OBJECTCLASS && (f != FIELD_CONST || strchr(format, '%')))
+        return -1;
+    /* New attributes are integers if they are an unformatted integer field. */
+    if (id == ATTR_UNKNOWN
+        && (id = schema_add(name, attrmap_fields[f].integer && !format ? ATTR_INTEGER : ATTR_CASEIGNORE)) == ATTR_UNKNOWN)
+        return -1;
+    /* Insert it after any others for the same attribute, keeping them sorted. */
+    desc = XNEW(attrmap_desc, map->count + 1);
+    for (i = 0; i < map->count && map->desc[i].id <= id; i++)
+        desc[i] = map->desc[i];
+    desc[i].id = id;
+    desc[i].field = f;
+    desc[i].format = format ? XSTRDUP(format) : NULL;
+    memcpy(desc + i + 1, map->desc + i, (map->count - i) * sizeof(*desc));
+    if (map->desc != attrmap_passwd_default && map->desc != attrmap_group_default)
+        free((void *)map->desc);
+    map->desc = desc;
+    map->count++;
+    return 0;
+}
+
+/* Get the next whitespace separated token from a string, or NULL if there are none. */
+static char *attrmap_token(char **s)
+{
+    char *t = *s + strspn(*s, " \t");
+    size_t len = strcspn(t, " \t");
+
+    if (!len)
+        return NULL;
+    *s = t + len;
+    if (**s)
+        *(*s)++ = '\0';
+    *s += strspn(*s, " \t");
+    return t;
+}
+
+int attrmap_load(const char *path)
+{
+    assert(path);
+    FILE *f = fopen(path, "r");
+    char *line = NULL, *s, *class, *name, *field;
+    size_t size = 0, len;
+    int n = 0, bad = 0;
+    attrmap *map;
+
+    if (!f) {
+        lwarn("failed to load %s", path);
+        return -1;
+    }
+    while (getline(&line, &size, f) != -1) {
+        n++;
+        /* Strip the trailing newline and whitespace. */
+        for (len = strlen(line); len && isspace((unsigned char)line[len - 1]); len--) ;
+        line[len] = '\0';
+        s = line;
+        if (!(class = attrmap_token(&s)) || *class == '#')
+            continue;
+        name = attrmap_token(&s);
+        field = attrmap_token(&s);
+        map = !strcmp(class, "passwd") ? &attrmap_passwd : !strcmp(class, "group") ? &attrmap_group : NULL;
+        if (!map || !name || !field || attrmap_add(map, name, field, *s ? s : NULL)) {
+            lwarnx("%s:%d: invalid attribute map", path, n);
+            bad++;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (bad)
+        return -1;
+    lnote("loaded %s with %d passwd and %d group attribute maps", path, attrmap_passwd.count, attrmap_group.count);
+    return 0;
+}
+
+/* Format a value into buf, truncating it to fit. */
+static const char *attrmap_format(const char *format, const char *v, char *buf)
+{
+    size_t n = 0, len;
+
+    for (; *format && n < ATTRMAP_VALUE_MAX - 1; format++) {
+        if (format[0] == '%' && format[1] == 's') {
+            len = min(strlen(v), ATTRMAP_VALUE_MAX - 1 - n);
+            memcpy(buf + n, v, len);
+            n += len;
+            format++;
+        } else {
+            /* A "%%" is a '%'. */
+            if (format[0] == '%')
+                format++;
+            buf[n++] = *format;
+        }
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+const char *attrmap_value(const attrmap_desc *d, const passwd_t *pw, const spwd_t *sp, const group_t *gr, int i,
+                          char *buf)
+{
+    assert(d);
+    assert(buf);
+    char tmp[ATTRMAP_VALUE_MAX];
+    const char *v = tmp;
+    long num = 0;
+    size_t len;
+
+    if ((i && d->field != FIELD_GR_MEM) || (attrmap_isshadow(d) && !sp))
+        return NULL;
+    switch (d->field) {
+    case FIELD_CONST:
+        v = "";
+        break;
+    case FIELD_PW_NAME:
+        v = pw->pw_name;
+        break;
+    case FIELD_PW_PASSWD:
+        v = sp ? sp->sp_pwdp : pw->pw_passwd;
+        break;
+    case FIELD_PW_GECOS:
+        v = pw->pw_gecos;
+        break;
+    case FIELD_PW_CN:
+        len = min(strcspn(pw->pw_gecos, ","), sizeof(tmp) - 1);
+        memcpy(tmp, pw->pw_gecos, len);
+        tmp[len] = '\0';
+        break;
+    case FIELD_PW_DIR:
+        v = pw->pw_dir;
+        break;
+    case FIELD_PW_SHELL:
+        v = pw->pw_shell;
+        break;
+    case FIELD_SP_NAMP:
+        v = sp->sp_namp;
+        break;
+    case FIELD_GR_NAME:
+        v = gr->gr_name;
+        break;
+    case FIELD_GR_PASSWD:
+        v = gr->gr_passwd;
+        break;
+    case FIELD_GR_MEM:
+        if (!(v = gr->gr_mem[i]))
+            return NULL;
+        break;
+    case FIELD_PW_UID:
+        num = pw->pw_uid;
+        break;
+    case FIELD_PW_GID:
+        num = pw->pw_gid;
+        break;
+    case FIELD_SP_LSTCHG:
+        num = sp->sp_lstchg;
+        break;
+    case FIELD_SP_MIN:
+        num = sp->sp_min;
+        break;
+    case FIELD_SP_MAX:
+        num = sp->sp_max;
+        break;
+    case FIELD_SP_WARN:
+        num = sp->sp_warn;
+        break;
+    case FIELD_SP_INACT:
+        num = sp->sp_inact;
+        break;
+    case FIELD_SP_EXPIRE:
+        num = sp->sp_expire;
+        break;
+    case FIELD_SP_FLAG:
+        num = (long)sp->sp_flag;
+        break;
+    case FIELD_GR_GID:
+        num = gr->gr_gid;
+        break;
+    default:
+        return NULL;
+    }
+    if (attrmap_fields[d->field].integer)
+        snprintf(tmp, sizeof(tmp), "%ld", num);
+    /* Record fields are returned directly, others are copied into buf. */
+    if (!d->format && v != tmp)
+        return v;
+    return attrmap_format(d->format ? d->format : "%s", v, buf);
+}
+
+bool attrmap_hasclass(const attrmap *map, const char *value)
+{
+    assert(map);
+    assert(value);
+
+    /* The objectClass descriptors are constants and always first. */
+    for (const attrmap_desc *d = map->desc; d < map->desc + map->count && d->id == ATTR_OBJECTCLASS; d++)
+        if (!strcasecmp(d->format, value))
+            return true;
+    return false;
+}
@@ -0,0 +1,120 @@
+/** \file attrmap.h
+ * The attribute maps from passwd, shadow, and group fields to attributes.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * An attrmap is a flat array of attrmap_desc descriptors, each giving an
+ * attribute, the record field its values come from, and an optional format for
+ * the values. Descriptors are sorted by attr_id, so the descriptors for an
+ * attribute with several of them, like the objectClass constants, are
+ * adjacent and the attributes are generated in attr_id order. Generating
+ * entries, comparing attributes, and resolving objectClass filters all use the
+ * same arrays, and generating an entry only visits the descriptors for the
+ * attributes in its attr_mask, so mapped attributes cost nothing for searches
+ * that don't select or filter on them.
+ *
+ * The attrmap_passwd and attrmap_group maps start with the RFC2307 posix
+ * schema. At startup attrmap_load() can add descriptors from a map file for
+ * custom schemas like inetOrgPerson or samba, with new attribute names added
+ * to the schema with schema_add(). Each line of a map file is:
+ *
+ *     <passwd|group> <attribute> <field> [<format>]
+ *
+ * The field is a struct passwd, spwd, or group member name like "pw_name",
+ * "pw_cn" for the first gecos field, or "-" for a constant format. The format
+ * is the rest of the line with each "%s" replaced by the field value and "%%"
+ * by "%". Shadow fields only have values for root with a shadow entry. Blank
+ * lines and lines starting with '#' are ignored. */
+#ifndef LIGHTLDAPD_ATTRMAP_H
+#define LIGHTLDAPD_ATTRMAP_H
+
+#include "files.h"
+#include "schema.h"
+
+#define ATTRMAP_VALUE_MAX 256   /**< The max length of a value. */
+#define ATTRMAP_PASSWD 1        /**< The class bit for passwd and shadow fields. */
+#define ATTRMAP_GROUP 2         /**< The class bit for group fields. */
+
+/** The attrmap_field sources of values. */
+typedef enum {
+    FIELD_CONST,                /**< The format as a constant. */
+    FIELD_PW_NAME,
+    FIELD_PW_PASSWD,            /**< The shadow sp_pwdp if available. */
+    FIELD_PW_UID,
+    FIELD_PW_GID,
+    FIELD_PW_GECOS,
+    FIELD_PW_CN,                /**< The first field of pw_gecos. */
+    FIELD_PW_DIR,
+    FIELD_PW_SHELL,
+    FIELD_SP_NAMP,
+    FIELD_SP_LSTCHG,
+    FIELD_SP_MIN,
+    FIELD_SP_MAX,
+    FIELD_SP_WARN,
+    FIELD_SP_INACT,
+    FIELD_SP_EXPIRE,
+    FIELD_SP_FLAG,
+    FIELD_GR_NAME,
+    FIELD_GR_PASSWD,
+    FIELD_GR_GID,
+    FIELD_GR_MEM,               /**< A value for each member. */
+    FIELD_COUNT                 /**< The number of fields. */
+} attrmap_field;
+
+/** The attrmap_desc class for an attribute's values from a field. */
+typedef struct {
+    attr_id id;                 /**< The attribute. */
+    attrmap_field field;        /**< The field the values come from. */
+    const char *format;         /**< The value format, or NULL for the field value. */
+} attrmap_desc;
+
+/** Check if an attrmap_desc has values only with a shadow entry. */
+#define attrmap_isshadow(d) (FIELD_SP_NAMP <= (d)->field && (d)->field <= FIELD_SP_FLAG)
+
+/** The attrmap class. */
+typedef struct {
+    int class;                  /**< The ATTRMAP_PASSWD or ATTRMAP_GROUP class. */
+    const attrmap_desc *desc;   /**< The descriptors sorted by attr_id. */
+    int count;                  /**< The number of descriptors. */
+} attrmap;
+extern attrmap attrmap_passwd;  /**< The map for passwd and shadow entries. */
+extern attrmap attrmap_group;   /**< The map for group entries. */
+
+/** Add a descriptor to an attrmap.
+ *
+ * \param map - The attrmap to add to.
+ *
+ * \param name - The attribute name, which is added to the schema if needed.
+ *
+ * \param field - The field name, or "-" for a constant.
+ *
+ * \param format - The value format, or NULL for the field value.
+ *
+ * \return 0 on success or -1 if it is invalid. */
+int attrmap_add(attrmap *map, const char *name, const char *field, const char *format);
+
+/** Add the descriptors in a map file to attrmap_passwd and attrmap_group.
+ *
+ * \return 0 on success or -1 on error. */
+int attrmap_load(const char *path);
+
+/** Get a value for an attrmap_desc from a record.
+ *
+ * \param d - The attrmap_desc to get the value for.
+ *
+ * \param pw, sp, gr - The passwd, optional shadow, and group records.
+ *
+ * \param i - The index of the value.
+ *
+ * \param buf - A buffer of ATTRMAP_VALUE_MAX for formatting the value.
+ *
+ * \return The value, or NULL if there is no value i. */
+const char *attrmap_value(const attrmap_desc *d, const passwd_t *pw, const spwd_t *sp, const group_t *gr, int i,
+                          char *buf);
+
+/** Check if an attrmap's entries have an objectClass value, ignoring case. */
+bool attrmap_hasclass(const attrmap *map, const char *value);
+
+#endif                          /* LIGHTLDAPD_ATTRMAP_H */
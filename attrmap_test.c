@@ -0,0 +1,137 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "attrmap.h"
+#include "utils.h"
+
+static char path[] = "/tmp/attrmap_test.XXXXXX";
+
+/* Get the values of an attribute from an attrmap joined with '|'. */
+static char *values(const attrmap *map, attr_id id, const passwd_t *pw, const spwd_t *sp, const group_t *gr,
+                    char *out)
+{
+    char buf[ATTRMAP_VALUE_MAX];
+    const char *v;
+
+    *out = '\0';
+    for (int d = 0; d < map->count; d++)
+        if (map->desc[d].id == id)
+            for (int i = 0; (v = attrmap_value(&map->desc[d], pw, sp, gr, i, buf)); i++)
+                strcat(strcat(out, *out ? "|" : ""), v);
+    return out;
+}
+
+int main(void)
+{
+    char *mem[] = { "alice", "bob", NULL };
+    char *nomem[] = { NULL };
+    passwd_t pw = {.pw_name = "bob",.pw_passwd = "x",.pw_uid = 1000,.pw_gid = 100,
+        .pw_gecos = "Bob Smith,Room 1,,",.pw_dir = "/home/bob",.pw_shell = "/bin/sh"
+    };
+    spwd_t sp = {.sp_namp = "bob",.sp_pwdp = "$6$hash",.sp_lstchg = 17000,.sp_min = 0,.sp_max = 99999,
+        .sp_warn = 7,.sp_inact = -1,.sp_expire = -1,.sp_flag = -1
+    };
+    group_t gr = {.gr_name = "users",.gr_passwd = "x",.gr_gid = 100,.gr_mem = mem };
+    char out[1024];
+    attr_id mail, emp, sid;
+    FILE *f;
+    int fd;
+
+    /* The default maps are sorted by attr_id. */
+    for (int i = 1; i < attrmap_passwd.count; i++)
+        assert(attrmap_passwd.desc[i - 1].id <= attrmap_passwd.desc[i].id);
+    for (int i = 1; i < attrmap_group.count; i++)
+        assert(attrmap_group.desc[i - 1].id <= attrmap_group.desc[i].id);
+    /* The default passwd values, with shadowAccount only with shadow. */
+    assert(!strcmp(values(&attrmap_passwd, ATTR_OBJECTCLASS, &pw, NULL, NULL, out), "top|account|posixAccount"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_OBJECTCLASS, &pw, &sp, NULL, out),
+                   "top|account|posixAccount|shadowAccount"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_UID, &pw, NULL, NULL, out), "bob"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_CN, &pw, NULL, NULL, out), "Bob Smith"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_USERPASSWORD, &pw, NULL, NULL, out), "{crypt}x"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_USERPASSWORD, &pw, &sp, NULL, out), "{crypt}$6$hash"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_UIDNUMBER, &pw, NULL, NULL, out), "1000"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_GECOS, &pw, NULL, NULL, out), "Bob Smith,Room 1,,"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_SHADOWMAX, &pw, NULL, NULL, out), ""));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_SHADOWMAX, &pw, &sp, NULL, out), "99999"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_SHADOWFLAG, &pw, &sp, NULL, out), "-1"));
+    assert(!strcmp(values(&attrmap_passwd, ATTR_MEMBERUID, &pw, &sp, NULL, out), ""));
+    /* The default group values, with a value per member. */
+    assert(!strcmp(values(&attrmap_group, ATTR_OBJECTCLASS, NULL, NULL, &gr, out), "top|posixGroup"));
+    assert(!strcmp(values(&attrmap_group, ATTR_CN, NULL, NULL, &gr, out), "users"));
+    assert(!strcmp(values(&attrmap_group, ATTR_GIDNUMBER, NULL, NULL, &gr, out), "100"));
+    assert(!strcmp(values(&attrmap_group, ATTR_MEMBERUID, NULL, NULL, &gr, out), "alice|bob"));
+    gr.gr_mem = nomem;
+    assert(!strcmp(values(&attrmap_group, ATTR_MEMBERUID, NULL, NULL, &gr, out), ""));
+    gr.gr_mem = mem;
+    /* The objectClasses. */
+    assert(attrmap_hasclass(&attrmap_passwd, "posixaccount"));
+    assert(attrmap_hasclass(&attrmap_passwd, "shadowAccount"));
+    assert(!attrmap_hasclass(&attrmap_passwd, "posixGroup"));
+    assert(attrmap_hasclass(&attrmap_group, "posixgroup"));
+    assert(attrmap_hasclass(&attrmap_group, "top"));
+    assert(!attrmap_hasclass(&attrmap_group, "inetOrgPerson"));
+
+    /* Invalid descriptors. */
+    assert(attrmap_add(&attrmap_passwd, "mail", "gr_name", NULL) == -1);
+    assert(attrmap_add(&attrmap_passwd, "mail", "pw_nope", NULL) == -1);
+    assert(attrmap_add(&attrmap_passwd, "mail", "-", NULL) == -1);
+    assert(attrmap_add(&attrmap_passwd, "mail", "pw_name", "%d@example.com") == -1);
+    assert(attrmap_add(&attrmap_passwd, "mail", "pw_name", "%s@example.com%") == -1);
+    assert(attrmap_add(&attrmap_passwd, "memberOf", "pw_name", NULL) == -1);
+    assert(attrmap_add(&attrmap_passwd, "objectClass", "pw_name", NULL) == -1);
+    assert(attrmap_add(&attrmap_passwd, "objectClass", "-", "%s") == -1);
+    assert(attrmap_add(&attrmap_passwd, "1mail", "pw_name", NULL) == -1);
+    assert(attrmap_passwd.count == 19 && schema_count == ATTR_COUNT);
+
+    /* Load a map file adding custom attributes and objectClasses. */
+    assert((fd = mkstemp(path)) >= 0);
+    assert((f = fdopen(fd, "w")));
+    fprintf(f, "# An inetOrgPerson map.\n\n");
+    fprintf(f, "passwd objectClass - inetOrgPerson\n");
+    fprintf(f, "passwd mail pw_name %%s@example.com  \n");
+    fprintf(f, "passwd  displayName\tpw_cn\n");
+    fprintf(f, "passwd employeeNumber pw_uid\n");
+    fprintf(f, "passwd sambaSID pw_uid S-1-5-21-1-%%s\n");
+    fprintf(f, "passwd mail pw_name 100%%%% %%s\n");
+    fprintf(f, "group description gr_name The %%s group\n");
+    assert(!fclose(f));
+    assert(attrmap_load(path) == 0);
+    assert((mail = schema_id("mail", 4)) >= ATTR_COUNT);
+    assert((emp = schema_id("EMPLOYEENUMBER", 14)) >= ATTR_COUNT);
+    assert((sid = schema_id("sambaSID", 8)) >= ATTR_COUNT);
+    assert(schema_id("displayName", 11) >= ATTR_COUNT && schema_id("description", 11) >= ATTR_COUNT);
+    assert(schema_count == ATTR_COUNT + 5);
+    /* Custom attributes get matching rules from the field and format. */
+    assert(schema_attrs[emp].flags == ATTR_INTEGER);
+    assert(schema_attrs[sid].flags == ATTR_CASEIGNORE);
+    assert(schema_equal(emp, "1000", 4, "01000", 5));
+    assert(schema_equal(mail, "Bob@Example.com", 15, "bob@example.com", 15));
+    /* The maps are still sorted with the custom attributes last. */
+    for (int i = 1; i < attrmap_passwd.count; i++)
+        assert(attrmap_passwd.desc[i - 1].id <= attrmap_passwd.desc[i].id);
+    assert(attrmap_passwd.count == 19 + 6 && attrmap_group.count == 6 + 1);
+    assert(attrmap_passwd.desc[attrmap_passwd.count - 1].id == sid);
+    assert(!strcmp(values(&attrmap_passwd, ATTR_OBJECTCLASS, &pw, NULL, NULL, out),
+                   "top|account|posixAccount|inetOrgPerson"));
+    assert(!strcmp(values(&attrmap_passwd, mail, &pw, NULL, NULL, out), "bob@example.com|100% bob"));
+    assert(!strcmp(values(&attrmap_passwd, schema_id("displayname", 11), &pw, NULL, NULL, out), "Bob Smith"));
+    assert(!strcmp(values(&attrmap_passwd, emp, &pw, NULL, NULL, out), "1000"));
+    assert(!strcmp(values(&attrmap_passwd, sid, &pw, NULL, NULL, out), "S-1-5-21-1-1000"));
+    assert(!strcmp(values(&attrmap_group, schema_id("description", 11), NULL, NULL, &gr, out), "The users group"));
+    assert(attrmap_hasclass(&attrmap_passwd, "inetorgperson"));
+    assert(!attrmap_hasclass(&attrmap_group, "inetorgperson"));
+
+    /* Invalid lines fail the load, but the valid ones are still added. */
+    assert((f = fopen(path, "w")));
+    fprintf(f, "passwd givenName pw_cn\nshadow sn pw_cn\npasswd sn\ngroup gidNumber pw_gid\n");
+    assert(!fclose(f));
+    assert(attrmap_load(path) == -1);
+    assert(schema_id("givenName", 9) >= ATTR_COUNT);
+    assert(attrmap_passwd.count == 19 + 7 && attrmap_group.count == 7);
+    assert(attrmap_load("/nonexistent/attrmap") == -1);
+    assert(!unlink(path));
+    return 0;
+}
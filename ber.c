@@ -0,0 +1,571 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "ber.h"
+#include "utils.h"
+
+/* The BER tags used in LDAP requests. */
+#define TAG_BOOLEAN 0x01
+#define TAG_INTEGER 0x02
+#define TAG_STRING 0x04
+#define TAG_ENUMERATED 0x0a
+#define TAG_SEQUENCE 0x30
+#define TAG_BIND 0x60
+#define TAG_UNBIND 0x42
+#define TAG_SEARCH 0x63
+#define TAG_COMPARE 0x6e
+#define TAG_ABANDON 0x50
+#define TAG_EXTENDED 0x77
+#define TAG_CONTROLS 0xa0
+/* Context tags are 0x80 primitive or 0xa0 constructed plus the number. */
+#define TAG_CONTEXT(n) (0x80 | (n))
+#define TAG_CONTEXTC(n) (0xa0 | (n))
+
+/* A SET OF or SEQUENCE OF with any element type. */
+typedef A_SET_OF(void) ber_list;
+
+/* The decoder state for a message. */
+typedef struct {
+    ber_arena *arena;           /* The arena to allocate from. */
+    bool nomem;                 /* If the arena was too small. */
+    unsigned char **nul;        /* The string terminators to set. */
+    int nuls;                   /* The number of string terminators. */
+} ber_decoder;
+
+void ber_pool_init(ber_pool *pool)
+{
+    assert(pool);
+
+    memset(pool, 0, sizeof(*pool));
+}
+
+void ber_pool_done(ber_pool *pool)
+{
+    assert(pool);
+    ber_arena *a;
+
+    while ((a = pool->free)) {
+        pool->free = a->next;
+        free(a);
+    }
+    pool->count = 0;
+}
+
+/* Get an empty arena, from the pool if it is BER_ARENA_SIZE. */
+static ber_arena *ber_arena_new(ber_pool *pool, size_t size)
+{
+    ber_arena *a;
+
+    if (size == BER_ARENA_SIZE && (a = pool->free)) {
+        pool->free = a->next;
+        pool->count--;
+    } else {
+        a = XNEW(char, sizeof(ber_arena) + size);
+        a->size = size;
+        pool->allocs++;
+    }
+    memset(&a->message, 0, sizeof(a->message));
+    a->next = NULL;
+    a->used = 0;
+    return a;
+}
+
+void ber_arena_free(ber_pool *pool, ber_arena *arena)
+{
+    assert(pool);
+
+    if (arena && arena->size == BER_ARENA_SIZE && pool->count < BER_POOL_MAX) {
+        arena->next = pool->free;
+        pool->free = arena;
+        pool->count++;
+    } else {
+        free(arena);
+    }
+}
+
+/* Allocate zeroed memory from the arena, or NULL if it is full. */
+static void *ber_alloc(ber_decoder *d, size_t size)
+{
+    ber_arena *a = d->arena;
+    size_t used = (a->used + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+    if (used + size > a->size) {
+        d->nomem = true;
+        return NULL;
+    }
+    a->used = used + size;
+    return memset(a->data + used, 0, size);
+}
+
+/* Get the tag and length of the TLV at *p, advancing *p to the contents.
+ *
+ * \return 1 for a complete header, 0 if more data is needed, or -1 if the
+ * header is invalid. */
+static int ber_header(const unsigned char **p, const unsigned char *end, int *tag, size_t *len)
+{
+    const unsigned char *s = *p;
+    int n;
+
+    if (end - s < 2)
+        return 0;
+    *tag = *s++;
+    /* High tag numbers are never used by LDAP. */
+    if ((*tag & 0x1f) == 0x1f)
+        return -1;
+    if (*s < 0x80) {
+        *len = *s++;
+    } else {
+        /* Indefinite lengths and lengths over 4 bytes are not allowed. */
+        n = *s++ & 0x7f;
+        if (!n || n > 4)
+            return -1;
+        if (end - s < n)
+            return 0;
+        for (*len = 0; n--;)
+            *len = *len << 8 | *s++;
+    }
+    *p = s;
+    return 1;
+}
+
+/* Get the tag of the next element, or -1 if there are none. */
+static inline int ber_peek(const unsigned char *p, const unsigned char *end)
+{
+    return p < end ? *p : -1;
+}
+
+/* Get the contents of the next element with a tag, advancing *p past it. */
+static bool ber_next(const unsigned char **p, const unsigned char *end, int tag, const unsigned char **val,
+                     size_t *len)
+{
+    const unsigned char *s = *p;
+    int t;
+
+    if (ber_header(&s, end, &t, len) != 1 || t != tag || *len > (size_t)(end - s))
+        return false;
+    *val = s;
+    *p = s + *len;
+    return true;
+}
+
+/* Count the elements in the contents of a constructed element, or -1 if invalid. */
+static int ber_count(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *val;
+    size_t len;
+    int n;
+
+    for (n = 0; p < end; n++)
+        if (!ber_next(&p, end, ber_peek(p, end), &val, &len))
+            return -1;
+    return n;
+}
+
+/* Allocate the array and count elements of a list, returning the elements. */
+static void *ber_list_new(ber_decoder *d, void *list, int count, size_t size)
+{
+    ber_list *l = list;
+    char *v = ber_alloc(d, count * size);
+
+    if (!v || !(l->array = ber_alloc(d, count * sizeof(*l->array))))
+        return NULL;
+    for (int i = 0; i < count; i++)
+        l->array[i] = v + i * size;
+    l->count = l->size = count;
+    return v;
+}
+
+/* Get the value of INTEGER contents that fit in a long. */
+static bool ber_intval(const unsigned char *val, size_t len, long *v)
+{
+    unsigned long u;
+
+    if (!len || len > sizeof(long))
+        return false;
+    for (u = (*val & 0x80) ? ~0UL : 0UL; len--;)
+        u = u << 8 | *val++;
+    *v = (long)u;
+    return true;
+}
+
+/* Decode an INTEGER or ENUMERATED that fits in a long. */
+static bool ber_int(const unsigned char **p, const unsigned char *end, int tag, long *v)
+{
+    const unsigned char *val;
+    size_t len;
+
+    return ber_next(p, end, tag, &val, &len) && ber_intval(val, len, v);
+}
+
+/* Decode a BOOLEAN. */
+static bool ber_bool(const unsigned char **p, const unsigned char *end, int tag, BOOLEAN_t *v)
+{
+    const unsigned char *val;
+    size_t len;
+
+    if (!ber_next(p, end, tag, &val, &len) || len != 1)
+        return false;
+    *v = *val;
+    return true;
+}
+
+/* Set an OCTET STRING to the contents in the message copy. */
+static void ber_setstr(ber_decoder *d, OCTET_STRING_t *s, const unsigned char *val, size_t len)
+{
+    s->buf = (unsigned char *)val;
+    s->size = len;
+    /* The byte after the contents is terminated after decoding. */
+    d->nul[d->nuls++] = s->buf + len;
+}
+
+/* Decode an OCTET STRING. */
+static bool ber_str(ber_decoder *d, const unsigned char **p, const unsigned char *end, int tag, OCTET_STRING_t *s)
+{
+    const unsigned char *val;
+    size_t len;
+
+    if (!ber_next(p, end, tag, &val, &len))
+        return false;
+    ber_setstr(d, s, val, len);
+    return true;
+}
+
+/* Decode an optional OCTET STRING if the next element has the tag. */
+static bool ber_optstr(ber_decoder *d, const unsigned char **p, const unsigned char *end, int tag,
+                       OCTET_STRING_t **s)
+{
+    if (ber_peek(*p, end) != tag)
+        return true;
+    return (*s = ber_alloc(d, sizeof(**s))) && ber_str(d, p, end, tag, *s);
+}
+
+/* Decode an AttributeValueAssertion's contents. */
+static bool ber_ava(ber_decoder *d, const unsigned char **p, const unsigned char *end, AttributeValueAssertion_t *ava)
+{
+    return ber_str(d, p, end, TAG_STRING, &ava->attributeDesc) && ber_str(d, p, end, TAG_STRING, &ava->assertionValue);
+}
+
+/* Decode a SubstringFilter's contents. */
+static bool ber_substrings(ber_decoder *d, const unsigned char **p, const unsigned char *end, SubstringFilter_t *sf)
+{
+    const unsigned char *val, *e;
+    size_t len;
+    SubstringValue_t *v;
+    int n, tag;
+
+    if (!ber_str(d, p, end, TAG_STRING, &sf->type) || !ber_next(p, end, TAG_SEQUENCE, &val, &len))
+        return false;
+    e = val + len;
+    if ((n = ber_count(val, e)) < 0 || !(v = ber_list_new(d, &sf->substrings.list, n, sizeof(*v))))
+        return false;
+    for (int i = 0; i < n; i++) {
+        tag = ber_peek(val, e);
+        if (tag < TAG_CONTEXT(0) || tag > TAG_CONTEXT(2) || !ber_str(d, &val, e, tag, &v[i].choice.initial))
+            return false;
+        v[i].present = SubstringValue_PR_initial + (tag - TAG_CONTEXT(0));
+    }
+    return true;
+}
+
+/* Decode a MatchingRuleAssertion's contents. */
+static bool ber_mra(ber_decoder *d, const unsigned char **p, const unsigned char *end, MatchingRuleAssertion_t *mra)
+{
+    if (!ber_optstr(d, p, end, TAG_CONTEXT(1), &mra->matchingRule) ||
+        !ber_optstr(d, p, end, TAG_CONTEXT(2), &mra->type) ||
+        !ber_str(d, p, end, TAG_CONTEXT(3), &mra->matchValue))
+        return false;
+    if (ber_peek(*p, end) == TAG_CONTEXT(4))
+        return (mra->dnAttributes = ber_alloc(d, sizeof(BOOLEAN_t))) &&
+            ber_bool(p, end, TAG_CONTEXT(4), mra->dnAttributes);
+    return true;
+}
+
+/* Decode a Filter nested depth deep. */
+static bool ber_filter(ber_decoder *d, const unsigned char **p, const unsigned char *end, Filter_t *f, int depth)
+{
+    const unsigned char *val, *e;
+    size_t len;
+    int n, tag = ber_peek(*p, end);
+    Filter_t *v;
+
+    if (depth > BER_DEPTH_MAX || !ber_next(p, end, tag, &val, &len))
+        return false;
+    e = val + len;
+    switch (tag) {
+    case TAG_CONTEXTC(0):
+    case TAG_CONTEXTC(1):
+        f->present = tag == TAG_CONTEXTC(0) ? Filter_PR_and : Filter_PR_or;
+        if ((n = ber_count(val, e)) < 0 ||
+            !(v = ber_list_new(d, tag == TAG_CONTEXTC(0) ? (void *)&f->choice.And.list : (void *)&f->choice.Or.list,
+                               n, sizeof(*v))))
+            return false;
+        for (int i = 0; i < n; i++)
+            if (!ber_filter(d, &val, e, &v[i], depth + 1))
+                return false;
+        break;
+    case TAG_CONTEXTC(2):
+        f->present = Filter_PR_not;
+        if (!(f->choice.Not = ber_alloc(d, sizeof(Filter_t))) || !ber_filter(d, &val, e, f->choice.Not, depth + 1))
+            return false;
+        break;
+    case TAG_CONTEXTC(3):
+        f->present = Filter_PR_equalityMatch;
+        if (!ber_ava(d, &val, e, &f->choice.equalityMatch))
+            return false;
+        break;
+    case TAG_CONTEXTC(4):
+        f->present = Filter_PR_substrings;
+        if (!ber_substrings(d, &val, e, &f->choice.substrings))
+            return false;
+        break;
+    case TAG_CONTEXTC(5):
+        f->present = Filter_PR_greaterOrEqual;
+        if (!ber_ava(d, &val, e, &f->choice.greaterOrEqual))
+            return false;
+        break;
+    case TAG_CONTEXTC(6):
+        f->present = Filter_PR_lessOrEqual;
+        if (!ber_ava(d, &val, e, &f->choice.lessOrEqual))
+            return false;
+        break;
+    case TAG_CONTEXT(7):
+        f->present = Filter_PR_present;
+        ber_setstr(d, &f->choice.present, val, len);
+        val = e;
+        break;
+    case TAG_CONTEXTC(8):
+        f->present = Filter_PR_approxMatch;
+        if (!ber_ava(d, &val, e, &f->choice.approxMatch))
+            return false;
+        break;
+    case TAG_CONTEXTC(9):
+        f->present = Filter_PR_extensibleMatch;
+        if (!ber_mra(d, &val, e, &f->choice.extensibleMatch))
+            return false;
+        break;
+    default:
+        return false;
+    }
+    return val == e;
+}
+
+/* Decode a SEQUENCE OF LDAPString like an AttributeSelection. */
+static bool ber_strings(ber_decoder *d, const unsigned char **p, const unsigned char *end, void *list)
+{
+    const unsigned char *val, *e;
+    size_t len;
+    OCTET_STRING_t *v;
+    int n;
+
+    if (!ber_next(p, end, TAG_SEQUENCE, &val, &len))
+        return false;
+    e = val + len;
+    if ((n = ber_count(val, e)) < 0 || !(v = ber_list_new(d, list, n, sizeof(*v))))
+        return false;
+    for (int i = 0; i < n; i++)
+        if (!ber_str(d, &val, e, TAG_STRING, &v[i]))
+            return false;
+    return true;
+}
+
+/* Decode a BindRequest's contents. */
+static bool ber_bind(ber_decoder *d, const unsigned char **p, const unsigned char *end, BindRequest_t *req)
+{
+    AuthenticationChoice_t *auth = &req->authentication;
+    const unsigned char *val, *e;
+    size_t len;
+
+    if (!ber_int(p, end, TAG_INTEGER, &req->version) || !ber_str(d, p, end, TAG_STRING, &req->name))
+        return false;
+    if (ber_peek(*p, end) == TAG_CONTEXT(0)) {
+        auth->present = AuthenticationChoice_PR_simple;
+        return ber_str(d, p, end, TAG_CONTEXT(0), &auth->choice.simple);
+    }
+    auth->present = AuthenticationChoice_PR_sasl;
+    if (!ber_next(p, end, TAG_CONTEXTC(3), &val, &len))
+        return false;
+    e = val + len;
+    return ber_str(d, &val, e, TAG_STRING, &auth->choice.sasl.mechanism) &&
+        ber_optstr(d, &val, e, TAG_STRING, &auth->choice.sasl.credentials) && val == e;
+}
+
+/* Decode a SearchRequest's contents. */
+static bool ber_search(ber_decoder *d, const unsigned char **p, const unsigned char *end, SearchRequest_t *req)
+{
+    return ber_str(d, p, end, TAG_STRING, &req->baseObject) && ber_int(p, end, TAG_ENUMERATED, &req->scope) &&
+        ber_int(p, end, TAG_ENUMERATED, &req->derefAliases) && ber_int(p, end, TAG_INTEGER, &req->sizeLimit) &&
+        ber_int(p, end, TAG_INTEGER, &req->timeLimit) && ber_bool(p, end, TAG_BOOLEAN, &req->typesOnly) &&
+        ber_filter(d, p, end, &req->filter, 0) && ber_strings(d, p, end, &req->attributes.list);
+}
+
+/* Decode a CompareRequest's contents. */
+static bool ber_compare(ber_decoder *d, const unsigned char **p, const unsigned char *end, CompareRequest_t *req)
+{
+    const unsigned char *val;
+    size_t len;
+
+    return ber_str(d, p, end, TAG_STRING, &req->entry) && ber_next(p, end, TAG_SEQUENCE, &val, &len) &&
+        ber_ava(d, &val, *p, &req->ava) && val == *p;
+}
+
+/* Decode an ExtendedRequest's contents. */
+static bool ber_extended(ber_decoder *d, const unsigned char **p, const unsigned char *end, ExtendedRequest_t *req)
+{
+    return ber_str(d, p, end, TAG_CONTEXT(0), &req->requestName) &&
+        ber_optstr(d, p, end, TAG_CONTEXT(1), &req->requestValue);
+}
+
+/* Decode the Controls contents. */
+static bool ber_controls(ber_decoder *d, const unsigned char **p, const unsigned char *end, Controls_t *ctls)
+{
+    const unsigned char *val, *e;
+    size_t len;
+    Control_t *v;
+    int n;
+
+    if ((n = ber_count(*p, end)) < 0 || !(v = ber_list_new(d, &ctls->list, n, sizeof(*v))))
+        return false;
+    for (int i = 0; i < n; i++) {
+        if (!ber_next(p, end, TAG_SEQUENCE, &val, &len))
+            return false;
+        e = val + len;
+        if (!ber_str(d, &val, e, TAG_STRING, &v[i].controlType))
+            return false;
+        if (ber_peek(val, e) == TAG_BOOLEAN &&
+            (!(v[i].criticality = ber_alloc(d, sizeof(BOOLEAN_t))) || !ber_bool(&val, e, TAG_BOOLEAN, v[i].criticality)))
+            return false;
+        if (!ber_optstr(d, &val, e, TAG_STRING, &v[i].controlValue) || val != e)
+            return false;
+    }
+    return true;
+}
+
+/* Decode the LDAPMessage contents in the arena's message copy. */
+static bool ber_message(ber_decoder *d, const unsigned char *p, const unsigned char *end)
+{
+    LDAPMessage_t *msg = &d->arena->message;
+    struct LDAPMessage__protocolOp *op = &msg->protocolOp;
+    const unsigned char *val, *e;
+    size_t len;
+    int tag;
+    bool ok;
+
+    if (!ber_int(&p, end, TAG_INTEGER, &msg->messageID))
+        return false;
+    tag = ber_peek(p, end);
+    if (!ber_next(&p, end, tag, &val, &len))
+        return false;
+    e = val + len;
+    switch (tag) {
+    case TAG_BIND:
+        op->present = LDAPMessage__protocolOp_PR_bindRequest;
+        ok = ber_bind(d, &val, e, &op->choice.bindRequest);
+        break;
+    case TAG_UNBIND:
+        op->present = LDAPMessage__protocolOp_PR_unbindRequest;
+        ok = !len;
+        break;
+    case TAG_SEARCH:
+        op->present = LDAPMessage__protocolOp_PR_searchRequest;
+        ok = ber_search(d, &val, e, &op->choice.searchRequest);
+        break;
+    case TAG_COMPARE:
+        op->present = LDAPMessage__protocolOp_PR_compareRequest;
+        ok = ber_compare(d, &val, e, &op->choice.compareRequest);
+        break;
+    case TAG_ABANDON:
+        op->present = LDAPMessage__protocolOp_PR_abandonRequest;
+        ok = ber_intval(val, len, &op->choice.abandonRequest);
+        val = e;
+        break;
+    case TAG_EXTENDED:
+        op->present = LDAPMessage__protocolOp_PR_extendedReq;
+        ok = ber_extended(d, &val, e, &op->choice.extendedReq);
+        break;
+    default:
+        return false;
+    }
+    if (!ok || val != e)
+        return false;
+    if (ber_peek(p, end) == TAG_CONTROLS) {
+        if (!ber_next(&p, end, TAG_CONTROLS, &val, &len) || !(msg->controls = ber_alloc(d, sizeof(Controls_t))) ||
+            !ber_controls(d, &val, val + len, msg->controls))
+            return false;
+    }
+    return p == end;
+}
+
+/* Check if a complete message's protocolOp is a request we decode. */
+static bool ber_isrequest(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *val;
+    size_t len;
+
+    if (!ber_next(&p, end, TAG_INTEGER, &val, &len))
+        return true;            /* Let the decoder fail it. */
+    switch (ber_peek(p, end)) {
+    case TAG_BIND:
+    case TAG_UNBIND:
+    case TAG_SEARCH:
+    case TAG_COMPARE:
+    case TAG_ABANDON:
+    case TAG_EXTENDED:
+        return true;
+    }
+    return false;
+}
+
+ber_status ber_decode_request(ber_pool *pool, const void *buf, size_t len, size_t max, ber_arena **arena,
+                              size_t *consumed)
+{
+    assert(pool);
+    assert(buf);
+    assert(arena);
+    assert(consumed);
+    const unsigned char *p = buf, *end = p + len;
+    size_t mlen, hlen, size;
+    ber_decoder d;
+    unsigned char *copy;
+    int tag, r;
+
+    if ((r = ber_header(&p, end, &tag, &mlen)) < 0 || (r && tag != TAG_SEQUENCE))
+        return BER_FAIL;
+    if (!r)
+        return BER_WMORE;
+    hlen = p - (const unsigned char *)buf;
+    if (mlen > max - hlen) {
+        pool->others++;
+        return BER_OTHER;
+    }
+    if (mlen > (size_t)(end - p))
+        return BER_WMORE;
+    if (!ber_isrequest(p, p + mlen)) {
+        pool->others++;
+        return BER_OTHER;
+    }
+    /* Decode into arenas doubling in size until it fits. */
+    for (size = BER_ARENA_SIZE;; size *= 2) {
+        d.arena = ber_arena_new(pool, size);
+        d.nomem = false;
+        d.nuls = 0;
+        /* The copy has space for the last terminator, and there can't be
+         * more strings than half the content bytes. */
+        if ((copy = ber_alloc(&d, mlen + 1)) && (d.nul = ber_alloc(&d, (mlen / 2 + 1) * sizeof(*d.nul)))) {
+            memcpy(copy, p, mlen);
+            if (ber_message(&d, copy, copy + mlen))
+                break;
+        }
+        ber_arena_free(pool, d.arena);
+        if (!d.nomem)
+            return BER_FAIL;
+    }
+    /* Terminate the strings now the bytes after them are no longer needed. */
+    for (int i = 0; i < d.nuls; i++)
+        *d.nul[i] = '\0';
+    pool->decoded++;
+    *arena = d.arena;
+    *consumed = hlen + mlen;
+    return BER_OK;
+}
@@ -0,0 +1,87 @@
+/** \file ber.h
+ * A BER decoder for LDAP request messages into pooled arenas.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * This decodes the bind, unbind, search, compare, abandon and extended
+ * requests that lightldapd handles into the same asn1c LDAPMessage_t structs
+ * that asn1c's ber_decode() produces, so everything using them is unchanged.
+ * Instead of a malloc() for every node and string, a message is decoded into
+ * a ber_arena holding the LDAPMessage_t, a copy of the message bytes, and the
+ * nodes and SET OF arrays allocated from it. The string values point directly
+ * at their contents in the message copy, and are '\0' terminated in place
+ * after decoding by overwriting the tag byte that follows each of them.
+ *
+ * Arenas of BER_ARENA_SIZE come from a ber_pool free list and are returned to
+ * it with ber_arena_free(), so decoding typical requests allocates nothing.
+ * A message that doesn't fit is retried in larger arenas that are not pooled.
+ *
+ * Decoding is strict. Only definite lengths of up to 4 bytes and single byte
+ * tags are accepted, each element must have exactly the expected tag and
+ * fit inside its container, constructed elements must be fully consumed,
+ * and filters can nest at most BER_DEPTH_MAX deep. Other message types and
+ * messages larger than the receive buffer are left for asn1c to decode. */
+#ifndef LIGHTLDAPD_BER_H
+#define LIGHTLDAPD_BER_H
+
+#include <stddef.h>
+#include "asn1/LDAPMessage.h"
+
+#define BER_ARENA_SIZE 8192     /**< The pooled arena data size. */
+#define BER_POOL_MAX 64         /**< The max number of free arenas kept. */
+#define BER_DEPTH_MAX 32        /**< The max filter nesting depth. */
+
+/** The ber_decode_request() return status. */
+typedef enum {
+    BER_OK,                     /**< A message was decoded. */
+    BER_WMORE,                  /**< More data is needed. */
+    BER_FAIL,                   /**< The message is invalid. */
+    BER_OTHER                   /**< The message should be decoded by asn1c. */
+} ber_status;
+
+/** The ber_arena class for a decoded message. */
+typedef struct ber_arena ber_arena;
+struct ber_arena {
+    LDAPMessage_t message;      /**< The decoded message. */
+    ber_arena *next;            /**< The next arena in the pool free list. */
+    size_t size;                /**< The size of data. */
+    size_t used;                /**< The bytes of data used. */
+    _Alignas(max_align_t) unsigned char data[]; /**< The message copy and nodes. */
+};
+
+/** The ber_pool class for free arenas. */
+typedef struct {
+    ber_arena *free;            /**< The free list of arenas. */
+    int count;                  /**< The number of free arenas. */
+    unsigned long decoded;      /**< The messages decoded counter. */
+    unsigned long others;       /**< The messages left for asn1c counter. */
+    unsigned long allocs;       /**< The arenas allocated counter. */
+} ber_pool;
+/** Initialize an empty ber_pool. */
+void ber_pool_init(ber_pool *pool);
+/** Destroy a ber_pool freeing all the free arenas. */
+void ber_pool_done(ber_pool *pool);
+/** Return an arena and its decoded message to a ber_pool. */
+void ber_arena_free(ber_pool *pool, ber_arena *arena);
+
+/** Decode an LDAP request message at the start of a buffer.
+ *
+ * \param pool - The ber_pool to get the arena from.
+ *
+ * \param buf - The buffer with the received data.
+ *
+ * \param len - The length of the data in buf.
+ *
+ * \param max - The max message size, larger messages return BER_OTHER.
+ *
+ * \param arena - Set to the arena with the decoded message for BER_OK.
+ *
+ * \param consumed - Set to the length of the decoded message for BER_OK.
+ *
+ * \return The ber_status of the decode. */
+ber_status ber_decode_request(ber_pool *pool, const void *buf, size_t len, size_t max, ber_arena **arena,
+                              size_t *consumed);
+
+#endif                          /* LIGHTLDAPD_BER_H */
@@ -0,0 +1,185 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include "ber.h"
+#include "buffer.h"
+
+/* A simple BindRequest. */
+static const unsigned char bind_simple[] = {
+    0x30, 0x35, 0x02, 0x01, 0x01, 0x60, 0x30, 0x02, 0x01, 0x03, 0x04, 0x23, 0x75, 0x69, 0x64, 0x3d, 0x62, 0x6f,
+    0x62, 0x2c, 0x6f, 0x75, 0x3d, 0x70, 0x65, 0x6f, 0x70, 0x6c, 0x65, 0x2c, 0x64, 0x63, 0x3d, 0x65, 0x78, 0x61,
+    0x6d, 0x70, 0x6c, 0x65, 0x2c, 0x64, 0x63, 0x3d, 0x63, 0x6f, 0x6d, 0x80, 0x06, 0x73, 0x65, 0x63, 0x72, 0x65, 0x74
+};
+/* A SASL BindRequest with credentials. */
+static const unsigned char bind_sasl[] = {
+    0x30, 0x1d, 0x02, 0x01, 0x02, 0x60, 0x18, 0x02, 0x01, 0x03, 0x04, 0x00, 0xa3, 0x11, 0x04, 0x08, 0x45, 0x58,
+    0x54, 0x45, 0x52, 0x4e, 0x41, 0x4c, 0x04, 0x05, 0x63, 0x72, 0x65, 0x64, 0x73
+};
+/* A SearchRequest with every filter type and a paged results control. */
+static const unsigned char search[] = {
+    0x30, 0x81, 0xea, 0x02, 0x01, 0x03, 0x63, 0x81, 0xbc, 0x04, 0x11, 0x64, 0x63, 0x3d, 0x65, 0x78, 0x61, 0x6d,
+    0x70, 0x6c, 0x65, 0x2c, 0x64, 0x63, 0x3d, 0x63, 0x6f, 0x6d, 0x0a, 0x01, 0x02, 0x0a, 0x01, 0x00, 0x02, 0x01,
+    0x00, 0x02, 0x01, 0x00, 0x01, 0x01, 0x00, 0xa0, 0x81, 0x82, 0xa3, 0x1b, 0x04, 0x0b, 0x6f, 0x62, 0x6a, 0x65,
+    0x63, 0x74, 0x43, 0x6c, 0x61, 0x73, 0x73, 0x04, 0x0c, 0x70, 0x6f, 0x73, 0x69, 0x78, 0x41, 0x63, 0x63, 0x6f,
+    0x75, 0x6e, 0x74, 0xa1, 0x61, 0xa4, 0x10, 0x04, 0x03, 0x75, 0x69, 0x64, 0x30, 0x09, 0x80, 0x01, 0x62, 0x81,
+    0x01, 0x6f, 0x82, 0x01, 0x62, 0x87, 0x02, 0x63, 0x6e, 0xa5, 0x11, 0x04, 0x09, 0x75, 0x69, 0x64, 0x4e, 0x75,
+    0x6d, 0x62, 0x65, 0x72, 0x04, 0x04, 0x31, 0x30, 0x30, 0x30, 0xa6, 0x11, 0x04, 0x09, 0x75, 0x69, 0x64, 0x4e,
+    0x75, 0x6d, 0x62, 0x65, 0x72, 0x04, 0x04, 0x32, 0x30, 0x30, 0x30, 0xa8, 0x09, 0x04, 0x02, 0x63, 0x6e, 0x04,
+    0x03, 0x62, 0x6f, 0x62, 0xa2, 0x18, 0xa9, 0x16, 0x81, 0x08, 0x32, 0x2e, 0x35, 0x2e, 0x31, 0x33, 0x2e, 0x32,
+    0x82, 0x02, 0x63, 0x6e, 0x83, 0x03, 0x42, 0x6f, 0x62, 0x84, 0x01, 0xff, 0xa0, 0x00, 0x30, 0x13, 0x04, 0x03,
+    0x75, 0x69, 0x64, 0x04, 0x02, 0x63, 0x6e, 0x04, 0x08, 0x6d, 0x65, 0x6d, 0x62, 0x65, 0x72, 0x4f, 0x66, 0xa0,
+    0x26, 0x30, 0x24, 0x04, 0x16, 0x31, 0x2e, 0x32, 0x2e, 0x38, 0x34, 0x30, 0x2e, 0x31, 0x31, 0x33, 0x35, 0x35,
+    0x36, 0x2e, 0x31, 0x2e, 0x34, 0x2e, 0x33, 0x31, 0x39, 0x01, 0x01, 0xff, 0x04, 0x07, 0x30, 0x05, 0x02, 0x01,
+    0x64, 0x04, 0x00
+};
+/* A CompareRequest. */
+static const unsigned char compare[] = {
+    0x30, 0x36, 0x02, 0x01, 0x04, 0x6e, 0x31, 0x04, 0x23, 0x75, 0x69, 0x64, 0x3d, 0x62, 0x6f, 0x62, 0x2c, 0x6f,
+    0x75, 0x3d, 0x70, 0x65, 0x6f, 0x70, 0x6c, 0x65, 0x2c, 0x64, 0x63, 0x3d, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c,
+    0x65, 0x2c, 0x64, 0x63, 0x3d, 0x63, 0x6f, 0x6d, 0x30, 0x0a, 0x04, 0x03, 0x75, 0x69, 0x64, 0x04, 0x03, 0x62,
+    0x6f, 0x62
+};
+/* An AbandonRequest for messageID 3. */
+static const unsigned char abandon[] = {
+    0x30, 0x07, 0x02, 0x02, 0x01, 0x2c, 0x50, 0x01, 0x03
+};
+/* A StartTLS ExtendedRequest. */
+static const unsigned char extended[] = {
+    0x30, 0x1d, 0x02, 0x01, 0x05, 0x77, 0x18, 0x80, 0x16, 0x31, 0x2e, 0x33, 0x2e, 0x36, 0x2e, 0x31, 0x2e, 0x34,
+    0x2e, 0x31, 0x2e, 0x31, 0x34, 0x36, 0x36, 0x2e, 0x32, 0x30, 0x30, 0x33, 0x37
+};
+/* An UnbindRequest. */
+static const unsigned char unbind[] = {
+    0x30, 0x05, 0x02, 0x01, 0x06, 0x42, 0x00
+};
+/* A DelRequest that is left for asn1c. */
+static const unsigned char delete[] = {
+    0x30, 0x0c, 0x02, 0x01, 0x07, 0x4a, 0x07, 0x75, 0x69, 0x64, 0x3d, 0x62, 0x6f, 0x62
+};
+/* A SearchRequest with filters nested 41 deep. */
+static const unsigned char deep[] = {
+    0x30, 0x6c, 0x02, 0x01, 0x08, 0x63, 0x67, 0x04, 0x00, 0x0a, 0x01, 0x00, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x00,
+    0x02, 0x01, 0x00, 0x01, 0x01, 0x00, 0xa2, 0x52, 0xa2, 0x50, 0xa2, 0x4e, 0xa2, 0x4c, 0xa2, 0x4a, 0xa2, 0x48,
+    0xa2, 0x46, 0xa2, 0x44, 0xa2, 0x42, 0xa2, 0x40, 0xa2, 0x3e, 0xa2, 0x3c, 0xa2, 0x3a, 0xa2, 0x38, 0xa2, 0x36,
+    0xa2, 0x34, 0xa2, 0x32, 0xa2, 0x30, 0xa2, 0x2e, 0xa2, 0x2c, 0xa2, 0x2a, 0xa2, 0x28, 0xa2, 0x26, 0xa2, 0x24,
+    0xa2, 0x22, 0xa2, 0x20, 0xa2, 0x1e, 0xa2, 0x1c, 0xa2, 0x1a, 0xa2, 0x18, 0xa2, 0x16, 0xa2, 0x14, 0xa2, 0x12,
+    0xa2, 0x10, 0xa2, 0x0e, 0xa2, 0x0c, 0xa2, 0x0a, 0xa2, 0x08, 0xa2, 0x06, 0xa2, 0x04, 0x87, 0x02, 0x63, 0x6e,
+    0x30, 0x00
+};
+
+static ber_pool pool;
+
+/* Check a message decodes the same as asn1c, returning its arena. */
+static ber_arena *check_decode(const unsigned char *msg, size_t len)
+{
+    LDAPMessage_t *m = NULL;
+    ber_arena *a;
+    size_t consumed;
+    unsigned char b1[1024], b2[1024];
+    asn_enc_rval_t e1, e2;
+
+    assert(ber_decode(0, &asn_DEF_LDAPMessage, (void **)&m, msg, len).code == RC_OK);
+    assert(ber_decode_request(&pool, msg, len, BUFFER_SIZE, &a, &consumed) == BER_OK);
+    assert(consumed == len);
+    /* The DER encodings of both must be identical. */
+    e1 = der_encode_to_buffer(&asn_DEF_LDAPMessage, m, b1, sizeof(b1));
+    e2 = der_encode_to_buffer(&asn_DEF_LDAPMessage, &a->message, b2, sizeof(b2));
+    assert(e1.encoded == (ssize_t)len && e2.encoded == e1.encoded);
+    assert(!memcmp(b1, b2, len));
+    ASN_STRUCT_FREE(asn_DEF_LDAPMessage, m);
+    /* Every partial message needs more data. */
+    for (size_t n = 0; n < len; n++)
+        assert(ber_decode_request(&pool, msg, n, BUFFER_SIZE, &a, &consumed) == BER_WMORE);
+    return a;
+}
+
+/* Check a string is terminated and in the arena's message copy. */
+static void check_string(const ber_arena *a, const OCTET_STRING_t *s, const char *value)
+{
+    assert(s->size == (int)strlen(value));
+    assert(!strcmp((char *)s->buf, value));
+    assert(a->data < s->buf && s->buf < a->data + a->size);
+}
+
+int main(void)
+{
+    unsigned char msg[1024];
+    ber_arena *a, *b;
+    size_t consumed;
+    const BindRequest_t *breq;
+    const SearchRequest_t *sreq;
+    unsigned long allocs;
+
+    ber_pool_init(&pool);
+    a = check_decode(bind_simple, sizeof(bind_simple));
+    breq = &a->message.protocolOp.choice.bindRequest;
+    assert(a->message.messageID == 1 && breq->version == 3);
+    check_string(a, &breq->name, "uid=bob,ou=people,dc=example,dc=com");
+    assert(breq->authentication.present == AuthenticationChoice_PR_simple);
+    check_string(a, &breq->authentication.choice.simple, "secret");
+    ber_arena_free(&pool, a);
+    a = check_decode(bind_sasl, sizeof(bind_sasl));
+    breq = &a->message.protocolOp.choice.bindRequest;
+    check_string(a, &breq->name, "");
+    check_string(a, &breq->authentication.choice.sasl.mechanism, "EXTERNAL");
+    check_string(a, breq->authentication.choice.sasl.credentials, "creds");
+    ber_arena_free(&pool, a);
+    a = check_decode(search, sizeof(search));
+    sreq = &a->message.protocolOp.choice.searchRequest;
+    check_string(a, &sreq->baseObject, "dc=example,dc=com");
+    assert(sreq->scope == 2 && sreq->filter.present == Filter_PR_and);
+    assert(sreq->filter.choice.And.list.count == 3 && sreq->attributes.list.count == 3);
+    check_string(a, sreq->attributes.list.array[2], "memberOf");
+    assert(a->message.controls && a->message.controls->list.count == 1);
+    ber_arena_free(&pool, a);
+    ber_arena_free(&pool, check_decode(compare, sizeof(compare)));
+    a = check_decode(abandon, sizeof(abandon));
+    assert(a->message.messageID == 300 && a->message.protocolOp.choice.abandonRequest == 3);
+    ber_arena_free(&pool, a);
+    ber_arena_free(&pool, check_decode(extended, sizeof(extended)));
+    ber_arena_free(&pool, check_decode(unbind, sizeof(unbind)));
+
+    /* Other requests and messages over the max are left for asn1c. */
+    assert(ber_decode_request(&pool, delete, sizeof(delete), BUFFER_SIZE, &a, &consumed) == BER_OTHER);
+    assert(ber_decode_request(&pool, search, sizeof(search), sizeof(search) - 1, &a, &consumed) == BER_OTHER);
+    /* Filters nested too deep fail. */
+    assert(ber_decode_request(&pool, deep, sizeof(deep), BUFFER_SIZE, &a, &consumed) == BER_FAIL);
+    /* Invalid lengths fail. */
+    memcpy(msg, bind_simple, sizeof(bind_simple));
+    msg[11]++;
+    assert(ber_decode_request(&pool, msg, sizeof(bind_simple), BUFFER_SIZE, &a, &consumed) == BER_FAIL);
+    msg[11] = 0x80;
+    assert(ber_decode_request(&pool, msg, sizeof(bind_simple), BUFFER_SIZE, &a, &consumed) == BER_FAIL);
+    /* Trailing data in an element fails. */
+    memcpy(msg, unbind, sizeof(unbind));
+    msg[1]++, msg[6]++;
+    assert(ber_decode_request(&pool, msg, sizeof(unbind) + 1, BUFFER_SIZE, &a, &consumed) == BER_FAIL);
+
+    /* Decoding reuses pooled arenas without allocating. */
+    allocs = pool.allocs;
+    for (int i = 0; i < 10; i++)
+        ber_arena_free(&pool, check_decode(search, sizeof(search)));
+    assert(pool.allocs == allocs && pool.count == 1);
+    a = check_decode(bind_simple, sizeof(bind_simple));
+    b = check_decode(bind_simple, sizeof(bind_simple));
+    assert(a != b && pool.allocs == allocs + 1 && pool.count == 0);
+    ber_arena_free(&pool, a);
+    ber_arena_free(&pool, b);
+    assert(pool.count == 2);
+    /* A search with 100 present filters doesn't fit in a pooled arena. */
+    memcpy(msg, (unsigned char[]) {0x30, 0x82, 0x01, 0xae, 0x02, 0x01, 0x09, 0x63, 0x82, 0x01, 0xa7, 0x04, 0x00, 0x0a,
+           0x01, 0x02, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x01, 0x01, 0x00, 0xa1, 0x82, 0x01, 0x90},
+           32);
+    for (int i = 0; i < 100; i++)
+        memcpy(msg + 32 + 4 * i, (unsigned char[]) {0x87, 0x02, 'c', 'n'}, 4);
+    memcpy(msg + 432, (unsigned char[]) {0x30, 0x00}, 2);
+    a = check_decode(msg, 434);
+    assert(a->size > BER_ARENA_SIZE);
+    assert(a->message.protocolOp.choice.searchRequest.filter.choice.Or.list.count == 100);
+    ber_arena_free(&pool, a);
+    assert(pool.count == 2);
+    ber_pool_done(&pool);
+    assert(pool.count == 0 && !pool.free);
+    return 0;
+}
@@ -0,0 +1,1081 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "files.h"
+#include "utils.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Field counts for each file type. */
+#define PASSWD_FIELDS 7
+#define GROUP_FIELDS 4
+#define SHADOW_FIELDS 9
+
+void files_map_init(files_map *map, const char *dir, const char *name)
+{
+    assert(map);
+    assert(dir);
+    assert(name);
+
+    memset(map, 0, sizeof(*map));
+    snprintf(map->path, sizeof(map->path), "%s/%s", dir, name);
+}
+
+void files_map_done(files_map *map)
+{
+    assert(map);
+
+    if (map->data && map->mapsize)
+        munmap(map->data, map->mapsize);
+    map->data = NULL;
+    map->size = map->mapsize = 0;
+}
+
+bool files_map_changed(const files_map *map)
+{
+    assert(map);
+    struct stat st;
+
+    if (stat(map->path, &st))
+        memset(&st, 0, sizeof(st));
+    return st.st_ino != map->st.st_ino || st.st_dev != map->st.st_dev || st.st_size != map->st.st_size
+        || st.st_mtim.tv_sec != map->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != map->st.st_mtim.tv_nsec;
+}
+
+int files_map_load(files_map *map)
+{
+    assert(map);
+    int fd;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    void *p;
+
+    /* Record the stat even on failure so we don't retry until it changes. */
+    if ((fd = open(map->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (stat(map->path, &map->st))
+            memset(&map->st, 0, sizeof(map->st));
+        return -1;
+    }
+    if (fstat(fd, &map->st))
+        goto fail;
+    map->size = map->st.st_size;
+    /* Reserve an anonymous mapping with a zeroed byte past the end of the file
+     * so the last line is always '\0' terminated, then map the file over it. */
+    map->mapsize = (map->size + pagesize) / pagesize * pagesize;
+    p = mmap(NULL, map->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    if (map->size && mmap(p, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(p, map->mapsize);
+        goto fail;
+    }
+    map->data = p;
+    close(fd);
+    return 0;
+  fail:
+    map->data = NULL;
+    map->size = map->mapsize = 0;
+    close(fd);
+    return -1;
+}
+
+/* Count the occurrences of a char in a files_map. */
+static size_t files_map_count(const files_map *map, char c)
+{
+    size_t n = 0;
+
+    for (const char *p = map->data, *e = p + map->size; (p = memchr(p, c, e - p)); p++)
+        n++;
+    return n;
+}
+
+/* Get the next line from a files_map, '\0' terminating it in place. */
+static char *files_map_line(const files_map *map, char **pos)
+{
+    char *e = map->data + map->size;
+    char *line = *pos, *eol;
+
+    if (line >= e)
+        return NULL;
+    if ((eol = memchr(line, '\n', e - line)))
+        *eol = '\0';
+    else
+        eol = e;
+    *pos = eol + 1;
+    return line;
+}
+
+/* Check if a line should be skipped; empty, comments, or NIS compat entries. */
+#define line_skip(line) (!*(line) || *(line) == '#' || *(line) == '+' || *(line) == '-')
+
+/* Split a line into exactly n fields in place, returning false if it can't. */
+static bool line_split(char *line, char sep, char **fields, int n)
+{
+    char *e;
+
+    for (int i = 0; i < n - 1; i++) {
+        if (!(e = strchr(line, sep)))
+            return false;
+        *e = '\0';
+        fields[i] = line;
+        line = e + 1;
+    }
+    fields[n - 1] = line;
+    return !strchr(line, sep);
+}
+
+/* Parse a decimal id field, returning false if it is invalid. */
+static bool field_id(const char *s, unsigned int *id)
+{
+    char *e;
+    unsigned long v = strtoul(s, &e, 10);
+
+    if (!*s || *e || v > (unsigned int)-1)
+        return false;
+    *id = v;
+    return true;
+}
+
+/* Parse an optional decimal shadow field, using -1 if it is empty. */
+static bool field_long(const char *s, long *v)
+{
+    char *e;
+
+    if (!*s) {
+        *v = -1;
+        return true;
+    }
+    *v = strtol(s, &e, 10);
+    return !*e;
+}
+
+/* Comparison functions for sorting indexes with qsort. */
+#define cmp_ptr(a, b) (((a) > (b)) - ((a) < (b)))
+#define cmp_id(a, b) (((a) > (b)) - ((a) < (b)))
+
+static int pw_cmpname(const void *a, const void *b)
+{
+    const passwd_t *x = *(passwd_t * const *)a, *y = *(passwd_t * const *)b;
+    int c = strcmp(x->pw_name, y->pw_name);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int pw_cmpuid(const void *a, const void *b)
+{
+    const passwd_t *x = *(passwd_t * const *)a, *y = *(passwd_t * const *)b;
+    int c = cmp_id(x->pw_uid, y->pw_uid);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int pw_cmpgid(const void *a, const void *b)
+{
+    const passwd_t *x = *(passwd_t * const *)a, *y = *(passwd_t * const *)b;
+    int c = cmp_id(x->pw_gid, y->pw_gid);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int gr_cmpname(const void *a, const void *b)
+{
+    const group_t *x = *(group_t * const *)a, *y = *(group_t * const *)b;
+    int c = strcmp(x->gr_name, y->gr_name);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int gr_cmpgid(const void *a, const void *b)
+{
+    const group_t *x = *(group_t * const *)a, *y = *(group_t * const *)b;
+    int c = cmp_id(x->gr_gid, y->gr_gid);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+/* Compare case-folded strings that end at '\0' or an end char. */
+static int fold_cmp(const char *a, const char *b, char end)
+{
+    for (;; a++, b++) {
+        int x = *a == end ? 0 : tolower((unsigned char)*a);
+        int y = *b == end ? 0 : tolower((unsigned char)*b);
+        if (x != y || !x)
+            return x - y;
+    }
+}
+
+/* Compare a case-folded string that ends at '\0' or an end char with a prefix. */
+static int fold_prefix(const char *s, const char *prefix, char end)
+{
+    for (; *prefix; s++, prefix++) {
+        int x = *s == end ? 0 : tolower((unsigned char)*s);
+        int y = (unsigned char)*prefix;
+        if (x != y)
+            return x - y;
+    }
+    return 0;
+}
+
+static int pw_cmpfold(const void *a, const void *b)
+{
+    const passwd_t *x = *(passwd_t * const *)a, *y = *(passwd_t * const *)b;
+    int c = fold_cmp(x->pw_name, y->pw_name, '\0');
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int pw_cmpcn(const void *a, const void *b)
+{
+    const passwd_t *x = *(passwd_t * const *)a, *y = *(passwd_t * const *)b;
+    int c = fold_cmp(x->pw_gecos, y->pw_gecos, ',');
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int gr_cmpfold(const void *a, const void *b)
+{
+    const group_t *x = *(group_t * const *)a, *y = *(group_t * const *)b;
+    int c = fold_cmp(x->gr_name, y->gr_name, '\0');
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+static int mem_cmpname(const void *a, const void *b)
+{
+    const files_member *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+
+    return c ? c : cmp_ptr(x->gr, y->gr);
+}
+
+static int sp_cmpname(const void *a, const void *b)
+{
+    const spwd_t *x = *(spwd_t * const *)a, *y = *(spwd_t * const *)b;
+    int c = strcmp(x->sp_namp, y->sp_namp);
+
+    return c ? c : cmp_ptr(x, y);
+}
+
+/* Comparison functions for finding a key in a sorted index. */
+static int pw_keyname(const void *r, const void *k)
+{
+    return strcmp(((const passwd_t *)r)->pw_name, k);
+}
+
+static int pw_keyuid(const void *r, const void *k)
+{
+    return cmp_id(((const passwd_t *)r)->pw_uid, *(const uid_t *)k);
+}
+
+static int pw_keygid(const void *r, const void *k)
+{
+    return cmp_id(((const passwd_t *)r)->pw_gid, *(const gid_t *)k);
+}
+
+static int gr_keyname(const void *r, const void *k)
+{
+    return strcmp(((const group_t *)r)->gr_name, k);
+}
+
+static int gr_keygid(const void *r, const void *k)
+{
+    return cmp_id(((const group_t *)r)->gr_gid, *(const gid_t *)k);
+}
+
+static int sp_keyname(const void *r, const void *k)
+{
+    return strcmp(((const spwd_t *)r)->sp_namp, k);
+}
+
+static int pw_keyfold(const void *r, const void *k)
+{
+    return fold_prefix(((const passwd_t *)r)->pw_name, k, '\0');
+}
+
+static int pw_keycn(const void *r, const void *k)
+{
+    return fold_prefix(((const passwd_t *)r)->pw_gecos, k, ',');
+}
+
+static int gr_keyfold(const void *r, const void *k)
+{
+    return fold_prefix(((const group_t *)r)->gr_name, k, '\0');
+}
+
+/* Diff functions for records, returning their name order like strcmp(), and
+ * setting same if the names match and the records are identical. */
+static int pw_diff(const void *a, const void *b, bool *same)
+{
+    const passwd_t *x = a, *y = b;
+    int c = strcmp(x->pw_name, y->pw_name);
+
+    *same = !c && x->pw_uid == y->pw_uid && x->pw_gid == y->pw_gid && !strcmp(x->pw_passwd, y->pw_passwd)
+        && !strcmp(x->pw_gecos, y->pw_gecos) && !strcmp(x->pw_dir, y->pw_dir) && !strcmp(x->pw_shell, y->pw_shell);
+    return c;
+}
+
+static int gr_diff(const void *a, const void *b, bool *same)
+{
+    const group_t *x = a, *y = b;
+    int c = strcmp(x->gr_name, y->gr_name), i;
+
+    *same = !c && x->gr_gid == y->gr_gid && !strcmp(x->gr_passwd, y->gr_passwd);
+    for (i = 0; *same && x->gr_mem[i] && y->gr_mem[i]; i++)
+        *same = !strcmp(x->gr_mem[i], y->gr_mem[i]);
+    *same = *same && !x->gr_mem[i] && !y->gr_mem[i];
+    return c;
+}
+
+static int sp_diff(const void *a, const void *b, bool *same)
+{
+    const spwd_t *x = a, *y = b;
+    int c = strcmp(x->sp_namp, y->sp_namp);
+
+    *same = !c && !strcmp(x->sp_pwdp, y->sp_pwdp) && x->sp_lstchg == y->sp_lstchg && x->sp_min == y->sp_min
+        && x->sp_max == y->sp_max && x->sp_warn == y->sp_warn && x->sp_inact == y->sp_inact
+        && x->sp_expire == y->sp_expire && x->sp_flag == y->sp_flag;
+    return c;
+}
+
+/* Build a sorted index of pointers to n records of size len. */
+static void *index_new(void *records, int n, size_t len, int (*cmp)(const void *, const void *))
+{
+    void **index = XNEW(void *, n ? n : 1);
+
+    for (int i = 0; i < n; i++)
+        index[i] = (char *)records + i * len;
+    qsort(index, n, sizeof(*index), cmp);
+    return index;
+}
+
+/* Find the position of the first record in a sorted index that is after a
+ * key, or the first that is not before it if after is false. */
+static int index_bound(void *index, int n, int (*cmp)(const void *, const void *), const void *key, bool after)
+{
+    void **idx = index;
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = cmp(idx[mid], key);
+        if (c < 0 || (after && !c))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Find the first record in a sorted index that matches a key. */
+static void *index_find(void *index, int n, int (*cmp)(const void *, const void *), const void *key)
+{
+    void **idx = index;
+    int i = index_bound(index, n, cmp, key, false);
+
+    return (i < n && !cmp(idx[i], key)) ? idx[i] : NULL;
+}
+
+/* Find the range of records in a sorted index that match a key. */
+static void *index_range(void *index, int n, int (*cmp)(const void *, const void *), const void *key, int *count)
+{
+    void **idx = index;
+    int i = index_bound(index, n, cmp, key, false);
+
+    *count = index_bound(idx + i, n - i, cmp, key, true);
+    return idx + i;
+}
+
+/* Diff the new and old records using their name indexes.
+ *
+ * This merges the sorted name indexes to set the generation of each new
+ * record. Unchanged records keep their old generation, and added or changed
+ * records get gen. Records with duplicate names are matched in order.
+ *
+ * \return The number of records added, changed, or removed. */
+static int index_diff(void *index, int n, const void *records, size_t len, unsigned long *gens, void *oldindex,
+                      int oldn, const void *oldrecords, const unsigned long *oldgens,
+                      int (*diff)(const void *, const void *, bool *), unsigned long gen)
+{
+    void **idx = index, **old = oldindex;
+    int i = 0, j = 0, changes = 0;
+    bool same = false;
+
+    while (i < n || j < oldn) {
+        int c = i == n ? 1 : j == oldn ? -1 : diff(idx[i], old[j], &same);
+        if (c > 0) {
+            /* The old record was removed. */
+            changes++;
+            j++;
+            continue;
+        }
+        size_t r = ((const char *)idx[i] - (const char *)records) / len;
+        if (c < 0 || !same) {
+            /* The new record was added or changed. */
+            gens[r] = gen;
+            changes++;
+        } else
+            gens[r] = oldgens[((const char *)old[j] - (const char *)oldrecords) / len];
+        i++;
+        j += !c;
+    }
+    return changes;
+}
+
+/* Free a files_db array unless it is in the image mapping. */
+static void files_db_free(files_db *db, void *p)
+{
+    if (!((char *)p >= db->image && (char *)p < db->image + db->imagesize))
+        free(p);
+}
+
+/* Reload the passwd file, returning false if it failed. */
+static bool files_db_passwd(files_db *db)
+{
+    files_map map = db->passwd_map;
+    char *pos, *line, *f[PASSWD_FIELDS];
+    passwd_t *pw, **byname;
+    unsigned long *gens;
+    int n = 0, bad = 0, changes;
+
+    if (files_map_load(&map)) {
+        lwarn("failed to load %s", map.path);
+        db->passwd_map.st = map.st;
+        return false;
+    }
+    pw = XNEW(passwd_t, files_map_count(&map, '\n') + 1);
+    for (pos = map.data; (line = files_map_line(&map, &pos));) {
+        passwd_t *p = &pw[n];
+        if (line_skip(line))
+            continue;
+        if (!line_split(line, ':', f, PASSWD_FIELDS)) {
+            bad++;
+            continue;
+        }
+        p->pw_name = f[0];
+        p->pw_passwd = f[1];
+        p->pw_gecos = f[4];
+        p->pw_dir = f[5];
+        p->pw_shell = f[6];
+        if (field_id(f[2], &p->pw_uid) && field_id(f[3], &p->pw_gid))
+            n++;
+        else
+            bad++;
+    }
+    if (bad)
+        lwarnx("%s has %d invalid lines", map.path, bad);
+    byname = index_new(pw, n, sizeof(*pw), pw_cmpname);
+    gens = XNEW(unsigned long, n ? n : 1);
+    changes = index_diff(byname, n, pw, sizeof(*pw), gens, db->pw_byname, db->pw_count, db->pw, db->pw_gen, pw_diff,
+                         db->gen + 1);
+    lnote("loaded %s with %d records and %d changes", map.path, n, changes);
+    if (changes)
+        db->gen++;
+    files_map_done(&db->passwd_map);
+    files_db_free(db, db->pw);
+    files_db_free(db, db->pw_gen);
+    files_db_free(db, db->pw_byname);
+    files_db_free(db, db->pw_byuid);
+    files_db_free(db, db->pw_byfold);
+    files_db_free(db, db->pw_bycn);
+    files_db_free(db, db->pw_bygid);
+    db->passwd_map = map;
+    db->pw = pw;
+    db->pw_gen = gens;
+    db->pw_count = n;
+    db->pw_byname = byname;
+    db->pw_byuid = index_new(pw, n, sizeof(*pw), pw_cmpuid);
+    db->pw_byfold = index_new(pw, n, sizeof(*pw), pw_cmpfold);
+    db->pw_bycn = index_new(pw, n, sizeof(*pw), pw_cmpcn);
+    db->pw_bygid = index_new(pw, n, sizeof(*pw), pw_cmpgid);
+    return true;
+}
+
+/* Reload the group file, returning false if it failed. */
+static bool files_db_group(files_db *db)
+{
+    files_map map = db->group_map;
+    char *pos, *line, *f[GROUP_FIELDS];
+    group_t *gr, **byname;
+    files_member *bymember;
+    char **mem;
+    size_t lines;
+    unsigned long *gens;
+    int n = 0, m = 0, bad = 0, changes;
+
+    if (files_map_load(&map)) {
+        lwarn("failed to load %s", map.path);
+        db->group_map.st = map.st;
+        return false;
+    }
+    lines = files_map_count(&map, '\n') + 1;
+    gr = XNEW(group_t, lines);
+    /* Each line has at most one more member than commas plus a NULL. */
+    mem = XNEW(char *, files_map_count(&map, ',') + 2 * lines);
+    for (pos = map.data; (line = files_map_line(&map, &pos));) {
+        group_t *g = &gr[n];
+        if (line_skip(line))
+            continue;
+        if (!line_split(line, ':', f, GROUP_FIELDS)) {
+            bad++;
+            continue;
+        }
+        if (!field_id(f[2], &g->gr_gid)) {
+            bad++;
+            continue;
+        }
+        g->gr_name = f[0];
+        g->gr_passwd = f[1];
+        /* Temporarily store the member list offset until mem is final. */
+        g->gr_mem = (char **)(intptr_t)m;
+        for (char *s = f[3], *e; *s; s = e) {
+            if ((e = strchr(s, ',')))
+                *e++ = '\0';
+            else
+                e = s + strlen(s);
+            if (*s)
+                mem[m++] = s;
+        }
+        mem[m++] = NULL;
+        n++;
+    }
+    for (int i = 0; i < n; i++)
+        gr[i].gr_mem = mem + (intptr_t)gr[i].gr_mem;
+    /* Build the reverse index; there are m - n members excluding the NULLs. */
+    bymember = XNEW(files_member, m - n ? m - n : 1);
+    for (int i = 0, k = 0; i < n; i++)
+        for (char **p = gr[i].gr_mem; *p; p++)
+            bymember[k++] = (files_member) {*p, &gr[i]};
+    qsort(bymember, m - n, sizeof(*bymember), mem_cmpname);
+    if (bad)
+        lwarnx("%s has %d invalid lines", map.path, bad);
+    byname = index_new(gr, n, sizeof(*gr), gr_cmpname);
+    gens = XNEW(unsigned long, n ? n : 1);
+    changes = index_diff(byname, n, gr, sizeof(*gr), gens, db->gr_byname, db->gr_count, db->gr, db->gr_gen, gr_diff,
+                         db->gen + 1);
+    lnote("loaded %s with %d records and %d changes", map.path, n, changes);
+    if (changes)
+        db->gen++;
+    files_map_done(&db->group_map);
+    files_db_free(db, db->gr);
+    files_db_free(db, db->gr_gen);
+    files_db_free(db, db->gr_mem);
+    files_db_free(db, db->gr_byname);
+    files_db_free(db, db->gr_bygid);
+    files_db_free(db, db->gr_byfold);
+    files_db_free(db, db->gr_bymember);
+    db->group_map = map;
+    db->gr = gr;
+    db->gr_gen = gens;
+    db->gr_mem = mem;
+    db->gr_memcount = m;
+    db->gr_bymember = bymember;
+    db->gr_membercount = m - n;
+    db->gr_count = n;
+    db->gr_byname = byname;
+    db->gr_bygid = index_new(gr, n, sizeof(*gr), gr_cmpgid);
+    db->gr_byfold = index_new(gr, n, sizeof(*gr), gr_cmpfold);
+    return true;
+}
+
+/* Reload the shadow file, returning false if it failed. */
+static bool files_db_shadow(files_db *db)
+{
+    files_map map = db->shadow_map;
+    char *pos, *line, *f[SHADOW_FIELDS];
+    spwd_t *sp, **byname;
+    unsigned long *gens;
+    int n = 0, bad = 0, changes;
+    long flag;
+
+    if (files_map_load(&map)) {
+        /* A missing shadow file is OK, but a changed unreadable one is not. */
+        if (errno != ENOENT)
+            lwarn("failed to load %s", map.path);
+        db->shadow_map.st = map.st;
+        return false;
+    }
+    sp = XNEW(spwd_t, files_map_count(&map, '\n') + 1);
+    for (pos = map.data; (line = files_map_line(&map, &pos));) {
+        spwd_t *s = &sp[n];
+        if (line_skip(line))
+            continue;
+        if (!line_split(line, ':', f, SHADOW_FIELDS)) {
+            bad++;
+            continue;
+        }
+        s->sp_namp = f[0];
+        s->sp_pwdp = f[1];
+        if (field_long(f[2], &s->sp_lstchg) && field_long(f[3], &s->sp_min) && field_long(f[4], &s->sp_max)
+            && field_long(f[5], &s->sp_warn) && field_long(f[6], &s->sp_inact) && field_long(f[7], &s->sp_expire)
+            && field_long(f[8], &flag)) {
+            s->sp_flag = flag;
+            n++;
+        } else
+            bad++;
+    }
+    if (bad)
+        lwarnx("%s has %d invalid lines", map.path, bad);
+    byname = index_new(sp, n, sizeof(*sp), sp_cmpname);
+    gens = XNEW(unsigned long, n ? n : 1);
+    changes = index_diff(byname, n, sp, sizeof(*sp), gens, db->sp_byname, db->sp_count, db->sp, db->sp_gen, sp_diff,
+                         db->gen + 1);
+    lnote("loaded %s with %d records and %d changes", map.path, n, changes);
+    if (changes)
+        db->gen++;
+    files_map_done(&db->shadow_map);
+    files_db_free(db, db->sp);
+    files_db_free(db, db->sp_gen);
+    files_db_free(db, db->sp_byname);
+    db->shadow_map = map;
+    db->sp = sp;
+    db->sp_gen = gens;
+    db->sp_count = n;
+    db->sp_byname = byname;
+    return true;
+}
+
+int files_db_init(files_db *db, const char *dir)
+{
+    assert(db);
+    assert(dir);
+
+    memset(db, 0, sizeof(*db));
+    files_map_init(&db->passwd_map, dir, "passwd");
+    files_map_init(&db->group_map, dir, "group");
+    files_map_init(&db->shadow_map, dir, "shadow");
+    if (!files_db_passwd(db) || !files_db_group(db)) {
+        files_db_done(db);
+        return -1;
+    }
+    files_db_shadow(db);
+    return 0;
+}
+
+void files_db_done(files_db *db)
+{
+    assert(db);
+
+    files_map_done(&db->passwd_map);
+    files_map_done(&db->group_map);
+    files_map_done(&db->shadow_map);
+    files_db_free(db, db->pw);
+    files_db_free(db, db->pw_gen);
+    files_db_free(db, db->pw_byname);
+    files_db_free(db, db->pw_byuid);
+    files_db_free(db, db->pw_byfold);
+    files_db_free(db, db->pw_bycn);
+    files_db_free(db, db->pw_bygid);
+    files_db_free(db, db->gr);
+    files_db_free(db, db->gr_gen);
+    files_db_free(db, db->gr_mem);
+    files_db_free(db, db->gr_byname);
+    files_db_free(db, db->gr_bygid);
+    files_db_free(db, db->gr_byfold);
+    files_db_free(db, db->gr_bymember);
+    files_db_free(db, db->sp);
+    files_db_free(db, db->sp_gen);
+    files_db_free(db, db->sp_byname);
+    if (db->image)
+        munmap(db->image, db->imagesize);
+    memset(db, 0, sizeof(*db));
+}
+
+bool files_db_check(files_db *db)
+{
+    assert(db);
+    bool reloaded = false;
+
+    if (files_map_changed(&db->passwd_map))
+        reloaded |= files_db_passwd(db);
+    if (files_map_changed(&db->group_map))
+        reloaded |= files_db_group(db);
+    if (files_map_changed(&db->shadow_map))
+        reloaded |= files_db_shadow(db);
+    return reloaded;
+}
+
+/* The files_db image header. */
+typedef struct {
+    char magic[8];              /* The FILES_IMAGE_MAGIC. */
+    uint32_t version;           /* The FILES_IMAGE_VERSION. */
+    uint32_t hdrsize;           /* The header size, catching ABI changes. */
+    uint16_t sizes[4];          /* The record and pointer sizes. */
+    uintptr_t base;             /* The address the image is compiled for. */
+    size_t size;                /* The size of the image file. */
+    files_db db;                /* The files_db with pointers into the image. */
+} files_image;
+
+/* An array in a files_db and where it is in an image. */
+typedef struct {
+    void **field;               /* The files_db array pointer field. */
+    size_t len;                 /* The array size in bytes. */
+    char *src;                  /* The array when saving. */
+    size_t off;                 /* The array offset in the image. */
+} files_section;
+
+#define IMAGE_ALIGN 16
+#define IMAGE_SECTIONS 20
+#define image_align(n) (((n) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN)
+
+/* Get the sections for all the arrays in a files_db. */
+static void files_image_sections(files_db *db, files_section *s)
+{
+    int n = 0;
+
+#define SECTION(f, l) s[n++] = (files_section){(void **)&db->f, (l), NULL, 0}
+    /* The parsed file contents include the '\0' past the end. */
+    SECTION(passwd_map.data, db->passwd_map.data ? db->passwd_map.size + 1 : 0);
+    SECTION(group_map.data, db->group_map.data ? db->group_map.size + 1 : 0);
+    SECTION(shadow_map.data, db->shadow_map.data ? db->shadow_map.size + 1 : 0);
+    SECTION(pw, db->pw_count * sizeof(*db->pw));
+    SECTION(pw_gen, db->pw_count * sizeof(*db->pw_gen));
+    SECTION(pw_byname, db->pw_count * sizeof(*db->pw_byname));
+    SECTION(pw_byuid, db->pw_count * sizeof(*db->pw_byuid));
+    SECTION(pw_byfold, db->pw_count * sizeof(*db->pw_byfold));
+    SECTION(pw_bycn, db->pw_count * sizeof(*db->pw_bycn));
+    SECTION(pw_bygid, db->pw_count * sizeof(*db->pw_bygid));
+    SECTION(gr, db->gr_count * sizeof(*db->gr));
+    SECTION(gr_gen, db->gr_count * sizeof(*db->gr_gen));
+    SECTION(gr_byname, db->gr_count * sizeof(*db->gr_byname));
+    SECTION(gr_bygid, db->gr_count * sizeof(*db->gr_bygid));
+    SECTION(gr_byfold, db->gr_count * sizeof(*db->gr_byfold));
+    SECTION(gr_mem, db->gr_memcount * sizeof(*db->gr_mem));
+    SECTION(gr_bymember, db->gr_membercount * sizeof(*db->gr_bymember));
+    SECTION(sp, db->sp_count * sizeof(*db->sp));
+    SECTION(sp_gen, db->sp_count * sizeof(*db->sp_gen));
+    SECTION(sp_byname, db->sp_count * sizeof(*db->sp_byname));
+#undef SECTION
+    assert(n == IMAGE_SECTIONS);
+}
+
+/* Apply a fix function to every pointer in the arrays of a files_db. */
+static void files_image_walk(files_db *db, void *(*fix)(void *ctx, void *p), void *ctx)
+{
+#define FIX(p) ((p) = fix(ctx, (p)))
+    for (int i = 0; i < db->pw_count; i++) {
+        passwd_t *p = &db->pw[i];
+        FIX(p->pw_name);
+        FIX(p->pw_passwd);
+        FIX(p->pw_gecos);
+        FIX(p->pw_dir);
+        FIX(p->pw_shell);
+        FIX(db->pw_byname[i]);
+        FIX(db->pw_byuid[i]);
+        FIX(db->pw_byfold[i]);
+        FIX(db->pw_bycn[i]);
+        FIX(db->pw_bygid[i]);
+    }
+    for (int i = 0; i < db->gr_count; i++) {
+        group_t *g = &db->gr[i];
+        FIX(g->gr_name);
+        FIX(g->gr_passwd);
+        FIX(g->gr_mem);
+        FIX(db->gr_byname[i]);
+        FIX(db->gr_bygid[i]);
+        FIX(db->gr_byfold[i]);
+    }
+    for (size_t i = 0; i < db->gr_memcount; i++)
+        if (db->gr_mem[i])
+            FIX(db->gr_mem[i]);
+    for (int i = 0; i < db->gr_membercount; i++) {
+        FIX(db->gr_bymember[i].name);
+        FIX(db->gr_bymember[i].gr);
+    }
+    for (int i = 0; i < db->sp_count; i++) {
+        spwd_t *s = &db->sp[i];
+        FIX(s->sp_namp);
+        FIX(s->sp_pwdp);
+        FIX(db->sp_byname[i]);
+    }
+#undef FIX
+}
+
+/* Fix a pointer into a files_db array to point into the saved image. */
+static void *files_image_save_fix(void *ctx, void *p)
+{
+    files_section *s = ctx;
+
+    for (int i = 0; i < IMAGE_SECTIONS; i++)
+        if (s[i].src && (char *)p >= s[i].src && (char *)p < s[i].src + s[i].len)
+            return (char *)FILES_IMAGE_BASE + s[i].off + ((char *)p - s[i].src);
+    /* Every pointer must be into one of the arrays. */
+    assert(0);
+    return NULL;
+}
+
+int files_db_save(const files_db *db, const char *path)
+{
+    assert(db);
+    assert(path);
+    files_section s[IMAGE_SECTIONS], v[IMAGE_SECTIONS];
+    files_image hdr = {.magic = FILES_IMAGE_MAGIC, .version = FILES_IMAGE_VERSION, .hdrsize = sizeof(files_image),
+        .sizes = {sizeof(passwd_t), sizeof(group_t), sizeof(spwd_t), sizeof(void *)}, .base = FILES_IMAGE_BASE,
+        .db = *db
+    };
+    files_db view = *db;
+    char tmp[sizeof(db->passwd_map.path) + 8], *buf;
+    size_t off = image_align(sizeof(hdr));
+    ssize_t w = 0;
+    int fd;
+
+    /* Lay out the arrays and copy them after the header. */
+    files_image_sections(&hdr.db, s);
+    for (int i = 0; i < IMAGE_SECTIONS; i++) {
+        s[i].src = *s[i].field;
+        s[i].off = off;
+        off += image_align(s[i].len);
+    }
+    hdr.size = off;
+    buf = XNEW0(char, hdr.size);
+    files_image_sections(&view, v);
+    for (int i = 0; i < IMAGE_SECTIONS; i++) {
+        if (s[i].src)
+            memcpy(buf + s[i].off, s[i].src, s[i].len);
+        *v[i].field = s[i].src ? buf + s[i].off : NULL;
+    }
+    /* Point the copied arrays and the header files_db into the image. */
+    files_image_walk(&view, files_image_save_fix, s);
+    for (int i = 0; i < IMAGE_SECTIONS; i++)
+        *s[i].field = s[i].src ? (char *)FILES_IMAGE_BASE + s[i].off : NULL;
+    hdr.db.passwd_map.mapsize = hdr.db.group_map.mapsize = hdr.db.shadow_map.mapsize = 0;
+    hdr.db.image = NULL;
+    hdr.db.imagesize = 0;
+    hdr.db.savedgen = db->gen;
+    memcpy(buf, &hdr, sizeof(hdr));
+    /* Write a private temporary file and rename it into place. */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+        lwarn("failed to create %s", tmp);
+        free(buf);
+        return -1;
+    }
+    for (size_t n = 0; n < hdr.size && (w = write(fd, buf + n, hdr.size - n)) > 0; n += w) ;
+    free(buf);
+    if (w <= 0 || fsync(fd))
+        w = -1;
+    if (close(fd) || w < 0 || rename(tmp, path)) {
+        lwarn("failed to write %s", path);
+        unlink(tmp);
+        return -1;
+    }
+    lnote("saved %s with %zu bytes", path, hdr.size);
+    return 0;
+}
+
+pid_t files_db_save_async(const files_db *db, const char *path)
+{
+    assert(db);
+    assert(path);
+    pid_t pid;
+
+    /* The child only saves its snapshot, skipping atexit handlers and stdio. */
+    if (!(pid = fork()))
+        _exit(files_db_save(db, path) ? EXIT_FAILURE : EXIT_SUCCESS);
+    if (pid < 0)
+        lwarn("failed to fork to save %s", path);
+    return pid;
+}
+
+/* Fix a pointer in an image saved for FILES_IMAGE_BASE to where it is mapped. */
+static void *files_image_load_fix(void *ctx, void *p)
+{
+    return (char *)ctx + ((char *)p - (char *)FILES_IMAGE_BASE);
+}
+
+/* Map an image file into a files_db, returning -1 if it failed or is invalid. */
+static int files_db_image(files_db *db, const char *dir, const char *path)
+{
+    files_image hdr;
+    files_section s[IMAGE_SECTIONS];
+    files_map map;
+    struct stat st;
+    char *p = MAP_FAILED;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT)
+            lwarn("failed to open %s", path);
+        return -1;
+    }
+    if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        goto invalid;
+    if (memcmp(hdr.magic, FILES_IMAGE_MAGIC, sizeof(hdr.magic)) || hdr.version != FILES_IMAGE_VERSION
+        || hdr.hdrsize != sizeof(hdr) || hdr.sizes[0] != sizeof(passwd_t) || hdr.sizes[1] != sizeof(group_t)
+        || hdr.sizes[2] != sizeof(spwd_t) || hdr.sizes[3] != sizeof(void *) || hdr.base != FILES_IMAGE_BASE
+        || hdr.size != (size_t)st.st_size)
+        goto invalid;
+    /* The image must be for the same files. */
+    files_map_init(&map, dir, "passwd");
+    if (strcmp(map.path, hdr.db.passwd_map.path))
+        goto invalid;
+    files_map_init(&map, dir, "group");
+    if (strcmp(map.path, hdr.db.group_map.path))
+        goto invalid;
+    files_map_init(&map, dir, "shadow");
+    if (strcmp(map.path, hdr.db.shadow_map.path))
+        goto invalid;
+    files_image_sections(&hdr.db, s);
+    for (int i = 0; i < IMAGE_SECTIONS; i++) {
+        char *a = *s[i].field;
+        if (a && (a < (char *)FILES_IMAGE_BASE + sizeof(hdr) || a + s[i].len > (char *)FILES_IMAGE_BASE + hdr.size))
+            goto invalid;
+    }
+    /* Use the image in place if we get its base address, else relocate it. */
+    p = mmap((void *)FILES_IMAGE_BASE, hdr.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED && p != (char *)FILES_IMAGE_BASE) {
+        munmap(p, hdr.size);
+        if ((p = mmap(NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+            goto fail;
+        for (int i = 0; i < IMAGE_SECTIONS; i++)
+            if (*s[i].field)
+                *s[i].field = files_image_load_fix(p, *s[i].field);
+        files_image_walk(&hdr.db, files_image_load_fix, p);
+        mprotect(p, hdr.size, PROT_READ);
+        lnote("relocated %s", path);
+    } else if (p == MAP_FAILED)
+        goto fail;
+    close(fd);
+    *db = hdr.db;
+    db->image = p;
+    db->imagesize = hdr.size;
+    lnote("loaded %s with %d passwd, %d group and %d shadow records", path, db->pw_count, db->gr_count, db->sp_count);
+    return 0;
+  invalid:
+    errno = EINVAL;
+  fail:
+    lwarn("failed to load %s", path);
+    close(fd);
+    return -1;
+}
+
+int files_db_load(files_db *db, const char *dir, const char *path)
+{
+    assert(db);
+    assert(dir);
+    assert(path);
+
+    if (!files_db_image(db, dir, path)) {
+        files_db_check(db);
+        return 0;
+    }
+    return files_db_init(db, dir);
+}
+
+passwd_t *files_db_getpwnam(const files_db *db, const char *name)
+{
+    assert(db);
+    assert(name);
+
+    return index_find(db->pw_byname, db->pw_count, pw_keyname, name);
+}
+
+passwd_t *files_db_getpwuid(const files_db *db, uid_t uid)
+{
+    assert(db);
+
+    return index_find(db->pw_byuid, db->pw_count, pw_keyuid, &uid);
+}
+
+group_t *files_db_getgrnam(const files_db *db, const char *name)
+{
+    assert(db);
+    assert(name);
+
+    return index_find(db->gr_byname, db->gr_count, gr_keyname, name);
+}
+
+group_t *files_db_getgrgid(const files_db *db, gid_t gid)
+{
+    assert(db);
+
+    return index_find(db->gr_bygid, db->gr_count, gr_keygid, &gid);
+}
+
+spwd_t *files_db_getspnam(const files_db *db, const char *name)
+{
+    assert(db);
+    assert(name);
+
+    return index_find(db->sp_byname, db->sp_count, sp_keyname, name);
+}
+
+passwd_t **files_db_pwprefix(const files_db *db, const char *prefix, int *count)
+{
+    assert(db);
+    assert(prefix);
+    assert(count);
+
+    return index_range(db->pw_byfold, db->pw_count, pw_keyfold, prefix, count);
+}
+
+passwd_t **files_db_pwcnprefix(const files_db *db, const char *prefix, int *count)
+{
+    assert(db);
+    assert(prefix);
+    assert(count);
+
+    return index_range(db->pw_bycn, db->pw_count, pw_keycn, prefix, count);
+}
+
+group_t **files_db_grprefix(const files_db *db, const char *prefix, int *count)
+{
+    assert(db);
+    assert(prefix);
+    assert(count);
+
+    return index_range(db->gr_byfold, db->gr_count, gr_keyfold, prefix, count);
+}
+
+passwd_t **files_db_pwuidrange(const files_db *db, uid_t beg, uid_t end, int *count)
+{
+    assert(db);
+    assert(count);
+    int i = index_bound(db->pw_byuid, db->pw_count, pw_keyuid, &beg, false);
+    int j = index_bound(db->pw_byuid, db->pw_count, pw_keyuid, &end, true);
+
+    *count = j > i ? j - i : 0;
+    return db->pw_byuid + i;
+}
+
+group_t **files_db_grgidrange(const files_db *db, gid_t beg, gid_t end, int *count)
+{
+    assert(db);
+    assert(count);
+    int i = index_bound(db->gr_bygid, db->gr_count, gr_keygid, &beg, false);
+    int j = index_bound(db->gr_bygid, db->gr_count, gr_keygid, &end, true);
+
+    *count = j > i ? j - i : 0;
+    return db->gr_bygid + i;
+}
+
+passwd_t **files_db_pwgid(const files_db *db, gid_t gid, int *count)
+{
+    assert(db);
+    assert(count);
+
+    return index_range(db->pw_bygid, db->pw_count, pw_keygid, &gid, count);
+}
+
+files_member *files_db_grmember(const files_db *db, const char *name, int *count)
+{
+    assert(db);
+    assert(name);
+    assert(count);
+    int lo = 0, hi = db->gr_membercount, i;
+
+    /* Find the first member with the name, then count them. */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(db->gr_bymember[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < db->gr_membercount && !strcmp(db->gr_bymember[i].name, name); i++) ;
+    *count = i - lo;
+    return db->gr_bymember + lo;
+}
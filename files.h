@@ -0,0 +1,208 @@
+/** \file files.h
+ * A passwd/group/shadow files database using mmap.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * This reads the passwd, group and shadow files directly instead of using
+ * glibc NSS. Each file is mmapped privately and parsed in one pass in place,
+ * replacing the ':', ',' and '\n' separators with '\0' so the passwd_t,
+ * group_t and spwd_t records point directly into the mapping. Sorted indexes
+ * of record pointers give name and id lookups using a binary search. There
+ * are also indexes sorted by the case-folded names and passwd gecos cn, so
+ * searching for a name prefix is a binary search for the range of matches.
+ * There is also a reverse membership index of (member, group) pairs sorted by
+ * member name, and passwd records sorted by gid, so the groups of a user and
+ * the primary and secondary members of a group are each a binary search.
+ *
+ * Before use files_db_check() should be called to stat() the files and
+ * reload any that have a changed mtime, size, or inode. A file that fails to
+ * reload keeps its old mapping and records, so shadow can still be used after
+ * dropping root privileges.
+ *
+ * A reloaded file is diffed against the old records by name. Each record has
+ * the generation when it was last added or changed, and the files_db
+ * generation is incremented whenever a reload adds, changes, or removes any
+ * records. So anything derived from the records can check it is current, and
+ * rewriting a file without changing it keeps everything current.
+ *
+ * A files_db can be saved to a compiled image file with files_db_save(). The
+ * image has a header with a copy of the files_db, the parsed file contents,
+ * and the record, generation, member and index arrays, with all pointers set
+ * for the image mapped at FILES_IMAGE_BASE. Loading it with files_db_load()
+ * maps it read-only at that address and uses it directly without parsing or
+ * sorting anything. If that address is taken it is mapped privately instead
+ * and relocated in one pass over the pointers. The image keeps the stat of
+ * each file it was compiled from, so files_db_check() reloads only the files
+ * that changed since it was saved. The arrays in the image are never freed,
+ * and the image is unmapped by files_db_done(). Saving builds and fsyncs the
+ * whole image, so files_db_save_async() does it in a forked child with a
+ * copy-on-write snapshot of the files_db, keeping it off the event loop. */
+#ifndef LIGHTLDAPD_FILES_H
+#define LIGHTLDAPD_FILES_H
+
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FILES_IMAGE_MAGIC "lldimg\n"     /**< The image file magic. */
+#define FILES_IMAGE_VERSION 3   /**< The image format version. */
+/** The address images are compiled for. */
+#define FILES_IMAGE_BASE ((uintptr_t)(sizeof(void *) > 4 ? 0x3a5000000000 : 0x5a000000))
+
+/** The type for passwd, group, and spwd entries. */
+typedef struct passwd passwd_t;
+typedef struct group group_t;
+typedef struct spwd spwd_t;
+
+/** The files_map class for an mmapped file. */
+typedef struct {
+    char path[256];             /**< The path of the file. */
+    char *data;                 /**< The private mapping of the file. */
+    size_t size;                /**< The size of the file. */
+    size_t mapsize;             /**< The size of the mapping. */
+    struct stat st;             /**< The stat of the mapped file. */
+} files_map;
+/** Initialize an empty files_map for a path. */
+void files_map_init(files_map *map, const char *dir, const char *name);
+/** Destroy a files_map unmapping any file. */
+void files_map_done(files_map *map);
+/** Check if a files_map file has changed since it was mapped. */
+bool files_map_changed(const files_map *map);
+/** Map a files_map file, returning -1 on error. */
+int files_map_load(files_map *map);
+
+/** The files_member class for a group member in the reverse index. */
+typedef struct {
+    char *name;                 /**< The member name. */
+    group_t *gr;                /**< The group it is a member of. */
+} files_member;
+
+/** The files_db class. */
+typedef struct {
+    files_map passwd_map;       /**< The /etc/passwd file mapping. */
+    files_map group_map;        /**< The /etc/group file mapping. */
+    files_map shadow_map;       /**< The /etc/shadow file mapping. */
+    passwd_t *pw;               /**< The passwd records in file order. */
+    unsigned long *pw_gen;      /**< The passwd record generations. */
+    passwd_t **pw_byname;       /**< The passwd records sorted by name. */
+    passwd_t **pw_byuid;        /**< The passwd records sorted by uid. */
+    passwd_t **pw_byfold;       /**< The passwd records sorted by folded name. */
+    passwd_t **pw_bycn;         /**< The passwd records sorted by folded gecos cn. */
+    passwd_t **pw_bygid;        /**< The passwd records sorted by gid. */
+    int pw_count;               /**< The number of passwd records. */
+    group_t *gr;                /**< The group records in file order. */
+    unsigned long *gr_gen;      /**< The group record generations. */
+    group_t **gr_byname;        /**< The group records sorted by name. */
+    group_t **gr_bygid;         /**< The group records sorted by gid. */
+    group_t **gr_byfold;        /**< The group records sorted by folded name. */
+    char **gr_mem;              /**< The NULL terminated member lists. */
+    size_t gr_memcount;         /**< The number of gr_mem entries. */
+    files_member *gr_bymember;  /**< The group members sorted by name. */
+    int gr_membercount;         /**< The number of group members. */
+    int gr_count;               /**< The number of group records. */
+    spwd_t *sp;                 /**< The shadow records in file order. */
+    unsigned long *sp_gen;      /**< The shadow record generations. */
+    spwd_t **sp_byname;         /**< The shadow records sorted by name. */
+    int sp_count;               /**< The number of shadow records. */
+    unsigned long gen;          /**< The generation, incremented on each change. */
+    unsigned long savedgen;     /**< The generation of the image, or 0 if none. */
+    char *image;                /**< The image mapping, or NULL. */
+    size_t imagesize;           /**< The size of the image mapping. */
+} files_db;
+/** Initialize a files_db and load the files in a directory.
+ *
+ * The passwd and group files must exist, but shadow is optional.
+ *
+ * \param db - The files_db to initialize.
+ *
+ * \param dir - The directory with the files, normally "/etc".
+ *
+ * \return 0 on success or -1 on error. */
+int files_db_init(files_db *db, const char *dir);
+/** Initialize a files_db from an image, or the files if that fails.
+ *
+ * Any files changed since the image was saved are reloaded. The image is not
+ * saved, so if savedgen != gen it is missing, invalid or stale and should be
+ * saved with files_db_save() or files_db_save_async().
+ *
+ * \param db - The files_db to initialize.
+ *
+ * \param dir - The directory with the files, normally "/etc".
+ *
+ * \param path - The image file path.
+ *
+ * \return 0 on success or -1 on error. */
+int files_db_load(files_db *db, const char *dir, const char *path);
+/** Save a files_db to an image file.
+ *
+ * The image is written to a temporary file that is renamed over path, so
+ * readers always see a complete image.
+ *
+ * \return 0 on success or -1 on error. */
+int files_db_save(const files_db *db, const char *path);
+/** Save a files_db to an image file in a forked child process.
+ *
+ * The child saves a snapshot of the files_db with files_db_save() and exits
+ * with 0 on success. The caller must reap it and set savedgen to the gen
+ * saved if it succeeded.
+ *
+ * \return The child's pid, or -1 on error. */
+pid_t files_db_save_async(const files_db *db, const char *path);
+/** Destroy a files_db freeing all records and mappings. */
+void files_db_done(files_db *db);
+/** Reload any files in a files_db that have changed.
+ *
+ * \return true if any files were reloaded. */
+bool files_db_check(files_db *db);
+/** Get the generation when a passwd, group, or shadow record last changed. */
+#define files_db_pwgen(db, r) ((db)->pw_gen[(r) - (db)->pw])
+#define files_db_grgen(db, r) ((db)->gr_gen[(r) - (db)->gr])
+#define files_db_spgen(db, r) ((db)->sp_gen[(r) - (db)->sp])
+/** Get a passwd record by name, or NULL if not found. */
+passwd_t *files_db_getpwnam(const files_db *db, const char *name);
+/** Get the first passwd record for a uid, or NULL if not found. */
+passwd_t *files_db_getpwuid(const files_db *db, uid_t uid);
+/** Get a group record by name, or NULL if not found. */
+group_t *files_db_getgrnam(const files_db *db, const char *name);
+/** Get the first group record for a gid, or NULL if not found. */
+group_t *files_db_getgrgid(const files_db *db, gid_t gid);
+/** Get a shadow record by name, or NULL if not found. */
+spwd_t *files_db_getspnam(const files_db *db, const char *name);
+/** Get the passwd records with a name prefix.
+ *
+ * \param db - The files_db to search.
+ *
+ * \param prefix - The lowercase case-folded name prefix.
+ *
+ * \param count - Set to the number of matching records.
+ *
+ * \return The first of count matching records in the pw_byfold index. */
+passwd_t **files_db_pwprefix(const files_db *db, const char *prefix, int *count);
+/** Get the passwd records with a gecos cn prefix, like files_db_pwprefix(). */
+passwd_t **files_db_pwcnprefix(const files_db *db, const char *prefix, int *count);
+/** Get the group records with a name prefix, like files_db_pwprefix(). */
+group_t **files_db_grprefix(const files_db *db, const char *prefix, int *count);
+/** Get the passwd records with a uid in the range beg-end inclusive.
+ *
+ * \return The first of count matching records in the pw_byuid index. */
+passwd_t **files_db_pwuidrange(const files_db *db, uid_t beg, uid_t end, int *count);
+/** Get the group records with a gid in the range beg-end inclusive. */
+group_t **files_db_grgidrange(const files_db *db, gid_t beg, gid_t end, int *count);
+/** Get the passwd records with a primary gid.
+ *
+ * \return The first of count matching records in the pw_bygid index. */
+passwd_t **files_db_pwgid(const files_db *db, gid_t gid, int *count);
+/** Get the groups a user is a listed member of.
+ *
+ * This doesn't include the user's primary group unless it also lists them.
+ *
+ * \return The first of count matching files_members in file order. */
+files_member *files_db_grmember(const files_db *db, const char *name, int *count);
+
+#endif                          /* LIGHTLDAPD_FILES_H */
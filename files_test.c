@@ -0,0 +1,287 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "files.h"
+#include "utils.h"
+
+#define USERS 100000
+#define GROUPS 1000
+
+static char dir[] = "/tmp/files_test.XXXXXX";
+
+/* Write a file in the test dir atomically, the way vipw and useradd do. */
+static void write_file(const char *name, void (*write)(FILE *f))
+{
+    char path[256], tmp[256];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s/%s-", dir, name);
+    assert((f = fopen(tmp, "w")));
+    write(f);
+    assert(!fclose(f));
+    assert(!rename(tmp, path));
+}
+
+static void write_passwd(FILE *f)
+{
+    fprintf(f, "root:x:0:0:root:/root:/bin/bash\n");
+    fprintf(f, "# A comment.\n\n+nisuser\n");
+    fprintf(f, "bad:x:notanumber:0::/:/bin/false\n");
+    fprintf(f, "short:x:1:1\n");
+    for (int i = 0; i < USERS; i++)
+        fprintf(f, "user%d:x:%d:%d:User %d,Room %d,,:/home/user%d:/bin/bash\n", i, 10000 + i, 10000 + i % GROUPS, i,
+                i, i);
+    /* A duplicate uid and a last line without a newline. */
+    fprintf(f, "dupuser:x:10000:10000::/home/dupuser:/bin/sh");
+}
+
+static void write_passwd2(FILE *f)
+{
+    fprintf(f, "root:x:0:0:root:/root:/bin/bash\nnewuser:x:2000:2000::/home/newuser:/bin/sh\n");
+}
+
+static void write_group(FILE *f)
+{
+    fprintf(f, "root:x:0:\n");
+    fprintf(f, "empty:x:1:\n");
+    fprintf(f, "trailing:x:2:root,,user1,\n");
+    for (int i = 0; i < GROUPS; i++) {
+        fprintf(f, "group%d:x:%d:", i, 10000 + i);
+        for (int j = i; j < USERS; j += GROUPS)
+            fprintf(f, "%suser%d", j == i ? "" : ",", j);
+        fprintf(f, "\n");
+    }
+}
+
+static void write_shadow(FILE *f)
+{
+    fprintf(f, "root:$6$salt$hash:18000:0:99999:7:::\n");
+    for (int i = 0; i < USERS; i++)
+        fprintf(f, "user%d:$6$salt$user%d:18000:1:2:3:4:5:\n", i, i);
+}
+
+int main(void)
+{
+    files_db db, db2, db3;
+    passwd_t *pw;
+    group_t *gr;
+    spwd_t *sp;
+    char path[256], image[256];
+    passwd_t **pws;
+    int n, status;
+    pid_t pid;
+
+    assert(mkdtemp(dir));
+    /* Missing passwd and group files fail. */
+    assert(files_db_init(&db, dir) == -1);
+    write_file("passwd", write_passwd);
+    assert(files_db_init(&db, dir) == -1);
+    write_file("group", write_group);
+    /* Shadow is optional. */
+    assert(files_db_init(&db, dir) == 0);
+    assert(db.pw_count == USERS + 2);
+    assert(db.gr_count == GROUPS + 3);
+    assert(db.sp_count == 0);
+    assert(!files_db_getspnam(&db, "root"));
+    /* Unchanged files are not reloaded. */
+    assert(!files_db_check(&db));
+    /* Each file that loaded records incremented the generation. */
+    assert(db.gen == 2);
+    assert(files_db_pwgen(&db, files_db_getpwnam(&db, "root")) == 1);
+    assert(files_db_grgen(&db, files_db_getgrnam(&db, "root")) == 2);
+    /* Records are in file order. */
+    assert(!strcmp(db.pw[0].pw_name, "root"));
+    assert(!strcmp(db.pw[1].pw_name, "user0"));
+    assert(!strcmp(db.pw[USERS + 1].pw_name, "dupuser"));
+    /* Lookups by name and id. */
+    assert((pw = files_db_getpwnam(&db, "user12345")));
+    assert(pw->pw_uid == 22345);
+    assert(pw->pw_gid == 10345);
+    assert(!strcmp(pw->pw_passwd, "x"));
+    assert(!strcmp(pw->pw_gecos, "User 12345,Room 12345,,"));
+    assert(!strcmp(pw->pw_dir, "/home/user12345"));
+    assert(!strcmp(pw->pw_shell, "/bin/bash"));
+    assert(files_db_getpwuid(&db, 22345) == pw);
+    assert((pw = files_db_getpwnam(&db, "dupuser")));
+    assert(!strcmp(pw->pw_shell, "/bin/sh"));
+    /* Duplicate uids return the first in the file. */
+    assert((pw = files_db_getpwuid(&db, 10000)));
+    assert(!strcmp(pw->pw_name, "user0"));
+    assert(files_db_getpwuid(&db, 0) == &db.pw[0]);
+    assert(!files_db_getpwnam(&db, "nobody"));
+    assert(!files_db_getpwnam(&db, "bad"));
+    assert(!files_db_getpwnam(&db, "short"));
+    assert(!files_db_getpwnam(&db, "+nisuser"));
+    assert(!files_db_getpwuid(&db, 1));
+    assert(!files_db_getpwuid(&db, 10000 + USERS));
+    /* Group members. */
+    assert((gr = files_db_getgrnam(&db, "empty")));
+    assert(gr->gr_gid == 1);
+    assert(!gr->gr_mem[0]);
+    assert((gr = files_db_getgrgid(&db, 2)));
+    assert(!strcmp(gr->gr_name, "trailing"));
+    assert(!strcmp(gr->gr_mem[0], "root"));
+    assert(!strcmp(gr->gr_mem[1], "user1"));
+    assert(!gr->gr_mem[2]);
+    assert((gr = files_db_getgrnam(&db, "group999")));
+    assert(gr->gr_gid == 10999);
+    n = 0;
+    for (char **m = gr->gr_mem; *m; m++, n++)
+        assert(files_db_getpwnam(&db, *m)->pw_gid == gr->gr_gid);
+    assert(n == USERS / GROUPS);
+    assert(!files_db_getgrgid(&db, 3));
+    /* Reverse membership in file order, and primary group members. */
+    files_member *mem = files_db_grmember(&db, "user1", &n);
+    assert(n == 2 && mem[0].gr == files_db_getgrnam(&db, "trailing") && mem[1].gr == files_db_getgrnam(&db, "group1"));
+    mem = files_db_grmember(&db, "root", &n);
+    assert(n == 1 && !strcmp(mem[0].gr->gr_name, "trailing"));
+    files_db_grmember(&db, "nobody", &n);
+    assert(n == 0);
+    assert(db.gr_membercount == USERS + 2);
+    pws = files_db_pwgid(&db, 10001, &n);
+    assert(n == USERS / GROUPS && pws[0] == files_db_getpwnam(&db, "user1"));
+    for (int i = 0; i < n; i++)
+        assert(pws[i]->pw_gid == 10001);
+    files_db_pwgid(&db, 10000, &n);
+    assert(n == USERS / GROUPS + 1);
+    files_db_pwgid(&db, 3, &n);
+    assert(n == 0);
+    /* Id ranges. */
+    pws = files_db_pwuidrange(&db, 10000, 10009, &n);
+    assert(n == 11);
+    assert(pws[0] == &db.pw[1] && pws[1] == &db.pw[USERS + 1]);
+    for (int i = 2; i < n; i++)
+        assert(pws[i]->pw_uid == (uid_t)(10000 + i - 1));
+    files_db_pwuidrange(&db, 0, (uid_t)-1, &n);
+    assert(n == USERS + 2);
+    files_db_pwuidrange(&db, 1, 9999, &n);
+    assert(n == 0);
+    files_db_pwuidrange(&db, 10010, 10009, &n);
+    assert(n == 0);
+    group_t **grs = files_db_grgidrange(&db, 2, 10001, &n);
+    assert(n == 3 && grs[0]->gr_gid == 2 && grs[2]->gr_gid == 10001);
+    /* Case-folded prefix ranges. */
+    pws = files_db_pwprefix(&db, "user1234", &n);
+    assert(n == 11);
+    for (int i = 0; i < n; i++)
+        assert(!strncmp(pws[i]->pw_name, "user1234", 8));
+    assert(pws == files_db_pwprefix(&db, "user1234", &n) && n == 11);
+    files_db_pwprefix(&db, "", &n);
+    assert(n == USERS + 2);
+    files_db_pwprefix(&db, "user", &n);
+    assert(n == USERS);
+    files_db_pwprefix(&db, "zz", &n);
+    assert(n == 0);
+    files_db_pwprefix(&db, "User", &n);
+    assert(n == 0);
+    pws = files_db_pwcnprefix(&db, "user 9999", &n);
+    assert(n == 11);
+    for (int i = 0; i < n; i++)
+        assert(!strncmp(pws[i]->pw_gecos, "User 9999", 9));
+    /* The cn ends at the first ',' of the gecos. */
+    files_db_pwcnprefix(&db, "user 12345,", &n);
+    assert(n == 0);
+    pws = files_db_pwcnprefix(&db, "r", &n);
+    assert(n == 1 && pws[0] == &db.pw[0]);
+    grs = files_db_grprefix(&db, "group99", &n);
+    assert(n == 11);
+    for (int i = 0; i < n; i++)
+        assert(!strncmp(grs[i]->gr_name, "group99", 7));
+    /* Adding shadow is detected and loaded. */
+    write_file("shadow", write_shadow);
+    assert(files_db_check(&db));
+    assert(db.gen == 3);
+    assert(db.sp_count == USERS + 1);
+    assert((sp = files_db_getspnam(&db, "root")));
+    assert(!strcmp(sp->sp_pwdp, "$6$salt$hash"));
+    assert(sp->sp_lstchg == 18000);
+    assert(sp->sp_max == 99999);
+    assert(sp->sp_inact == -1);
+    assert(sp->sp_expire == -1);
+    assert(sp->sp_flag == (unsigned long)-1);
+    assert((sp = files_db_getspnam(&db, "user99999")));
+    assert(!strcmp(sp->sp_pwdp, "$6$salt$user99999"));
+    assert(sp->sp_min == 1 && sp->sp_warn == 3 && sp->sp_expire == 5);
+    assert(files_db_spgen(&db, sp) == 3);
+    /* Rewriting passwd unchanged reloads it without changing the generation. */
+    write_file("passwd", write_passwd);
+    assert(files_db_check(&db));
+    assert(db.gen == 3);
+    assert(files_db_pwgen(&db, files_db_getpwnam(&db, "user1")) == 1);
+    /* Replacing passwd is detected and reloaded. */
+    write_file("passwd", write_passwd2);
+    assert(files_db_check(&db));
+    assert(db.pw_count == 2);
+    assert(db.gen == 4);
+    assert(files_db_pwgen(&db, files_db_getpwnam(&db, "root")) == 1);
+    assert(files_db_pwgen(&db, files_db_getpwnam(&db, "newuser")) == 4);
+    assert(!files_db_getpwnam(&db, "user0"));
+    assert(files_db_getpwuid(&db, 2000) == files_db_getpwnam(&db, "newuser"));
+    assert(!files_db_check(&db));
+    write_file("group", write_group);
+    assert(files_db_check(&db));
+    assert(db.gen == 4);
+    /* Removing a file keeps the old records. */
+    snprintf(path, sizeof(path), "%s/shadow", dir);
+    assert(!unlink(path));
+    assert(!files_db_check(&db));
+    assert(db.sp_count == USERS + 1);
+    assert(files_db_getspnam(&db, "root"));
+    assert(!files_db_check(&db));
+    assert(db.gen == 4);
+    /* Saved images load with the same records and generations. */
+    snprintf(image, sizeof(image), "%s/image", dir);
+    assert(!files_db_save(&db, image));
+    assert(!files_db_load(&db2, dir, image));
+    assert(db2.image && db2.gen == 4 && db2.savedgen == 4);
+    assert(db2.pw_count == 2 && db2.gr_count == GROUPS + 3 && db2.sp_count == USERS + 1);
+    assert((pw = files_db_getpwnam(&db2, "newuser")));
+    assert(pw->pw_uid == 2000 && !strcmp(pw->pw_dir, "/home/newuser"));
+    assert(files_db_pwgen(&db2, pw) == 4);
+    assert(files_db_getpwuid(&db2, 2000) == pw);
+    assert((sp = files_db_getspnam(&db2, "user99999")));
+    assert(!strcmp(sp->sp_pwdp, "$6$salt$user99999"));
+    /* A second image mapping can't use the base address and is relocated. */
+    assert(!files_db_load(&db3, dir, image));
+    assert(db3.image && db3.image != db2.image);
+    assert((gr = files_db_getgrnam(&db3, "trailing")));
+    assert(!strcmp(gr->gr_mem[0], "root") && !strcmp(gr->gr_mem[1], "user1") && !gr->gr_mem[2]);
+    assert(files_db_grgidrange(&db3, 10000, 10999, &n)[999] == files_db_getgrnam(&db3, "group999") && n == 1000);
+    files_db_grprefix(&db3, "group99", &n);
+    assert(n == 11);
+    assert(files_db_grmember(&db3, "user1", &n)[1].gr == files_db_getgrnam(&db3, "group1") && n == 2);
+    assert(files_db_pwgid(&db3, 2000, &n)[0] == files_db_getpwnam(&db3, "newuser") && n == 1);
+    files_db_done(&db3);
+    /* Files changed since the image was saved are reloaded and diffed. */
+    write_file("passwd", write_passwd);
+    assert(files_db_check(&db2));
+    assert(db2.pw_count == USERS + 2 && db2.gen == 5);
+    assert(files_db_pwgen(&db2, files_db_getpwnam(&db2, "root")) == 1);
+    assert(files_db_getspnam(&db2, "root"));
+    files_db_done(&db2);
+    /* A stale image is reloaded when loaded, and can be saved in a child. */
+    assert(!files_db_load(&db2, dir, image));
+    assert(db2.pw_count == USERS + 2 && db2.gen == 5 && db2.savedgen == 4);
+    assert((pid = files_db_save_async(&db2, image)) > 0);
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    files_db_done(&db2);
+    assert(!files_db_load(&db2, dir, image));
+    assert(db2.pw_count == USERS + 2 && db2.savedgen == 5 && !files_db_check(&db2));
+    files_db_done(&db2);
+    /* A failed save exits the child with an error. */
+    assert((pid = files_db_save_async(&db, "/nonexistent/image")) > 0);
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0);
+    /* Images for other files are not used. */
+    assert(files_db_load(&db2, "/nonexistent", image) == -1);
+    assert(!unlink(image));
+    files_db_done(&db);
+    snprintf(path, sizeof(path), "%s/passwd", dir);
+    assert(!unlink(path));
+    snprintf(path, sizeof(path), "%s/group", dir);
+    assert(!unlink(path));
+    assert(!rmdir(dir));
+}
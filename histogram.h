@@ -0,0 +1,97 @@
+/** \file histogram.h
+ * A simple log-linear histogram for latency percentiles.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * Values are non-negative integers, typically latencies in microseconds.
+ * Values less than HISTOGRAM_SUB each get their own bucket. Larger values are
+ * bucketed by their highest set bit into HISTOGRAM_SUB linear sub-buckets, so
+ * percentiles are accurate to within 1/HISTOGRAM_SUB of the value. */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUBBITS 4     /**< The bits of linear sub-buckets. */
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUBBITS)  /**< The linear sub-buckets. */
+#define HISTOGRAM_BITS 40       /**< The max bits of values, larger are clamped. */
+#define HISTOGRAM_SIZE ((HISTOGRAM_BITS - HISTOGRAM_SUBBITS + 1) * HISTOGRAM_SUB)
+
+/** The histogram class. */
+typedef struct {
+    uint64_t count;             /**< The number of values added. */
+    uint64_t sum;               /**< The sum of all values added. */
+    uint64_t max;               /**< The max value added. */
+    uint32_t bucket[HISTOGRAM_SIZE];    /**< The count of values in each bucket. */
+} histogram_t;
+/** Initialize an empty histogram instance. */
+static inline void histogram_init(histogram_t *h);
+/** Add a value to a histogram. */
+static inline void histogram_add(histogram_t *h, uint64_t v);
+/** Merge all the values in another histogram into a histogram. */
+static inline void histogram_merge(histogram_t *h, const histogram_t *o);
+/** Get the value at or below which a fraction p of values are. */
+static inline uint64_t histogram_percentile(const histogram_t *h, double p);
+/** Get the mean of all the values. */
+#define histogram_mean(h) ((h)->count ? (double)(h)->sum / (h)->count : 0.0)
+
+/* Get the bucket index for a value. */
+static inline int _histogram_index(uint64_t v)
+{
+    if (v < HISTOGRAM_SUB)
+        return v;
+    if (v >> HISTOGRAM_BITS)
+        return HISTOGRAM_SIZE - 1;
+    int shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUBBITS;
+    return (shift + 1) * HISTOGRAM_SUB + ((v >> shift) & (HISTOGRAM_SUB - 1));
+}
+
+/* Get the largest value that goes in a bucket index. */
+static inline uint64_t _histogram_value(int i)
+{
+    if (i < HISTOGRAM_SUB)
+        return i;
+    int shift = i / HISTOGRAM_SUB - 1;
+    return ((uint64_t)(HISTOGRAM_SUB + i % HISTOGRAM_SUB + 1) << shift) - 1;
+}
+
+static inline void histogram_init(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void histogram_add(histogram_t *h, uint64_t v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+    h->bucket[_histogram_index(v)]++;
+}
+
+static inline void histogram_merge(histogram_t *h, const histogram_t *o)
+{
+    h->count += o->count;
+    h->sum += o->sum;
+    if (o->max > h->max)
+        h->max = o->max;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++)
+        h->bucket[i] += o->bucket[i];
+}
+
+static inline uint64_t histogram_percentile(const histogram_t *h, double p)
+{
+    assert(0.0 <= p && p <= 1.0);
+    uint64_t n = 0, target = p * h->count;
+
+    for (int i = 0; i < HISTOGRAM_SIZE; i++)
+        if ((n += h->bucket[i]) > target || (n && n == h->count))
+            return _histogram_value(i) < h->max ? _histogram_value(i) : h->max;
+    return 0;
+}
+
+#endif                          /* HISTOGRAM_H */
@@ -0,0 +1,57 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include "histogram.h"
+
+int main(void)
+{
+    histogram_t h;
+
+    histogram_init(&h);
+    assert(h.count == 0);
+    assert(histogram_mean(&h) == 0.0);
+    assert(histogram_percentile(&h, 0.5) == 0);
+    /* Every value maps to a bucket whose max value is at least the value. */
+    for (uint64_t v = 0; v < 100000; v++) {
+        int i = _histogram_index(v);
+        assert(0 <= i && i < HISTOGRAM_SIZE);
+        assert(v <= _histogram_value(i));
+        assert(i == 0 || _histogram_value(i - 1) < v);
+    }
+    /* Buckets are accurate to within 1/HISTOGRAM_SUB. */
+    for (uint64_t v = HISTOGRAM_SUB; v < ((uint64_t)1 << HISTOGRAM_BITS); v = v * 3 / 2)
+        assert(_histogram_value(_histogram_index(v)) - v <= v / HISTOGRAM_SUB);
+    /* Values that are too large are clamped into the last bucket. */
+    assert(_histogram_index((uint64_t)1 << 50) == HISTOGRAM_SIZE - 1);
+    /* Small values are exact. */
+    for (uint64_t v = 1; v <= 10; v++)
+        histogram_add(&h, v);
+    assert(h.count == 10);
+    assert(h.sum == 55);
+    assert(h.max == 10);
+    assert(histogram_mean(&h) == 5.5);
+    assert(histogram_percentile(&h, 0.0) == 1);
+    assert(histogram_percentile(&h, 0.5) == 6);
+    assert(histogram_percentile(&h, 0.9) == 10);
+    assert(histogram_percentile(&h, 1.0) == 10);
+    /* Large values are approximate, but never exceed the max. */
+    histogram_init(&h);
+    for (uint64_t v = 1; v <= 1000; v++)
+        histogram_add(&h, v * 1000);
+    assert(h.max == 1000000);
+    uint64_t p50 = histogram_percentile(&h, 0.5);
+    assert(500000 <= p50 && p50 <= 500000 + 500000 / HISTOGRAM_SUB);
+    uint64_t p99 = histogram_percentile(&h, 0.99);
+    assert(990000 <= p99 && p99 <= 1000000);
+    assert(histogram_percentile(&h, 0.999) <= 1000000);
+    assert(histogram_percentile(&h, 1.0) == 1000000);
+    /* Merging adds all the values. */
+    histogram_t m;
+    histogram_init(&m);
+    histogram_add(&m, 2000000);
+    histogram_merge(&m, &h);
+    assert(m.count == 1001);
+    assert(m.max == 2000000);
+    assert(histogram_percentile(&m, 0.5) == p50);
+    assert(histogram_percentile(&m, 1.0) == 2000000);
+}
@@ -5,14 +5,30 @@
  * Licensed under the GPLv3 License. See LICENSE file for details.
  */
 
+#define _GNU_SOURCE             /* For accept4() and struct ucred. */
 #include "ldap_server.h"
 #include "nss2ldap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static const char *LDAPOID_StartTLS = "1.3.6.1.4.1.1466.20037";
 
 void sighup_cb(ev_loop *loop, ev_signal *watcher, int revents);
 void sigterm_cb(ev_loop *loop, ev_signal *watcher, int revents);
+void sigusr1_cb(ev_loop *loop, ev_signal *watcher, int revents);
+void prepare_cb(ev_loop *loop, ev_prepare *watcher, int revents);
+void check_cb(ev_loop *loop, ev_check *watcher, int revents);
+void files_cb(ev_loop *loop, ev_stat *watcher, int revents);
+void image_cb(ev_loop *loop, ev_child *watcher, int revents);
 void accept_cb(ev_loop *loop, ev_io *watcher, int revents);
+void unix_accept_cb(ev_loop *loop, ev_io *watcher, int revents);
+void handoff_cb(ev_loop *loop, ev_io *watcher, int revents);
 void read_cb(ev_loop *loop, ev_io *watcher, int revents);
 void write_cb(ev_loop *loop, ev_io *watcher, int revents);
 void delay_cb(EV_P_ ev_timer *w, int revents);
@@ -24,6 +40,8 @@ int ldap_server_init(ldap_server *server, ev_loop *loop, const char *basedn, con
                      const ldap_ranges *gids)
 {
     mbedtls_net_init(&server->socket);
+    mbedtls_net_init(&server->unix_socket);
+    mbedtls_net_init(&server->handoff_socket);
     server->basedn = basedn;
     server->rootuser = rootuser;
     /* We set rootuid from rootuser later in ldap_server_start(). */
@@ -38,35 +56,114 @@ int ldap_server_init(ldap_server *server, ev_loop *loop, const char *basedn, con
     server->sigint_watcher.data = server;
     ev_signal_init(&server->sigterm_watcher, sigterm_cb, SIGTERM);
     server->sigterm_watcher.data = server;
+    ev_signal_init(&server->sigusr1_watcher, sigusr1_cb, SIGUSR1);
+    server->sigusr1_watcher.data = server;
+    ev_prepare_init(&server->prepare_watcher, prepare_cb);
+    server->prepare_watcher.data = server;
+    ev_check_init(&server->check_watcher, check_cb);
+    server->check_watcher.data = server;
+    ev_init(&server->passwd_watcher, files_cb);
+    server->passwd_watcher.data = server;
+    ev_init(&server->group_watcher, files_cb);
+    server->group_watcher.data = server;
+    ev_init(&server->shadow_watcher, files_cb);
+    server->shadow_watcher.data = server;
+    ev_child_init(&server->image_watcher, image_cb, 0, 0);
+    server->image_watcher.data = server;
     ev_init(&server->connection_watcher, accept_cb);
     server->connection_watcher.data = server;
+    ev_init(&server->unix_watcher, unix_accept_cb);
+    server->unix_watcher.data = server;
+    ev_init(&server->handoff_watcher, handoff_cb);
+    server->handoff_watcher.data = server;
     server->ssl = NULL;
     server->connection = NULL;
     server->cxn_opened_c = 0;
     server->cxn_closed_c = 0;
     server->msg_send_c = 0;
     server->msg_recv_c = 0;
+    server->slowtime = 0.0;
+    server->files = NULL;
+    server->budget = MEMORY_BUDGET;
+    server->queued = 0;
+    server->queued_max = 0;
+    server->paused_c = 0;
+    server->maxvalues = 0;
+    server->streamed_c = 0;
+    server->woken = 0.0;
+    server->lag = 0.0;
+    server->overload = 0.0;
+    server->overloaded = false;
+    histogram_init(&server->work);
+    server->overload_c = 0;
+    server->shed_c = 0;
+    filter_cache_init(&server->filters);
+    response_cache_init(&server->responses, RESPONSE_CACHE_MAX);
+    response_flights_init(&server->flights);
+    quota_table_init(&server->quotas);
+    profile_table_init(&server->profiles);
+    ber_pool_init(&server->arenas);
     if (crtpath && !(server->ssl = mbedtls_ssl_server_new(crtpath, caspath, keypath)))
         return 1;
     return 0;
 }
 
+/* Start saving the files image in a child if it is stale and not already saving. */
+static void ldap_server_save_image(ldap_server *server)
+{
+    files_db *db = server->files;
+    pid_t pid;
+
+    if (!server->files_image || ev_is_active(&server->image_watcher) || db->savedgen == db->gen)
+        return;
+    if ((pid = files_db_save_async(db, server->files_image)) < 0)
+        return;
+    server->image_gen = db->gen;
+    ev_child_set(&server->image_watcher, pid, 0);
+    ev_child_start(server->loop, &server->image_watcher);
+}
+
 void ldap_server_start(ldap_server *server, mbedtls_net_context socket)
 {
     assert(!ev_is_active(&server->sighup_watcher));
     assert(!ev_is_active(&server->sigint_watcher));
     assert(!ev_is_active(&server->sigterm_watcher));
+    assert(!ev_is_active(&server->sigusr1_watcher));
     assert(!ev_is_active(&server->connection_watcher));
 
     lwarnx("server starting");
     /* We set rootuid here so it is resolved inside any chroot. */
     server->rootuid = name2uid(server->rootuser);
     server->socket = socket;
+    /* Set nonblock mode so accept_cb() can accept until there are none left. */
+    if (mbedtls_net_set_nonblock(&server->socket))
+        lwarnx("mbedtls_net_set_nonblock failed for server socket");
     ev_io_set(&server->connection_watcher, socket.fd, EV_READ);
     ev_io_start(server->loop, &server->connection_watcher);
+    if (server->unix_socket.fd >= 0) {
+        ev_io_set(&server->unix_watcher, server->unix_socket.fd, EV_READ);
+        ev_io_start(server->loop, &server->unix_watcher);
+    }
+    if (server->handoff_socket.fd >= 0) {
+        ev_io_set(&server->handoff_watcher, server->handoff_socket.fd, EV_READ);
+        ev_io_start(server->loop, &server->handoff_watcher);
+    }
     ev_signal_start(server->loop, &server->sighup_watcher);
     ev_signal_start(server->loop, &server->sigint_watcher);
     ev_signal_start(server->loop, &server->sigterm_watcher);
+    ev_signal_start(server->loop, &server->sigusr1_watcher);
+    ev_prepare_start(server->loop, &server->prepare_watcher);
+    ev_check_start(server->loop, &server->check_watcher);
+    /* Watch the files so they are reloaded when they change. */
+    if (server->files) {
+        ev_stat_set(&server->passwd_watcher, server->files->passwd_map.path, 0.0);
+        ev_stat_start(server->loop, &server->passwd_watcher);
+        ev_stat_set(&server->group_watcher, server->files->group_map.path, 0.0);
+        ev_stat_start(server->loop, &server->group_watcher);
+        ev_stat_set(&server->shadow_watcher, server->files->shadow_map.path, 0.0);
+        ev_stat_start(server->loop, &server->shadow_watcher);
+        ldap_server_save_image(server);
+    }
 }
 
 void ldap_server_stop(ldap_server *server)
@@ -74,6 +171,7 @@ void ldap_server_stop(ldap_server *server)
     assert(ev_is_active(&server->sighup_watcher));
     assert(ev_is_active(&server->sigint_watcher));
     assert(ev_is_active(&server->sigterm_watcher));
+    assert(ev_is_active(&server->sigusr1_watcher));
     assert(ev_is_active(&server->connection_watcher));
 
     lwarnx("server stopping");
@@ -83,8 +181,182 @@ void ldap_server_stop(ldap_server *server)
     ev_signal_stop(server->loop, &server->sighup_watcher);
     ev_signal_stop(server->loop, &server->sigint_watcher);
     ev_signal_stop(server->loop, &server->sigterm_watcher);
+    ev_signal_stop(server->loop, &server->sigusr1_watcher);
+    ev_prepare_stop(server->loop, &server->prepare_watcher);
+    ev_check_stop(server->loop, &server->check_watcher);
+    ev_stat_stop(server->loop, &server->passwd_watcher);
+    ev_stat_stop(server->loop, &server->group_watcher);
+    ev_stat_stop(server->loop, &server->shadow_watcher);
+    ev_child_stop(server->loop, &server->image_watcher);
     ev_io_stop(server->loop, &server->connection_watcher);
+    ev_io_stop(server->loop, &server->unix_watcher);
+    ev_io_stop(server->loop, &server->handoff_watcher);
     mbedtls_net_free(&server->socket);
+    mbedtls_net_free(&server->unix_socket);
+    mbedtls_net_free(&server->handoff_socket);
+    ldap_server_stats(server);
+    filter_cache_done(&server->filters);
+    response_cache_done(&server->responses);
+    quota_table_done(&server->quotas);
+    ber_pool_done(&server->arenas);
+}
+
+/* Log the top search fingerprint profiles in an order. */
+static void ldap_server_stats_profile(const profile_table *pt, profile_order order, const char *name)
+{
+    const profile_entry *top[PROFILE_TOP];
+    const int n = profile_top(pt, order, top, PROFILE_TOP);
+
+    for (int i = 0; i < n; i++) {
+        const profile_entry *e = top[i];
+        lnote("stats profile top %s %d: count=%lu err=%lu scanned=%lu returned=%lu bytes=%" PRIu64
+              " p50=%.3fms p99=%.3fms total=%.3fs query=%s", name, i + 1, e->count, e->error, e->scanned, e->returned,
+              e->bytes, histogram_percentile(&e->latency, 0.5) * 1e-3,
+              histogram_percentile(&e->latency, 0.99) * 1e-3, e->latency.sum * 1e-6, e->key);
+    }
+}
+
+/* Log the server statistics. */
+void ldap_server_stats(ldap_server *server)
+{
+    const filter_cache *fc = &server->filters;
+    const unsigned long lookups = fc->hits + fc->misses;
+    const response_cache *rc = &server->responses;
+    const response_flights *rf = &server->flights;
+    const unsigned long searches = rc->hits + rc->misses;
+    const quota_table *qt = &server->quotas;
+    const ber_pool *bp = &server->arenas;
+    const profile_table *pt = &server->profiles;
+    const histogram_t *wh = &server->work;
+
+    lnote("stats connections opened=%u closed=%u messages recv=%u sent=%u", server->cxn_opened_c,
+          server->cxn_closed_c, server->msg_recv_c, server->msg_send_c);
+    lnote("stats filter cache size=%d hits=%lu misses=%lu hitrate=%.1f%%", fc->count, fc->hits, fc->misses,
+          lookups ? 100.0 * fc->hits / lookups : 0.0);
+    lnote("stats response cache size=%d bytes=%zu hits=%lu misses=%lu stale=%lu hitrate=%.1f%%", rc->count, rc->size,
+          rc->hits, rc->misses, rc->stale, searches ? 100.0 * rc->hits / searches : 0.0);
+    lnote("stats response flights size=%d joined=%lu", rf->count, rf->joined);
+    lnote("stats loop iterations=%" PRIu64 " lag=%.3fms work p50=%.3fms p99=%.3fms max=%.3fms overloaded=%u shed=%u",
+          wh->count, server->lag * 1e3, histogram_percentile(wh, 0.5) * 1e-3, histogram_percentile(wh, 0.99) * 1e-3,
+          wh->max * 1e-3, server->overload_c, server->shed_c);
+    lnote("stats memory queued=%zu max=%zu budget=%zu paused=%u streamed=%u", server->queued, server->queued_max,
+          server->budget, server->paused_c, server->streamed_c);
+    lnote("stats log dropped=%lu", atomic_load_explicit(&log_dropped, memory_order_relaxed));
+    lnote("stats quotas size=%d rejected connections=%lu binds=%lu searches=%lu blocked binds=%lu", qt->count,
+          qt->rejected[QUOTA_CONNECT], qt->rejected[QUOTA_BIND], qt->rejected[QUOTA_SEARCH], qt->blocked);
+    lnote("stats decoder arenas=%d allocs=%lu decoded=%lu asn1c=%lu", bp->count, bp->allocs, bp->decoded, bp->others);
+    lnote("stats profile searches=%lu fingerprints=%d", pt->total, pt->count);
+    ldap_server_stats_profile(pt, PROFILE_BYCOUNT, "count");
+    ldap_server_stats_profile(pt, PROFILE_BYTIME, "time");
+}
+
+/* Bind a non-blocking listening unix socket, returning -1 on error. */
+int ldap_unix_bind(mbedtls_net_context *ctx, const char *path, mode_t mode)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    /* Remove any stale socket left by a previous run, but nothing else. */
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || chmod(path, mode) || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    ctx->fd = fd;
+    return 0;
+}
+
+/* Use an inherited listening socket for TCP or ldapi depending on its family. */
+static int ldap_listen_add(int fd, mbedtls_net_context *ctx, mbedtls_net_context *unix_ctx)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    mbedtls_net_context *c;
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+        close(fd);
+        return -1;
+    }
+    c = addr.ss_family == AF_UNIX ? unix_ctx : ctx;
+    /* Only the first socket of each family is used. */
+    if (c->fd >= 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    return 0;
+}
+
+/* Get the listening sockets passed by systemd socket activation.
+ *
+ * Returns -1 if there are none, and ctx or unix_ctx are left with -1 fds if
+ * no socket of that family was passed. */
+int ldap_listen_fds(mbedtls_net_context *ctx, mbedtls_net_context *unix_ctx)
+{
+    const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+    int n;
+
+    if (!pid || !fds || atol(pid) != getpid() || (n = atoi(fds)) < 1)
+        return -1;
+    /* Don't pass them on to any child processes. */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd++)
+        ldap_listen_add(fd, ctx, unix_ctx);
+    return ctx->fd >= 0 || unix_ctx->fd >= 0 ? 0 : -1;
+}
+
+/* Take over the listening sockets of a running server from its handoff socket.
+ *
+ * The running server sends them with SCM_RIGHTS and then stops accepting
+ * and shuts down after finishing its requests. Returns -1 if there is no
+ * running server to take them from. */
+int ldap_handoff_recv(const char *path, mbedtls_net_context *ctx, mbedtls_net_context *unix_ctx)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    struct timeval tv = {.tv_sec = HANDOFF_TIMEOUT };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } cmsg;
+    char c;
+    struct iovec iov = {.iov_base = &c,.iov_len = 1 };
+    struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,.msg_control = cmsg.buf,.msg_controllen = sizeof(cmsg.buf) };
+    struct cmsghdr *h;
+    int fd, n = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) || connect(fd, (struct sockaddr *)&addr, sizeof(addr))
+        || recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    for (h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h))
+        if (h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS)
+            for (size_t i = 0; i < (h->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                memcpy(&fd, CMSG_DATA(h) + i * sizeof(int), sizeof(int));
+                if (!ldap_listen_add(fd, ctx, unix_ctx))
+                    n++;
+            }
+    return n ? 0 : -1;
 }
 
 ldap_connection *ldap_connection_new(ldap_server *server, mbedtls_net_context socket, const char *ip)
@@ -96,6 +368,7 @@ ldap_connection *ldap_connection_new(ldap_server *server, mbedtls_net_context so
     connection->socket = socket;
     strcpy(connection->client_ip, ip);
     connection->binduid = (uid_t)(-1);
+    connection->peeruid = (uid_t)(-1);
     ev_io_init(&connection->read_watcher, read_cb, socket.fd, EV_READ);
     connection->read_watcher.data = connection;
     ev_io_init(&connection->write_watcher, write_cb, socket.fd, EV_WRITE);
@@ -103,8 +376,12 @@ ldap_connection *ldap_connection_new(ldap_server *server, mbedtls_net_context so
     ev_init(&connection->delay_watcher, delay_cb);
     connection->delay_watcher.data = connection;
     connection->recv_msg = NULL;
+    connection->recv_arena = NULL;
+    memset(&connection->recv_timing, 0, sizeof(connection->recv_timing));
     connection->request = NULL;
     connection->delay = 0.0;
+    connection->queued = 0;
+    connection->paused = false;
     buffer_init(&connection->recv_buf);
     buffer_init(&connection->send_buf);
     connection->ssl = NULL;
@@ -126,7 +403,7 @@ void ldap_connection_free(ldap_connection *connection)
     ev_io_stop(server->loop, &connection->write_watcher);
     ev_timer_stop(server->loop, &connection->delay_watcher);
     mbedtls_net_free(&connection->socket);
-    LDAPMessage_free(connection->recv_msg);
+    ldap_message_free(server, connection->recv_msg, connection->recv_arena);
     while (connection->request)
         ldap_request_free(connection->request);
     mbedtls_ssl_connection_free(connection->ssl);
@@ -147,10 +424,10 @@ void ldap_connection_respond(ldap_connection *connection)
     assert(connection);
     ldap_server *server = connection->server;
     LDAPMessage_t **msg = &connection->recv_msg;
-    ldap_status_t status;
+    ldap_status_t status = RC_OK;
 
-    /* While we've recieved a message, add a request. */
-    while ((status = ldap_connection_recv(connection, msg)) == RC_OK) {
+    /* While we are not paused and we've recieved a message, add a request. */
+    while (!ldap_connection_ispaused(connection) && (status = ldap_connection_recv(connection, msg)) == RC_OK) {
         switch ((*msg)->protocolOp.present) {
             /* For known request types, create a new request. */
         case LDAPMessage__protocolOp_PR_bindRequest:
@@ -159,6 +436,9 @@ void ldap_connection_respond(ldap_connection *connection)
         case LDAPMessage__protocolOp_PR_searchRequest:
             ldap_request_search(connection, *msg);
             break;
+        case LDAPMessage__protocolOp_PR_compareRequest:
+            ldap_request_compare(connection, *msg);
+            break;
         case LDAPMessage__protocolOp_PR_abandonRequest:
             ldap_request_abandon(connection, *msg);
             break;
@@ -175,6 +455,8 @@ void ldap_connection_respond(ldap_connection *connection)
             return ldap_connection_close(connection);
         }
         *msg = NULL;
+        connection->recv_arena = NULL;
+        memset(&connection->recv_timing, 0, sizeof(connection->recv_timing));
     }
     /* If we got an error receiving messages, close the connection. */
     if (status == RC_FAIL) {
@@ -188,12 +470,25 @@ void ldap_connection_respond(ldap_connection *connection)
         lcwarn(connection, "failure sending message");
         return ldap_connection_close(connection);
     }
+    /* Send what we can now, so the write watcher is only needed when the
+     * socket is full. This saves a loop iteration and watcher changes. */
+    if (ldap_connection_flush(connection) == RC_FAIL)
+        return ldap_connection_close(connection);
     /* Update the state of all the connection watchers. */
     if (connection->delay && !ev_is_active(&connection->delay_watcher)) {
         ev_timer_set(&connection->delay_watcher, connection->delay, 0.0);
         ev_timer_start(server->loop, &connection->delay_watcher);
     }
-    if (connection->delay || buffer_full(&connection->recv_buf))
+    /* Pause reading while this connection's replies are over the memory budget. */
+    if (ldap_connection_ispaused(connection) != connection->paused) {
+        connection->paused = !connection->paused;
+        if (connection->paused) {
+            server->paused_c++;
+            lcinfo(connection, "paused with %zu of %zu bytes queued", connection->queued, server->queued);
+        } else
+            lcinfo(connection, "resumed");
+    }
+    if (connection->delay || buffer_full(&connection->recv_buf) || connection->paused)
         ev_io_stop(server->loop, &connection->read_watcher);
     else
         ev_io_start(server->loop, &connection->read_watcher);
@@ -203,7 +498,29 @@ void ldap_connection_respond(ldap_connection *connection)
         ev_io_start(server->loop, &connection->write_watcher);
 }
 
-ldap_status_t ldap_connection_send(ldap_connection *connection, LDAPMessage_t *msg)
+ldap_status_t ldap_connection_flush(ldap_connection *connection)
+{
+    buffer_t *buf = &connection->send_buf;
+    int buf_cnt;
+
+    if (buffer_empty(buf))
+        return RC_OK;
+    if (connection->ssl)
+        buf_cnt = mbedtls_ssl_write(connection->ssl, buffer_rpos(buf), buffer_rlen(buf));
+    else
+        buf_cnt = mbedtls_net_send(&connection->socket, buffer_rpos(buf), buffer_rlen(buf));
+    if (buf_cnt == MBEDTLS_ERR_SSL_WANT_WRITE || buf_cnt == MBEDTLS_ERR_SSL_WANT_READ)
+        return RC_WMORE;
+    if (buf_cnt < 0) {
+        /* Discard the data so closing the connection doesn't retry it. */
+        buffer_init(buf);
+        mbedtls_fail1("mbedtls_net_send", buf_cnt, RC_FAIL);
+    }
+    buffer_toss(buf, buf_cnt);
+    return buffer_empty(buf) ? RC_OK : RC_WMORE;
+}
+
+ldap_status_t ldap_connection_send(ldap_connection *connection, LDAPMessage_t *msg, response_stream *stream)
 {
     buffer_t *buf = &connection->send_buf;
     asn_enc_rval_t rencode;
@@ -211,26 +528,85 @@ ldap_status_t ldap_connection_send(ldap_connection *connection, LDAPMessage_t *m
     /* Send nothing if connection is delayed. */
     if (connection->delay)
         return RC_WMORE;
-    /* from asn1c's FAQ: If you want BER or DER encoding, use der_encode(). */
-    rencode = der_encode_to_buffer(&asn_DEF_LDAPMessage, msg, buffer_wpos(buf), buffer_wlen(buf));
-    /* If it failed the buffer was full, return RC_WMORE to try again. */
-    if (rencode.encoded == -1)
+    if (!stream->data) {
+        /* from asn1c's FAQ: If you want BER or DER encoding, use der_encode(). */
+        rencode = der_encode_to_buffer(&asn_DEF_LDAPMessage, msg, buffer_wpos(buf), buffer_wlen(buf));
+        if (rencode.encoded != -1) {
+            buffer_fill(buf, rencode.encoded);
+            connection->server->msg_send_c++;
+            LDAP_DEBUG(msg);
+            return RC_OK;
+        }
+        /* If it failed the buffer was full, return RC_WMORE to try again
+         * unless it was empty and the message is too big for it. */
+        if (!buffer_empty(buf))
+            return RC_WMORE;
+        /* Messages bigger than the buffer are encoded once into the stream,
+         * and then sent from it a buffer at a time. */
+        rencode = der_encode(&asn_DEF_LDAPMessage, msg, response_stream_cb, stream);
+        if (rencode.encoded == -1) {
+            response_stream_done(stream);
+            lcwarnx(connection, "%ld:%s failed to encode reply", msg->messageID, LDAPMessage_name(msg));
+            return RC_FAIL;
+        }
+        connection->server->streamed_c++;
+    }
+    buffer_fill(buf, response_stream_get(stream, buffer_wpos(buf), buffer_wlen(buf)));
+    if (stream->pos < stream->len)
         return RC_WMORE;
-    buffer_fill(buf, rencode.encoded);
+    response_stream_done(stream);
     connection->server->msg_send_c++;
     LDAP_DEBUG(msg);
     return RC_OK;
 }
 
+ldap_status_t ldap_connection_send_response(ldap_connection *connection, const response *r, size_t *pos,
+                                            MessageID_t msgid)
+{
+    buffer_t *buf = &connection->send_buf;
+    size_t len;
+
+    /* Send nothing if connection is delayed. */
+    if (connection->delay)
+        return RC_WMORE;
+    /* Copy as many messages as fit with the messageID rewritten. */
+    while (*pos < r->len && (len = response_getmsg(r, pos, msgid, buffer_wpos(buf), buffer_wlen(buf)))) {
+        buffer_fill(buf, len);
+        connection->server->msg_send_c++;
+    }
+    return *pos < r->len ? RC_WMORE : RC_OK;
+}
+
 ldap_status_t ldap_connection_recv(ldap_connection *connection, LDAPMessage_t **msg)
 {
     buffer_t *buf = &connection->recv_buf;
-    asn_dec_rval_t rdecode;
+    timing_t *timing = &connection->recv_timing;
+    asn_dec_rval_t rdecode = { RC_WMORE, 0 };
+    ber_status status = BER_OTHER;
+    ev_tstamp t, c;
 
-    /* Recv nothing if connection is delayed. */
-    if (connection->delay)
+    /* Recv nothing if connection is delayed or there is nothing to decode. */
+    if (connection->delay || buffer_empty(buf))
         return RC_WMORE;
-    rdecode = ber_decode(0, &asn_DEF_LDAPMessage, (void **)msg, buffer_rpos(buf), buffer_rlen(buf));
+    t = mtime();
+    c = cputime();
+    /* The request starts when we first start decoding it. */
+    if (!timing->start)
+        timing->start = t;
+    /* Use our decoder unless asn1c is part way through a message. */
+    if (!*msg)
+        status = ber_decode_request(&connection->server->arenas, buffer_rpos(buf), buffer_rlen(buf), BUFFER_SIZE,
+                                    &connection->recv_arena, &rdecode.consumed);
+    if (status == BER_OK) {
+        *msg = &connection->recv_arena->message;
+        rdecode.code = RC_OK;
+    } else if (status == BER_FAIL) {
+        rdecode.code = RC_FAIL;
+    } else if (status == BER_OTHER) {
+        rdecode = ber_decode(0, &asn_DEF_LDAPMessage, (void **)msg, buffer_rpos(buf), buffer_rlen(buf));
+    }
+    timing->decode += mtime() - t;
+    timing->cpu += cputime() - c;
     buffer_toss(buf, rdecode.consumed);
     if (rdecode.code == RC_FAIL) {
         fail1("ber_decode", RC_FAIL);
@@ -262,6 +638,87 @@ void sigterm_cb(ev_loop *loop, ev_signal *watcher, int revents)
     ldap_server_stop(server);
 }
 
+void sigusr1_cb(ev_loop *loop, ev_signal *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    assert(server->loop == loop);
+    assert(&server->sigusr1_watcher == watcher);
+    assert(revents == EV_SIGNAL);
+
+    ldap_server_stats(server);
+}
+
+/* Record the work done in a loop iteration before it blocks.
+ *
+ * Everything queued while the loop is busy waits for the rest of the
+ * iteration, so the average work per iteration is the loop lag. Above the
+ * overload lag scanning searches are shed until it drops below half of it. */
+void prepare_cb(ev_loop *loop, ev_prepare *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    assert(server->loop == loop);
+    assert(&server->prepare_watcher == watcher);
+    assert(revents == EV_PREPARE);
+    ev_tstamp work;
+
+    if (!server->woken)
+        return;
+    work = mtime() - server->woken;
+    histogram_add(&server->work, work * 1e6);
+    server->lag += (work - server->lag) / LAG_WEIGHT;
+    if (!server->overloaded && server->overload && server->lag > server->overload) {
+        lwarnx("overloaded lag=%.3fms, shedding scanning searches", server->lag * 1e3);
+        server->overloaded = true;
+        server->overload_c++;
+    } else if (server->overloaded && server->lag < server->overload / 2) {
+        lnote("no longer overloaded lag=%.3fms", server->lag * 1e3);
+        server->overloaded = false;
+    }
+}
+
+/* Record when the loop wakes up to start an iteration. */
+void check_cb(ev_loop *loop, ev_check *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    assert(server->loop == loop);
+    assert(&server->check_watcher == watcher);
+    assert(revents == EV_CHECK);
+
+    server->woken = mtime();
+}
+
+void files_cb(ev_loop *loop, ev_stat *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    assert(server->loop == loop);
+    assert(revents == EV_STAT);
+    ev_tstamp t = mtime();
+
+    /* This only reloads the files that changed, between requests. */
+    if (files_db_check(server->files)) {
+        lnote("reloaded files in %.3fms generation=%lu", (mtime() - t) * 1e3, server->files->gen);
+        ldap_server_save_image(server);
+    }
+}
+
+void image_cb(ev_loop *loop, ev_child *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    assert(server->loop == loop);
+    assert(&server->image_watcher == watcher);
+    assert(revents == EV_CHILD);
+
+    ev_child_stop(loop, watcher);
+    if (WIFEXITED(watcher->rstatus) && !WEXITSTATUS(watcher->rstatus)) {
+        server->files->savedgen = server->image_gen;
+        /* Save again if the files were reloaded while saving. */
+        ldap_server_save_image(server);
+    } else {
+        /* Don't retry until the files are reloaded again. */
+        lwarnx("failed to save %s status=%d", server->files_image, watcher->rstatus);
+    }
+}
+
 void accept_cb(ev_loop *loop, ev_io *watcher, int revents)
 {
     ldap_server *server = watcher->data;
@@ -269,23 +726,113 @@ void accept_cb(ev_loop *loop, ev_io *watcher, int revents)
     char addr[16];
     size_t len;
     char ip[INET6_ADDRSTRLEN];
+    int err;
     assert(server->loop == loop);
     assert(&server->connection_watcher == watcher);
 
     if (EV_ERROR & revents)
         fail("got invalid event");
-    if (mbedtls_net_accept(&server->socket, &socket, addr, sizeof(addr), &len))
-        fail("mbedtls_net_accept error");
-    /* Set nonblock mode so mbedtls_ssl_handshake() is non-blocking. */
-    if (mbedtls_net_set_nonblock(&socket)) {
-        mbedtls_net_free(&socket);
-        fail("mbedtls_net_set_nonblock");
+    /* Accept a batch of pending connections to save waiting for each one. */
+    for (int i = 0; i < ACCEPT_MAX; i++) {
+        if ((err = mbedtls_net_accept(&server->socket, &socket, addr, sizeof(addr), &len))) {
+            if (err != MBEDTLS_ERR_SSL_WANT_READ)
+                mbedtls_fail("mbedtls_net_accept", err);
+            return;
+        }
+        /* Set nonblock mode so mbedtls_ssl_handshake() is non-blocking. */
+        if (mbedtls_net_set_nonblock(&socket)) {
+            mbedtls_net_free(&socket);
+            fail("mbedtls_net_set_nonblock");
+        }
+        if (!inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, ip, sizeof(ip))) {
+            lwarn("inet_ntop() failed to format client address");
+            strcpy(ip, "<unknown>");
+        }
+        /* Drop connections from clients over their quota straight away. */
+        if (!quota_take(&server->quotas, ip, QUOTA_CONNECT, ev_now(loop))) {
+            linfo("%s over connection quota", ip);
+            mbedtls_net_free(&socket);
+            continue;
+        }
+        ldap_connection_new(server, socket, ip);
+    }
+}
+
+void unix_accept_cb(ev_loop *loop, ev_io *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    mbedtls_net_context socket;
+    struct ucred cred;
+    socklen_t len;
+    assert(server->loop == loop);
+    assert(&server->unix_watcher == watcher);
+
+    if (EV_ERROR & revents)
+        fail("got invalid event");
+    for (int i = 0; i < ACCEPT_MAX; i++) {
+        mbedtls_net_init(&socket);
+        if ((socket.fd = accept4(server->unix_socket.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                lwarn("accept4() failed for ldapi connection");
+            return;
+        }
+        len = sizeof(cred);
+        if (getsockopt(socket.fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+            lwarn("getsockopt(SO_PEERCRED) failed");
+            mbedtls_net_free(&socket);
+            continue;
+        }
+        ldap_connection_new(server, socket, "ldapi")->peeruid = cred.uid;
     }
-    if (!inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, ip, sizeof(ip))) {
-        lwarn("inet_ntop() failed to format client address");
-        strcpy(ip, "<unknown>");
+}
+
+void handoff_cb(ev_loop *loop, ev_io *watcher, int revents)
+{
+    ldap_server *server = watcher->data;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } cmsg;
+    char c = 'L';
+    struct iovec iov = {.iov_base = &c,.iov_len = 1 };
+    struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,.msg_control = cmsg.buf };
+    struct cmsghdr *h = &cmsg.hdr;
+    int fd, fds[2], n = 0;
+    assert(server->loop == loop);
+    assert(&server->handoff_watcher == watcher);
+
+    if (EV_ERROR & revents)
+        fail("got invalid event");
+    if ((fd = accept4(server->handoff_socket.fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            lwarn("accept4() failed for handoff connection");
+        return;
+    }
+    /* Only hand off to root or our own user. */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || (cred.uid && cred.uid != getuid())) {
+        lwarnx("refused socket handoff to uid %d", (int)cred.uid);
+        close(fd);
+        return;
     }
-    ldap_connection_new(server, socket, ip);
+    fds[n++] = server->socket.fd;
+    if (server->unix_socket.fd >= 0)
+        fds[n++] = server->unix_socket.fd;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(h), fds, n * sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+        lwarn("sendmsg() failed for socket handoff");
+        close(fd);
+        return;
+    }
+    close(fd);
+    /* The new server is accepting now, so finish our requests and exit. */
+    lnote("listening sockets handed off, shutting down.");
+    ldap_server_stop(server);
 }
 
 void read_cb(ev_loop *loop, ev_io *watcher, int revents)
@@ -316,20 +863,10 @@ void write_cb(ev_loop *loop, ev_io *watcher, int revents)
 {
     assert(revents == EV_WRITE);
     ldap_connection *connection = watcher->data;
-    buffer_t *buf = &connection->send_buf;
-    ssize_t buf_cnt;
     assert(connection->server->loop == loop);
     assert(&connection->write_watcher == watcher);
 
-    if (connection->ssl)
-        buf_cnt = mbedtls_ssl_write(connection->ssl, buffer_rpos(buf), buffer_rlen(buf));
-    else
-        buf_cnt = mbedtls_net_send(&connection->socket, buffer_rpos(buf), buffer_rlen(buf));
-    if (buf_cnt < 0) {
-        ldap_connection_close(connection);
-        mbedtls_fail("mbedtls_net_send", buf_cnt);
-    }
-    buffer_toss(buf, buf_cnt);
+    /* This flushes the send buffer after adding any replies that fit. */
     ldap_connection_respond(connection);
 }
 
@@ -406,8 +943,16 @@ ldap_request *ldap_request_new(ldap_connection *connection, LDAPMessage_t *msg)
 
     request->connection = connection;
     request->message = msg;
+    /* Take the arena the message was decoded into. */
+    request->arena = connection->recv_arena;
+    connection->recv_arena = NULL;
     request->reply = NULL;
     request->count = 0;
+    request->scanned = 0;
+    request->sent = 0;
+    /* Take the decode timing and assume it's ready until a backend is run. */
+    request->timing = connection->recv_timing;
+    request->timing.ready = mtime();
     /* Add the request to the connection's circular dlist. */
     ldap_request_add(&connection->request, request);
     lrinfo(request, "new request");
@@ -419,9 +964,11 @@ void ldap_request_free(ldap_request *request)
 {
     if (request) {
         lrinfo(request, "completed");
+        ldap_request_slowlog(request);
+        ldap_request_profile(request);
         /* Remove the request from the connection's circular dlist. */
         ldap_request_rem(&request->connection->request, request);
-        LDAPMessage_free(request->message);
+        ldap_message_free(request->connection->server, request->message, request->arena);
         while (request->reply)
             ldap_reply_free(request->reply);
         free(request);
@@ -434,7 +981,7 @@ ldap_request *ldap_request_bind(ldap_connection *connection, LDAPMessage_t *msg)
     assert(msg->protocolOp.present == LDAPMessage__protocolOp_PR_bindRequest);
     ldap_request *request = ldap_request_new(connection, msg);
 
-    ldap_request_bind_pam(request);
+    ldap_request_backend(request, ldap_request_bind_pam);
     return request;
 }
 
@@ -444,7 +991,17 @@ ldap_request *ldap_request_search(ldap_connection *connection, LDAPMessage_t *ms
     assert(msg->protocolOp.present == LDAPMessage__protocolOp_PR_searchRequest);
     ldap_request *request = ldap_request_new(connection, msg);
 
-    ldap_request_search_nss(request);
+    ldap_request_backend(request, ldap_request_search_nss);
+    return request;
+}
+
+/* Allocate and initialize a compare ldap_request from a compare message. */
+ldap_request *ldap_request_compare(ldap_connection *connection, LDAPMessage_t *msg)
+{
+    assert(msg->protocolOp.present == LDAPMessage__protocolOp_PR_compareRequest);
+    ldap_request *request = ldap_request_new(connection, msg);
+
+    ldap_request_backend(request, ldap_request_compare_nss);
     return request;
 }
 
@@ -492,10 +1049,78 @@ void ldap_request_abandon(ldap_connection *connection, LDAPMessage_t *msg)
 
     lcinfo(connection, "%ld:%s abandon request", msg->messageID, LDAPMessage_name(msg));
     /* Consume the message like we do for other request types. */
-    LDAPMessage_free(msg);
-    for (ldap_request r = connection->request; r; r = ldap_request_next(&connection->request, r))
-        if (r->message->messageID == msgid)
+    ldap_message_free(connection->server, msg, connection->recv_arena);
+    connection->recv_arena = NULL;
+    for (ldap_request *r = connection->request; r; r = ldap_request_next(&connection->request, r))
+        if (r->message->messageID == msgid) {
+            /* A partly streamed reply must be finished so the stream stays
+             * in sync, so only drop the replies after it. */
+            if (r->reply && r->reply->stream.pos) {
+                while (r->reply->next != r->reply)
+                    ldap_reply_free(r->reply->next);
+                return;
+            }
             return ldap_request_free(r);
+        }
+}
+
+/* Run a backend handler to add the replies for a request, timing it. */
+void ldap_request_backend(ldap_request *request, void (*handler)(ldap_request *))
+{
+    assert(request);
+    assert(handler);
+    timing_t *timing = &request->timing;
+    ev_tstamp t = mtime(), c = cputime();
+
+    handler(request);
+    /* Account for the memory used by the queued replies. */
+    for (ldap_reply *r = request->reply; r; r = ldap_reply_next(&request->reply, r))
+        ldap_reply_account(r);
+    timing->ready = mtime();
+    timing->backend = timing->ready - t;
+    timing->cpu += cputime() - c;
+}
+
+/* Log the phase timing of a completed request if it was slow. */
+void ldap_request_slowlog(ldap_request *request)
+{
+    assert(request);
+    const timing_t *timing = &request->timing;
+    const LDAPMessage_t *msg = request->message;
+    ev_tstamp slowtime = request->connection->server->slowtime;
+    ev_tstamp total = mtime() - timing->start;
+    ev_tstamp recv = timing->ready - timing->start - timing->backend;
+    ev_tstamp flush = total - recv - timing->backend - timing->queue - timing->encode;
+    char filter[1024] = "";
+    int entries = 0;
+
+    if (!slowtime || !timing->start || total < slowtime)
+        return;
+    if (msg->protocolOp.present == LDAPMessage__protocolOp_PR_searchRequest) {
+        Filter_str(&msg->protocolOp.choice.searchRequest.filter, filter, sizeof(filter));
+        /* The last reply is the SearchResultDone. */
+        entries = request->count - 1;
+    }
+    lrwarnx(request,
+            "slow request total=%.3fms recv=%.3fms decode=%.3fms backend=%.3fms queue=%.3fms encode=%.3fms "
+            "flush=%.3fms cpu=%.3fms entries=%d filter=%s", total * 1e3, recv * 1e3, timing->decode * 1e3,
+            timing->backend * 1e3, timing->queue * 1e3, timing->encode * 1e3, flush * 1e3, timing->cpu * 1e3, entries,
+            filter);
+}
+
+/* Add a completed search request to the server's fingerprint profiles. */
+void ldap_request_profile(ldap_request *request)
+{
+    assert(request);
+    const timing_t *timing = &request->timing;
+    char key[PROFILE_KEY_MAX];
+
+    if (!timing->start || request->message->protocolOp.present != LDAPMessage__protocolOp_PR_searchRequest)
+        return;
+    SearchRequest_fingerprint(request, key, sizeof(key));
+    /* The last reply is the SearchResultDone. */
+    profile_add(&request->connection->server->profiles, key, request->scanned, request->count - 1, request->sent,
+                (mtime() - timing->start) * 1e6);
 }
 
 /* Process a single reply for an ldap_response. */
@@ -528,27 +1153,100 @@ ldap_reply *ldap_reply_new(ldap_request *request)
     return reply;
 }
 
+/* Allocate and initialize an ldap_reply that sends an encoded response.
+ *
+ * This takes the reference to the response, and counts all its messages. */
+ldap_reply *ldap_reply_response(ldap_request *request, response *r)
+{
+    assert(request);
+    assert(r && r->count);
+    ldap_reply *reply = ldap_reply_new(request);
+
+    reply->response = r;
+    request->count += r->count - 1;
+    return reply;
+}
+
 /* Destroy and free an ldap_response. */
 void ldap_reply_free(ldap_reply *reply)
 {
     if (reply) {
+        ldap_connection *connection = reply->request->connection;
+        /* Release the accounted memory. */
+        connection->queued -= reply->size;
+        connection->server->queued -= reply->size;
         /* Remove the reply from the request's circular dlist. */
         ldap_reply_rem(&reply->request->reply, reply);
         LDAPMessage_done(&reply->message);
+        response_unref(reply->response);
+        response_stream_done(&reply->stream);
         free(reply);
     }
 }
 
+/* Get an estimate of the bytes of memory used by a reply. */
+static size_t ldap_reply_size(const ldap_reply *reply)
+{
+    const SearchResultEntry_t *res = &reply->message.protocolOp.choice.searchResEntry;
+    size_t size = sizeof(*reply);
+
+    if (reply->response)
+        return size + reply->response->len;
+    /* A message being streamed also holds its whole encoding. */
+    size += reply->stream.size;
+    if (reply->message.protocolOp.present != LDAPMessage__protocolOp_PR_searchResEntry)
+        return size;
+    size += res->objectName.size;
+    for (int i = 0; i < res->attributes.list.count; i++) {
+        const PartialAttribute_t *attr = res->attributes.list.array[i];
+        size += sizeof(*attr) + attr->type.size;
+        for (int j = 0; j < attr->vals.list.count; j++)
+            size += sizeof(*attr->vals.list.array[j]) + attr->vals.list.array[j]->size;
+    }
+    return size;
+}
+
+void ldap_reply_account(ldap_reply *reply)
+{
+    assert(reply);
+    ldap_connection *connection = reply->request->connection;
+    ldap_server *server = connection->server;
+    size_t size = ldap_reply_size(reply);
+
+    connection->queued += size - reply->size;
+    server->queued += size - reply->size;
+    server->queued_max = max(server->queued_max, server->queued);
+    reply->size = size;
+}
+
 ldap_status_t ldap_reply_respond(ldap_reply *reply)
 {
     assert(reply);
     ldap_request *request = reply->request;
     ldap_connection *connection = request->connection;
-    ldap_status_t status = ldap_connection_send(connection, &reply->message);
+    ev_tstamp t = mtime();
+    size_t len = buffer_rlen(&connection->send_buf);
+    const bool streaming = reply->stream.data != NULL;
+    ldap_status_t status;
 
+    /* If this is the first attempt to encode a reply, it's done queueing. */
+    if (!request->timing.encode)
+        request->timing.queue = t - request->timing.ready;
+    if (reply->response)
+        status = ldap_connection_send_response(connection, reply->response, &reply->pos, request->message->messageID);
+    else
+        status = ldap_connection_send(connection, &reply->message, &reply->stream);
+    request->timing.encode += mtime() - t;
+    request->sent += buffer_rlen(&connection->send_buf) - len;
+    /* Account for the memory of a message that started streaming. */
+    if (!streaming && reply->stream.data)
+        ldap_reply_account(reply);
     /* If the message was sent, we are done. */
     if (status == RC_OK) {
-        lrdebug(request, "%s reply sent", LDAPMessage_name(&reply->message));
+        if (reply->response)
+            lrdebug(request, "%d cached replies sent", reply->response->count);
+        else
+            lrdebug(request, "%s reply sent", LDAPMessage_name(&reply->message));
         ldap_reply_free(reply);
     }
     return status;
@@ -12,19 +12,48 @@
 #include "ssl.h"
 #include "buffer.h"
 #include "ranges.h"
+#include "files.h"
+#include "search.h"
+#include "response.h"
+#include "quota.h"
+#include "profile.h"
+#include "ber.h"
 #include "asn1/LDAPMessage.h"
 #define EV_COMPAT3 0            /* Use the ev 4.X API. */
 #include <ev.h>
 #include <arpa/inet.h>
 
+#define ACCEPT_MAX 64           /**< The max connections accepted per event. */
+#define LISTEN_FDS_START 3      /**< The first socket activation fd. */
+#define HANDOFF_TIMEOUT 5       /**< The seconds to wait for a socket handoff. */
+#define MEMORY_BUDGET (64 << 20)        /**< The default max queued reply bytes. */
+#define LAG_WEIGHT 8            /**< The iterations averaged for the loop lag. */
+
 /* Pre-declare types needed for forward referencing. */
 typedef struct ldap_connection ldap_connection;
 typedef struct ldap_request ldap_request;
 typedef struct ldap_reply ldap_reply;
 
+/** The request phase timing class.
+ *
+ * All times are in seconds from the monotonic clock. The flush time is the
+ * time spent waiting for the client to read replies so there is space in the
+ * send buffer. */
+typedef struct {
+    ev_tstamp start;            /**< When decoding of the request started. */
+    ev_tstamp ready;            /**< When the backend finished the request. */
+    ev_tstamp decode;           /**< Time spent decoding the request. */
+    ev_tstamp backend;          /**< Time spent in the PAM or NSS backend. */
+    ev_tstamp queue;            /**< Time waiting to encode the first reply. */
+    ev_tstamp encode;           /**< Time spent encoding replies. */
+    ev_tstamp cpu;              /**< CPU time spent decoding and in the backend. */
+} timing_t;
+
 /** The ldap_server class. */
 typedef struct {
     mbedtls_net_context socket; /**< The mbedtls server socket used. */
+    mbedtls_net_context unix_socket;    /**< The ldapi unix socket, or -1 fd for none. */
+    mbedtls_net_context handoff_socket; /**< The socket handoff unix socket, or -1 fd for none. */
     const char *basedn;         /**< The ldap basedn to use. */
     const char *rootuser;       /**< The name of admin "root" user. */
     uid_t rootuid;              /**< The uid of admin "root" user. */
@@ -35,7 +64,16 @@ typedef struct {
     ev_signal sighup_watcher;   /**< The SIGHUP watcher. */
     ev_signal sigint_watcher;   /**< The SIGINT watcher. */
     ev_signal sigterm_watcher;  /**< The SIGTERM watcher. */
+    ev_signal sigusr1_watcher;  /**< The SIGUSR1 watcher. */
+    ev_prepare prepare_watcher; /**< The loop lag watcher before blocking. */
+    ev_check check_watcher;     /**< The loop lag watcher after waking up. */
+    ev_stat passwd_watcher;     /**< The files passwd watcher. */
+    ev_stat group_watcher;      /**< The files group watcher. */
+    ev_stat shadow_watcher;     /**< The files shadow watcher. */
+    ev_child image_watcher;     /**< The files image saving child watcher. */
     ev_io connection_watcher;   /**< The libev incoming connection watcher. */
+    ev_io unix_watcher;         /**< The libev incoming ldapi connection watcher. */
+    ev_io handoff_watcher;      /**< The libev incoming socket handoff watcher. */
     mbedtls_ssl_server *ssl;    /**< The mbedtls ssl server config. */
     ldap_connection *connection;        /**< The circular dlist of
                                          * connections. */
@@ -43,12 +81,39 @@ typedef struct {
     unsigned int cxn_closed_c;  /**< Connections closed counter. */
     unsigned int msg_send_c;    /**< Messages sent counter. */
     unsigned int msg_recv_c;    /**< Messages revieved counter. */
+    ev_tstamp slowtime;         /**< Log requests slower than this, 0 for none. */
+    files_db *files;            /**< The files database to use instead of NSS, or NULL. */
+    const char *files_image;    /**< The files image to save after reloads, or NULL. */
+    unsigned long image_gen;    /**< The files generation being saved. */
+    filter_cache filters;       /**< The cache of compiled search filters. */
+    response_cache responses;   /**< The cache of encoded search responses. */
+    response_flights flights;   /**< The uncached search responses being sent. */
+    quota_table quotas;         /**< The per-client quotas and failed binds. */
+    profile_table profiles;     /**< The search fingerprint profiles. */
+    ber_pool arenas;            /**< The pool of arenas for decoded requests. */
+    size_t budget;              /**< The max queued reply bytes, 0 for unlimited. */
+    size_t queued;              /**< The bytes of all queued replies. */
+    size_t queued_max;          /**< The most bytes of queued replies. */
+    unsigned int paused_c;      /**< Connections paused over budget counter. */
+    unsigned maxvalues;         /**< The max values returned per attribute, 0 for unlimited. */
+    unsigned int streamed_c;    /**< Messages streamed bigger than the buffer counter. */
+    ev_tstamp woken;            /**< When the loop last woke up, 0 for not yet. */
+    ev_tstamp lag;              /**< The average work per loop iteration. */
+    ev_tstamp overload;         /**< Shed scanning searches above this lag, 0 for never. */
+    bool overloaded;            /**< If scanning searches are being shed. */
+    histogram_t work;           /**< The work per loop iteration in microseconds. */
+    unsigned int overload_c;    /**< Times overloaded counter. */
+    unsigned int shed_c;        /**< Searches shed when overloaded counter. */
 } ldap_server;
 int ldap_server_init(ldap_server *server, ev_loop *loop, const char *basedn, const char *rootuser, const bool anonok,
                      const char *crtpath, const char *caspath, const char *keypath, const ldap_ranges *uids,
                      const ldap_ranges *gids);
 void ldap_server_start(ldap_server *server, mbedtls_net_context socket);
 void ldap_server_stop(ldap_server *server);
+void ldap_server_stats(ldap_server *server);
+int ldap_unix_bind(mbedtls_net_context *ctx, const char *path, mode_t mode);
+int ldap_listen_fds(mbedtls_net_context *ctx, mbedtls_net_context *unix_ctx);
+int ldap_handoff_recv(const char *path, mbedtls_net_context *ctx, mbedtls_net_context *unix_ctx);
 
 /* Reuse the ber_decode return value enum as the ldap recv/send status. */
 typedef enum asn_dec_rval_code_e ldap_status_t;
@@ -61,12 +126,17 @@ struct ldap_connection {
     mbedtls_net_context socket; /**< The mbedtls client socket used. */
     char client_ip[INET6_ADDRSTRLEN];   /**< The client ip address. */
     uid_t binduid;              /**< The uid the client binded to. */
+    uid_t peeruid;              /**< The ldapi peer uid, or -1 for TCP. */
     ev_io read_watcher;         /**< The libev data read watcher. */
     ev_io write_watcher;        /**< The libev data write watcher. */
     ev_timer delay_watcher;     /**< The libev failed bind delay watcher. */
     LDAPMessage_t *recv_msg;    /**< The incoming message being decoded */
+    ber_arena *recv_arena;      /**< The arena for recv_msg, or NULL for asn1c. */
+    timing_t recv_timing;       /**< The timing for decoding recv_msg. */
     ldap_request *request;      /**< The circular dlist of requests. */
     ev_tstamp delay;            /**< The delay time to pause for. */
+    size_t queued;              /**< The bytes of queued replies. */
+    bool paused;                /**< If reading is paused over the budget. */
     buffer_t recv_buf;          /**< The buffer for incoming data. */
     buffer_t send_buf;          /**< The buffer for outgoing data. */
     mbedtls_ssl_context *ssl;   /**< The mbedtls ssl context. */
@@ -75,8 +145,13 @@ ldap_connection *ldap_connection_new(ldap_server *server, mbedtls_net_context so
 void ldap_connection_free(ldap_connection *connection);
 void ldap_connection_close(ldap_connection *connection);
 void ldap_connection_respond(ldap_connection *connection);
-ldap_status_t ldap_connection_send(ldap_connection *connection, LDAPMessage_t *msg);
+ldap_status_t ldap_connection_flush(ldap_connection *connection);
+ldap_status_t ldap_connection_send(ldap_connection *connection, LDAPMessage_t *msg, response_stream *stream);
+ldap_status_t ldap_connection_send_response(ldap_connection *connection, const response *r, size_t *pos,
+                                            MessageID_t msgid);
 ldap_status_t ldap_connection_recv(ldap_connection *connection, LDAPMessage_t **msg);
+/** Check if a connection with queued replies is over the server's memory budget. */
+#define ldap_connection_ispaused(c) ((c)->queued && (c)->server->budget && (c)->server->queued >= (c)->server->budget)
 #define ENTRY ldap_connection
 #include "dlist.h"
 
@@ -85,16 +160,24 @@ struct ldap_request {
     ldap_request *next, *prev;  /**< The circular dlist pointers. */
     ldap_connection *connection;        /**< The connection for this request. */
     LDAPMessage_t *message;     /**< The recieved request message. */
+    ber_arena *arena;           /**< The arena for message, or NULL for asn1c. */
     ldap_reply *reply;          /**< The dlist of replies for this request. */
     int count;                  /**< The count of replies for this request. */
+    unsigned long scanned;      /**< The entries scanned for this request. */
+    size_t sent;                /**< The bytes of replies sent for this request. */
+    timing_t timing;            /**< The phase timing for this request. */
 };
 ldap_request *ldap_request_new(ldap_connection *connection, LDAPMessage_t *msg);
 void ldap_request_free(ldap_request *request);
 ldap_request *ldap_request_bind(ldap_connection *connection, LDAPMessage_t *msg);
 ldap_request *ldap_request_search(ldap_connection *connection, LDAPMessage_t *msg);
+ldap_request *ldap_request_compare(ldap_connection *connection, LDAPMessage_t *msg);
 ldap_request *ldap_request_extended(ldap_connection *connection, LDAPMessage_t *msg);
 void ldap_request_abandon(ldap_connection *connection, LDAPMessage_t *msg);
 ldap_status_t ldap_request_respond(ldap_request *request);
+void ldap_request_backend(ldap_request *request, void (*handler)(ldap_request *));
+void ldap_request_slowlog(ldap_request *request);
+void ldap_request_profile(ldap_request *request);
 #define ENTRY ldap_request
 #include "dlist.h"
 
@@ -103,9 +186,15 @@ struct ldap_reply {
     ldap_reply *next, *prev;
     ldap_request *request;
     LDAPMessage_t message;
+    response *response;         /**< The encoded messages to send instead, or NULL. */
+    size_t pos;                 /**< The position of the next encoded message. */
+    response_stream stream;     /**< The message being streamed, if too big for the buffer. */
+    size_t size;                /**< The bytes accounted for this reply. */
 };
 ldap_reply *ldap_reply_new(ldap_request *request);
+ldap_reply *ldap_reply_response(ldap_request *request, response *r);
 void ldap_reply_free(ldap_reply *reply);
+void ldap_reply_account(ldap_reply *reply);
 ldap_status_t ldap_reply_respond(ldap_reply *reply);
 #define ENTRY ldap_reply
 #include "dlist.h"
@@ -119,12 +208,18 @@ ldap_status_t ldap_reply_respond(ldap_reply *reply);
 /** Destroy and free an LDAPMessage instance. */
 #define LDAPMessage_free(msg) ASN_STRUCT_FREE(asn_DEF_LDAPMessage, msg)
 
+/** Destroy and free a received message, returning it to the pool if it was
+ * decoded into an arena. */
+#define ldap_message_free(server, msg, arena) \
+    do { if (arena) ber_arena_free(&(server)->arenas, arena); else LDAPMessage_free(msg); } while (0)
+
 /** Get the string msg type name. */
 #define LDAPMessage_name(m) asn_DEF_LDAPMessage.elements[1].type->elements[(m)->protocolOp.present - 1].name
 
 /* LDAPString methods. */
 #define LDAPString_new(s) OCTET_STRING_new_fromBuf(&asn_DEF_LDAPString, (s), -1)
 #define LDAPString_set(str, s) OCTET_STRING_fromString((str), (s));
+#define LDAPString_free(s) ASN_STRUCT_FREE(asn_DEF_LDAPString, (s))
 
 /* LDAP debug trace output. */
 #ifdef DEBUG
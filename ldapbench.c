@@ -0,0 +1,552 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * A load generator for benchmarking a running lightldapd.
+ *
+ * It opens a number of concurrent connections, optionally using StartTLS, and
+ * keeps a number of requests pipelined on each. The requests are a weighted
+ * random mix of nslcd style binds, passwd point lookups, initgroups searches
+ * and full passwd enumerations. When done it reports the throughput and the
+ * latency percentiles for each kind of request.
+ */
+
+#include "nss2ldap.h"
+#include "histogram.h"
+#include <unistd.h>
+
+/** The kinds of operations. */
+typedef enum {
+    OP_BIND,
+    OP_LOOKUP,
+    OP_INITGROUPS,
+    OP_ENUM,
+    OP_COUNT
+} op_kind_t;
+static const char *op_name[OP_COUNT] = { "bind", "lookup", "initgroups", "enum" };
+
+/** An outstanding operation. */
+typedef struct {
+    MessageID_t msgid;          /**< The messageID, or 0 if unused. */
+    op_kind_t kind;             /**< The kind of operation. */
+    double start;               /**< When the request was queued. */
+    int entries;                /**< The entries received so far. */
+} op_t;
+
+/** A benchmark client connection. */
+typedef struct {
+    int id;                     /**< The id number for this connection. */
+    mbedtls_net_context socket; /**< The mbedtls client socket used. */
+    mbedtls_ssl_context *ssl;   /**< The mbedtls ssl context, or NULL. */
+    ev_io read_watcher;         /**< The libev data read watcher. */
+    ev_io write_watcher;        /**< The libev data write watcher. */
+    LDAPMessage_t *recv_msg;    /**< The incoming message being decoded. */
+    buffer_t recv_buf;          /**< The buffer for incoming data. */
+    buffer_t send_buf;          /**< The buffer for outgoing data. */
+    MessageID_t msgid;          /**< The last messageID used. */
+    int pending;                /**< The number of outstanding operations. */
+    op_t *ops;                  /**< The outstanding operations. */
+} conn_t;
+
+/** The statistics for a kind of operation. */
+typedef struct {
+    histogram_t latency;        /**< The latencies in microseconds. */
+    unsigned long errors;       /**< The count of failed operations. */
+    unsigned long entries;      /**< The count of entries returned. */
+} stats_t;
+
+char *setting_host = "localhost";
+char *setting_port = "389";
+char *setting_basedn = "dc=lightldapd";
+char *setting_user = "user%04d";
+char *setting_passwd = "pass%04d";
+char *setting_mix = "bind=1,lookup=8,initgroups=4,enum=1";
+int setting_users = 1;
+int setting_connections = 10;
+int setting_pipeline = 1;
+double setting_duration = 10.0;
+unsigned long setting_requests = 0;
+bool setting_starttls = false;
+unsigned setting_seed = 1;
+void settings(int argc, char **argv);
+
+static int mix[OP_COUNT];       /* The weights for each kind of operation. */
+static int mix_total;           /* The sum of all the weights. */
+static stats_t stats[OP_COUNT]; /* The statistics for each kind. */
+static unsigned long issued;    /* The count of requests sent. */
+static bool running = true;     /* If we are still issuing requests. */
+static conn_t *conns;           /* The array of connections. */
+static int active;              /* The count of open connections. */
+static mbedtls_ssl_config ssl_conf;
+static mbedtls_ctr_drbg_context ctr_drbg;
+static mbedtls_entropy_context entropy;
+
+static void read_cb(ev_loop *loop, ev_io *watcher, int revents);
+static void write_cb(ev_loop *loop, ev_io *watcher, int revents);
+static void timeout_cb(ev_loop *loop, ev_timer *watcher, int revents);
+
+/* Set a Filter to an equalityMatch. */
+static Filter_t *Filter_eq(Filter_t *f, const char *attr, const char *value)
+{
+    f->present = Filter_PR_equalityMatch;
+    OCTET_STRING_fromString(&f->choice.equalityMatch.attributeDesc, attr);
+    OCTET_STRING_fromString(&f->choice.equalityMatch.assertionValue, value);
+    return f;
+}
+
+/* Add a new empty sub-Filter to an and/or Filter. */
+static Filter_t *Filter_sub(Filter_t *f)
+{
+    Filter_t *s = XNEW0(Filter_t, 1);
+
+    asn_set_add(f->present == Filter_PR_and ? (void *)&f->choice.And : (void *)&f->choice.Or, s);
+    return s;
+}
+
+/* Set an LDAPMessage to a simple BindRequest. */
+static void LDAPMessage_bind(LDAPMessage_t *msg, const char *dn, const char *pw)
+{
+    BindRequest_t *req = &msg->protocolOp.choice.bindRequest;
+
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_bindRequest;
+    req->version = 3;
+    OCTET_STRING_fromString(&req->name, dn);
+    req->authentication.present = AuthenticationChoice_PR_simple;
+    OCTET_STRING_fromString(&req->authentication.choice.simple, pw);
+}
+
+/* Set an LDAPMessage to a SearchRequest, returning the Filter to set. */
+static Filter_t *LDAPMessage_search(LDAPMessage_t *msg, const char *basedn, const char **attrs)
+{
+    SearchRequest_t *req = &msg->protocolOp.choice.searchRequest;
+
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchRequest;
+    OCTET_STRING_fromString(&req->baseObject, basedn);
+    req->scope = SearchRequest__scope_wholeSubtree;
+    for (; *attrs; attrs++)
+        asn_sequence_add(&req->attributes.list, LDAPString_new(*attrs));
+    return &req->filter;
+}
+
+/* Set an LDAPMessage to the request for an operation. */
+static void LDAPMessage_op(LDAPMessage_t *msg, op_kind_t kind)
+{
+    static const char *pwattrs[] = { "uid", "userPassword", "uidNumber", "gidNumber", "cn", "homeDirectory",
+        "loginShell", "gecos", "objectClass", NULL
+    };
+    static const char *grattrs[] = { "gidNumber", NULL };
+    char user[PWNAME_MAX], pw[PWNAME_MAX], dn[STRING_MAX];
+    int n = random() % setting_users + 1;
+    Filter_t *f;
+
+    snprintf(user, sizeof(user), setting_user, n);
+    snprintf(pw, sizeof(pw), setting_passwd, n);
+    snprintf(dn, sizeof(dn), "uid=%s,ou=people,%s", user, setting_basedn);
+    switch (kind) {
+    case OP_BIND:
+        LDAPMessage_bind(msg, dn, pw);
+        break;
+    case OP_LOOKUP:
+        /* (&(objectClass=posixAccount)(uid=<user>)) */
+        f = LDAPMessage_search(msg, setting_basedn, pwattrs);
+        f->present = Filter_PR_and;
+        Filter_eq(Filter_sub(f), "objectClass", "posixAccount");
+        Filter_eq(Filter_sub(f), "uid", user);
+        break;
+    case OP_INITGROUPS:
+        /* (&(objectClass=posixGroup)(|(memberUid=<user>)(member=<dn>))) */
+        f = LDAPMessage_search(msg, setting_basedn, grattrs);
+        f->present = Filter_PR_and;
+        Filter_eq(Filter_sub(f), "objectClass", "posixGroup");
+        f = Filter_sub(f);
+        f->present = Filter_PR_or;
+        Filter_eq(Filter_sub(f), "memberUid", user);
+        Filter_eq(Filter_sub(f), "member", dn);
+        break;
+    case OP_ENUM:
+        /* (objectClass=posixAccount) */
+        f = LDAPMessage_search(msg, setting_basedn, pwattrs);
+        Filter_eq(f, "objectClass", "posixAccount");
+        break;
+    default:
+        assert(0);
+    }
+}
+
+/* Pick a random kind of operation using the mix weights. */
+static op_kind_t op_pick(void)
+{
+    int r = random() % mix_total;
+    op_kind_t kind = 0;
+
+    while (r >= mix[kind])
+        r -= mix[kind++];
+    return kind;
+}
+
+/* Find an outstanding operation by messageID. */
+static op_t *conn_op(conn_t *conn, MessageID_t msgid)
+{
+    for (int i = 0; i < setting_pipeline; i++)
+        if (conn->ops[i].msgid == msgid)
+            return &conn->ops[i];
+    return NULL;
+}
+
+/* Encode a message into a connection's send_buf. */
+static bool conn_send(conn_t *conn, LDAPMessage_t *msg)
+{
+    buffer_t *buf = &conn->send_buf;
+    asn_enc_rval_t rencode = der_encode_to_buffer(&asn_DEF_LDAPMessage, msg, buffer_wpos(buf), buffer_wlen(buf));
+
+    if (rencode.encoded == -1)
+        return false;
+    buffer_fill(buf, rencode.encoded);
+    return true;
+}
+
+/* Queue as many new requests as the pipeline allows. */
+static void conn_issue(conn_t *conn)
+{
+    LDAPMessage_t msg;
+    op_t *op;
+
+    while (running && conn->pending < setting_pipeline && (op = conn_op(conn, 0))) {
+        if (setting_requests && issued >= setting_requests) {
+            running = false;
+            break;
+        }
+        op->kind = op_pick();
+        LDAPMessage_init((&msg), ++conn->msgid);
+        LDAPMessage_op(&msg, op->kind);
+        bool sent = conn_send(conn, &msg);
+        LDAPMessage_done(&msg);
+        if (!sent) {
+            conn->msgid--;
+            break;
+        }
+        op->msgid = conn->msgid;
+        op->entries = 0;
+        op->start = mtime();
+        conn->pending++;
+        issued++;
+    }
+}
+
+/* Account for a received response message. */
+static void conn_recv(conn_t *conn, LDAPMessage_t *msg)
+{
+    op_t *op = conn_op(conn, msg->messageID);
+    long code;
+
+    if (!op)
+        lerrx(1, "%d: unexpected response for messageID %ld", conn->id, msg->messageID);
+    switch (msg->protocolOp.present) {
+    case LDAPMessage__protocolOp_PR_searchResEntry:
+        op->entries++;
+        return;
+    case LDAPMessage__protocolOp_PR_bindResponse:
+        code = msg->protocolOp.choice.bindResponse.resultCode;
+        break;
+    case LDAPMessage__protocolOp_PR_searchResDone:
+        code = msg->protocolOp.choice.searchResDone.resultCode;
+        break;
+    default:
+        lerrx(1, "%d: unexpected %s response", conn->id, LDAPMessage_name(msg));
+    }
+    stats_t *s = &stats[op->kind];
+    histogram_add(&s->latency, (mtime() - op->start) * 1e6);
+    s->entries += op->entries;
+    if (code != LDAPResult__resultCode_success)
+        s->errors++;
+    op->msgid = 0;
+    conn->pending--;
+}
+
+/* Update a connection's watchers, closing it if it's finished. */
+static void conn_update(ev_loop *loop, conn_t *conn)
+{
+    /* Do nothing if the connection is already closed. */
+    if (conn->socket.fd < 0)
+        return;
+    conn_issue(conn);
+    if (!running && !conn->pending && buffer_empty(&conn->send_buf)) {
+        ev_io_stop(loop, &conn->read_watcher);
+        ev_io_stop(loop, &conn->write_watcher);
+        if (conn->ssl)
+            mbedtls_ssl_close_notify(conn->ssl);
+        mbedtls_net_free(&conn->socket);
+        if (!--active)
+            ev_break(loop, EVBREAK_ALL);
+        return;
+    }
+    if (buffer_empty(&conn->send_buf))
+        ev_io_stop(loop, &conn->write_watcher);
+    else
+        ev_io_start(loop, &conn->write_watcher);
+}
+
+static void read_cb(ev_loop *loop, ev_io *watcher, int revents)
+{
+    conn_t *conn = watcher->data;
+    buffer_t *buf = &conn->recv_buf;
+    asn_dec_rval_t rdecode;
+    int n;
+
+    if (conn->ssl)
+        n = mbedtls_ssl_read(conn->ssl, buffer_wpos(buf), buffer_wlen(buf));
+    else
+        n = mbedtls_net_recv(&conn->socket, buffer_wpos(buf), buffer_wlen(buf));
+    if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+        return;
+    if (n <= 0)
+        lerrx(1, "%d: connection closed by server", conn->id);
+    buffer_fill(buf, n);
+    do {
+        rdecode = ber_decode(0, &asn_DEF_LDAPMessage, (void **)&conn->recv_msg, buffer_rpos(buf), buffer_rlen(buf));
+        buffer_toss(buf, rdecode.consumed);
+        if (rdecode.code == RC_FAIL)
+            lerrx(1, "%d: ber_decode failed", conn->id);
+        if (rdecode.code == RC_OK) {
+            conn_recv(conn, conn->recv_msg);
+            LDAPMessage_free(conn->recv_msg);
+            conn->recv_msg = NULL;
+        }
+    } while (rdecode.code == RC_OK && !buffer_empty(buf));
+    conn_update(loop, conn);
+}
+
+static void write_cb(ev_loop *loop, ev_io *watcher, int revents)
+{
+    conn_t *conn = watcher->data;
+    buffer_t *buf = &conn->send_buf;
+    int n;
+
+    if (conn->ssl)
+        n = mbedtls_ssl_write(conn->ssl, buffer_rpos(buf), buffer_rlen(buf));
+    else
+        n = mbedtls_net_send(&conn->socket, buffer_rpos(buf), buffer_rlen(buf));
+    if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+        return;
+    if (n < 0)
+        lerrx(1, "%d: send failed", conn->id);
+    buffer_toss(buf, n);
+    conn_update(loop, conn);
+}
+
+static void timeout_cb(ev_loop *loop, ev_timer *watcher, int revents)
+{
+    running = false;
+    /* Close any idle connections. */
+    for (int i = 0; i < setting_connections; i++)
+        conn_update(loop, &conns[i]);
+}
+
+/* Do a blocking StartTLS extended request and TLS handshake. */
+static void conn_starttls(conn_t *conn)
+{
+    LDAPMessage_t msg, *resp = NULL;
+    asn_dec_rval_t rdecode;
+    int n;
+
+    LDAPMessage_init((&msg), ++conn->msgid);
+    msg.protocolOp.present = LDAPMessage__protocolOp_PR_extendedReq;
+    OCTET_STRING_fromString(&msg.protocolOp.choice.extendedReq.requestName, "1.3.6.1.4.1.1466.20037");
+    conn_send(conn, &msg);
+    LDAPMessage_done(&msg);
+    if (mbedtls_net_send(&conn->socket, buffer_rpos(&conn->send_buf), buffer_rlen(&conn->send_buf)) < 0)
+        lerrx(1, "%d: StartTLS send failed", conn->id);
+    buffer_toss(&conn->send_buf, buffer_rlen(&conn->send_buf));
+    do {
+        if ((n = mbedtls_net_recv(&conn->socket, buffer_wpos(&conn->recv_buf), buffer_wlen(&conn->recv_buf))) <= 0)
+            lerrx(1, "%d: StartTLS recv failed", conn->id);
+        buffer_fill(&conn->recv_buf, n);
+        rdecode = ber_decode(0, &asn_DEF_LDAPMessage, (void **)&resp, buffer_rpos(&conn->recv_buf),
+                             buffer_rlen(&conn->recv_buf));
+        buffer_toss(&conn->recv_buf, rdecode.consumed);
+    } while (rdecode.code == RC_WMORE);
+    if (rdecode.code != RC_OK || resp->protocolOp.present != LDAPMessage__protocolOp_PR_extendedResp
+        || resp->protocolOp.choice.extendedResp.resultCode != ExtendedResponse__resultCode_success)
+        lerrx(1, "%d: StartTLS refused", conn->id);
+    LDAPMessage_free(resp);
+    conn->ssl = XNEW0(mbedtls_ssl_context, 1);
+    mbedtls_ssl_init(conn->ssl);
+    if (mbedtls_ssl_setup(conn->ssl, &ssl_conf))
+        lerrx(1, "mbedtls_ssl_setup failed");
+    mbedtls_ssl_set_bio(conn->ssl, &conn->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+    while ((n = mbedtls_ssl_handshake(conn->ssl)))
+        if (n != MBEDTLS_ERR_SSL_WANT_READ && n != MBEDTLS_ERR_SSL_WANT_WRITE)
+            lerrx(1, "%d: TLS handshake failed", conn->id);
+}
+
+/* Open and start a benchmark client connection. */
+static void conn_init(conn_t *conn, ev_loop *loop, int id)
+{
+    conn->id = id;
+    conn->ssl = NULL;
+    conn->recv_msg = NULL;
+    buffer_init(&conn->recv_buf);
+    buffer_init(&conn->send_buf);
+    conn->msgid = 0;
+    conn->pending = 0;
+    conn->ops = XNEW0(op_t, setting_pipeline);
+    mbedtls_net_init(&conn->socket);
+    if (mbedtls_net_connect(&conn->socket, setting_host, setting_port, MBEDTLS_NET_PROTO_TCP))
+        lerrx(1, "%d: failed to connect to %s:%s", id, setting_host, setting_port);
+    if (setting_starttls)
+        conn_starttls(conn);
+    if (mbedtls_net_set_nonblock(&conn->socket))
+        lerrx(1, "%d: mbedtls_net_set_nonblock failed", id);
+    ev_io_init(&conn->read_watcher, read_cb, conn->socket.fd, EV_READ);
+    conn->read_watcher.data = conn;
+    ev_io_init(&conn->write_watcher, write_cb, conn->socket.fd, EV_WRITE);
+    conn->write_watcher.data = conn;
+    ev_io_start(loop, &conn->read_watcher);
+    active++;
+    conn_update(loop, conn);
+}
+
+/* Parse a mix setting like "bind=1,lookup=8,initgroups=4,enum=1". */
+static bool mix_init(const char *s)
+{
+    char b[256], *p = b, *e;
+
+    mix_total = 0;
+    memset(mix, 0, sizeof(mix));
+    strncpy(b, s, sizeof(b) - 1);
+    b[sizeof(b) - 1] = '\0';
+    for (e = strsep(&p, ","); e; e = strsep(&p, ",")) {
+        char *v = strchr(e, '=');
+        op_kind_t kind;
+        if (!v)
+            return false;
+        *v++ = '\0';
+        for (kind = 0; kind < OP_COUNT && strcmp(e, op_name[kind]); kind++) ;
+        if (kind == OP_COUNT || (mix[kind] = atoi(v)) < 0)
+            return false;
+        mix_total += mix[kind];
+    }
+    return mix_total > 0;
+}
+
+/* Print the report of throughput and latency percentiles. */
+static void report(double elapsed)
+{
+    histogram_t all;
+    unsigned long errors = 0, entries = 0;
+
+    histogram_init(&all);
+    printf("connections=%d pipeline=%d tls=%s elapsed=%.3fs\n", setting_connections, setting_pipeline,
+           setting_starttls ? "yes" : "no", elapsed);
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "qps", "errors", "entries", "p50ms",
+           "p99ms", "p999ms", "maxms");
+    for (op_kind_t kind = 0; kind < OP_COUNT; kind++) {
+        histogram_t *h = &stats[kind].latency;
+        printf("%-10s %10lu %10.1f %10lu %10lu %10.3f %10.3f %10.3f %10.3f\n", op_name[kind], (unsigned long)h->count,
+               h->count / elapsed, stats[kind].errors, stats[kind].entries, histogram_percentile(h, 0.5) * 1e-3,
+               histogram_percentile(h, 0.99) * 1e-3, histogram_percentile(h, 0.999) * 1e-3, h->max * 1e-3);
+        histogram_merge(&all, h);
+        errors += stats[kind].errors;
+        entries += stats[kind].entries;
+    }
+    printf("%-10s %10lu %10.1f %10lu %10lu %10.3f %10.3f %10.3f %10.3f\n", "total", (unsigned long)all.count,
+           all.count / elapsed, errors, entries, histogram_percentile(&all, 0.5) * 1e-3,
+           histogram_percentile(&all, 0.99) * 1e-3, histogram_percentile(&all, 0.999) * 1e-3, all.max * 1e-3);
+}
+
+int main(int argc, char **argv)
+{
+    ev_loop *loop = EV_DEFAULT;
+    ev_timer timeout_watcher;
+    double start;
+
+    settings(argc, argv);
+    srandom(setting_seed);
+    for (op_kind_t kind = 0; kind < OP_COUNT; kind++)
+        histogram_init(&stats[kind].latency);
+    if (setting_starttls) {
+        mbedtls_ssl_config_init(&ssl_conf);
+        mbedtls_ctr_drbg_init(&ctr_drbg);
+        mbedtls_entropy_init(&entropy);
+        if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (unsigned char *)"ldapbench", 9)
+            || mbedtls_ssl_config_defaults(&ssl_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT))
+            lerrx(1, "mbedtls client setup failed");
+        /* We are measuring the server, not checking its certificate. */
+        mbedtls_ssl_conf_authmode(&ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+        mbedtls_ssl_conf_rng(&ssl_conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+    }
+    conns = XNEW0(conn_t, setting_connections);
+    start = mtime();
+    for (int i = 0; i < setting_connections; i++)
+        conn_init(&conns[i], loop, i + 1);
+    if (setting_duration > 0) {
+        ev_timer_init(&timeout_watcher, timeout_cb, setting_duration, 0.0);
+        ev_timer_start(loop, &timeout_watcher);
+    }
+    ev_run(loop, 0);
+    report(mtime() - start);
+    return 0;
+}
+
+void settings(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "b:c:h:m:n:p:s:t:u:w:N:P:Z")) != -1) {
+        switch (c) {
+        case 'b':
+            setting_basedn = optarg;
+            break;
+        case 'c':
+            setting_connections = atoi(optarg);
+            break;
+        case 'h':
+            setting_host = optarg;
+            break;
+        case 'm':
+            setting_mix = optarg;
+            break;
+        case 'n':
+            setting_requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            setting_port = optarg;
+            break;
+        case 's':
+            setting_seed = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            setting_duration = atof(optarg);
+            break;
+        case 'u':
+            setting_user = optarg;
+            break;
+        case 'w':
+            setting_passwd = optarg;
+            break;
+        case 'N':
+            setting_users = atoi(optarg);
+            break;
+        case 'P':
+            setting_pipeline = atoi(optarg);
+            break;
+        case 'Z':
+            setting_starttls = true;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-h localhost] [-p 389] [-b dc=lightldapd] [-Z] [-c connections] [-P pipeline] \\\n"
+                    "  [-t seconds] [-n requests] [-m bind=1,lookup=8,initgroups=4,enum=1] \\\n"
+                    "  [-u user%%04d] [-w pass%%04d] [-N users] [-s seed]\n", argv[0]);
+            exit(EX_USAGE);
+        }
+    }
+    if (setting_connections < 1 || setting_pipeline < 1 || setting_users < 1)
+        lerrx(EX_USAGE, "Invalid -c, -P or -N value");
+    if (!setting_duration && !setting_requests)
+        lerrx(EX_USAGE, "One of -t or -n must be set");
+    if (!mix_init(setting_mix))
+        lerrx(EX_USAGE, "Invalid -m mix value: \"%s\"", setting_mix);
+}
@@ -6,14 +6,36 @@
 #include "log.h"
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <time.h>
 
 log_func_t *log_func = errlog;
 log_prefix_t *log_prefix = log_prefix_color;
 int log_level = LOG_DEBUG;
+atomic_ulong log_dropped = 0;
 char prefix[256];               /* log_prefix result buffer. */
 
+/* The async log ring buffer entry. */
+typedef struct {
+    int level;                  /* The message level. */
+    char msg[LOG_MSG_MAX];      /* The formatted message. */
+} log_entry;
+
+/* The async log ring buffer and writer state. The head is only written by
+ * the logging thread and the tail only by the writer thread, so they are
+ * the only synchronization needed besides the semaphore for waking. */
+static log_entry log_ring[LOG_RING_SIZE];
+static atomic_ulong log_head, log_tail;
+static atomic_bool log_stopping;
+static sem_t log_sem;
+static pthread_t log_writer;
+static log_func_t *log_sink;    /* The log_func the writer writes to. */
+static bool log_atexit = false;   /* If log_async_stop() is registered atexit. */
+
 const char *levelname[8] = {
     "EMERGENCY!",               /* LOG_EMERG */
     "ALERT",                    /* LOG_ALERT */
@@ -64,6 +86,77 @@ void errlog(int level, const char *msg, ...)
     va_end(args);
 }
 
+void asynclog(int level, const char *msg, ...)
+{
+    unsigned long head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_entry *e = &log_ring[head % LOG_RING_SIZE];
+    va_list args;
+
+    if (head - atomic_load_explicit(&log_tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    e->level = level;
+    va_start(args, msg);
+    vsnprintf(e->msg, sizeof(e->msg), msg, args);
+    va_end(args);
+    atomic_store_explicit(&log_head, head + 1, memory_order_release);
+    sem_post(&log_sem);
+}
+
+/* The async log writer thread, writing messages until stopped. */
+static void *log_write(void *arg)
+{
+    unsigned long tail, dropped = 0, d;
+
+    assert(!arg);
+    for (;;) {
+        sem_wait(&log_sem);
+        tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&log_head, memory_order_acquire)) {
+            log_entry *e = &log_ring[tail % LOG_RING_SIZE];
+            log_sink(e->level, "%s", e->msg);
+            atomic_store_explicit(&log_tail, ++tail, memory_order_release);
+        }
+        /* The counter is only reported, so a relaxed load is enough. */
+        if ((d = atomic_load_explicit(&log_dropped, memory_order_relaxed)) != dropped) {
+            log_sink(LOG_WARNING, "log: dropped %lu messages", d - dropped);
+            dropped = d;
+        }
+        if (atomic_load(&log_stopping) && tail == atomic_load(&log_head))
+            return NULL;
+    }
+}
+
+int log_async_start(void)
+{
+    assert(log_func != asynclog);
+
+    if (sem_init(&log_sem, 0, 0))
+        return -1;
+    atomic_store(&log_stopping, false);
+    log_sink = log_func;
+    if (pthread_create(&log_writer, NULL, log_write, NULL)) {
+        sem_destroy(&log_sem);
+        return -1;
+    }
+    log_func = asynclog;
+    if (!log_atexit)
+        log_atexit = !atexit(log_async_stop);
+    return 0;
+}
+
+void log_async_stop(void)
+{
+    if (log_func != asynclog)
+        return;
+    log_func = log_sink;
+    atomic_store(&log_stopping, true);
+    sem_post(&log_sem);
+    pthread_join(log_writer, NULL);
+    sem_destroy(&log_sem);
+}
+
 char *log_prefix_plain(int level, const char *file, const unsigned line, const char *func)
 {
     snprintf(prefix, sizeof(prefix), "%s:%u %s: %s: ", file, line, func, levelname[level]);
@@ -76,3 +169,13 @@ char *log_prefix_color(int level, const char *file, const unsigned line, const c
              levelname[level]);
     return prefix;
 }
+
+char *log_prefix_compact(int level, const char *file, const unsigned line, const char *func)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    snprintf(prefix, sizeof(prefix), "ts=%ld.%03ld lvl=%s src=%s:%u fn=%s msg=", (long)t.tv_sec,
+             t.tv_nsec / 1000000, levelname[level], file, line, func);
+    return prefix;
+}
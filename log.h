@@ -3,7 +3,16 @@
  *
  * \copyright Copyright (c) 2021 Donovan Baarda <abo@minkirri.apana.org.au>
  *
- * \licence Licensed under the GPLv3 License. See LICENSE file for details. */
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * The logging macros check the level before evaluating any arguments or
+ * formatting the prefix, so disabled log levels cost only a comparison.
+ *
+ * With log_async_start() messages are formatted into a single producer single
+ * consumer ring buffer, and a background thread writes them using the
+ * log_func set by log_init(). This keeps slow syslog() or stderr writes off
+ * the event loop. If the ring buffer is full messages are dropped and counted
+ * in log_dropped, and the writer logs how many were dropped. */
 #ifndef LIGHTLDAPD_LOG_H
 #define LIGHTLDAPD_LOG_H
 
@@ -12,6 +21,7 @@
 #include <syslog.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 /** Logging function type. */
 typedef void log_func_t(int level, const char *msg, ...)
@@ -23,6 +33,10 @@ typedef char *log_prefix_t(int level, const char *file, const unsigned line, con
 extern log_func_t *log_func;    /**< Logging function to use. */
 extern log_prefix_t *log_prefix;        /**< Logging prefix function to use. */
 extern int log_level;           /**< The level to log upto. */
+extern atomic_ulong log_dropped;        /**< The async dropped messages counter. */
+
+#define LOG_RING_SIZE 1024      /**< The async ring buffer size in messages. */
+#define LOG_MSG_MAX 512         /**< The max async message length. */
 
 /** Initialize logging.
  *
@@ -36,6 +50,21 @@ extern int log_level;           /**< The level to log upto. */
  * \param level - The level to log upto. */
 void log_init(const char *name, bool daemon, int level);
 
+/** Start logging asynchronously using a background writer thread.
+ *
+ * This must be called after log_init() and after any fork() or daemon(). The
+ * writer is stopped and the buffered messages are flushed at exit.
+ *
+ * \return 0 on success or -1 if the thread could not be started. */
+int log_async_start(void);
+
+/** Stop the async background writer, flushing all buffered messages. */
+void log_async_stop(void);
+
+/** Logging function to the async ring buffer. */
+void asynclog(int level, const char *msg, ...)
+    __attribute__((__format__(printf, 2, 3)));
+
 /** Logging function to stderr using warnx(). */
 void errlog(int level, const char *msg, ...)
     __attribute__((__format__(printf, 2, 3)));
@@ -46,8 +75,11 @@ char *log_prefix_plain(int level, const char *file, const unsigned line, const c
 /** Logging prefix function with color. */
 char *log_prefix_color(int level, const char *file, const unsigned line, const char *func);
 
+/** Logging prefix function for compact structured key=value logs. */
+char *log_prefix_compact(int level, const char *file, const unsigned line, const char *func);
+
 #define _prefix(l) log_prefix(l, __FILE__, __LINE__, __FUNCTION__)
-#define _log(l, f, ...) log_func(l, "%s"f, _prefix(l), ##__VA_ARGS__)
+#define _log(l, f, ...) ((l) <= log_level ? log_func(l, "%s"f, _prefix(l), ##__VA_ARGS__) : (void)0)
 
 #define lerr(e, f, ...) do { _log(LOG_ERR, f": %s", ##__VA_ARGS__, strerror(errno)); exit(e); } while (0)
 #define lerrx(e, f, ...) do { _log(LOG_ERR, f, ##__VA_ARGS__); exit(e); } while (0)
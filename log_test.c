@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include "log.h"
 
+extern char prefix[];
+
 /* openlog() stub function for testing. */
 void openlog(const char *ident, int option, int facility)
 {
@@ -23,6 +25,13 @@ int setlogmask(int mask)
     return LOG_UPTO(LOG_DEBUG);
 }
 
+/* Count calls to check disabled log arguments are not evaluated. */
+static int calls = 0;
+static int count(void)
+{
+    return ++calls;
+}
+
 int main(void)
 {
     /* Test default behaviour */
@@ -44,6 +53,24 @@ int main(void)
     lnote("something important");
     lwarn("something concerning");
     lwarnx("something concerning");
+    /* Test disabled levels don't evaluate their arguments. */
+    linfo("something boring %d", count());
+    assert(calls == 0);
+    lwarnx("something concerning %d", count());
+    assert(calls == 1);
+    /* Test async behaviour */
+    assert(log_async_start() == 0);
+    assert(log_func == asynclog);
+    linfo("something boring");
+    lnote("something important");
+    lwarnx("something concerning");
+    log_async_stop();
+    assert(log_func == syslog);
+    assert(atomic_load(&log_dropped) == 0);
+    /* Test compact prefix */
+    log_prefix_compact(LOG_WARNING, "file.c", 42, "func");
+    assert(!strncmp(prefix, "ts=", 3));
+    assert(strstr(prefix, " lvl=warning src=file.c:42 fn=func msg="));
     /* Test errlog behaviour */
     log_init("test", 0, LOG_ERR);
     assert(log_level == LOG_ERR);
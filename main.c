@@ -7,12 +7,21 @@
 
 #include "utils.h"
 #include "ldap_server.h"
+#include "attrmap.h"
 #include "ranges.h"
 #include "pam.h"
 #include "log.h"
 #include <unistd.h>
 #include <syslog.h>
 
+/* The libev io_uring backend, or 0 for older libev versions without it.
+ * EVBACKEND_IOURING is an enum, so check the version that added it. */
+#if EV_VERSION_MAJOR > 4 || (EV_VERSION_MAJOR == 4 && EV_VERSION_MINOR >= 31)
+#define EV_IOURING EVBACKEND_IOURING
+#else
+#define EV_IOURING 0
+#endif
+
 char *setting_port = "389";
 bool setting_loopback = 0;
 bool setting_authnss = 0;
@@ -28,24 +37,58 @@ char *setting_keypath = NULL;
 char *setting_uids = "1000-29999";
 char *setting_gids = "100,1000-29999";
 char *setting_loglevel = "4";
+char *setting_slowtime = "0";
+bool setting_files = 0;
+char *setting_imagepath = NULL;
+bool setting_iouring = 0;
+char *setting_unixpath = NULL;
+char *setting_handoffpath = NULL;
+char *setting_mappath = NULL;
+char *setting_quotas = NULL;
+char *setting_budget = NULL;
+char *setting_overload = "0";
+char *setting_maxvalues = "0";
+bool setting_asynclog = 0;
+bool setting_compactlog = 0;
 void settings(int argc, char **argv);
 
 int main(int argc, char **argv)
 {
-    ev_loop *loop = EV_DEFAULT;
+    ev_loop *loop;
     mbedtls_net_context socket;
     ldap_server server;
     char *server_addr;
     uid_t runuid;
     ldap_ranges uids, gids;
+    files_db files;
     int loglevel;
+    double slowtime;
+    double overload;
+    int maxvalues;
+    int budget;
+    const char *listen_from = NULL;
 
     settings(argc, argv);
+    /* Try io_uring first, falling back to the recommended backends. */
+    loop = ev_default_loop(setting_iouring ? EV_IOURING | ev_recommended_backends() : 0);
     server_addr = setting_loopback ? "127.0.0.1" : NULL;
     runuid = name2uid(setting_runuser);
     loglevel = atoi(setting_loglevel);
     if (loglevel < LOG_ALERT || loglevel > LOG_DEBUG)
         lerrx(EX_USAGE, "Invalid -L loglevel value: \"%s\"", setting_loglevel);
+    slowtime = atof(setting_slowtime);
+    if (slowtime < 0)
+        lerrx(EX_USAGE, "Invalid -t slowtime value: \"%s\"", setting_slowtime);
+    overload = atof(setting_overload);
+    if (overload < 0)
+        lerrx(EX_USAGE, "Invalid -O lagms value: \"%s\"", setting_overload);
+    maxvalues = atoi(setting_maxvalues);
+    if (maxvalues < 0)
+        lerrx(EX_USAGE, "Invalid -V maxvalues value: \"%s\"", setting_maxvalues);
+    /* The default budget is only defined by MEMORY_BUDGET. */
+    budget = setting_budget ? atoi(setting_budget) : MEMORY_BUDGET >> 20;
+    if (budget < 0)
+        lerrx(EX_USAGE, "Invalid -M megabytes value: \"%s\"", setting_budget);
     if (!ldap_ranges_init(&uids, setting_uids))
         lerrx(EX_USAGE, "Invalid -U value: \"%s\"", setting_uids);
     if (!ldap_ranges_init(&gids, setting_gids))
@@ -54,15 +97,53 @@ int main(int argc, char **argv)
         (&server, loop, setting_basedn, setting_rootuser, setting_anonok, setting_crtpath, setting_caspath,
          setting_keypath, &uids, &gids))
         lerr(1, "ldap_server_init() failed");
-    if (mbedtls_net_bind(&socket, server_addr, setting_port, MBEDTLS_NET_PROTO_TCP))
+    /* Optional tuning settings are set after ldap_server_init(). */
+    server.slowtime = slowtime / 1000.0;
+    server.overload = overload / 1000.0;
+    server.maxvalues = maxvalues;
+    if (setting_quotas && !quota_table_set(&server.quotas, setting_quotas))
+        lerrx(EX_USAGE, "Invalid -Q value: \"%s\"", setting_quotas);
+    server.budget = (size_t)budget << 20;
+    /* Use sockets from systemd or a running server before binding new ones. */
+    mbedtls_net_init(&socket);
+    if (!ldap_listen_fds(&socket, &server.unix_socket))
+        listen_from = "socket activation";
+    else if (setting_handoffpath && !ldap_handoff_recv(setting_handoffpath, &socket, &server.unix_socket))
+        listen_from = setting_handoffpath;
+    if (socket.fd < 0 && mbedtls_net_bind(&socket, server_addr, setting_port, MBEDTLS_NET_PROTO_TCP))
         lerr(1, "mbdedtls_net_bind() failed");
+    /* Any local user can connect, and their peer credentials identify them. */
+    if (setting_unixpath && server.unix_socket.fd < 0 && ldap_unix_bind(&server.unix_socket, setting_unixpath, 0666))
+        lerr(1, "ldap_unix_bind() failed");
+    /* Only root can take over our sockets. */
+    if (setting_handoffpath && ldap_unix_bind(&server.handoff_socket, setting_handoffpath, 0600))
+        lerr(1, "ldap_unix_bind() failed for handoff");
     log_init("lightldapd", setting_daemon, loglevel);
+    if (listen_from)
+        lnote("using listening sockets from %s", listen_from);
+    if (setting_compactlog)
+        log_prefix = log_prefix_compact;
+    if (setting_mappath && attrmap_load(setting_mappath))
+        lerrx(1, "attrmap_load() failed");
+    if (setting_iouring && !(ev_backend(loop) & EV_IOURING))
+        lwarnx("io_uring not available, using the default event backend");
     if (setting_daemon && daemon(1, 0))
         lerr(1, "daemon() failed");
+    /* The writer thread must be started after daemon() forks. */
+    if (setting_asynclog && log_async_start())
+        lerr(1, "log_async_start() failed");
     if (setting_chroot && chroot(setting_chroot))
         lerr(1, "chroot() failed");
     if (chdir("/"))
         lerr(1, "chdir() failed");
+    /* Load the files after chroot but before setuid so shadow is readable. */
+    if (setting_files && (setting_imagepath ? files_db_load(&files, "/etc", setting_imagepath)
+                          : files_db_init(&files, "/etc")))
+        lerrx(1, "files_db_init() failed");
+    if (setting_files) {
+        server.files = &files;
+        server.files_image = setting_imagepath;
+    }
     if (runuid && setuid(runuid))
         lerr(1, "setuid() failed");
     if (setting_authnss)
@@ -76,7 +157,7 @@ void settings(int argc, char **argv)
 {
     int c;
 
-    while ((c = getopt(argc, argv, "ab:dlp:r:u:A:C:G:K:L:NR:U:")) != -1) {
+    while ((c = getopt(argc, argv, "ab:di:jlm:p:r:t:u:A:C:FG:H:IJK:L:M:NO:Q:R:S:U:V:")) != -1) {
         switch (c) {
         case 'a':
             setting_anonok = true;
@@ -87,15 +168,27 @@ void settings(int argc, char **argv)
         case 'd':
             setting_daemon = true;
             break;
+        case 'i':
+            setting_imagepath = optarg;
+            break;
+        case 'j':
+            setting_asynclog = true;
+            break;
         case 'l':
             setting_loopback = true;
             break;
+        case 'm':
+            setting_mappath = optarg;
+            break;
         case 'p':
             setting_port = optarg;
             break;
         case 'r':
             setting_rootuser = optarg;
             break;
+        case 't':
+            setting_slowtime = optarg;
+            break;
         case 'u':
             setting_runuser = optarg;
             break;
@@ -105,29 +198,58 @@ void settings(int argc, char **argv)
         case 'C':
             setting_crtpath = optarg;
             break;
+        case 'F':
+            setting_files = true;
+            break;
         case 'G':
             setting_gids = optarg;
             break;
+        case 'H':
+            setting_handoffpath = optarg;
+            break;
+        case 'I':
+            setting_iouring = true;
+            break;
+        case 'J':
+            setting_compactlog = true;
+            break;
         case 'K':
             setting_keypath = optarg;
             break;
         case 'L':
             setting_loglevel = optarg;
             break;
+        case 'M':
+            setting_budget = optarg;
+            break;
         case 'N':
             setting_authnss = true;
             break;
+        case 'O':
+            setting_overload = optarg;
+            break;
+        case 'Q':
+            setting_quotas = optarg;
+            break;
         case 'R':
             setting_chroot = optarg;
             break;
+        case 'S':
+            setting_unixpath = optarg;
+            break;
         case 'U':
             setting_uids = optarg;
             break;
+        case 'V':
+            setting_maxvalues = optarg;
+            break;
         default:
             fprintf(stderr,
                     "Usage: %s [-a] [-b dc=lightldapd] [-r rootuser] [-l] [-p 389] [-d] \\\n"
                     "  [-u runuser] [-R chroot] [-C crtfile] [-A ca-file] [-K keyfile] \\\n"
-                    "  [-U 1000-29999,...] [-G 100,1000-29999,...] [-N] [-L loglevel]", argv[0]);
+                    "  [-U 1000-29999,...] [-G 100,1000-29999,...] [-N] [-L loglevel] [-t slowms] [-F] [-i imagefile] [-I] \\\n"
+                    "  [-S /run/lightldapd.sock] [-Q connects,binds,searches] [-M 64] [-j] [-J] \\\n"
+                    "  [-H /run/lightldapd.handoff] [-m mapfile] [-O lagms] [-V maxvalues]", argv[0]);
             exit(EX_USAGE);
         }
     }
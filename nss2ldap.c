@@ -5,16 +5,9 @@
  */
 
 #include "nss2ldap.h"
+#include "attrmap.h"
 #include "pam.h"
 #include "ranges.h"
-#include <grp.h>
-#include <pwd.h>
-#include <shadow.h>
-
-/** The type for passwd, group, and spwd entries. */
-typedef struct passwd passwd_t;
-typedef struct group group_t;
-typedef struct spwd spwd_t;
 
 /* Search Scope class. */
 #define SCOPE_PASSWD 1          /**< Mask bit to search passwd data. */
@@ -25,8 +18,23 @@ typedef struct {
     const char *uidNumber;      /**< Specific passwd uidNumber to search. */
     const char *cn;             /**< Specific group cn to search. */
     const char *gidNumber;      /**< Specific group uidNumber to search. */
+    const char *uidPrefix;      /**< Passwd uid prefix to search. */
+    const char *pwcnPrefix;     /**< Passwd cn prefix to search. */
+    const char *cnPrefix;       /**< Group cn prefix to search. */
+    const char *memberOf;       /**< Passwd memberOf group dn to search. */
+    uid_t uidMin, uidMax;       /**< Passwd uidNumber range to search. */
+    gid_t gidMin, gidMax;       /**< Group gidNumber range to search. */
     const ldap_ranges *uids;    /**< The ranges of uids exported. */
     const ldap_ranges *gids;    /**< The ranges of gids exported. */
+    const files_db *files;      /**< The files database to use, or NULL for NSS. */
+    passwd_t **pwrange;         /**< The passwd files index range, or NULL. */
+    group_t **grrange;          /**< The group files index range, or NULL. */
+    int pos;                    /**< The position iterating through files. */
+    int end;                    /**< The end position iterating through files. */
+    ldap_ranges slices;         /**< The id ranges to iterate through files. */
+    int slice;                  /**< The next id range iterating through files. */
+    const group_t *group;       /**< The memberOf group iterating through files. */
+    char **mem;                 /**< The next memberOf group member. */
 } scope_t;
 static void scope_init(scope_t *s, const ldap_ranges *uids, const ldap_ranges *gids);
 static scope_t *scope_and(scope_t *s, scope_t *o);
@@ -38,45 +46,74 @@ static void scope_passwd_done(scope_t *s);
 static group_t *scope_group_iter(scope_t *s);
 static group_t *scope_group_next(scope_t *s);
 static void scope_group_done(scope_t *s);
+static spwd_t *scope_shadow_get(scope_t *s, const char *name);
+static passwd_t *scope_passwd_files(scope_t *s);
+static passwd_t *scope_passwd_member(scope_t *s);
+static group_t *scope_group_files(scope_t *s);
+
+/* Check if a scope has exact or any passwd and group specifics. */
+#define scope_pwexact(s) ((s)->uid || (s)->uidNumber)
+#define scope_grexact(s) ((s)->cn || (s)->gidNumber)
+#define scope_pwany(s) (scope_pwexact(s) || (s)->uidPrefix || (s)->pwcnPrefix || (s)->memberOf)
+#define scope_grany(s) (scope_grexact(s) || (s)->cnPrefix)
+/* Check if a value index is in an attr_range, or there is no range. */
+#define range_has(r, n) (!(r) || ((r)->low <= (n) && (n) <= (r)->high))
+/* Check if a scope scans passwd or group entries instead of looking one up. */
+#define scope_isscan(s) ((((s)->mask & SCOPE_PASSWD) && !scope_pwexact(s)) \
+                         || (((s)->mask & SCOPE_GROUP) && !scope_grexact(s)))
+/* Check if a scope has a restricted uidNumber or gidNumber range. */
+#define scope_uidrange(s) ((s)->uidMin != 0 || (s)->uidMax != (uid_t)-1)
+#define scope_gidrange(s) ((s)->gidMin != 0 || (s)->gidMax != (gid_t)-1)
+
+/* Lookups using the files database if set, or else NSS. */
+#define scope_getpwnam(s, n) ((s)->files ? files_db_getpwnam((s)->files, (n)) : getpwnam(n))
+#define scope_getpwuid(s, u) ((s)->files ? files_db_getpwuid((s)->files, (u)) : getpwuid(u))
+#define scope_getgrnam(s, n) ((s)->files ? files_db_getgrnam((s)->files, (n)) : getgrnam(n))
+#define scope_getgrgid(s, g) ((s)->files ? files_db_getgrgid((s)->files, (g)) : getgrgid(g))
 
 /* Functions for dn's and cn's. */
-static char *gecos2cn(const char *gecos, char *cn);
 static char *name2dn(const char *basedn, const char *name, char *dn);
 static char *group2dn(const char *basedn, const char *group, char *dn);
 static char *dn2name(const char *basedn, const char *dn, char *name);
-
-/* PartialAttribute methods. */
-static PartialAttribute_t *PartialAttribute_new(const char *type);
-static LDAPString_t *PartialAttribute_add(PartialAttribute_t *attr, const char *value);
-static LDAPString_t *PartialAttribute_addf(PartialAttribute_t *attr, char *format, ...);
-static void PartialAttribute_clear(PartialAttribute_t *attr);
-
-/* SearchResultEntry methods. */
-#define SearchResultEntry_done(res) ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_SearchResultEntry, res)
-#define SearchResultEntry_init(res) memset(res, 0, sizeof(*res))
-static PartialAttribute_t *SearchResultEntry_add(SearchResultEntry_t *res, const char *type);
-static const PartialAttribute_t *SearchResultEntry_get(const SearchResultEntry_t *res, const char *type);
-static void SearchResultEntry_passwd(SearchResultEntry_t *res, const char *basedn, const bool isroot, passwd_t *pw);
-static void SearchResultEntry_group(SearchResultEntry_t *res, const char *basedn, group_t *gr);
+static char *dn2group(const char *basedn, const char *dn, char *name);
+static char *dn2cn(const char *dn, char *name);
+static bool group_hasmember(const group_t *gr, const char *name);
 
 /* SearchRequest methods. */
-static bool SearchRequest_select(const SearchRequest_t *req, SearchResultEntry_t *res);
-static scope_t *SearchRequest_scope(const SearchRequest_t *req, const ldap_server *server, scope_t *scope);
-
-/* AttributeSelection methods. */
-static bool AttributeSelection_contains(const AttributeSelection_t *sel, const char *type);
-
-/* AttributeDescription methods. */
-static bool AttributeDescription_present(const AttributeDescription_t *present, const SearchResultEntry_t *res);
-
-/* AttributeValueAssertion methods */
-static bool AttributeValueAssertion_equal(const AttributeValueAssertion_t *equal, const SearchResultEntry_t *res);
-static scope_t *AttributeValueAssertion_equal_scope(const AttributeValueAssertion_t *equal, scope_t *scope);
-
-/* Filter methods. */
-static bool Filter_matches(const Filter_t *filter, const SearchResultEntry_t *res);
-static bool Filter_ok(const Filter_t *filter);
-static scope_t *Filter_scope(const Filter_t *filter, scope_t *scope);
+static scope_t *SearchRequest_scope(const SearchRequest_t *req, const filter_t *filter, const ldap_server *server,
+                                    scope_t *scope);
+static size_t SearchRequest_key(const SearchRequest_t *req, const filter_t *filter, const attr_mask attrs,
+                                const attr_ranges *ranges, const int limit, const bool isroot, char *key,
+                                size_t len);
+static void ldap_request_cache(ldap_request *request, ldap_server *server, const char *key, size_t keylen,
+                               unsigned long gen);
+static void ldap_request_busy(ldap_request *request, const char *msg);
+
+/* CompareRequest methods. */
+static bool compare_value(attr_id id, const char *value, const AssertionValue_t *val);
+static long attrmap_compare(const attrmap *map, const passwd_t *pw, const spwd_t *sp, const group_t *gr,
+                            attr_id id, const AssertionValue_t *val);
+static long member_compare(const ldap_server *server, const passwd_t *pw, const group_t *gr,
+                           const AssertionValue_t *val);
+#define compare_result(b) ((b) ? LDAPResult__resultCode_compareTrue : LDAPResult__resultCode_compareFalse)
+
+/* filter_t methods. */
+static scope_t *filter_scope(const filter_t *filter, scope_t *scope);
+static scope_t *filter_equal_scope(const filter_t *filter, scope_t *scope);
+static scope_t *filter_substrings_scope(const filter_t *filter, scope_t *scope);
+static scope_t *filter_order_scope(const filter_t *filter, scope_t *scope);
+
+/* String buffer for formatting with truncation. */
+typedef struct {
+    char *buf;                  /**< The string buffer. */
+    size_t len;                 /**< The size of the string buffer. */
+    size_t pos;                 /**< The end of the string in the buffer. */
+} strbuf_t;
+static void strbuf_init(strbuf_t *str, char *buf, size_t len);
+static void strbuf_add(strbuf_t *str, const char *s);
+static void strbuf_addval(strbuf_t *str, const OCTET_STRING_t *val);
+static void strbuf_addarg(strbuf_t *str, const OCTET_STRING_t *val, const bool template);
+static void Filter_fmt(const Filter_t *filter, strbuf_t *str, const bool template);
 
 /* Get the ldap_replies for a BindRequest ldap_request using pam. */
 void ldap_request_bind_pam(ldap_request *request)
@@ -91,7 +128,20 @@ void ldap_request_bind_pam(ldap_request *request)
 
     msg->protocolOp.present = LDAPMessage__protocolOp_PR_bindResponse;
     LDAPString_set(&resp->matchedDN, (const char *)req->name.buf);
-    if (req->name.size == 0) {
+    if (req->authentication.present == AuthenticationChoice_PR_sasl
+        && !strcmp((const char *)req->authentication.choice.sasl.mechanism.buf, "EXTERNAL")) {
+        /* sasl external auth using the ldapi peer credentials */
+        if (connection->peeruid == (uid_t)(-1)) {
+            lrwarnx(request, "sasl external bind without peer credentials");
+            resp->resultCode = BindResponse__resultCode_inappropriateAuthentication;
+        } else if (!authzid_ok(server, req->authentication.choice.sasl.credentials, connection->peeruid)) {
+            lrwarnx(request, "sasl external bind with invalid authzid");
+            resp->resultCode = BindResponse__resultCode_invalidCredentials;
+        } else {                /* Success! */
+            resp->resultCode = BindResponse__resultCode_success;
+            connection->binduid = connection->peeruid;
+        }
+    } else if (req->name.size == 0) {
         /* anonymous bind */
         resp->resultCode = BindResponse__resultCode_success;
         connection->binduid = (uid_t)(-1);
@@ -100,19 +150,33 @@ void ldap_request_bind_pam(ldap_request *request)
         char user[PWNAME_MAX];
         char *pw = (char *)req->authentication.choice.simple.buf;
         char status[PAMMSG_LEN] = "";
-        if (server->ssl && !connection->ssl) {
+        const ev_tstamp now = ev_now(server->loop);
+        /* Local ldapi connections don't need ssl. */
+        if (server->ssl && !connection->ssl && connection->peeruid == (uid_t)(-1)) {
             lrwarnx(request, "missing ssl");
             resp->resultCode = BindResponse__resultCode_confidentialityRequired;
         } else if (!dn2name(server->basedn, (const char *)req->name.buf, user)) {
             lrwarnx(request, "bad DN: %s", req->name.buf);
             resp->resultCode = BindResponse__resultCode_invalidDNSyntax;
+        } else if (connection->peeruid == (uid_t)(-1)
+                   && !quota_take(&server->quotas, connection->client_ip, QUOTA_BIND, now)) {
+            /* Reject over quota binds before doing any PAM work. */
+            lrwarnx(request, "over bind quota");
+            resp->resultCode = BindResponse__resultCode_busy;
+            LDAPString_set(&resp->diagnosticMessage, "Too many binds.");
+        } else if (quota_isblocked(&server->quotas, user, connection->client_ip, now)) {
+            lrwarnx(request, "blocked after failed binds for %s", user);
+            resp->resultCode = BindResponse__resultCode_unwillingToPerform;
+            LDAPString_set(&resp->diagnosticMessage, "Too many failed binds.");
         } else if (PAM_SUCCESS != auth_user(user, pw, status, &connection->delay)) {
             lrwarnx(request, "%s", status);
             resp->resultCode = BindResponse__resultCode_invalidCredentials;
             LDAPString_set(&resp->diagnosticMessage, status);
+            quota_bindresult(&server->quotas, user, connection->client_ip, false, now);
         } else {                /* Success! */
             resp->resultCode = BindResponse__resultCode_success;
             connection->binduid = name2uid(user);
+            quota_bindresult(&server->quotas, user, connection->client_ip, true, now);
         }
     } else {
         /* sasl auth */
@@ -131,36 +195,86 @@ void ldap_request_search_nss(ldap_request *request)
     const SearchRequest_t *req = &request->message->protocolOp.choice.searchRequest;
     int limit = req->sizeLimit;
     const char *basedn = server->basedn;
-    const bool filterok = Filter_ok(&req->filter);
+    /* Compile the filter and selection once for all entries. */
+    filter_t *filter = filter_cache_get(&server->filters, &req->filter);
+    const bool filterok = filter != NULL;
+    const attr_mask attrs = AttributeSelection_mask(&req->attributes);
+    /* Only the attributes selected or filtered on are generated. */
+    const attr_mask need = filterok ? attrs | filter_attrs(filter) : attrs;
+    attr_ranges ranges;
     const bool isroot = server->rootuid == connection->binduid;
     const bool isauth = server->anonok || connection->binduid != (uid_t)(-1);
-
+    char key[STRING_MAX + FILTER_KEY_MAX];
+    size_t keylen = 0;
+    unsigned long gen = 0;
+    response *r;
+
+    /* Reject over quota searches before doing any NSS work. */
+    if (connection->peeruid == (uid_t)(-1)
+        && !quota_take(&server->quotas, connection->client_ip, QUOTA_SEARCH, ev_now(server->loop))) {
+        lrwarnx(request, "over search quota");
+        filter_free(filter);
+        ldap_request_busy(request, "Too many searches.");
+        return;
+    }
     /* Adjust limit to RESPONSE_MAX if it is zero or too large. */
     limit = (limit && (limit < RESPONSE_MAX)) ? limit : RESPONSE_MAX;
+    AttributeSelection_ranges(&req->attributes, server->maxvalues, &ranges);
+    /* Use a cached or in flight response if it is current. Without the files
+     * database the generation is the second, so NSS changes are seen quickly. */
+    gen = server->files ? server->files->gen : (unsigned long)ev_now(server->loop);
+    if (filterok && isauth)
+        keylen = SearchRequest_key(req, filter, attrs, &ranges, limit, isroot, key, sizeof(key));
+    if (keylen && ((server->files && (r = response_cache_get(&server->responses, key, keylen, gen)))
+                   || (r = response_flights_get(&server->flights, key, keylen, gen)))) {
+        filter_free(filter);
+        ldap_reply_response(request, r);
+        return;
+    }
+    scope_t scope;
+    if (filterok && isauth)
+        SearchRequest_scope(req, filter, server, &scope);
+    /* When overloaded, fail scanning searches fast so lookups still go through. */
+    if (server->overloaded && filterok && isauth && scope_isscan(&scope)) {
+        lrinfo(request, "overloaded, scanning search shed");
+        server->shed_c++;
+        filter_free(filter);
+        ldap_request_busy(request, "Server overloaded.");
+        return;
+    }
     LDAPMessage_t *msg = &ldap_reply_new(request)->message;
     /* Add all the matching entries. */
     if (filterok && isauth) {
-        scope_t scope;
-        SearchRequest_scope(req, server, &scope);
+        /* Only the ranges of values are generated, except for filtered attributes. */
+        attr_ranges genranges = ranges;
+        attr_ranges_all(&genranges, filter_attrs(filter));
         for (passwd_t *pw = scope_passwd_iter(&scope); pw && (request->count <= limit); pw = scope_passwd_next(&scope)) {
+            request->scanned++;
             msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchResEntry;
             SearchResultEntry_t *entry = &msg->protocolOp.choice.searchResEntry;
-            SearchResultEntry_passwd(entry, basedn, isroot, pw);
+            SearchResultEntry_passwd(entry, basedn, isroot ? scope_shadow_get(&scope, pw->pw_name) : NULL, pw, need,
+                                     &genranges);
+            if (need & ATTR_BIT(ATTR_MEMBEROF))
+                SearchResultEntry_memberof(entry, basedn, server->files, server->gids, pw, &genranges);
             /* If the entry matches, keep it and add another. */
-            if (SearchRequest_select(req, entry))
+            if (SearchResultEntry_select(entry, filter, attrs, req->typesOnly, &ranges))
                 msg = &ldap_reply_new(request)->message;
         }
         scope_passwd_done(&scope);
         for (group_t *gr = scope_group_iter(&scope); gr && (request->count <= limit); gr = scope_group_next(&scope)) {
+            request->scanned++;
             msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchResEntry;
             SearchResultEntry_t *entry = &msg->protocolOp.choice.searchResEntry;
-            SearchResultEntry_group(entry, basedn, gr);
+            SearchResultEntry_group(entry, basedn, gr, need, &genranges);
+            if (need & ATTR_BIT(ATTR_MEMBER))
+                SearchResultEntry_member(entry, basedn, gr, &genranges);
             /* If the entry matches, keep it and add another. */
-            if (SearchRequest_select(req, entry))
+            if (SearchResultEntry_select(entry, filter, attrs, req->typesOnly, &ranges))
                 msg = &ldap_reply_new(request)->message;
         }
         scope_group_done(&scope);
     }
+    filter_free(filter);
     /* Otherwise construct a SearchResultDone. */
     msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchResDone;
     SearchResultDone_t *done = &msg->protocolOp.choice.searchResDone;
@@ -174,6 +288,181 @@ void ldap_request_search_nss(ldap_request *request)
         done->resultCode = LDAPResult__resultCode_success;
         LDAPString_set(&done->matchedDN, basedn);
     }
+    if (keylen)
+        ldap_request_cache(request, server, key, keylen, gen);
+}
+
+/* Get the ldap_replies for a CompareRequest ldap_request using nss.
+ *
+ * The entry DN is resolved directly to its passwd or group record, and the
+ * assertion is compared against that record's values without building a
+ * SearchResultEntry. */
+void ldap_request_compare_nss(ldap_request *request)
+{
+    assert(request);
+    assert(request->message->protocolOp.present == LDAPMessage__protocolOp_PR_compareRequest);
+    ldap_connection *connection = request->connection;
+    ldap_server *server = connection->server;
+    const CompareRequest_t *req = &request->message->protocolOp.choice.compareRequest;
+    LDAPMessage_t *msg = &ldap_reply_new(request)->message;
+    CompareResponse_t *res = &msg->protocolOp.choice.compareResponse;
+    const char *dn = (const char *)req->entry.buf;
+    const attr_id id = schema_id((const char *)req->ava.attributeDesc.buf, req->ava.attributeDesc.size);
+    const bool isroot = server->rootuid == connection->binduid;
+    const bool isauth = server->anonok || connection->binduid != (uid_t)(-1);
+    char name[STRING_MAX];
+    passwd_t *pw;
+    group_t *gr;
+
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_compareResponse;
+    if (!isauth) {
+        res->resultCode = LDAPResult__resultCode_insufficientAccessRights;
+        LDAPString_set(&res->diagnosticMessage, "anonymous compare not permitted");
+    } else if (connection->peeruid == (uid_t)(-1)
+               && !quota_take(&server->quotas, connection->client_ip, QUOTA_SEARCH, ev_now(server->loop))) {
+        lrwarnx(request, "over search quota");
+        res->resultCode = LDAPResult__resultCode_busy;
+        LDAPString_set(&res->diagnosticMessage, "Too many searches.");
+    } else if (id == ATTR_UNKNOWN) {
+        res->resultCode = LDAPResult__resultCode_undefinedAttributeType;
+    } else if (dn2name(server->basedn, dn, name)) {
+        pw = server->files ? files_db_getpwnam(server->files, name) : getpwnam(name);
+        if (pw && ldap_ranges_ismatch(server->uids, pw->pw_uid)) {
+            spwd_t *sp = !isroot ? NULL : server->files ? files_db_getspnam(server->files, name) : getspnam(name);
+            res->resultCode = id == ATTR_MEMBEROF ? member_compare(server, pw, NULL, &req->ava.assertionValue)
+                : attrmap_compare(&attrmap_passwd, pw, sp, NULL, id, &req->ava.assertionValue);
+        } else
+            res->resultCode = LDAPResult__resultCode_noSuchObject;
+    } else if (dn2group(server->basedn, dn, name)) {
+        gr = server->files ? files_db_getgrnam(server->files, name) : getgrnam(name);
+        if (gr && ldap_ranges_ismatch(server->gids, gr->gr_gid))
+            res->resultCode = id == ATTR_MEMBER ? member_compare(server, NULL, gr, &req->ava.assertionValue)
+                : attrmap_compare(&attrmap_group, NULL, NULL, gr, id, &req->ava.assertionValue);
+        else
+            res->resultCode = LDAPResult__resultCode_noSuchObject;
+    } else {
+        res->resultCode = LDAPResult__resultCode_noSuchObject;
+    }
+    if (res->resultCode == LDAPResult__resultCode_noSuchObject)
+        LDAPString_set(&res->matchedDN, server->basedn);
+}
+
+/* Check if a string value equals an assertion value. */
+static bool compare_value(attr_id id, const char *value, const AssertionValue_t *val)
+{
+    return schema_equal(id, value, strlen(value), (const char *)val->buf, val->size);
+}
+
+/* Compare an attribute of a passwd and optional shadow entry or a group entry
+ * using an attrmap, returning the resultCode.
+ *
+ * This uses the same descriptors as SearchResultEntry_passwd() and
+ * SearchResultEntry_group(), so the values always match. */
+static long attrmap_compare(const attrmap *map, const passwd_t *pw, const spwd_t *sp, const group_t *gr,
+                            attr_id id, const AssertionValue_t *val)
+{
+    char buf[ATTRMAP_VALUE_MAX];
+    const char *v;
+    bool found = false;
+
+    /* The descriptors are sorted by attr_id, so stop after the last match. */
+    for (const attrmap_desc *d = map->desc; d < map->desc + map->count && d->id <= id; d++) {
+        if (d->id != id || (attrmap_isshadow(d) && !sp))
+            continue;
+        found = true;
+        for (int i = 0; (v = attrmap_value(d, pw, sp, gr, i, buf)); i++)
+            if (compare_value(id, v, val))
+                return LDAPResult__resultCode_compareTrue;
+    }
+    return found ? LDAPResult__resultCode_compareFalse : LDAPResult__resultCode_noSuchAttribute;
+}
+
+/* Compare a memberOf DN of a passwd entry or a member DN of a group entry,
+ * returning the resultCode.
+ *
+ * This resolves the DN and checks the one membership, including the primary
+ * group for memberOf, instead of building the whole list of values. */
+static long member_compare(const ldap_server *server, const passwd_t *pw, const group_t *gr,
+                           const AssertionValue_t *val)
+{
+    const char *dn = (const char *)val->buf;
+    char name[STRING_MAX];
+
+    if (gr)
+        return compare_result(dn2name(server->basedn, dn, name) && group_hasmember(gr, name));
+    if (!dn2group(server->basedn, dn, name))
+        return LDAPResult__resultCode_compareFalse;
+    gr = server->files ? files_db_getgrnam(server->files, name) : getgrnam(name);
+    return compare_result(gr && ldap_ranges_ismatch(server->gids, gr->gr_gid)
+                          && (gr->gr_gid == pw->pw_gid || group_hasmember(gr, pw->pw_name)));
+}
+
+/* Get the response cache key for a SearchRequest, or 0 if it doesn't fit.
+ *
+ * The key includes everything that affects the response, with the normalized
+ * filter so that equivalent filters share a cached response. */
+static size_t SearchRequest_key(const SearchRequest_t *req, const filter_t *filter, const attr_mask attrs,
+                                const attr_ranges *ranges, const int limit, const bool isroot, char *key,
+                                size_t len)
+{
+    int n = snprintf(key, len, "%ld:%d:%x:%d:%d:", req->scope, limit, attrs, req->typesOnly ? 1 : 0, isroot);
+    size_t flen;
+
+    /* Include the ranges selected, since the max values are the same for all. */
+    for (attr_id id = 0; id < schema_count && n >= 0 && (size_t)n < len; id++)
+        if (ranges->ranged & ATTR_BIT(id))
+            n += snprintf(key + n, len - n, "%d=%u-%u:", id, ranges->range[id].low, ranges->range[id].high);
+    if (n >= 0 && (size_t)n < len)
+        n += snprintf(key + n, len - n, "%s", req->baseObject.buf);
+
+    /* Include the '\0' after the baseObject to separate it from the filter. */
+    if (n < 0 || (size_t)n >= len || !(flen = filter_serialize(filter, key + n + 1, len - n - 1)))
+        return 0;
+    return n + 1 + flen;
+}
+
+/* Encode a search request's replies into a cached response.
+ *
+ * The replies are replaced by the encoded response, so they are only encoded
+ * once. If any reply fails to encode, which happens for entries too big for
+ * the buffer with room for a bigger messageID, the replies are left unchanged
+ * and streamed instead. Responses
+ * not in the cache are put in the flights while they are being sent, so
+ * identical searches meanwhile share them. */
+static void ldap_request_cache(ldap_request *request, ldap_server *server, const char *key, size_t keylen,
+                               unsigned long gen)
+{
+    unsigned char buf[BUFFER_SIZE - RESPONSE_MSGID_GROWTH];
+    response *r = response_new(gen);
+    ldap_reply *reply = request->reply;
+    asn_enc_rval_t rencode;
+
+    do {
+        rencode = der_encode_to_buffer(&asn_DEF_LDAPMessage, &reply->message, buf, sizeof(buf));
+        if (rencode.encoded == -1 || !response_addmsg(r, buf, rencode.encoded)) {
+            lrinfo(request, "response too big to cache");
+            return response_unref(r);
+        }
+    } while ((reply = ldap_reply_next(&request->reply, reply)));
+    if (server->files)
+        response_cache_put(&server->responses, key, keylen, r);
+    if (!r->key)
+        response_flights_put(&server->flights, key, keylen, r);
+    while (request->reply)
+        ldap_reply_free(request->reply);
+    request->count = 0;
+    ldap_reply_response(request, r);
+}
+
+/* Reply to a search request with a busy SearchResultDone. */
+static void ldap_request_busy(ldap_request *request, const char *msg)
+{
+    LDAPMessage_t *reply = &ldap_reply_new(request)->message;
+    SearchResultDone_t *done = &reply->protocolOp.choice.searchResDone;
+
+    reply->protocolOp.present = LDAPMessage__protocolOp_PR_searchResDone;
+    done->resultCode = LDAPResult__resultCode_busy;
+    LDAPString_set(&done->diagnosticMessage, msg);
 }
 
 /* Initialize a search scope to include everything. */
@@ -181,8 +470,37 @@ static void scope_init(scope_t *s, const ldap_ranges *uids, const ldap_ranges *g
 {
     s->mask = -1;
     s->uid = s->uidNumber = s->cn = s->gidNumber = NULL;
+    s->uidPrefix = s->pwcnPrefix = s->cnPrefix = s->memberOf = NULL;
+    s->uidMin = s->gidMin = 0;
+    s->uidMax = (uid_t)-1;
+    s->gidMax = (gid_t)-1;
     s->uids = uids;
     s->gids = gids;
+    s->files = NULL;
+    s->pwrange = NULL;
+    s->grrange = NULL;
+    s->pos = s->end = 0;
+    s->slices.count = s->slice = 0;
+    s->group = NULL;
+    s->mem = NULL;
+}
+
+/* Set the passwd specifics of a scope to another's, or clear them if NULL. */
+static void scope_setpw(scope_t *s, const scope_t *o)
+{
+    s->uid = o ? o->uid : NULL;
+    s->uidNumber = o ? o->uidNumber : NULL;
+    s->uidPrefix = o ? o->uidPrefix : NULL;
+    s->pwcnPrefix = o ? o->pwcnPrefix : NULL;
+    s->memberOf = o ? o->memberOf : NULL;
+}
+
+/* Set the group specifics of a scope to another's, or clear them if NULL. */
+static void scope_setgr(scope_t *s, const scope_t *o)
+{
+    s->cn = o ? o->cn : NULL;
+    s->gidNumber = o ? o->gidNumber : NULL;
+    s->cnPrefix = o ? o->cnPrefix : NULL;
 }
 
 /* Logical 'and' of two search scopes. */
@@ -191,20 +509,21 @@ static scope_t *scope_and(scope_t *s, scope_t *o)
     s->mask &= o->mask;
     /* If we exclude passwd, clear specifics. */
     if (!(s->mask & SCOPE_PASSWD))
-        s->uidNumber = s->uid = NULL;
-    else if (!s->uid && !s->uidNumber) {
-        /* If we include passwd and don't have specifics, use the others. */
-        s->uidNumber = o->uidNumber;
-        s->uid = o->uid;
-    }
+        scope_setpw(s, NULL);
+    else if (!scope_pwany(s) || (!scope_pwexact(s) && scope_pwexact(o)))
+        /* If we include passwd and the other's specifics are better, use them. */
+        scope_setpw(s, o);
     /* If we exclude group, clear specifics. */
     if (!(s->mask & SCOPE_GROUP))
-        s->gidNumber = s->cn = NULL;
-    else if (!s->cn && !s->gidNumber) {
-        /* If we include group and don't have specifics, use the other's. */
-        s->gidNumber = o->gidNumber;
-        s->cn = o->cn;
-    }
+        scope_setgr(s, NULL);
+    else if (!scope_grany(s) || (!scope_grexact(s) && scope_grexact(o)))
+        /* If we include group and the other's specifics are better, use them. */
+        scope_setgr(s, o);
+    /* Intersect the id ranges. */
+    s->uidMin = max(s->uidMin, o->uidMin);
+    s->uidMax = min(s->uidMax, o->uidMax);
+    s->gidMin = max(s->gidMin, o->gidMin);
+    s->gidMax = min(s->gidMax, o->gidMax);
     return s;
 }
 
@@ -213,18 +532,26 @@ static scope_t *scope_or(scope_t *s, scope_t *o)
 {
     /* If we don't include passwd, use the other's specifics. */
     if (!(s->mask & SCOPE_PASSWD)) {
-        s->uidNumber = o->uidNumber;
-        s->uid = o->uid;
-    } else if (o->mask & SCOPE_PASSWD)
-        /* If both include passwd, we can't be specific. */
-        s->uidNumber = s->uid = NULL;
+        scope_setpw(s, o);
+        s->uidMin = o->uidMin;
+        s->uidMax = o->uidMax;
+    } else if (o->mask & SCOPE_PASSWD) {
+        /* If both include passwd, we can't be specific, but can use a range covering both. */
+        scope_setpw(s, NULL);
+        s->uidMin = min(s->uidMin, o->uidMin);
+        s->uidMax = max(s->uidMax, o->uidMax);
+    }
     /* If we don't include group, use the other's specifics. */
     if (!(s->mask & SCOPE_GROUP)) {
-        s->gidNumber = o->gidNumber;
-        s->cn = o->cn;
-    } else if (o->mask & SCOPE_GROUP)
-        /* If both include group, we can't be specific. */
-        s->gidNumber = s->cn = NULL;
+        scope_setgr(s, o);
+        s->gidMin = o->gidMin;
+        s->gidMax = o->gidMax;
+    } else if (o->mask & SCOPE_GROUP) {
+        /* If both include group, we can't be specific, but can use a range covering both. */
+        scope_setgr(s, NULL);
+        s->gidMin = min(s->gidMin, o->gidMin);
+        s->gidMax = max(s->gidMax, o->gidMax);
+    }
     s->mask |= o->mask;
     return s;
 }
@@ -234,14 +561,26 @@ static scope_t *scope_not(scope_t *s)
 {
     s->mask = ~s->mask;
     /* If we had passwd specifics, we need to include the rest. */
-    if (s->uid || s->uidNumber) {
+    if (scope_pwany(s)) {
         s->mask |= SCOPE_PASSWD;
-        s->uid = s->uidNumber = NULL;
+        scope_setpw(s, NULL);
     }
     /* If we had group specifics, we need to include the rest. */
-    if (s->cn || s->gidNumber) {
+    if (scope_grany(s)) {
         s->mask |= SCOPE_GROUP;
-        s->cn = s->gidNumber = NULL;
+        scope_setgr(s, NULL);
+    }
+    /* If we had id ranges, we need to include the rest. Note passwd entries
+     * also have a gidNumber, so a gid range doesn't exclude them. */
+    if (scope_uidrange(s)) {
+        s->mask |= SCOPE_PASSWD;
+        s->uidMin = 0;
+        s->uidMax = (uid_t)-1;
+    }
+    if (scope_gidrange(s)) {
+        s->mask |= SCOPE_PASSWD | SCOPE_GROUP;
+        s->gidMin = 0;
+        s->gidMax = (gid_t)-1;
     }
     return s;
 }
@@ -254,13 +593,36 @@ static passwd_t *scope_passwd_iter(scope_t *s)
     } else if (s->uidNumber) {
         uid_t uid = atoi(s->uidNumber);
         /* printf("getpwuid(%d)\n", uid); */
-        return ldap_ranges_ismatch(s->uids, uid) ? getpwuid(uid) : NULL;
+        return ldap_ranges_ismatch(s->uids, uid) ? scope_getpwuid(s, uid) : NULL;
     } else if (s->uid) {
         /* printf("getpwnam(%s)\n", s->uid); */
-        passwd_t *p = getpwnam(s->uid);
+        passwd_t *p = scope_getpwnam(s, s->uid);
         return (p && ldap_ranges_ismatch(s->uids, p->pw_uid)) ? p : NULL;
     } else {
         /* printf("getpwent()\n"); */
+        s->pos = s->slice = s->slices.count = 0;
+        s->pwrange = NULL;
+        s->end = s->files ? s->files->pw_count : 0;
+        /* Use a files index range for prefixes, or the members of an exported
+         * memberOf group, or the uid index for the uidNumber range clipped to
+         * the exported uids, or else all entries. */
+        if (s->files && s->uidPrefix)
+            s->pwrange = files_db_pwprefix(s->files, s->uidPrefix, &s->end);
+        else if (s->files && s->pwcnPrefix)
+            s->pwrange = files_db_pwcnprefix(s->files, s->pwcnPrefix, &s->end);
+        else if (s->files && s->memberOf) {
+            char name[STRING_MAX];
+            group_t *g = dn2cn(s->memberOf, name) ? files_db_getgrnam(s->files, name) : NULL;
+            s->end = 0;
+            if (g && ldap_ranges_ismatch(s->gids, g->gr_gid)) {
+                s->group = g;
+                s->mem = g->gr_mem;
+                s->pwrange = files_db_pwgid(s->files, g->gr_gid, &s->end);
+            }
+        } else if (s->files && scope_uidrange(s)) {
+            ldap_ranges_clip(&s->slices, s->uids, s->uidMin, s->uidMax);
+            s->end = 0;
+        }
         return scope_passwd_next(s);
     }
 }
@@ -270,7 +632,11 @@ static passwd_t *scope_passwd_next(scope_t *s)
 {
     passwd_t *p = NULL;
 
-    if (!s->uid && !s->uidNumber)
+    if (s->group)
+        while ((p = scope_passwd_member(s)) && !ldap_ranges_ismatch(s->uids, p->pw_uid)) ;
+    else if (!s->uid && !s->uidNumber && s->files)
+        while ((p = scope_passwd_files(s)) && !ldap_ranges_ismatch(s->uids, p->pw_uid)) ;
+    else if (!s->uid && !s->uidNumber)
         while ((p = getpwent()) && !ldap_ranges_ismatch(s->uids, p->pw_uid)) ;
     return p;
 }
@@ -278,7 +644,7 @@ static passwd_t *scope_passwd_next(scope_t *s)
 /* Stop iterating through passwd entries included in a scope. */
 static void scope_passwd_done(scope_t *s)
 {
-    if (!s->uid && !s->uidNumber)
+    if (!s->uid && !s->uidNumber && !s->files)
         endpwent();
 }
 
@@ -290,13 +656,24 @@ static group_t *scope_group_iter(scope_t *s)
     } else if (s->gidNumber) {
         gid_t gid = atoi(s->gidNumber);
         /* printf("getgrgid(%d)\n", gid); */
-        return ldap_ranges_ismatch(s->gids, gid) ? getgrgid(gid) : NULL;
+        return ldap_ranges_ismatch(s->gids, gid) ? scope_getgrgid(s, gid) : NULL;
     } else if (s->cn) {
         /* printf("getgrnam(%s)\n", s->cn); */
-        group_t *g = getgrnam(s->cn);
+        group_t *g = scope_getgrnam(s, s->cn);
         return (g && ldap_ranges_ismatch(s->gids, g->gr_gid)) ? g : NULL;
     } else {
         /* printf("getgrent()\n"); */
+        s->pos = s->slice = s->slices.count = 0;
+        s->grrange = NULL;
+        s->end = s->files ? s->files->gr_count : 0;
+        /* Use a files index range for prefixes, or the gid index for the
+         * gidNumber range clipped to the exported gids, or else all entries. */
+        if (s->files && s->cnPrefix)
+            s->grrange = files_db_grprefix(s->files, s->cnPrefix, &s->end);
+        else if (s->files && scope_gidrange(s)) {
+            ldap_ranges_clip(&s->slices, s->gids, s->gidMin, s->gidMax);
+            s->end = 0;
+        }
         return scope_group_next(s);
     }
 }
@@ -306,7 +683,9 @@ static group_t *scope_group_next(scope_t *s)
 {
     group_t *g = NULL;
 
-    if (!s->cn && !s->gidNumber)
+    if (!s->cn && !s->gidNumber && s->files)
+        while ((g = scope_group_files(s)) && !ldap_ranges_ismatch(s->gids, g->gr_gid)) ;
+    else if (!s->cn && !s->gidNumber)
         while ((g = getgrent()) && !ldap_ranges_ismatch(s->gids, g->gr_gid)) ;
     return g;
 }
@@ -314,20 +693,60 @@ static group_t *scope_group_next(scope_t *s)
 /* Stop iterating through group entries included in a scope. */
 static void scope_group_done(scope_t *s)
 {
-    if (!s->cn && !s->gidNumber)
+    if (!s->cn && !s->gidNumber && !s->files)
         endgrent();
 }
 
-/* Get the cn from the first field of a gecos entry. */
-static char *gecos2cn(const char *gecos, char *cn)
+/* Get the next passwd entry iterating through files, moving through the id range slices. */
+static passwd_t *scope_passwd_files(scope_t *s)
 {
-    assert(gecos);
-    assert(cn);
-    size_t len = strcspn(gecos, ",");
+    while (s->pos >= s->end) {
+        if (s->slice >= s->slices.count)
+            return NULL;
+        ldap_range *r = &s->slices.range[s->slice++];
+        s->pwrange = files_db_pwuidrange(s->files, r->beg, r->end, &s->end);
+        s->pos = 0;
+    }
+    return s->pwrange ? s->pwrange[s->pos++] : &s->files->pw[s->pos++];
+}
 
-    memcpy(cn, gecos, len);
-    cn[len] = '\0';
-    return cn;
+/* Get the next group entry iterating through files, moving through the id range slices. */
+static group_t *scope_group_files(scope_t *s)
+{
+    while (s->pos >= s->end) {
+        if (s->slice >= s->slices.count)
+            return NULL;
+        ldap_range *r = &s->slices.range[s->slice++];
+        s->grrange = files_db_grgidrange(s->files, r->beg, r->end, &s->end);
+        s->pos = 0;
+    }
+    return s->grrange ? s->grrange[s->pos++] : &s->files->gr[s->pos++];
+}
+
+/* Get the next passwd entry iterating through the memberOf group's members,
+ * first the listed members and then the primary members not also listed. */
+static passwd_t *scope_passwd_member(scope_t *s)
+{
+    passwd_t *p;
+    files_member *m;
+    int n;
+
+    while (*s->mem)
+        if ((p = files_db_getpwnam(s->files, *s->mem++)))
+            return p;
+    while (s->pos < s->end) {
+        p = s->pwrange[s->pos++];
+        for (m = files_db_grmember(s->files, p->pw_name, &n); n && m->gr != s->group; m++, n--) ;
+        if (!n)
+            return p;
+    }
+    return NULL;
+}
+
+/* Get the shadow entry for a name. */
+static spwd_t *scope_shadow_get(scope_t *s, const char *name)
+{
+    return s->files ? files_db_getspnam(s->files, name) : getspnam(name);
 }
 
 /* Return a full "uid=<name>,ou=people,..." ldap dn from a name and basedn. */
@@ -350,6 +769,27 @@ static char *group2dn(const char *basedn, const char *group, char *dn)
     return dn;
 }
 
+bool authzid_ok(const ldap_server *server, const OCTET_STRING_t *authzid, uid_t uid)
+{
+    assert(server);
+    char name[PWNAME_MAX];
+    const char *id;
+    passwd_t *pw;
+
+    if (!authzid || !authzid->size)
+        return true;
+    id = (const char *)authzid->buf;
+    if (!strncmp(id, "dn:", 3)) {
+        if (!dn2name(server->basedn, id + 3, name))
+            return false;
+    } else if (!strncmp(id, "u:", 2) && strlen(id + 2) < sizeof(name))
+        strcpy(name, id + 2);
+    else
+        return false;
+    pw = server->files ? files_db_getpwnam(server->files, name) : getpwnam(name);
+    return pw && pw->pw_uid == uid && ldap_ranges_ismatch(server->uids, pw->pw_uid);
+}
+
 /* Return the name from a full "uid=<name>,ou=people,..." ldap dn. */
 static char *dn2name(const char *basedn, const char *dn, char *name)
 {
@@ -361,15 +801,59 @@ static char *dn2name(const char *basedn, const char *dn, char *name)
     const char *end = strchr(dn, ',');
     size_t len = end - pos;
 
-    if (!end || strncmp(dn, "uid=", 4) || strncmp(end, ",ou=people,", 11) || strcmp(end + 11, basedn))
+    if (!end || strncmp(dn, "uid=", 4) || strncmp(end, ",ou=people,", 11) || strcmp(end + 11, basedn)
+        || len >= PWNAME_MAX)
+        return NULL;
+    memcpy(name, pos, len);
+    name[len] = '\0';
+    return name;
+}
+
+/* Return the group from a full "cn=<group>,ou=groups,..." ldap dn. */
+static char *dn2group(const char *basedn, const char *dn, char *name)
+{
+    assert(basedn);
+    assert(dn);
+    assert(name);
+    /* cn=$name$,ou=groups,$basedn$ */
+    const char *pos = dn + 3;
+    const char *end = strchr(dn, ',');
+    size_t len = end - pos;
+
+    if (!end || strncmp(dn, "cn=", 3) || strncmp(end, ",ou=groups,", 11) || strcmp(end + 11, basedn)
+        || len >= STRING_MAX)
         return NULL;
     memcpy(name, pos, len);
     name[len] = '\0';
     return name;
 }
 
+/* Return the cn from a "cn=<group>,..." ldap dn without checking the rest. */
+static char *dn2cn(const char *dn, char *name)
+{
+    assert(dn);
+    assert(name);
+    const char *end = strchr(dn, ',');
+    size_t len = end - dn - 3;
+
+    if (!end || strncmp(dn, "cn=", 3) || len >= STRING_MAX)
+        return NULL;
+    memcpy(name, dn + 3, len);
+    name[len] = '\0';
+    return name;
+}
+
+/* Check if a name is a listed member of a group. */
+static bool group_hasmember(const group_t *gr, const char *name)
+{
+    for (char **m = gr->gr_mem; *m; m++)
+        if (!strcmp(*m, name))
+            return true;
+    return false;
+}
+
 /* Allocate a PartialAttribute and set it's type. */
-static PartialAttribute_t *PartialAttribute_new(const char *type)
+PartialAttribute_t *PartialAttribute_new(const char *type)
 {
     assert(type);
     PartialAttribute_t *a = XNEW0(PartialAttribute_t, 1);
@@ -379,7 +863,7 @@ static PartialAttribute_t *PartialAttribute_new(const char *type)
 }
 
 /* Add a string value to a PartialAttribute. */
-static LDAPString_t *PartialAttribute_add(PartialAttribute_t *attr, const char *value)
+LDAPString_t *PartialAttribute_add(PartialAttribute_t *attr, const char *value)
 {
     assert(attr);
     assert(value);
@@ -390,7 +874,7 @@ static LDAPString_t *PartialAttribute_add(PartialAttribute_t *attr, const char *
 }
 
 /* Add a formated value to a PartialAttribute. */
-static LDAPString_t *PartialAttribute_addf(PartialAttribute_t *attr, char *format, ...)
+LDAPString_t *PartialAttribute_addf(PartialAttribute_t *attr, char *format, ...)
 {
     assert(attr);
     assert(format);
@@ -403,15 +887,57 @@ static LDAPString_t *PartialAttribute_addf(PartialAttribute_t *attr, char *forma
 }
 
 /* Remove all the values from a PartialAttribute. */
-static void PartialAttribute_clear(PartialAttribute_t *attr)
+void PartialAttribute_clear(PartialAttribute_t *attr)
 {
     assert(attr);
 
     asn_set_empty(&attr->vals);
 }
 
+/* Set the ";range=low-high" type of a PartialAttribute if it is ranged.
+ *
+ * It is ranged if it was selected with a range or has more than count values
+ * in its range, and high is "*" if the range includes the last value. */
+static void PartialAttribute_setrange(PartialAttribute_t *attr, attr_id id, const attr_ranges *ranges,
+                                      unsigned count)
+{
+    assert(attr);
+    char type[STRING_MAX];
+
+    if (!ranges)
+        return;
+    const attr_range *range = &ranges->range[id];
+    const bool last = !count || count - 1 <= range->high;
+    if (last && !(ranges->ranged & ATTR_BIT(id)))
+        return;
+    if (last)
+        snprintf(type, sizeof(type), "%s;range=%u-*", schema_name(id), range->low);
+    else
+        snprintf(type, sizeof(type), "%s;range=%u-%u", schema_name(id), range->low, range->high);
+    LDAPString_set(&attr->type, type);
+}
+
+/* Remove the values of a PartialAttribute outside its range and set its type. */
+static void PartialAttribute_range(PartialAttribute_t *attr, attr_id id, const attr_ranges *ranges)
+{
+    assert(attr);
+    assert(ranges);
+    const attr_range *range = &ranges->range[id];
+    AttributeValue_t **v = attr->vals.list.array;
+    const unsigned count = attr->vals.list.count;
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < count; i++)
+        if (range_has(range, i))
+            v[n++] = v[i];
+        else
+            LDAPString_free(v[i]);
+    attr->vals.list.count = n;
+    PartialAttribute_setrange(attr, id, ranges, count);
+}
+
 /* Add a PartialAttribute to a SearchResultEntry. */
-static PartialAttribute_t *SearchResultEntry_add(SearchResultEntry_t *res, const char *type)
+PartialAttribute_t *SearchResultEntry_add(SearchResultEntry_t *res, const char *type)
 {
     assert(res);
     assert(type);
@@ -421,105 +947,132 @@ static PartialAttribute_t *SearchResultEntry_add(SearchResultEntry_t *res, const
     return a;
 }
 
-/* Get a PartialAttribute from a SearchResultEntry. */
-static const PartialAttribute_t *SearchResultEntry_get(const SearchResultEntry_t *res, const char *type)
+/* Add the attributes in an attr_mask from an attrmap to a SearchResultEntry.
+ *
+ * Only the descriptors for attributes in the mask are used, and the adjacent
+ * descriptors for the same attribute add their values to one attribute. */
+static void SearchResultEntry_attrmap(SearchResultEntry_t *res, const attrmap *map, const attr_mask attrs,
+                                      const passwd_t *pw, const spwd_t *sp, const group_t *gr,
+                                      const attr_ranges *ranges)
 {
-    assert(res);
-    assert(type);
-
-    for (int i = 0; i < res->attributes.list.count; i++) {
-        const PartialAttribute_t *attr = res->attributes.list.array[i];
-        if (!strcmp((const char *)attr->type.buf, type))
-            return attr;
+    PartialAttribute_t *attribute = NULL;
+    const attr_range *range = NULL;
+    attr_id id = ATTR_UNKNOWN;
+    char buf[ATTRMAP_VALUE_MAX];
+    const char *v;
+    unsigned n = 0;
+
+    for (const attrmap_desc *d = map->desc; d < map->desc + map->count; d++) {
+        if (!(attrs & ATTR_BIT(d->id)) || (attrmap_isshadow(d) && !sp))
+            continue;
+        if (d->id != id) {
+            if (attribute)
+                PartialAttribute_setrange(attribute, id, ranges, n);
+            id = d->id;
+            attribute = SearchResultEntry_add(res, schema_name(id));
+            range = ranges ? &ranges->range[id] : NULL;
+            n = 0;
+        }
+        for (int i = 0; (v = attrmap_value(d, pw, sp, gr, i, buf)); i++, n++)
+            if (range_has(range, n))
+                PartialAttribute_add(attribute, v);
     }
-    return NULL;
+    if (attribute)
+        PartialAttribute_setrange(attribute, id, ranges, n);
 }
 
-/* Set a SearchResultEntry from an nss passwd entry. */
-static void SearchResultEntry_passwd(SearchResultEntry_t *res, const char *basedn, const bool isroot, passwd_t *pw)
+/* Set a SearchResultEntry from an nss passwd and optional shadow entry. */
+void SearchResultEntry_passwd(SearchResultEntry_t *res, const char *basedn, const spwd_t *sp, const passwd_t *pw,
+                              const attr_mask attrs, const attr_ranges *ranges)
 {
     assert(res);
     assert(basedn);
     assert(pw);
-    PartialAttribute_t *attribute;
     char buf[STRING_MAX];
-    spwd_t *sp = isroot ? getspnam(pw->pw_name) : NULL;
 
     LDAPString_set(&res->objectName, name2dn(basedn, pw->pw_name, buf));
-    attribute = SearchResultEntry_add(res, "objectClass");
-    PartialAttribute_add(attribute, "top");
-    PartialAttribute_add(attribute, "account");
-    PartialAttribute_add(attribute, "posixAccount");
-    if (sp)
-        PartialAttribute_add(attribute, "shadowAccount");
-    attribute = SearchResultEntry_add(res, "uid");
-    PartialAttribute_add(attribute, pw->pw_name);
-    attribute = SearchResultEntry_add(res, "cn");
-    PartialAttribute_add(attribute, gecos2cn(pw->pw_gecos, buf));
-    attribute = SearchResultEntry_add(res, "userPassword");
-    if (sp)
-        PartialAttribute_addf(attribute, "{crypt}%s", sp->sp_pwdp);
-    else
-        PartialAttribute_addf(attribute, "{crypt}%s", pw->pw_passwd);
-    attribute = SearchResultEntry_add(res, "uidNumber");
-    PartialAttribute_addf(attribute, "%i", pw->pw_uid);
-    attribute = SearchResultEntry_add(res, "gidNumber");
-    PartialAttribute_addf(attribute, "%i", pw->pw_gid);
-    attribute = SearchResultEntry_add(res, "gecos");
-    PartialAttribute_add(attribute, pw->pw_gecos);
-    attribute = SearchResultEntry_add(res, "homeDirectory");
-    PartialAttribute_add(attribute, pw->pw_dir);
-    attribute = SearchResultEntry_add(res, "loginShell");
-    PartialAttribute_add(attribute, pw->pw_shell);
-    if (sp) {
-        attribute = SearchResultEntry_add(res, "shadowLastChange");
-        PartialAttribute_addf(attribute, "%i", sp->sp_lstchg);
-        attribute = SearchResultEntry_add(res, "shadowMin");
-        PartialAttribute_addf(attribute, "%i", sp->sp_min);
-        attribute = SearchResultEntry_add(res, "shadowMax");
-        PartialAttribute_addf(attribute, "%i", sp->sp_max);
-        attribute = SearchResultEntry_add(res, "shadowWarning");
-        PartialAttribute_addf(attribute, "%i", sp->sp_warn);
-        attribute = SearchResultEntry_add(res, "shadowInactive");
-        PartialAttribute_addf(attribute, "%i", sp->sp_inact);
-        attribute = SearchResultEntry_add(res, "shadowExpire");
-        PartialAttribute_addf(attribute, "%i", sp->sp_expire);
-        attribute = SearchResultEntry_add(res, "shadowFlag");
-        PartialAttribute_addf(attribute, "%i", sp->sp_flag);
-    }
+    SearchResultEntry_attrmap(res, &attrmap_passwd, attrs, pw, sp, NULL, ranges);
 }
 
 /* Set a SearchResultEntry from an nss group entry. */
-static void SearchResultEntry_group(SearchResultEntry_t *res, const char *basedn, group_t *gr)
+void SearchResultEntry_group(SearchResultEntry_t *res, const char *basedn, const group_t *gr, const attr_mask attrs,
+                             const attr_ranges *ranges)
 {
     assert(res);
     assert(basedn);
     assert(gr);
-    PartialAttribute_t *attribute;
     char buf[STRING_MAX];
 
     LDAPString_set(&res->objectName, group2dn(basedn, gr->gr_name, buf));
-    attribute = SearchResultEntry_add(res, "objectClass");
-    PartialAttribute_add(attribute, "top");
-    PartialAttribute_add(attribute, "posixGroup");
-    attribute = SearchResultEntry_add(res, "cn");
-    PartialAttribute_add(attribute, gr->gr_name);
-    attribute = SearchResultEntry_add(res, "userPassword");
-    PartialAttribute_addf(attribute, "{crypt}%s", gr->gr_passwd);
-    attribute = SearchResultEntry_add(res, "gidNumber");
-    PartialAttribute_addf(attribute, "%i", gr->gr_gid);
-    attribute = SearchResultEntry_add(res, "memberUid");
-    for (char **m = gr->gr_mem; *m; m++)
-        PartialAttribute_add(attribute, *m);
+    SearchResultEntry_attrmap(res, &attrmap_group, attrs, NULL, NULL, gr, ranges);
 }
 
-/* Check a SearchRequest matches an entry and prune it to match selections. */
-static bool SearchRequest_select(const SearchRequest_t *req, SearchResultEntry_t *res)
+/* Add the memberOf group DNs of a passwd entry to a SearchResultEntry.
+ *
+ * This includes the primary group, using the files reverse membership index
+ * or else NSS getgrouplist(), and only the exported groups. */
+void SearchResultEntry_memberof(SearchResultEntry_t *res, const char *basedn, const files_db *files,
+                                const ldap_ranges *gids, const passwd_t *pw, const attr_ranges *ranges)
 {
-    assert(req);
     assert(res);
+    assert(basedn);
+    assert(gids);
+    assert(pw);
+    PartialAttribute_t *attribute = SearchResultEntry_add(res, "memberOf");
+    const attr_range *range = ranges ? &ranges->range[ATTR_MEMBEROF] : NULL;
+    char buf[STRING_MAX];
+    unsigned count = 0;
+    group_t *g;
+
+    if (files) {
+        int n;
+        files_member *m = files_db_grmember(files, pw->pw_name, &n);
+        if ((g = files_db_getgrgid(files, pw->pw_gid)) && ldap_ranges_ismatch(gids, g->gr_gid)
+            && range_has(range, count++))
+            PartialAttribute_add(attribute, group2dn(basedn, g->gr_name, buf));
+        for (; n--; m++)
+            if (m->gr != g && ldap_ranges_ismatch(gids, m->gr->gr_gid) && range_has(range, count++))
+                PartialAttribute_add(attribute, group2dn(basedn, m->gr->gr_name, buf));
+    } else {
+        gid_t list[GROUPS_MAX];
+        int n = GROUPS_MAX;
+        if (getgrouplist(pw->pw_name, pw->pw_gid, list, &n) < 0)
+            n = GROUPS_MAX;
+        for (int i = 0; i < n; i++)
+            if (ldap_ranges_ismatch(gids, list[i]) && (g = getgrgid(list[i])) && range_has(range, count++))
+                PartialAttribute_add(attribute, group2dn(basedn, g->gr_name, buf));
+    }
+    PartialAttribute_setrange(attribute, ATTR_MEMBEROF, ranges, count);
+}
 
-    if (!Filter_matches(&req->filter, res)) {
+/* Add the member DNs of a group entry to a SearchResultEntry. */
+void SearchResultEntry_member(SearchResultEntry_t *res, const char *basedn, const group_t *gr,
+                              const attr_ranges *ranges)
+{
+    assert(res);
+    assert(basedn);
+    assert(gr);
+    PartialAttribute_t *attribute = SearchResultEntry_add(res, "member");
+    const attr_range *range = ranges ? &ranges->range[ATTR_MEMBER] : NULL;
+    char buf[STRING_MAX];
+    unsigned count = 0;
+
+    for (char **m = gr->gr_mem; *m; m++, count++)
+        if (range_has(range, count))
+            PartialAttribute_add(attribute, name2dn(basedn, *m, buf));
+    PartialAttribute_setrange(attribute, ATTR_MEMBER, ranges, count);
+}
+
+/* Check a SearchResultEntry matches a filter and prune it to match selections. */
+bool SearchResultEntry_select(SearchResultEntry_t *res, const filter_t *filter, const attr_mask attrs,
+                              const bool typesOnly, const attr_ranges *ranges)
+{
+    assert(res);
+    assert(filter);
+    entry_t entry;
+
+    entry_init(&entry, res);
+    if (!filter_matches(filter, &entry)) {
         /* Empty and wipe the whole entry. */
         SearchResultEntry_done(res);
         SearchResultEntry_init(res);
@@ -529,20 +1082,27 @@ static bool SearchRequest_select(const SearchRequest_t *req, SearchResultEntry_t
     int i = 0;
     while (i < res->attributes.list.count) {
         PartialAttribute_t *attr = res->attributes.list.array[i];
-        if (req->typesOnly)
-            PartialAttribute_clear(attr);
-        if (!AttributeSelection_contains(&req->attributes, (const char *)attr->type.buf))
+        attr_range range;
+        attr_id id = schema_desc((const char *)attr->type.buf, attr->type.size, &range);
+        if (id == ATTR_UNKNOWN || !(attrs & ATTR_BIT(id))) {
             asn_sequence_del(&res->attributes.list, i, 1);
-        else
-            i++;
+            continue;
+        }
+        if (ranges && !memchr(attr->type.buf, ';', attr->type.size))
+            PartialAttribute_range(attr, id, ranges);
+        if (typesOnly)
+            PartialAttribute_clear(attr);
+        i++;
     }
     return true;
 }
 
 /* Get the scope for a SearchRequest. */
-static scope_t *SearchRequest_scope(const SearchRequest_t *req, const ldap_server *server, scope_t *scope)
+static scope_t *SearchRequest_scope(const SearchRequest_t *req, const filter_t *filter, const ldap_server *server,
+                                    scope_t *scope)
 {
     assert(req);
+    assert(filter);
     assert(server);
     assert(scope);
     const char *basedn = server->basedn;
@@ -556,170 +1116,342 @@ static scope_t *SearchRequest_scope(const SearchRequest_t *req, const ldap_serve
     strcat(groupbasedn, basedn);
     /* Set dnscope to exclude passwd or group depending on reqbasedn. */
     scope_init(scope, server->uids, server->gids);
+    scope->files = server->files;
     if (!strends(passwdbasedn, reqbasedn))
         scope->mask &= ~SCOPE_PASSWD;
     if (!strends(groupbasedn, reqbasedn))
         scope->mask &= ~SCOPE_GROUP;
-    return scope_and(scope, Filter_scope(&req->filter, &fscope));
+    return scope_and(scope, filter_scope(filter, &fscope));
 }
 
-/* Check if an AttributeSelection contains an attribute type. */
-static bool AttributeSelection_contains(const AttributeSelection_t *sel, const char *type)
+/* Get the search scope for an equalityMatch filter_t. */
+static scope_t *filter_equal_scope(const filter_t *filter, scope_t *scope)
 {
-    assert(sel);
-    assert(type);
+    assert(filter);
+    assert(scope);
+    const char *value = filter->value;
 
-    for (int i = 0; i < sel->list.count; i++)
-        if (!strcmp((const char *)sel->list.array[i]->buf, type))
-            return true;
-    /* An empty AttributeSelection means select all attributes. */
-    return !sel->list.count;
+    /* Note case-insensitive values are already folded to lowercase. */
+    scope_init(scope, NULL, NULL);
+    switch (filter->id) {
+    case ATTR_OBJECTCLASS:
+        /* Only search the entries that have the objectClass. */
+        scope->mask = (attrmap_hasclass(&attrmap_passwd, value) ? SCOPE_PASSWD : 0)
+            | (attrmap_hasclass(&attrmap_group, value) ? SCOPE_GROUP : 0);
+        break;
+    case ATTR_UID:
+        scope->uid = value;
+        break;
+    case ATTR_UIDNUMBER:
+        scope->uidNumber = value;
+        break;
+    case ATTR_CN:
+        scope->cn = value;
+        break;
+    case ATTR_GIDNUMBER:
+        scope->gidNumber = value;
+        break;
+    case ATTR_MEMBEROF:
+        /* Only passwd entries have a memberOf. */
+        scope->mask = SCOPE_PASSWD;
+        scope->memberOf = value;
+        break;
+    case ATTR_MEMBER:
+        /* Only group entries have a member. */
+        scope->mask = SCOPE_GROUP;
+        break;
+    default:
+        break;
+    }
+    return scope;
 }
 
-/* Check if an AttributeDescription_present matches a SearchResultEntry. */
-static bool AttributeDescription_present(const AttributeDescription_t *present, const SearchResultEntry_t *res)
+/* Get the search scope for a substrings filter_t. */
+static scope_t *filter_substrings_scope(const filter_t *filter, scope_t *scope)
 {
-    return SearchResultEntry_get(res, (const char *)present->buf) != NULL;
-}
+    assert(filter);
+    assert(scope);
+    /* Note case-insensitive values are already folded to lowercase. */
+    const char *prefix = filter->part[0].type == SubstringValue_PR_initial ? filter->part[0].value : NULL;
 
-/* Check if an AttributeValueAssertion is equal to a SearchResultEntry */
-static bool AttributeValueAssertion_equal(const AttributeValueAssertion_t *equal, const SearchResultEntry_t *res)
-{
-    assert(equal);
-    assert(res);
-    const char *name = (const char *)equal->attributeDesc.buf;
-    const char *value = (const char *)equal->assertionValue.buf;
-    const PartialAttribute_t *attr = SearchResultEntry_get(res, name);
-
-    if (attr)
-        for (int i = 0; i < attr->vals.list.count; i++)
-            if (!strcmp((const char *)attr->vals.list.array[i]->buf, value))
-                return true;
-    return false;
+    scope_init(scope, NULL, NULL);
+    switch (filter->id) {
+    case ATTR_UID:
+        scope->uidPrefix = prefix;
+        break;
+    case ATTR_CN:
+        scope->pwcnPrefix = scope->cnPrefix = prefix;
+        break;
+    default:
+        break;
+    }
+    return scope;
 }
 
-/* Get the search scope for an AttributeValueAssertion_equal check. */
-static scope_t *AttributeValueAssertion_equal_scope(const AttributeValueAssertion_t *equal, scope_t *scope)
+/* Get the search scope for a greaterOrEqual or lessOrEqual filter_t. */
+static scope_t *filter_order_scope(const filter_t *filter, scope_t *scope)
 {
-    assert(equal);
+    assert(filter);
     assert(scope);
-    const char *name = (const char *)equal->attributeDesc.buf;
-    const char *value = (const char *)equal->assertionValue.buf;
+    const bool ge = filter->op == Filter_PR_greaterOrEqual;
+    const long num = filter->num;
 
     scope_init(scope, NULL, NULL);
-    if (!strcmp(name, "objectClass")) {
-        if (!strcmp(value, "posixAccount") || !strcmp(value, "shadowAccount"))
-            scope->mask = SCOPE_PASSWD;
-        else if (!strcmp(value, "posixGroup"))
-            scope->mask = SCOPE_GROUP;
-        else
+    switch (filter->id) {
+    case ATTR_UIDNUMBER:
+        /* Only passwd entries have a uidNumber. */
+        scope->mask = SCOPE_PASSWD;
+        if (ge && num > (long)(uid_t)-1)
             scope->mask = 0;
-    } else if (!strcmp(name, "uid")) {
-        scope->uid = value;
-    } else if (!strcmp(name, "uidNumber")) {
-        scope->uidNumber = value;
-    } else if (!strcmp(name, "cn")) {
-        scope->cn = value;
-    } else if (!strcmp(name, "gidNumber")) {
-        scope->gidNumber = value;
+        else if (ge && num > 0)
+            scope->uidMin = num;
+        else if (!ge && num < 0)
+            scope->mask = 0;
+        else if (!ge && num < (long)(uid_t)-1)
+            scope->uidMax = num;
+        break;
+    case ATTR_GIDNUMBER:
+        /* Passwd entries also have a gidNumber, but we only index groups. */
+        if (ge && num > (long)(gid_t)-1)
+            scope->mask &= ~SCOPE_GROUP;
+        else if (ge && num > 0)
+            scope->gidMin = num;
+        else if (!ge && num < 0)
+            scope->mask &= ~SCOPE_GROUP;
+        else if (!ge && num < (long)(gid_t)-1)
+            scope->gidMax = num;
+        break;
+    default:
+        break;
     }
     return scope;
 }
 
-/* Check if a Filter is fully supported. */
-static bool Filter_ok(const Filter_t *filter)
+/* Get the search scope for a filter_t. */
+static scope_t *filter_scope(const filter_t *filter, scope_t *scope)
 {
     assert(filter);
+    assert(scope);
+    scope_t other;
 
-    switch (filter->present) {
+    switch (filter->op) {
     case Filter_PR_and:
-        for (int i = 0; i < filter->choice.And.list.count; i++)
-            if (!Filter_ok(filter->choice.And.list.array[i]))
-                return false;
-        return true;
+        /* Start with everything, so an empty and is true. */
+        scope_init(scope, NULL, NULL);
+        for (int i = 0; i < filter->count; i++)
+            scope_and(scope, filter_scope(&filter->sub[i], &other));
+        return scope;
     case Filter_PR_or:
-        for (int i = 0; i < filter->choice.Or.list.count; i++)
-            if (!Filter_ok(filter->choice.Or.list.array[i]))
-                return false;
-        return true;
+        /* Start with nothing, so an empty or is false. */
+        scope_init(scope, NULL, NULL);
+        scope->mask = 0;
+        for (int i = 0; i < filter->count; i++)
+            scope_or(scope, filter_scope(&filter->sub[i], &other));
+        return scope;
     case Filter_PR_not:
-        return Filter_ok(filter->choice.Not);
+        return scope_not(filter_scope(filter->sub, scope));
     case Filter_PR_equalityMatch:
-    case Filter_PR_present:
-        return true;
+        return filter_equal_scope(filter, scope);
     case Filter_PR_substrings:
+        return filter_substrings_scope(filter, scope);
     case Filter_PR_greaterOrEqual:
     case Filter_PR_lessOrEqual:
+        return filter_order_scope(filter, scope);
+    case Filter_PR_present:
     case Filter_PR_approxMatch:
     case Filter_PR_extensibleMatch:
     default:
-        return false;
+        scope_init(scope, NULL, NULL);
+        return scope;
     }
 }
 
-/* Check if a Filter matches a SearchResultEntry. */
-static bool Filter_matches(const Filter_t *filter, const SearchResultEntry_t *res)
+/* Format a Filter as an RFC4515 string. */
+char *Filter_str(const Filter_t *filter, char *buf, size_t len)
 {
     assert(filter);
-    assert(res);
-    assert(Filter_ok(filter));
+    assert(buf);
+    assert(len);
+    strbuf_t str;
+
+    strbuf_init(&str, buf, len);
+    Filter_fmt(filter, &str, false);
+    return buf;
+}
 
+/* Format a SearchRequest ldap_request's fingerprint for profiling. */
+char *SearchRequest_fingerprint(const ldap_request *request, char *buf, size_t len)
+{
+    assert(request);
+    assert(request->message->protocolOp.present == LDAPMessage__protocolOp_PR_searchRequest);
+    assert(buf);
+    assert(len);
+    static const char *scopes[] = { "base", "one", "sub" };
+    const SearchRequest_t *req = &request->message->protocolOp.choice.searchRequest;
+    const ldap_connection *connection = request->connection;
+    const attr_mask attrs = AttributeSelection_mask(&req->attributes);
+    const char *sep = "";
+    strbuf_t str;
+
+    strbuf_init(&str, buf, len);
+    /* The bind class. */
+    if (connection->binduid == (uid_t)(-1))
+        strbuf_add(&str, "anon ");
+    else
+        strbuf_add(&str, connection->binduid == connection->server->rootuid ? "root " : "user ");
+    strbuf_add(&str, 0 <= req->scope && req->scope <= 2 ? scopes[req->scope] : "?");
+    strbuf_add(&str, " ");
+    /* The selected attributes, with "*" for all the normal ones. */
+    attr_mask rest = attrs;
+    if ((attrs & ~ATTR_VIRTUAL) == (ATTR_ALL & ~ATTR_VIRTUAL)) {
+        strbuf_add(&str, "*");
+        rest &= ATTR_VIRTUAL;
+        sep = ",";
+    }
+    for (attr_id id = 0; id < schema_count; id++)
+        if (rest & ATTR_BIT(id)) {
+            strbuf_add(&str, sep);
+            strbuf_add(&str, schema_name(id));
+            sep = ",";
+        }
+    strbuf_add(&str, attrs ? " " : "1.1 ");
+    Filter_fmt(&req->filter, &str, true);
+    return buf;
+}
+
+/* Append a Filter formatted as an RFC4515 string to a strbuf.
+ *
+ * For a template the assertion values are replaced by '?', except for
+ * objectClass equality values like the filter_cache templates. */
+static void Filter_fmt(const Filter_t *filter, strbuf_t *str, const bool template)
+{
+    assert(filter);
+    assert(str);
+    const SubstringFilter_t *sub;
+
+    strbuf_add(str, "(");
     switch (filter->present) {
     case Filter_PR_and:
+        strbuf_add(str, "&");
         for (int i = 0; i < filter->choice.And.list.count; i++)
-            if (!Filter_matches(filter->choice.And.list.array[i], res))
-                return false;
-        return true;
+            Filter_fmt(filter->choice.And.list.array[i], str, template);
+        break;
     case Filter_PR_or:
+        strbuf_add(str, "|");
         for (int i = 0; i < filter->choice.Or.list.count; i++)
-            if (Filter_matches(filter->choice.Or.list.array[i], res))
-                return true;
-        return false;
+            Filter_fmt(filter->choice.Or.list.array[i], str, template);
+        break;
     case Filter_PR_not:
-        return !Filter_matches(filter->choice.Not, res);
+        strbuf_add(str, "!");
+        Filter_fmt(filter->choice.Not, str, template);
+        break;
     case Filter_PR_equalityMatch:
-        return AttributeValueAssertion_equal(&filter->choice.equalityMatch, res);
-    case Filter_PR_present:
-        return AttributeDescription_present(&filter->choice.present, res);
+        strbuf_addval(str, &filter->choice.equalityMatch.attributeDesc);
+        strbuf_add(str, "=");
+        strbuf_addarg(str, &filter->choice.equalityMatch.assertionValue, template
+                      && schema_id((const char *)filter->choice.equalityMatch.attributeDesc.buf,
+                                   filter->choice.equalityMatch.attributeDesc.size) != ATTR_OBJECTCLASS);
+        break;
     case Filter_PR_substrings:
+        sub = &filter->choice.substrings;
+        strbuf_addval(str, &sub->type);
+        strbuf_add(str, "=");
+        for (int i = 0; i < sub->substrings.list.count; i++) {
+            const SubstringValue_t *v = sub->substrings.list.array[i];
+            if (v->present != SubstringValue_PR_initial)
+                strbuf_add(str, "*");
+            strbuf_addarg(str, &v->choice.any, template);
+        }
+        if (!sub->substrings.list.count
+            || sub->substrings.list.array[sub->substrings.list.count - 1]->present != SubstringValue_PR_final)
+            strbuf_add(str, "*");
+        break;
     case Filter_PR_greaterOrEqual:
+        strbuf_addval(str, &filter->choice.greaterOrEqual.attributeDesc);
+        strbuf_add(str, ">=");
+        strbuf_addarg(str, &filter->choice.greaterOrEqual.assertionValue, template);
+        break;
     case Filter_PR_lessOrEqual:
+        strbuf_addval(str, &filter->choice.lessOrEqual.attributeDesc);
+        strbuf_add(str, "<=");
+        strbuf_addarg(str, &filter->choice.lessOrEqual.assertionValue, template);
+        break;
+    case Filter_PR_present:
+        strbuf_addval(str, &filter->choice.present);
+        strbuf_add(str, "=*");
+        break;
     case Filter_PR_approxMatch:
+        strbuf_addval(str, &filter->choice.approxMatch.attributeDesc);
+        strbuf_add(str, "~=");
+        strbuf_addarg(str, &filter->choice.approxMatch.assertionValue, template);
+        break;
     case Filter_PR_extensibleMatch:
+        if (filter->choice.extensibleMatch.type)
+            strbuf_addval(str, filter->choice.extensibleMatch.type);
+        if (filter->choice.extensibleMatch.dnAttributes && *filter->choice.extensibleMatch.dnAttributes)
+            strbuf_add(str, ":dn");
+        if (filter->choice.extensibleMatch.matchingRule) {
+            strbuf_add(str, ":");
+            strbuf_addval(str, filter->choice.extensibleMatch.matchingRule);
+        }
+        strbuf_add(str, ":=");
+        strbuf_addarg(str, &filter->choice.extensibleMatch.matchValue, template);
+        break;
     default:
-        return false;
+        strbuf_add(str, "?");
     }
+    strbuf_add(str, ")");
 }
 
-static scope_t *Filter_scope(const Filter_t *filter, scope_t *scope)
+/* Initialize a strbuf to an empty string in a buffer. */
+static void strbuf_init(strbuf_t *str, char *buf, size_t len)
 {
-    assert(filter);
-    assert(scope);
-    scope_t other;
+    assert(str);
+    assert(buf);
+    assert(len);
+
+    str->buf = buf;
+    str->len = len;
+    str->pos = 0;
+    buf[0] = '\0';
+}
 
-    switch (filter->present) {
-    case Filter_PR_and:
-        Filter_scope(filter->choice.And.list.array[0], scope);
-        for (int i = 1; i < filter->choice.And.list.count; i++)
-            scope_and(scope, Filter_scope(filter->choice.And.list.array[i], &other));
-        return scope;
-    case Filter_PR_or:
-        Filter_scope(filter->choice.Or.list.array[0], scope);
-        for (int i = 1; i < filter->choice.Or.list.count; i++)
-            scope_or(scope, Filter_scope(filter->choice.Or.list.array[i], &other));
-        return scope;
-    case Filter_PR_not:
-        return scope_not(Filter_scope(filter->choice.Not, scope));
-    case Filter_PR_equalityMatch:
-        return AttributeValueAssertion_equal_scope(&filter->choice.equalityMatch, scope);
-    case Filter_PR_present:
-    case Filter_PR_substrings:
-    case Filter_PR_greaterOrEqual:
-    case Filter_PR_lessOrEqual:
-    case Filter_PR_approxMatch:
-    case Filter_PR_extensibleMatch:
-    default:
-        scope_init(scope, NULL, NULL);
-        return scope;
+/* Append a string to a strbuf, truncating it if it doesn't fit. */
+static void strbuf_add(strbuf_t *str, const char *s)
+{
+    assert(str);
+    assert(s);
+
+    while (*s && str->pos < str->len - 1)
+        str->buf[str->pos++] = *s++;
+    str->buf[str->pos] = '\0';
+}
+
+/* Append an OCTET_STRING value to a strbuf, escaping it for RFC4515. */
+static void strbuf_addval(strbuf_t *str, const OCTET_STRING_t *val)
+{
+    assert(str);
+    assert(val);
+    char esc[4];
+
+    for (int i = 0; i < val->size; i++) {
+        unsigned char c = val->buf[i];
+        if (c < 0x20 || c >= 0x7f || strchr("*()\\", c)) {
+            snprintf(esc, sizeof(esc), "\\%02x", c);
+            strbuf_add(str, esc);
+        } else {
+            esc[0] = c;
+            esc[1] = '\0';
+            strbuf_add(str, esc);
+        }
     }
 }
+
+/* Append an assertion value to a strbuf, or '?' for a template. */
+static void strbuf_addarg(strbuf_t *str, const OCTET_STRING_t *val, const bool template)
+{
+    if (template)
+        strbuf_add(str, "?");
+    else
+        strbuf_addval(str, val);
+}
@@ -7,10 +7,13 @@
 #ifndef LIGHTLDAPD_NSS2LDAP_H
 #define LIGHTLDAPD_NSS2LDAP_H
 #include "ldap_server.h"
+#include "files.h"
+#include "search.h"
 
 #define PWNAME_MAX 32           /**< The max length of a username string. */
 #define STRING_MAX 256          /**< The max length of an LDAPString. */
 #define RESPONSE_MAX 100000     /**< The max results in any response. */
+#define GROUPS_MAX 1024         /**< The max NSS groups of a user for memberOf. */
 
 /** Add the ldap_replies for a BindRequest ldap_request using pam.
  *
@@ -22,4 +25,101 @@ void ldap_request_bind_pam(ldap_request *request);
  * \param request - the ldap_request to add the replies to. */
 void ldap_request_search_nss(ldap_request *request);
 
+/** Add the ldap_replies for a CompareRequest ldap_request using nss.
+ *
+ * \param request - the ldap_request to add the replies to. */
+void ldap_request_compare_nss(ldap_request *request);
+
+/** Check a SASL EXTERNAL authzid is empty or is the exported user with a uid.
+ *
+ * The authzid can be a "dn:" DN or a "u:" username as in RFC4513, and is
+ * looked up in the server's files database if it has one.
+ *
+ * \param *server - the ldap_server.
+ *
+ * \param *authzid - the authzid, or NULL.
+ *
+ * \param uid - the uid of the peer.
+ *
+ * \return true if the peer can bind as the authzid. */
+bool authzid_ok(const ldap_server *server, const OCTET_STRING_t *authzid, uid_t uid);
+
+/* PartialAttribute methods. */
+/** Allocate a PartialAttribute and set its type. */
+PartialAttribute_t *PartialAttribute_new(const char *type);
+/** Add a string value to a PartialAttribute. */
+LDAPString_t *PartialAttribute_add(PartialAttribute_t *attr, const char *value);
+/** Add a formatted value to a PartialAttribute. */
+LDAPString_t *PartialAttribute_addf(PartialAttribute_t *attr, char *format, ...);
+/** Remove all the values from a PartialAttribute. */
+void PartialAttribute_clear(PartialAttribute_t *attr);
+
+/* SearchResultEntry methods. */
+/** Destroy a SearchResultEntry freeing its contents only. */
+#define SearchResultEntry_done(res) ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_SearchResultEntry, res)
+/** Initialize an empty SearchResultEntry. */
+#define SearchResultEntry_init(res) memset(res, 0, sizeof(*res))
+/** Add a PartialAttribute to a SearchResultEntry. */
+PartialAttribute_t *SearchResultEntry_add(SearchResultEntry_t *res, const char *type);
+/** Set a SearchResultEntry from an nss passwd and optional shadow entry.
+ *
+ * Only the attributes in attrs are added, using the attrmap_passwd map, with
+ * only the values in ranges if it is not NULL. */
+void SearchResultEntry_passwd(SearchResultEntry_t *res, const char *basedn, const spwd_t *sp, const passwd_t *pw,
+                              const attr_mask attrs, const attr_ranges *ranges);
+/** Set a SearchResultEntry from an nss group entry.
+ *
+ * Only the attributes in attrs are added, using the attrmap_group map, with
+ * only the values in ranges if it is not NULL. */
+void SearchResultEntry_group(SearchResultEntry_t *res, const char *basedn, const group_t *gr, const attr_mask attrs,
+                             const attr_ranges *ranges);
+/** Add the memberOf group DNs of a passwd entry to a SearchResultEntry.
+ *
+ * This includes the primary group and only the gids exported, using the files
+ * database if it is not NULL or else NSS, and only the values in ranges if it
+ * is not NULL. */
+void SearchResultEntry_memberof(SearchResultEntry_t *res, const char *basedn, const files_db *files,
+                                const ldap_ranges *gids, const passwd_t *pw, const attr_ranges *ranges);
+/** Add the member DNs of a group entry to a SearchResultEntry.
+ *
+ * Only the values in ranges are added if it is not NULL. */
+void SearchResultEntry_member(SearchResultEntry_t *res, const char *basedn, const group_t *gr,
+                              const attr_ranges *ranges);
+/** Check a SearchResultEntry matches a filter and prune it to match selections.
+ *
+ * Attributes without a ";range=" type, which are all their values generated
+ * for the filter, are also pruned to the values in ranges if it is not NULL. */
+bool SearchResultEntry_select(SearchResultEntry_t *res, const filter_t *filter, const attr_mask attrs,
+                              const bool typesOnly, const attr_ranges *ranges);
+
+/** Format a Filter as an RFC4515 filter string.
+ *
+ * The string is truncated if it doesn't fit in the buffer.
+ *
+ * \param *filter - the Filter to format.
+ *
+ * \param *buf - the buffer to put the string into.
+ *
+ * \param len - the size of the buffer.
+ *
+ * \return the buf string. */
+char *Filter_str(const Filter_t *filter, char *buf, size_t len);
+
+/** Format a SearchRequest ldap_request's fingerprint for profiling.
+ *
+ * This is "<bind> <scope> <attrs> <filter>" where bind is "anon", "user", or
+ * "root", scope is "base", "one", or "sub", attrs is the comma separated
+ * attributes selected with "*" for all the normal ones, and filter is the
+ * filter template with the assertion values replaced by '?'. The string is
+ * truncated if it doesn't fit in the buffer.
+ *
+ * \param *request - the SearchRequest ldap_request.
+ *
+ * \param *buf - the buffer to put the string into.
+ *
+ * \param len - the size of the buffer.
+ *
+ * \return the buf string. */
+char *SearchRequest_fingerprint(const ldap_request *request, char *buf, size_t len);
+
 #endif                          /* LIGHTLDAPD_NSS2LDAP_H */
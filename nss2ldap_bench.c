@@ -0,0 +1,507 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * Microbenchmarks for the search, encoding and buffer hot paths.
+ *
+ * Each benchmark times one inner-loop function in isolation over synthetic
+ * passwd and group entries, with all the inputs built before timing starts.
+ * Batches of calls are repeated until BENCH_TIME has elapsed, and the time and
+ * heap allocations per call are reported one benchmark per line in a stable
+ * format suitable for diffing before and after a change.
+ *
+ * Allocations are counted by linking with -Wl,--wrap for the allocation
+ * functions, so only calls made from our code and the asn1c code are counted.
+ */
+
+#include "nss2ldap.h"
+#include <stdio.h>
+
+#define BENCH_TIME 0.5          /**< The min seconds to run each benchmark. */
+#define BENCH_BATCH 16          /**< The initial number of calls per batch. */
+#define BENCH_BASEDN "dc=example,dc=com"        /**< The basedn of entries. */
+#define BENCH_MEMBERS 1000      /**< The number of members of the large group. */
+
+/* Counting allocation wrappers. */
+static unsigned long allocs = 0;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    allocs++;
+    return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n)
+{
+    allocs++;
+    return __real_strndup(s, n);
+}
+
+/** A benchmark function, returning a value to stop it being optimized away. */
+typedef int bench_func(void);
+
+/* The result sink for all benchmarks. */
+static volatile int sink;
+
+/* Run a benchmark and print its results. */
+static void bench(const char *name, bench_func *func)
+{
+    unsigned long n = 0, a;
+    double t, start;
+    int r = 0;
+
+    /* Warm up caches and any lazy initialization. */
+    for (int i = 0; i < BENCH_BATCH; i++)
+        r += func();
+    a = allocs;
+    start = mtime();
+    for (unsigned long batch = BENCH_BATCH; (t = mtime() - start) < BENCH_TIME; batch *= 2) {
+        for (unsigned long i = 0; i < batch; i++)
+            r += func();
+        n += batch;
+    }
+    a = allocs - a;
+    sink = r;
+    printf("%-32s %10lu %12.1f %10.2f\n", name, n, t * 1e9 / n, (double)a / n);
+}
+
+/* The synthetic inputs. */
+static passwd_t pw_user, pw_other;
+static group_t gr_small, gr_large;
+static attr_ranges ranges_large;
+static SearchResultEntry_t res_user, res_other, res_small, res_large;
+static entry_t entry_user, entry_other, entry_small, entry_large;
+static filter_t *filter_lookup, *filter_initgroups, *filter_substrings;
+static attr_mask attrs_lookup;
+static filter_cache cache;
+static LDAPMessage_t msg_lookup, msg_initgroups, msg_substrings, msg_bind, msg_user, msg_large;
+static char ber_lookup[BUFFER_SIZE], ber_bind[BUFFER_SIZE];
+static size_t ber_lookup_len, ber_bind_len;
+static buffer_t buf_recv;
+static response *resp_large;
+static char buf_send[BUFFER_SIZE];
+static ldap_ranges ranges;
+
+/* Set a passwd entry to a synthetic user. */
+static void passwd_set(passwd_t *pw, int n)
+{
+    char s[STRING_MAX];
+
+    snprintf(s, sizeof(s), "user%d", n);
+    pw->pw_name = strdup(s);
+    pw->pw_passwd = "x";
+    pw->pw_uid = 1000 + n;
+    pw->pw_gid = 1000 + n;
+    snprintf(s, sizeof(s), "User %d,Room %d,555-%04d,,", n, n, n);
+    pw->pw_gecos = strdup(s);
+    snprintf(s, sizeof(s), "/home/user%d", n);
+    pw->pw_dir = strdup(s);
+    pw->pw_shell = "/bin/bash";
+}
+
+/* Set a group entry to a synthetic group with n members. */
+static void group_set(group_t *gr, const char *name, int n)
+{
+    char s[STRING_MAX];
+
+    gr->gr_name = (char *)name;
+    gr->gr_passwd = "x";
+    gr->gr_gid = 5000 + n;
+    gr->gr_mem = calloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        snprintf(s, sizeof(s), "user%d", i);
+        gr->gr_mem[i] = strdup(s);
+    }
+}
+
+/* Set a Filter to an equalityMatch. */
+static Filter_t *Filter_eq(Filter_t *f, const char *attr, const char *value)
+{
+    f->present = Filter_PR_equalityMatch;
+    OCTET_STRING_fromString(&f->choice.equalityMatch.attributeDesc, attr);
+    OCTET_STRING_fromString(&f->choice.equalityMatch.assertionValue, value);
+    return f;
+}
+
+/* Add a part to a substrings Filter if the value is not NULL. */
+static void Filter_part(Filter_t *f, SubstringValue_PR type, const char *value)
+{
+    SubstringValue_t *v;
+
+    if (value) {
+        v = XNEW0(SubstringValue_t, 1);
+        v->present = type;
+        OCTET_STRING_fromString(&v->choice.any, value);
+        asn_sequence_add(&f->choice.substrings.substrings.list, v);
+    }
+}
+
+/* Set a Filter to a substrings match with optional initial, any, and final parts. */
+static Filter_t *Filter_substr(Filter_t *f, const char *attr, const char *initial, const char *any, const char *final)
+{
+    f->present = Filter_PR_substrings;
+    OCTET_STRING_fromString(&f->choice.substrings.type, attr);
+    Filter_part(f, SubstringValue_PR_initial, initial);
+    Filter_part(f, SubstringValue_PR_any, any);
+    Filter_part(f, SubstringValue_PR_final, final);
+    return f;
+}
+
+/* Add a new empty sub-Filter to an and/or Filter. */
+static Filter_t *Filter_sub(Filter_t *f)
+{
+    Filter_t *s = XNEW0(Filter_t, 1);
+
+    asn_set_add(f->present == Filter_PR_and ? (void *)&f->choice.And : (void *)&f->choice.Or, s);
+    return s;
+}
+
+/* Set an LDAPMessage to a simple BindRequest. */
+static void LDAPMessage_bind(LDAPMessage_t *msg, const char *dn, const char *pw)
+{
+    BindRequest_t *req = &msg->protocolOp.choice.bindRequest;
+
+    LDAPMessage_init(msg, 1);
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_bindRequest;
+    req->version = 3;
+    OCTET_STRING_fromString(&req->name, dn);
+    req->authentication.present = AuthenticationChoice_PR_simple;
+    OCTET_STRING_fromString(&req->authentication.choice.simple, pw);
+}
+
+/* Set an LDAPMessage to a SearchRequest, returning the Filter to set. */
+static Filter_t *LDAPMessage_search(LDAPMessage_t *msg, const char **attrs)
+{
+    SearchRequest_t *req = &msg->protocolOp.choice.searchRequest;
+
+    LDAPMessage_init(msg, 2);
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchRequest;
+    OCTET_STRING_fromString(&req->baseObject, BENCH_BASEDN);
+    req->scope = SearchRequest__scope_wholeSubtree;
+    for (; *attrs; attrs++)
+        asn_sequence_add(&req->attributes.list, LDAPString_new(*attrs));
+    return &req->filter;
+}
+
+/* Set an LDAPMessage to a SearchResultEntry copied from an entry. */
+static void LDAPMessage_entry(LDAPMessage_t *msg, SearchResultEntry_t *res)
+{
+    LDAPMessage_init(msg, 2);
+    msg->protocolOp.present = LDAPMessage__protocolOp_PR_searchResEntry;
+    msg->protocolOp.choice.searchResEntry = *res;
+}
+
+/* Encode an LDAPMessage into a buffer, returning the encoded length. */
+static size_t LDAPMessage_encode(LDAPMessage_t *msg, char *buf)
+{
+    asn_enc_rval_t rencode = der_encode_to_buffer(&asn_DEF_LDAPMessage, msg, buf, BUFFER_SIZE);
+
+    if (rencode.encoded < 0)
+        lerrx(EX_SOFTWARE, "encoding %s failed", LDAPMessage_name(msg));
+    return rencode.encoded;
+}
+
+/* Build all the benchmark inputs. */
+static void bench_init(void)
+{
+    /* The attributes nslcd requests for passwd and group lookups. */
+    static const char *pwattrs[] = { "uid", "userPassword", "uidNumber", "gidNumber", "cn", "homeDirectory",
+        "loginShell", "gecos", "objectClass", NULL
+    };
+    static const char *grattrs[] = { "gidNumber", NULL };
+    Filter_t *f;
+
+    passwd_set(&pw_user, 500);
+    passwd_set(&pw_other, 501);
+    group_set(&gr_small, "small", 3);
+    group_set(&gr_large, "large", BENCH_MEMBERS);
+    SearchResultEntry_passwd(&res_user, BENCH_BASEDN, NULL, &pw_user, ATTR_ALL, NULL);
+    SearchResultEntry_passwd(&res_other, BENCH_BASEDN, NULL, &pw_other, ATTR_ALL, NULL);
+    SearchResultEntry_group(&res_small, BENCH_BASEDN, &gr_small, ATTR_ALL, NULL);
+    SearchResultEntry_group(&res_large, BENCH_BASEDN, &gr_large, ATTR_ALL, NULL);
+    /* memberUid;range=0-99 */
+    ranges_large.ranged = ATTR_BIT(ATTR_MEMBERUID);
+    attr_ranges_all(&ranges_large, ~ATTR_BIT(ATTR_MEMBERUID));
+    ranges_large.range[ATTR_MEMBERUID] = (attr_range) { 0, 99 };
+    /* (&(objectClass=posixAccount)(uid=user500)) */
+    f = LDAPMessage_search(&msg_lookup, pwattrs);
+    f->present = Filter_PR_and;
+    Filter_eq(Filter_sub(f), "objectClass", "posixAccount");
+    Filter_eq(Filter_sub(f), "uid", "user500");
+    /* (&(objectClass=posixGroup)(|(memberUid=user999)(member=uid=user999,...))) */
+    f = LDAPMessage_search(&msg_initgroups, grattrs);
+    f->present = Filter_PR_and;
+    Filter_eq(Filter_sub(f), "objectClass", "posixGroup");
+    f = Filter_sub(f);
+    f->present = Filter_PR_or;
+    Filter_eq(Filter_sub(f), "memberUid", "user999");
+    Filter_eq(Filter_sub(f), "member", "uid=user999,ou=people," BENCH_BASEDN);
+    /* (|(uid=user6*)(cn=*Room 50*)) */
+    f = LDAPMessage_search(&msg_substrings, pwattrs);
+    f->present = Filter_PR_or;
+    Filter_substr(Filter_sub(f), "uid", "user6", NULL, NULL);
+    Filter_substr(Filter_sub(f), "cn", NULL, "Room 50", NULL);
+    LDAPMessage_bind(&msg_bind, "uid=user500,ou=people," BENCH_BASEDN, "secret");
+    filter_lookup = filter_new(&msg_lookup.protocolOp.choice.searchRequest.filter);
+    filter_initgroups = filter_new(&msg_initgroups.protocolOp.choice.searchRequest.filter);
+    filter_substrings = filter_new(&msg_substrings.protocolOp.choice.searchRequest.filter);
+    filter_cache_init(&cache);
+    attrs_lookup = AttributeSelection_mask(&msg_lookup.protocolOp.choice.searchRequest.attributes);
+    entry_init(&entry_user, &res_user);
+    entry_init(&entry_other, &res_other);
+    entry_init(&entry_small, &res_small);
+    entry_init(&entry_large, &res_large);
+    ber_lookup_len = LDAPMessage_encode(&msg_lookup, ber_lookup);
+    ber_bind_len = LDAPMessage_encode(&msg_bind, ber_bind);
+    /* The entry messages share the entries, so are never freed. */
+    LDAPMessage_entry(&msg_user, &res_user);
+    LDAPMessage_entry(&msg_large, &res_large);
+    resp_large = response_new(0);
+    if (!response_addmsg(resp_large, (unsigned char *)buf_send, LDAPMessage_encode(&msg_large, buf_send)))
+        lerrx(EX_SOFTWARE, "invalid response");
+    /* A receive buffer with a few requests queued. */
+    buffer_init(&buf_recv);
+    buffer_fill(&buf_recv, 4 * ber_lookup_len);
+    if (!ldap_ranges_init(&ranges, "1000-29999,30001-60000"))
+        lerrx(EX_SOFTWARE, "invalid ranges");
+}
+
+static int bench_filter_new(void)
+{
+    filter_t *f = filter_new(&msg_lookup.protocolOp.choice.searchRequest.filter);
+
+    filter_free(f);
+    return f != NULL;
+}
+
+static int bench_filter_cache_get(void)
+{
+    filter_t *f = filter_cache_get(&cache, &msg_lookup.protocolOp.choice.searchRequest.filter);
+
+    filter_free(f);
+    return f != NULL;
+}
+
+static int bench_entry_init(void)
+{
+    entry_t entry;
+
+    entry_init(&entry, &res_user);
+    return entry.attr[ATTR_UID] != NULL;
+}
+
+static int bench_filter_matches_lookup_hit(void)
+{
+    return filter_matches(filter_lookup, &entry_user);
+}
+
+static int bench_filter_matches_lookup_miss(void)
+{
+    return filter_matches(filter_lookup, &entry_other);
+}
+
+static int bench_filter_matches_initgroups_small(void)
+{
+    return filter_matches(filter_initgroups, &entry_small);
+}
+
+static int bench_filter_matches_initgroups_large(void)
+{
+    return filter_matches(filter_initgroups, &entry_large);
+}
+
+static int bench_filter_matches_substrings_miss(void)
+{
+    return filter_matches(filter_substrings, &entry_other);
+}
+
+/* Note the entry benchmarks include freeing the entry. */
+static int bench_SearchResultEntry_passwd(void)
+{
+    SearchResultEntry_t res;
+
+    SearchResultEntry_init(&res);
+    SearchResultEntry_passwd(&res, BENCH_BASEDN, NULL, &pw_user, ATTR_ALL, NULL);
+    int n = res.attributes.list.count;
+    SearchResultEntry_done(&res);
+    return n;
+}
+
+/* Only generating the selected attributes, like for an initgroups search. */
+static int bench_SearchResultEntry_passwd_gidNumber(void)
+{
+    SearchResultEntry_t res;
+
+    SearchResultEntry_init(&res);
+    SearchResultEntry_passwd(&res, BENCH_BASEDN, NULL, &pw_user, ATTR_BIT(ATTR_GIDNUMBER), NULL);
+    int n = res.attributes.list.count;
+    SearchResultEntry_done(&res);
+    return n;
+}
+
+static int bench_SearchResultEntry_group_small(void)
+{
+    SearchResultEntry_t res;
+
+    SearchResultEntry_init(&res);
+    SearchResultEntry_group(&res, BENCH_BASEDN, &gr_small, ATTR_ALL, NULL);
+    int n = res.attributes.list.count;
+    SearchResultEntry_done(&res);
+    return n;
+}
+
+static int bench_SearchResultEntry_group_large(void)
+{
+    SearchResultEntry_t res;
+
+    SearchResultEntry_init(&res);
+    SearchResultEntry_group(&res, BENCH_BASEDN, &gr_large, ATTR_ALL, NULL);
+    int n = res.attributes.list.count;
+    SearchResultEntry_done(&res);
+    return n;
+}
+
+static int bench_SearchResultEntry_group_large_range(void)
+{
+    SearchResultEntry_t res;
+
+    SearchResultEntry_init(&res);
+    SearchResultEntry_group(&res, BENCH_BASEDN, &gr_large, ATTR_ALL, &ranges_large);
+    int n = res.attributes.list.count;
+    SearchResultEntry_done(&res);
+    return n;
+}
+
+/* This selects all the entry attributes, so it doesn't modify the entry. */
+static int bench_SearchResultEntry_select(void)
+{
+    return SearchResultEntry_select(&res_user, filter_lookup, attrs_lookup, false, NULL);
+}
+
+static int bench_der_encode_passwd(void)
+{
+    return LDAPMessage_encode(&msg_user, buf_send);
+}
+
+static int bench_der_encode_group_large(void)
+{
+    return LDAPMessage_encode(&msg_large, buf_send);
+}
+
+/* Sending a cached response only rewrites the messageID. */
+static int bench_response_getmsg_group_large(void)
+{
+    size_t pos = 0;
+
+    return response_getmsg(resp_large, &pos, 42, (unsigned char *)buf_send, sizeof(buf_send));
+}
+
+static int bench_ber_decode_search(void)
+{
+    LDAPMessage_t *msg = NULL;
+    asn_dec_rval_t rdecode = ber_decode(NULL, &asn_DEF_LDAPMessage, (void **)&msg, ber_lookup, ber_lookup_len);
+
+    LDAPMessage_free(msg);
+    return rdecode.consumed;
+}
+
+static int bench_ber_decode_bind(void)
+{
+    LDAPMessage_t *msg = NULL;
+    asn_dec_rval_t rdecode = ber_decode(NULL, &asn_DEF_LDAPMessage, (void **)&msg, ber_bind, ber_bind_len);
+
+    LDAPMessage_free(msg);
+    return rdecode.consumed;
+}
+
+/* Our decoder with a warm arena pool shouldn't allocate. */
+static int bench_ber_decode_request_search(void)
+{
+    static ber_pool pool;
+    ber_arena *arena;
+    size_t consumed = 0;
+
+    ber_decode_request(&pool, ber_lookup, ber_lookup_len, BUFFER_SIZE, &arena, &consumed);
+    ber_arena_free(&pool, arena);
+    return consumed;
+}
+
+static int bench_ber_decode_request_bind(void)
+{
+    static ber_pool pool;
+    ber_arena *arena;
+    size_t consumed = 0;
+
+    ber_decode_request(&pool, ber_bind, ber_bind_len, BUFFER_SIZE, &arena, &consumed);
+    ber_arena_free(&pool, arena);
+    return consumed;
+}
+
+/* Toss a request from the front of the buffer and receive another. */
+static int bench_buffer_toss(void)
+{
+    buffer_toss(&buf_recv, ber_lookup_len);
+    buffer_fill(&buf_recv, ber_lookup_len);
+    return buf_recv.len;
+}
+
+static int bench_ldap_ranges_ismatch(void)
+{
+    static uid_t id = 0;
+
+    return ldap_ranges_ismatch(&ranges, id++ & 0xffff);
+}
+
+int main(int argc, char **argv)
+{
+    bench_init();
+    printf("%-32s %10s %12s %10s\n", "benchmark", "ops", "ns/op", "allocs/op");
+    bench("filter_new", bench_filter_new);
+    bench("filter_cache_get", bench_filter_cache_get);
+    bench("entry_init", bench_entry_init);
+    bench("filter_matches/lookup_hit", bench_filter_matches_lookup_hit);
+    bench("filter_matches/lookup_miss", bench_filter_matches_lookup_miss);
+    bench("filter_matches/initgroups_small", bench_filter_matches_initgroups_small);
+    bench("filter_matches/initgroups_large", bench_filter_matches_initgroups_large);
+    bench("filter_matches/substrings_miss", bench_filter_matches_substrings_miss);
+    bench("SearchResultEntry_passwd", bench_SearchResultEntry_passwd);
+    bench("SearchResultEntry_passwd/gidNumber", bench_SearchResultEntry_passwd_gidNumber);
+    bench("SearchResultEntry_group/small", bench_SearchResultEntry_group_small);
+    bench("SearchResultEntry_group/large", bench_SearchResultEntry_group_large);
+    bench("SearchResultEntry_group/large/range", bench_SearchResultEntry_group_large_range);
+    bench("SearchResultEntry_select", bench_SearchResultEntry_select);
+    bench("der_encode_to_buffer/passwd", bench_der_encode_passwd);
+    bench("der_encode_to_buffer/group_large", bench_der_encode_group_large);
+    bench("response_getmsg/group_large", bench_response_getmsg_group_large);
+    bench("ber_decode/search", bench_ber_decode_search);
+    bench("ber_decode/bind", bench_ber_decode_bind);
+    bench("ber_decode_request/search", bench_ber_decode_request_search);
+    bench("ber_decode_request/bind", bench_ber_decode_request_bind);
+    bench("buffer_toss", bench_buffer_toss);
+    bench("ldap_ranges_ismatch", bench_ldap_ranges_ismatch);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "nss2ldap.h"
+
+static char dir[] = "/tmp/nss2ldap_test.XXXXXX";
+
+static void write_file(const char *name, const char *data)
+{
+    char path[256];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    assert((f = fopen(path, "w")));
+    fputs(data, f);
+    assert(!fclose(f));
+}
+
+static void remove_file(const char *name)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    assert(!unlink(path));
+}
+
+/* Check an authzid string. */
+static bool authzid(const ldap_server *server, const char *id, uid_t uid)
+{
+    OCTET_STRING_t s = {.buf = (uint8_t *)id,.size = strlen(id) };
+
+    return authzid_ok(server, &s, uid);
+}
+
+int main(void)
+{
+    ldap_server server = {.basedn = "dc=example,dc=com" };
+    ldap_ranges uids;
+    files_db files;
+
+    /* Users that only exist in the files database, one outside the uids. */
+    assert(mkdtemp(dir));
+    write_file("passwd", "alice:x:91000:91000::/home/alice:/bin/sh\nsvc:x:500:500::/:/bin/false\n");
+    write_file("group", "alice:x:91000:\n");
+    assert(!files_db_init(&files, dir));
+    assert(ldap_ranges_init(&uids, "1000-99999"));
+    server.files = &files;
+    server.uids = &uids;
+
+    /* An empty authzid is the peer itself. */
+    assert(authzid_ok(&server, NULL, 91000));
+    assert(authzid(&server, "", 91000));
+    /* Users are looked up in the files database with -F. */
+    assert(authzid(&server, "u:alice", 91000));
+    assert(authzid(&server, "dn:uid=alice,ou=people,dc=example,dc=com", 91000));
+    assert(!authzid(&server, "u:alice", 91001));
+    assert(!authzid(&server, "dn:uid=alice,ou=people,dc=other,dc=com", 91000));
+    assert(!authzid(&server, "u:nobody", 91000));
+    assert(!authzid(&server, "alice", 91000));
+    /* Users outside the exported uids can't be used. */
+    assert(!authzid(&server, "u:svc", 500));
+
+    files_db_done(&files);
+    remove_file("passwd");
+    remove_file("group");
+    assert(!rmdir(dir));
+    return 0;
+}
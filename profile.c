@@ -0,0 +1,93 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "profile.h"
+#include "utils.h"
+
+/* Get the FNV-1a hash of a key. */
+static uint32_t profile_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h;
+}
+
+void profile_table_init(profile_table *table)
+{
+    assert(table);
+
+    memset(table, 0, sizeof(*table));
+}
+
+profile_entry *profile_add(profile_table *table, const char *key, unsigned long scanned, unsigned long returned,
+                           uint64_t bytes, uint64_t usecs)
+{
+    assert(table);
+    assert(key);
+    char k[PROFILE_KEY_MAX];
+    profile_entry *e = NULL, *low = NULL;
+    unsigned long count = 0;
+    uint32_t hash;
+
+    snprintf(k, sizeof(k), "%s", key);
+    hash = profile_hash(k);
+    table->total++;
+    for (int i = 0; i < table->count && !e; i++) {
+        profile_entry *p = &table->entry[i];
+        if (p->hash == hash && !strcmp(p->key, k))
+            e = p;
+        else if (!low || p->count < low->count)
+            low = p;
+    }
+    if (!e) {
+        /* Use a free entry, or replace the lowest count taking over its count. */
+        if (table->count < PROFILE_SIZE) {
+            e = &table->entry[table->count++];
+        } else {
+            e = low;
+            count = low->count;
+        }
+        memset(e, 0, sizeof(*e));
+        strcpy(e->key, k);
+        e->hash = hash;
+        e->count = e->error = count;
+    }
+    e->count++;
+    e->scanned += scanned;
+    e->returned += returned;
+    e->bytes += bytes;
+    histogram_add(&e->latency, usecs);
+    return e;
+}
+
+/* Get the value of an entry to sort by. */
+static uint64_t profile_value(const profile_entry *e, profile_order order)
+{
+    return order == PROFILE_BYCOUNT ? e->count : e->latency.sum;
+}
+
+int profile_top(const profile_table *table, profile_order order, const profile_entry **top, int n)
+{
+    assert(table);
+    assert(top);
+    int count = 0;
+
+    /* Insertion sort the entries into top, keeping only the first n. */
+    for (int i = 0; i < table->count; i++) {
+        const profile_entry *e = &table->entry[i];
+        uint64_t v = profile_value(e, order);
+        int j = min(count, n - 1);
+        if (j < 0 || (count == n && profile_value(top[j], order) >= v))
+            continue;
+        for (; j > 0 && profile_value(top[j - 1], order) < v; j--)
+            top[j] = top[j - 1];
+        top[j] = e;
+        if (count < n)
+            count++;
+    }
+    return count;
+}
@@ -0,0 +1,89 @@
+/** \file profile.h
+ * A heavy-hitters profile of search request fingerprints.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * Each completed search has a fingerprint key of its bind class, scope,
+ * selected attributes, and filter template with the assertion values
+ * replaced by '?'. A profile_table keeps counters and a latency histogram for
+ * up to PROFILE_SIZE fingerprints using the Space-Saving algorithm. When the
+ * table is full a new fingerprint replaces the one with the lowest count,
+ * taking over its count plus one, and remembers that as its error. So any
+ * fingerprint seen more than total/PROFILE_SIZE times is always kept, and
+ * its count is at most error too high. The other counters only include the
+ * searches since the fingerprint was added.
+ *
+ * The entries scanned versus returned shows which searches are not resolved
+ * to an index or a specific entry and scan everything. */
+#ifndef LIGHTLDAPD_PROFILE_H
+#define LIGHTLDAPD_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+#define PROFILE_SIZE 64         /**< The number of fingerprints kept. */
+#define PROFILE_KEY_MAX 256     /**< The max key length including the '\0'. */
+#define PROFILE_TOP 10          /**< The number of fingerprints in the stats. */
+
+/** The profile_entry class for a fingerprint's counters. */
+typedef struct {
+    char key[PROFILE_KEY_MAX];  /**< The fingerprint key. */
+    uint32_t hash;              /**< The hash of the key. */
+    unsigned long count;        /**< The estimated searches with this key. */
+    unsigned long error;        /**< The max overestimate of count. */
+    unsigned long scanned;      /**< The entries scanned. */
+    unsigned long returned;     /**< The entries returned. */
+    uint64_t bytes;             /**< The bytes of replies sent. */
+    histogram_t latency;        /**< The latency in microseconds. */
+} profile_entry;
+
+/** The profile_order for sorting the top entries. */
+typedef enum {
+    PROFILE_BYCOUNT,            /**< Sort by the count. */
+    PROFILE_BYTIME              /**< Sort by the total latency. */
+} profile_order;
+
+/** The profile_table class. */
+typedef struct {
+    profile_entry entry[PROFILE_SIZE];  /**< The fingerprint entries. */
+    int count;                  /**< The number of entries used. */
+    unsigned long total;        /**< The number of searches added. */
+} profile_table;
+/** Initialize an empty profile_table. */
+void profile_table_init(profile_table *table);
+
+/** Add a completed search to a profile_table.
+ *
+ * \param table - The profile_table to add to.
+ *
+ * \param key - The fingerprint key, truncated to PROFILE_KEY_MAX.
+ *
+ * \param scanned - The entries scanned.
+ *
+ * \param returned - The entries returned.
+ *
+ * \param bytes - The bytes of replies sent.
+ *
+ * \param usecs - The latency in microseconds.
+ *
+ * \return The profile_entry for the key. */
+profile_entry *profile_add(profile_table *table, const char *key, unsigned long scanned, unsigned long returned,
+                           uint64_t bytes, uint64_t usecs);
+
+/** Get the top entries in a profile_table.
+ *
+ * \param table - The profile_table to get the entries from.
+ *
+ * \param order - The order to sort the entries by.
+ *
+ * \param top - The array to put the top entries in, largest first.
+ *
+ * \param n - The max number of entries to get.
+ *
+ * \return The number of entries put in top. */
+int profile_top(const profile_table *table, profile_order order, const profile_entry **top, int n);
+
+#endif                          /* LIGHTLDAPD_PROFILE_H */
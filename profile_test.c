@@ -0,0 +1,60 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "profile.h"
+
+int main(void)
+{
+    profile_table t;
+    const profile_entry *top[PROFILE_TOP];
+    profile_entry *e;
+    char key[PROFILE_KEY_MAX + 10];
+
+    profile_table_init(&t);
+    assert(profile_top(&t, PROFILE_BYCOUNT, top, PROFILE_TOP) == 0);
+    /* Counters are added for each key. */
+    e = profile_add(&t, "anon sub * (uid=?)", 100, 1, 300, 1000);
+    assert(profile_add(&t, "anon sub * (uid=?)", 100, 0, 50, 3000) == e);
+    assert(e->count == 2 && e->error == 0 && e->scanned == 200 && e->returned == 1 && e->bytes == 350);
+    assert(e->latency.count == 2 && e->latency.sum == 4000);
+    for (int i = 0; i < 5; i++)
+        profile_add(&t, "user sub gidNumber (&(objectClass=posixGroup)(memberUid=?))", 1, 2, 10, 100);
+    profile_add(&t, "root base * (objectClass=*)", 1, 1, 10, 10000);
+    assert(t.count == 3 && t.total == 8);
+    /* The top entries are sorted by count or total latency. */
+    assert(profile_top(&t, PROFILE_BYCOUNT, top, PROFILE_TOP) == 3);
+    assert(top[0]->count == 5 && top[1] == e && top[2]->count == 1);
+    assert(profile_top(&t, PROFILE_BYTIME, top, 2) == 2);
+    assert(!strcmp(top[0]->key, "root base * (objectClass=*)") && top[1] == e);
+    assert(profile_top(&t, PROFILE_BYCOUNT, top, 0) == 0);
+    /* Long keys are truncated, and still match. */
+    memset(key, 'x', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    e = profile_add(&t, key, 0, 0, 0, 0);
+    assert(strlen(e->key) == PROFILE_KEY_MAX - 1);
+    assert(profile_add(&t, key, 0, 0, 0, 0) == e && e->count == 2);
+
+    /* When full, new keys replace the lowest count taking over its count. */
+    profile_table_init(&t);
+    for (int i = 0; i < PROFILE_SIZE; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        for (int j = 0; j <= i; j++)
+            profile_add(&t, key, 1, 1, 1, 1);
+    }
+    assert(t.count == PROFILE_SIZE);
+    e = profile_add(&t, "new", 5, 0, 0, 1);
+    assert(!strcmp(t.entry[0].key, "new") && e == &t.entry[0]);
+    assert(e->count == 2 && e->error == 1 && e->scanned == 5 && e->latency.count == 1);
+    /* A frequent key is never replaced. */
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "rare%d", i);
+        profile_add(&t, key, 0, 0, 0, 0);
+        profile_add(&t, "frequent", 0, 0, 0, 0);
+    }
+    assert(profile_top(&t, PROFILE_BYCOUNT, top, 1) == 1);
+    assert(!strcmp(top[0]->key, "frequent") && top[0]->count - top[0]->error >= 1000);
+    assert(t.count == PROFILE_SIZE);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "quota.h"
+#include "utils.h"
+
+#define ENTRY quota
+#include "dlist.h"
+
+/* Get the FNV-1a hash of a key. */
+static uint32_t quota_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h;
+}
+
+void quota_table_init(quota_table *table)
+{
+    assert(table);
+
+    memset(table, 0, sizeof(*table));
+}
+
+void quota_table_done(quota_table *table)
+{
+    assert(table);
+    quota *q;
+
+    while ((q = table->lru)) {
+        quota_rem(&table->lru, q);
+        free(q);
+    }
+    memset(table->table, 0, sizeof(table->table));
+    table->count = 0;
+}
+
+bool quota_table_set(quota_table *table, const char *s)
+{
+    assert(table);
+    assert(s);
+    double rate[QUOTA_TYPES];
+    char *end;
+
+    for (int i = 0; i < QUOTA_TYPES; i++) {
+        rate[i] = strtod(s, &end);
+        if (end == s || rate[i] < 0 || *end != (i < QUOTA_TYPES - 1 ? ',' : '\0'))
+            return false;
+        s = end + 1;
+    }
+    memcpy(table->rate, rate, sizeof(rate));
+    return true;
+}
+
+/* Find the quota for a key, optionally adding a new one.
+ *
+ * A found or added quota is moved to the end of the LRU as the most recently
+ * used. When the table is full the least recently used quota is reused. */
+static quota *quota_get(quota_table *table, const char *key, bool add, double now)
+{
+    uint32_t hash = quota_hash(key);
+    quota *q, **h;
+
+    for (q = table->table[hash % QUOTA_SIZE]; q; q = q->hnext)
+        if (q->hash == hash && !strcmp(q->key, key))
+            break;
+    if (!q && !add)
+        return NULL;
+    if (q) {
+        quota_rem(&table->lru, q);
+    } else {
+        if (table->count < QUOTA_MAX) {
+            q = XNEW(quota, 1);
+            table->count++;
+        } else {
+            /* Reuse the oldest quota, removing it from its hash chain. */
+            q = table->lru;
+            for (h = &table->table[q->hash % QUOTA_SIZE]; *h != q; h = &(*h)->hnext) ;
+            *h = q->hnext;
+            quota_rem(&table->lru, q);
+        }
+        memset(q, 0, sizeof(*q));
+        q->hash = hash;
+        strncpy(q->key, key, QUOTA_KEY_MAX - 1);
+        q->time = now;
+        for (int i = 0; i < QUOTA_TYPES; i++)
+            q->tokens[i] = table->rate[i] * QUOTA_BURST;
+        q->hnext = table->table[hash % QUOTA_SIZE];
+        table->table[hash % QUOTA_SIZE] = q;
+    }
+    quota_add(&table->lru, q);
+    return q;
+}
+
+/* Get the "user@ip" key for tracking failed binds. */
+static char *quota_userkey(const char *user, const char *ip, char *key)
+{
+    snprintf(key, QUOTA_KEY_MAX, "%s@%s", user, ip);
+    return key;
+}
+
+bool quota_take(quota_table *table, const char *ip, quota_type type, double now)
+{
+    assert(table);
+    assert(ip);
+    assert(0 <= type && type < QUOTA_TYPES);
+    quota *q;
+
+    if (!table->rate[type])
+        return true;
+    q = quota_get(table, ip, true, now);
+    /* Refill all the buckets for the time since they were last refilled. */
+    for (int i = 0; i < QUOTA_TYPES; i++)
+        q->tokens[i] = min(q->tokens[i] + (now - q->time) * table->rate[i], table->rate[i] * QUOTA_BURST);
+    q->time = now;
+    if (q->tokens[type] < 1.0) {
+        table->rejected[type]++;
+        return false;
+    }
+    q->tokens[type] -= 1.0;
+    return true;
+}
+
+bool quota_isblocked(quota_table *table, const char *user, const char *ip, double now)
+{
+    assert(table);
+    assert(user);
+    assert(ip);
+    char key[QUOTA_KEY_MAX];
+    quota *q = quota_get(table, quota_userkey(user, ip, key), false, now);
+
+    if (q && now < q->blocked) {
+        table->blocked++;
+        return true;
+    }
+    return false;
+}
+
+void quota_bindresult(quota_table *table, const char *user, const char *ip, bool ok, double now)
+{
+    assert(table);
+    assert(user);
+    assert(ip);
+    char key[QUOTA_KEY_MAX];
+    quota *q = quota_get(table, quota_userkey(user, ip, key), !ok, now);
+
+    if (ok) {
+        if (q)
+            q->fails = 0;
+        return;
+    }
+    if (now - q->failtime > QUOTA_FAILS_AGE)
+        q->fails = 0;
+    q->fails++;
+    q->failtime = now;
+    /* Double the penalty for every failure after the free ones. */
+    if (q->fails > QUOTA_FAILS_FREE)
+        q->blocked = now + min(QUOTA_PENALTY * (1 << min(q->fails - QUOTA_FAILS_FREE - 1, 16)), QUOTA_PENALTY_MAX);
+}
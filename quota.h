@@ -0,0 +1,83 @@
+/** \file quota.h
+ * Per-client token bucket quotas and failed bind tracking.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * A quota_table keeps a quota for each recently seen key in a hash table with
+ * an LRU for aging. A client ip key has a token bucket for each quota_type
+ * that refills at the type's rate up to a burst of QUOTA_BURST seconds worth
+ * of tokens, and each request takes a token. A "user@ip" key tracks the
+ * failed binds for a user from a client, and after QUOTA_FAILS_FREE failures
+ * binds are blocked for a penalty time that doubles with each further
+ * failure up to QUOTA_PENALTY_MAX. A successful bind clears the failures.
+ *
+ * When the table is full the least recently used quota is reused. An idle
+ * quota has full buckets and no recent failures so forgetting it loses
+ * nothing, and only a flood of more than QUOTA_MAX distinct keys can push
+ * out a quota that is still limiting a client. */
+#ifndef LIGHTLDAPD_QUOTA_H
+#define LIGHTLDAPD_QUOTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define QUOTA_SIZE 1024         /**< The quota hash table size. */
+#define QUOTA_MAX 4096          /**< The max number of quotas kept. */
+#define QUOTA_KEY_MAX 80        /**< The max key length including the '\0'. */
+#define QUOTA_BURST 5.0         /**< The bucket size in seconds of the rate. */
+#define QUOTA_FAILS_FREE 3      /**< The failed binds allowed without penalty. */
+#define QUOTA_PENALTY 1.0       /**< The first failed bind penalty in seconds. */
+#define QUOTA_PENALTY_MAX 300.0 /**< The max failed bind penalty in seconds. */
+#define QUOTA_FAILS_AGE 900.0   /**< Seconds after which failures are forgotten. */
+
+/** The quota types with a token bucket per client. */
+typedef enum {
+    QUOTA_CONNECT,              /**< New connections. */
+    QUOTA_BIND,                 /**< Bind requests. */
+    QUOTA_SEARCH,               /**< Search requests. */
+    QUOTA_TYPES                 /**< The number of quota types. */
+} quota_type;
+
+/** The quota class for a key. */
+typedef struct quota quota;
+struct quota {
+    quota *next, *prev;         /**< The LRU dlist pointers. */
+    quota *hnext;               /**< The next in the hash table chain. */
+    uint32_t hash;              /**< The hash of the key. */
+    char key[QUOTA_KEY_MAX];    /**< The client ip or "user@ip" key. */
+    double time;                /**< When the buckets were last refilled. */
+    double tokens[QUOTA_TYPES]; /**< The tokens left in each bucket. */
+    int fails;                  /**< The number of failed binds. */
+    double failtime;            /**< When the last bind failed. */
+    double blocked;             /**< When binds are blocked until. */
+};
+
+/** The quota_table class. */
+typedef struct {
+    quota *lru;                 /**< The LRU dlist with the oldest first. */
+    quota *table[QUOTA_SIZE];   /**< The hash table. */
+    int count;                  /**< The number of quotas. */
+    double rate[QUOTA_TYPES];   /**< The per second rates, 0 for unlimited. */
+    unsigned long rejected[QUOTA_TYPES];        /**< The rejected counters. */
+    unsigned long blocked;      /**< The blocked binds counter. */
+} quota_table;
+/** Initialize an empty quota_table with no limits. */
+void quota_table_init(quota_table *table);
+/** Destroy a quota_table freeing all the quotas. */
+void quota_table_done(quota_table *table);
+/** Set the quota_table rates from a "connects,binds,searches" string.
+ *
+ * \return false if the string is invalid. */
+bool quota_table_set(quota_table *table, const char *s);
+/** Take a token for a request type from a client's bucket.
+ *
+ * \return false if the client is over quota. */
+bool quota_take(quota_table *table, const char *ip, quota_type type, double now);
+/** Check if binds for a user from a client are blocked by failures. */
+bool quota_isblocked(quota_table *table, const char *user, const char *ip, double now);
+/** Record a bind result for a user from a client. */
+void quota_bindresult(quota_table *table, const char *user, const char *ip, bool ok, double now);
+
+#endif                          /* LIGHTLDAPD_QUOTA_H */
@@ -0,0 +1,93 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include "quota.h"
+
+int main(void)
+{
+    quota_table t;
+    char ip[32];
+
+    quota_table_init(&t);
+    assert(!quota_table_set(&t, ""));
+    assert(!quota_table_set(&t, "1,2"));
+    assert(!quota_table_set(&t, "1,2,3,4"));
+    assert(!quota_table_set(&t, "1,-2,3"));
+    assert(!quota_table_set(&t, "1,a,3"));
+    /* Unlimited types don't add quotas. */
+    assert(quota_table_set(&t, "0,1,0.5"));
+    assert(t.rate[QUOTA_CONNECT] == 0 && t.rate[QUOTA_BIND] == 1 && t.rate[QUOTA_SEARCH] == 0.5);
+    for (int i = 0; i < 100; i++)
+        assert(quota_take(&t, "10.0.0.1", QUOTA_CONNECT, 0.0));
+    assert(t.count == 0);
+    /* Buckets start with a burst of tokens. */
+    for (int i = 0; i < 5; i++)
+        assert(quota_take(&t, "10.0.0.1", QUOTA_BIND, 0.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_BIND, 0.0));
+    assert(t.rejected[QUOTA_BIND] == 1);
+    /* Each client and type has its own bucket. */
+    assert(quota_take(&t, "10.0.0.2", QUOTA_BIND, 0.0));
+    assert(quota_take(&t, "10.0.0.1", QUOTA_SEARCH, 0.0));
+    assert(quota_take(&t, "10.0.0.1", QUOTA_SEARCH, 0.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_SEARCH, 0.0));
+    assert(t.count == 2);
+    /* Buckets refill at the rate. */
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_BIND, 0.5));
+    assert(quota_take(&t, "10.0.0.1", QUOTA_BIND, 1.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_BIND, 1.0));
+    assert(quota_take(&t, "10.0.0.1", QUOTA_SEARCH, 1.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_SEARCH, 1.0));
+    /* Buckets only refill up to the burst. */
+    for (int i = 0; i < 5; i++)
+        assert(quota_take(&t, "10.0.0.1", QUOTA_BIND, 100.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_BIND, 100.0));
+
+    /* Failed binds are free until QUOTA_FAILS_FREE. */
+    for (int i = 0; i < QUOTA_FAILS_FREE; i++) {
+        assert(!quota_isblocked(&t, "bob", "10.0.0.1", 0.0));
+        quota_bindresult(&t, "bob", "10.0.0.1", false, 0.0);
+    }
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", 0.0));
+    /* Then the penalty doubles for each failure. */
+    quota_bindresult(&t, "bob", "10.0.0.1", false, 0.0);
+    assert(quota_isblocked(&t, "bob", "10.0.0.1", 0.0));
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", QUOTA_PENALTY));
+    quota_bindresult(&t, "bob", "10.0.0.1", false, 10.0);
+    assert(quota_isblocked(&t, "bob", "10.0.0.1", 10.0 + QUOTA_PENALTY));
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", 10.0 + 2 * QUOTA_PENALTY));
+    assert(t.blocked == 2);
+    /* Other users and clients are not blocked. */
+    assert(!quota_isblocked(&t, "alice", "10.0.0.1", 10.0));
+    assert(!quota_isblocked(&t, "bob", "10.0.0.2", 10.0));
+    /* The penalty is capped. */
+    for (int i = 0; i < 30; i++)
+        quota_bindresult(&t, "bob", "10.0.0.1", false, 20.0);
+    assert(quota_isblocked(&t, "bob", "10.0.0.1", 20.0 + QUOTA_PENALTY_MAX - 1));
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", 20.0 + QUOTA_PENALTY_MAX));
+    /* A successful bind clears the failures. */
+    quota_bindresult(&t, "bob", "10.0.0.1", true, 1000.0);
+    quota_bindresult(&t, "bob", "10.0.0.1", false, 1000.0);
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", 1000.0));
+    /* Old failures are forgotten. */
+    for (int i = 0; i < QUOTA_FAILS_FREE; i++)
+        quota_bindresult(&t, "bob", "10.0.0.1", false, 1000.0);
+    assert(quota_isblocked(&t, "bob", "10.0.0.1", 1000.0));
+    quota_bindresult(&t, "bob", "10.0.0.1", false, 1000.0 + QUOTA_FAILS_AGE + 1);
+    assert(!quota_isblocked(&t, "bob", "10.0.0.1", 1000.0 + QUOTA_FAILS_AGE + 1));
+
+    /* The oldest quotas are reused when the table is full. */
+    for (int i = 0; i < QUOTA_MAX; i++) {
+        snprintf(ip, sizeof(ip), "192.168.%d.%d", i / 256, i % 256);
+        assert(quota_take(&t, ip, QUOTA_BIND, 2000.0));
+    }
+    assert(t.count == QUOTA_MAX);
+    assert(quota_take(&t, "192.168.0.0", QUOTA_BIND, 2000.0));
+    for (int i = 0; i < 5; i++)
+        assert(quota_take(&t, "10.0.0.1", QUOTA_BIND, 2000.0));
+    assert(!quota_take(&t, "10.0.0.1", QUOTA_BIND, 2000.0));
+    assert(t.count == QUOTA_MAX);
+    quota_table_done(&t);
+    assert(t.count == 0 && !t.lru);
+    return 0;
+}
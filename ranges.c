@@ -50,3 +50,35 @@ int ldap_ranges_init(ldap_ranges *r, const char *s)
     }
     return r->count;
 }
+
+/* Set r to the sorted and merged intersection of the ranges s and beg-end. */
+int ldap_ranges_clip(ldap_ranges *r, const ldap_ranges *s, uid_t beg, uid_t end)
+{
+    assert(r);
+    assert(s);
+    ldap_range t;
+    int i, j;
+
+    r->count = 0;
+    /* Insertion sort the clipped ranges by their beg. */
+    for (i = 0; i < s->count; i++) {
+        t.beg = s->range[i].beg > beg ? s->range[i].beg : beg;
+        t.end = s->range[i].end < end ? s->range[i].end : end;
+        if (t.beg > t.end)
+            continue;
+        for (j = r->count++; j > 0 && r->range[j - 1].beg > t.beg; j--)
+            r->range[j] = r->range[j - 1];
+        r->range[j] = t;
+    }
+    /* Merge overlapping and adjacent ranges. */
+    for (i = 0, j = 1; j < r->count; j++) {
+        if (r->range[j].beg <= r->range[i].end || r->range[j].beg - 1 == r->range[i].end) {
+            if (r->range[j].end > r->range[i].end)
+                r->range[i].end = r->range[j].end;
+        } else
+            r->range[++i] = r->range[j];
+    }
+    if (r->count)
+        r->count = i + 1;
+    return r->count;
+}
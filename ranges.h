@@ -25,6 +25,7 @@ typedef struct {
     ldap_range range[RANGES_SIZE];      /**< The ranges. */
 } ldap_ranges;
 int ldap_ranges_init(ldap_ranges *r, const char *s);
+int ldap_ranges_clip(ldap_ranges *r, const ldap_ranges *s, uid_t beg, uid_t end);
 static inline bool ldap_ranges_ismatch(const ldap_ranges *r, const uid_t id);
 
 static inline bool ldap_range_ismatch(const ldap_range *r, const uid_t id)
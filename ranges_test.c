@@ -52,4 +52,19 @@ int main(void)
     assert(ldap_ranges_ismatch(&rs, 1000));
     assert(ldap_ranges_ismatch(&rs, 4000));
     assert(!ldap_ranges_ismatch(&rs, 5000));
+
+    /* Clipping sorts and merges ranges. */
+    ldap_ranges cs;
+    assert(ldap_ranges_init(&rs, "5000-6000,100,1000-4000,3000-4500,4501") == 5);
+    assert(ldap_ranges_clip(&cs, &rs, 0, (uid_t)-1) == 3);
+    assert(cs.range[0].beg == 100 && cs.range[0].end == 100);
+    assert(cs.range[1].beg == 1000 && cs.range[1].end == 4501);
+    assert(cs.range[2].beg == 5000 && cs.range[2].end == 6000);
+    assert(ldap_ranges_clip(&cs, &rs, 101, 5500) == 2);
+    assert(cs.range[0].beg == 1000 && cs.range[0].end == 4501);
+    assert(cs.range[1].beg == 5000 && cs.range[1].end == 5500);
+    assert(ldap_ranges_clip(&cs, &rs, 4000, 4000) == 1);
+    assert(cs.range[0].beg == 4000 && cs.range[0].end == 4000);
+    assert(ldap_ranges_clip(&cs, &rs, 101, 999) == 0);
+    assert(ldap_ranges_clip(&cs, &rs, 2000, 1000) == 0);
 }
@@ -0,0 +1,344 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "response.h"
+#include "utils.h"
+
+#define ENTRY response
+#include "dlist.h"
+
+/* Parse a BER length, returning the number of length octets or 0 if invalid. */
+static size_t ber_getlen(const unsigned char *p, size_t n, size_t *len)
+{
+    size_t k;
+
+    if (!n)
+        return 0;
+    if (p[0] < 0x80) {
+        *len = p[0];
+        return 1;
+    }
+    k = p[0] & 0x7f;
+    if (!k || k > 4 || n < 1 + k)
+        return 0;
+    *len = 0;
+    for (size_t i = 1; i <= k; i++)
+        *len = (*len << 8) | p[i];
+    return 1 + k;
+}
+
+/* Get the number of octets needed for a DER length. */
+static size_t der_lenlen(size_t len)
+{
+    size_t k = 1;
+
+    if (len < 0x80)
+        return 1;
+    while (len >> (8 * k))
+        k++;
+    return 1 + k;
+}
+
+/* Write a DER length, returning the number of octets written. */
+static size_t der_putlen(unsigned char *p, size_t len)
+{
+    size_t n = der_lenlen(len);
+
+    if (n == 1)
+        p[0] = len;
+    else {
+        p[0] = 0x80 | (n - 1);
+        for (size_t i = 1; i < n; i++)
+            p[i] = len >> (8 * (n - 1 - i));
+    }
+    return n;
+}
+
+/* Get the number of octets needed for a DER INTEGER value. */
+static size_t der_intlen(long v)
+{
+    size_t k = 1;
+
+    while (k < sizeof(v) && (v < -(1L << (8 * k - 1)) || v >= (1L << (8 * k - 1))))
+        k++;
+    return k;
+}
+
+response *response_new(unsigned long gen)
+{
+    response *r = XNEW0(response, 1);
+
+    r->gen = gen;
+    r->refs = 1;
+    return r;
+}
+
+response *response_ref(response *r)
+{
+    assert(r);
+    assert(r->refs > 0);
+
+    r->refs++;
+    return r;
+}
+
+static void response_flights_rem(response_flights *flights, response *r);
+
+void response_unref(response *r)
+{
+    if (r && !--r->refs) {
+        if (r->flights)
+            response_flights_rem(r->flights, r);
+        free(r->key);
+        free(r->data);
+        free(r);
+    }
+}
+
+bool response_addmsg(response *r, const unsigned char *msg, size_t len)
+{
+    assert(r);
+    assert(msg);
+    size_t seqlen, idlen, pos, n;
+
+    /* Skip the LDAPMessage SEQUENCE header and the messageID INTEGER. */
+    if (len < 2 || msg[0] != 0x30 || !(n = ber_getlen(msg + 1, len - 1, &seqlen)) || 1 + n + seqlen != len)
+        return false;
+    pos = 1 + n;
+    if (pos >= len || msg[pos] != 0x02 || !(n = ber_getlen(msg + pos + 1, len - pos - 1, &idlen)))
+        return false;
+    pos += 1 + n + idlen;
+    if (pos >= len)
+        return false;
+    /* Store the rest of the message with its length. */
+    len -= pos;
+    if (r->len + der_lenlen(len) + len > r->size) {
+        r->size = max(2 * r->size, r->len + der_lenlen(len) + len);
+        r->data = XRENEW(r->data, unsigned char, r->size);
+    }
+    r->len += der_putlen(r->data + r->len, len);
+    memcpy(r->data + r->len, msg + pos, len);
+    r->len += len;
+    r->count++;
+    return true;
+}
+
+size_t response_getmsg(const response *r, size_t *pos, long msgid, unsigned char *buf, size_t len)
+{
+    assert(r);
+    assert(pos && *pos < r->len);
+    assert(buf);
+    size_t oplen, n = ber_getlen(r->data + *pos, r->len - *pos, &oplen);
+    size_t idlen = der_intlen(msgid);
+    size_t seqlen = 1 + der_lenlen(idlen) + idlen + oplen;
+    size_t msglen = 1 + der_lenlen(seqlen) + seqlen;
+    unsigned char *p = buf;
+
+    assert(n && *pos + n + oplen <= r->len);
+    if (msglen > len)
+        return 0;
+    *p++ = 0x30;
+    p += der_putlen(p, seqlen);
+    *p++ = 0x02;
+    p += der_putlen(p, idlen);
+    for (size_t i = idlen; i--;)
+        *p++ = msgid >> (8 * i);
+    memcpy(p, r->data + *pos + n, oplen);
+    *pos += n + oplen;
+    return msglen;
+}
+
+/* Get the FNV-1a hash of a key. */
+static uint32_t response_hash(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+void response_cache_init(response_cache *cache, size_t max)
+{
+    assert(cache);
+
+    memset(cache, 0, sizeof(*cache));
+    cache->max = max;
+}
+
+/* Remove a response from a response_cache and release it. */
+static void response_cache_rem(response_cache *cache, response *r)
+{
+    response **h;
+
+    for (h = &cache->table[r->hash % RESPONSE_CACHE_SIZE]; *h != r; h = &(*h)->hnext) ;
+    *h = r->hnext;
+    response_rem(&cache->lru, r);
+    cache->size -= r->keylen + r->len;
+    cache->count--;
+    free(r->key);
+    r->key = NULL;
+    response_unref(r);
+}
+
+void response_cache_done(response_cache *cache)
+{
+    assert(cache);
+    size_t max = cache->max;
+
+    while (cache->lru)
+        response_cache_rem(cache, cache->lru);
+    response_cache_init(cache, max);
+}
+
+response *response_cache_get(response_cache *cache, const char *key, size_t keylen, unsigned long gen)
+{
+    assert(cache);
+    assert(key);
+    uint32_t hash = response_hash(key, keylen);
+    response *r;
+
+    if (!cache->max)
+        return NULL;
+    for (r = cache->table[hash % RESPONSE_CACHE_SIZE]; r; r = r->hnext)
+        if (r->hash == hash && r->keylen == keylen && !memcmp(r->key, key, keylen))
+            break;
+    if (r && r->gen != gen) {
+        /* The directory has changed since it was cached. */
+        cache->stale++;
+        response_cache_rem(cache, r);
+        r = NULL;
+    }
+    if (!r) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    /* Move it to the end of the LRU dlist as the most recently used. */
+    response_rem(&cache->lru, r);
+    response_add(&cache->lru, r);
+    return response_ref(r);
+}
+
+void response_cache_put(response_cache *cache, const char *key, size_t keylen, response *r)
+{
+    assert(cache);
+    assert(key);
+    assert(r && !r->key);
+    uint32_t hash = response_hash(key, keylen);
+    response *o;
+
+    /* Don't cache responses that would use more than an eighth of the cache. */
+    if (keylen + r->len > cache->max / 8)
+        return;
+    for (o = cache->table[hash % RESPONSE_CACHE_SIZE]; o; o = o->hnext)
+        if (o->hash == hash && o->keylen == keylen && !memcmp(o->key, key, keylen))
+            break;
+    if (o)
+        response_cache_rem(cache, o);
+    while (cache->size + keylen + r->len > cache->max)
+        response_cache_rem(cache, cache->lru);
+    r->hash = hash;
+    r->keylen = keylen;
+    r->key = XNEW(char, keylen);
+    memcpy(r->key, key, keylen);
+    r->hnext = cache->table[hash % RESPONSE_CACHE_SIZE];
+    cache->table[hash % RESPONSE_CACHE_SIZE] = response_ref(r);
+    response_add(&cache->lru, r);
+    cache->size += keylen + r->len;
+    cache->count++;
+}
+
+void response_flights_init(response_flights *flights)
+{
+    assert(flights);
+
+    memset(flights, 0, sizeof(*flights));
+}
+
+/* Remove a response from a response_flights. */
+static void response_flights_rem(response_flights *flights, response *r)
+{
+    response **h;
+
+    for (h = &flights->table[r->hash % RESPONSE_FLIGHTS_SIZE]; *h != r; h = &(*h)->hnext) ;
+    *h = r->hnext;
+    flights->count--;
+    free(r->key);
+    r->key = NULL;
+    r->flights = NULL;
+}
+
+response *response_flights_get(response_flights *flights, const char *key, size_t keylen, unsigned long gen)
+{
+    assert(flights);
+    assert(key);
+    uint32_t hash = response_hash(key, keylen);
+    response *r;
+
+    for (r = flights->table[hash % RESPONSE_FLIGHTS_SIZE]; r; r = r->hnext)
+        if (r->hash == hash && r->keylen == keylen && !memcmp(r->key, key, keylen))
+            break;
+    if (!r || r->gen != gen)
+        return NULL;
+    flights->joined++;
+    return response_ref(r);
+}
+
+void response_flights_put(response_flights *flights, const char *key, size_t keylen, response *r)
+{
+    assert(flights);
+    assert(key);
+    assert(r && !r->key);
+    uint32_t hash = response_hash(key, keylen);
+    response *o;
+
+    for (o = flights->table[hash % RESPONSE_FLIGHTS_SIZE]; o; o = o->hnext)
+        if (o->hash == hash && o->keylen == keylen && !memcmp(o->key, key, keylen))
+            break;
+    if (o)
+        response_flights_rem(flights, o);
+    r->hash = hash;
+    r->keylen = keylen;
+    r->key = XNEW(char, keylen);
+    memcpy(r->key, key, keylen);
+    r->hnext = flights->table[hash % RESPONSE_FLIGHTS_SIZE];
+    flights->table[hash % RESPONSE_FLIGHTS_SIZE] = r;
+    r->flights = flights;
+    flights->count++;
+}
+
+int response_stream_cb(const void *data, size_t size, void *key)
+{
+    response_stream *s = key;
+
+    /* Double the size so appending is amortized O(1) per byte. */
+    if (s->len + size > s->size) {
+        s->size = max(2 * s->size, s->len + size);
+        s->data = XRENEW(s->data, unsigned char, s->size);
+    }
+    memcpy(s->data + s->len, data, size);
+    s->len += size;
+    return 0;
+}
+
+size_t response_stream_get(response_stream *s, unsigned char *buf, size_t len)
+{
+    assert(s);
+    assert(buf);
+    size_t n = min(len, s->len - s->pos);
+
+    memcpy(buf, s->data + s->pos, n);
+    s->pos += n;
+    return n;
+}
+
+void response_stream_done(response_stream *s)
+{
+    assert(s);
+
+    free(s->data);
+    memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,150 @@
+/** \file response.h
+ * A cache of encoded search responses.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * A response holds the DER encoded stream of messages for a search
+ * response. Each message is stored without its LDAPMessage SEQUENCE header
+ * and messageID, so it can be sent for any request by writing a new header
+ * with the request's messageID followed by a copy of the stored protocolOp.
+ *
+ * The response_cache keeps recently used responses in an LRU keyed by
+ * everything in the request that affects the response, up to a maximum total
+ * size. Each response records the directory generation it was built from, and
+ * is stale and discarded if the generation has changed. Responses are
+ * reference counted so they can still be sent after they are evicted.
+ *
+ * Responses that are not cached, like those from NSS or too large for the
+ * cache, are put in the response_flights while they are still being sent.
+ * Identical searches from many clients often arrive within milliseconds, and
+ * the later ones get a reference to the response being sent instead of doing
+ * the search again. Each is sent with its own messageID at its own pace. The
+ * flights hold no references, and responses leave them when their last
+ * reference is released, so they never outlive the searches sharing them. */
+#ifndef LIGHTLDAPD_RESPONSE_H
+#define LIGHTLDAPD_RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESPONSE_CACHE_SIZE 256 /**< The response cache hash table size. */
+#define RESPONSE_CACHE_MAX (4 << 20)    /**< The default max cached bytes. */
+#define RESPONSE_FLIGHTS_SIZE 64        /**< The response flights hash table size. */
+/** The max bytes a message can grow by when sent with another messageID.
+ *
+ * A messageID is at most 4 bytes, so it adds at most 3 bytes, and 1 more to
+ * the SEQUENCE length. Messages added must be this much smaller than the send
+ * buffer so they always fit an empty one. */
+#define RESPONSE_MSGID_GROWTH 8
+
+/** The response class for an encoded response. */
+typedef struct response response;
+typedef struct response_flights response_flights;
+struct response {
+    response *next, *prev;      /**< The LRU dlist pointers. */
+    response *hnext;            /**< The next in the hash table chain. */
+    uint32_t hash;              /**< The hash of the key. */
+    size_t keylen;              /**< The length of the key. */
+    char *key;                  /**< The request key, or NULL if not cached. */
+    unsigned long gen;          /**< The directory generation. */
+    int refs;                   /**< The reference count. */
+    int count;                  /**< The number of messages. */
+    size_t len;                 /**< The length of the encoded messages. */
+    size_t size;                /**< The allocated size of data. */
+    unsigned char *data;        /**< The encoded protocolOps. */
+    response_flights *flights;  /**< The response_flights it is in, or NULL. */
+};
+/** Allocate a new empty response with one reference. */
+response *response_new(unsigned long gen);
+/** Add a reference to a response. */
+response *response_ref(response *r);
+/** Remove a reference to a response, freeing it if it was the last. */
+void response_unref(response *r);
+/** Add a DER encoded LDAPMessage to a response.
+ *
+ * \return false if the message could not be parsed. */
+bool response_addmsg(response *r, const unsigned char *msg, size_t len);
+/** Encode the next message in a response with a messageID.
+ *
+ * \param r - The response to get the message from.
+ *
+ * \param pos - The position of the message, advanced to the next message.
+ *
+ * \param msgid - The messageID to use.
+ *
+ * \param buf - The buffer to encode the message into.
+ *
+ * \param len - The available space in the buffer.
+ *
+ * \return The encoded message length, or 0 if it didn't fit. */
+size_t response_getmsg(const response *r, size_t *pos, long msgid, unsigned char *buf, size_t len);
+
+/** The response_cache class. */
+typedef struct {
+    response *lru;              /**< The LRU dlist with the oldest first. */
+    response *table[RESPONSE_CACHE_SIZE];       /**< The hash table. */
+    int count;                  /**< The number of cached responses. */
+    size_t size;                /**< The total bytes of cached responses. */
+    size_t max;                 /**< The max total bytes, 0 to disable. */
+    unsigned long hits;         /**< The cache hits counter. */
+    unsigned long misses;       /**< The cache misses counter. */
+    unsigned long stale;        /**< The stale responses discarded counter. */
+} response_cache;
+/** Initialize an empty response_cache with a max size. */
+void response_cache_init(response_cache *cache, size_t max);
+/** Destroy a response_cache releasing all cached responses. */
+void response_cache_done(response_cache *cache);
+/** Get a cached response for a key and generation.
+ *
+ * \return A new reference to release with response_unref(), or NULL. */
+response *response_cache_get(response_cache *cache, const char *key, size_t keylen, unsigned long gen);
+/** Add a response to a response_cache for a key.
+ *
+ * The cache takes its own reference, and responses that are too large for
+ * the cache are not added. */
+void response_cache_put(response_cache *cache, const char *key, size_t keylen, response *r);
+
+/** The response_flights class for the uncached responses being sent. */
+struct response_flights {
+    response *table[RESPONSE_FLIGHTS_SIZE];     /**< The hash table. */
+    int count;                  /**< The number of responses being sent. */
+    unsigned long joined;       /**< The searches that shared a response. */
+};
+/** Initialize an empty response_flights. */
+void response_flights_init(response_flights *flights);
+/** Get a response being sent for a key and generation.
+ *
+ * \return A new reference to release with response_unref(), or NULL. */
+response *response_flights_get(response_flights *flights, const char *key, size_t keylen, unsigned long gen);
+/** Add a response being sent to a response_flights for a key.
+ *
+ * It is removed when its last reference is released, and replaces any other
+ * response with the same key. */
+void response_flights_put(response_flights *flights, const char *key, size_t keylen, response *r);
+
+/** The response_stream class for a message too big for the send buffer.
+ *
+ * The message is encoded once by der_encode() with response_stream_cb()
+ * into a growing buffer, and then copied into the send buffer a part at a
+ * time with response_stream_get(). */
+typedef struct {
+    unsigned char *data;        /**< The encoded message, or NULL. */
+    size_t len;                 /**< The encoded message length. */
+    size_t size;                /**< The allocated data size. */
+    size_t pos;                 /**< The bytes already copied out. */
+} response_stream;
+/** Append encoded bytes to a response_stream, for use with der_encode().
+ *
+ * \return 0 always, growing the data as needed. */
+int response_stream_cb(const void *data, size_t size, void *key);
+/** Copy the next part of a response_stream into a buffer.
+ *
+ * \return The number of bytes copied. */
+size_t response_stream_get(response_stream *s, unsigned char *buf, size_t len);
+/** Free a response_stream's data, leaving it empty. */
+void response_stream_done(response_stream *s);
+
+#endif                          /* LIGHTLDAPD_RESPONSE_H */
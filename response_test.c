@@ -0,0 +1,166 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include "buffer.h"
+#include "response.h"
+#include "utils.h"
+
+/* A SearchResultDone success LDAPMessage with messageID 5. */
+static const unsigned char done[] = { 0x30, 0x0c, 0x02, 0x01, 0x05, 0x65, 0x07, 0x0a, 0x01, 0x00, 0x04, 0x00, 0x04, 0x00 };
+
+int main(void)
+{
+    unsigned char msg[512], buf[512], big[BUFFER_SIZE], bigbuf[BUFFER_SIZE];
+    response *r, *r2;
+    response_cache cache;
+    response_flights flights;
+    response_stream stream;
+    size_t pos, len, n;
+
+    /* A SearchResultEntry with a 200 byte long form length and messageID 1. */
+    memcpy(msg, (unsigned char[]) {0x30, 0x81, 0xce, 0x02, 0x01, 0x01, 0x64, 0x81, 0xc8}, 9);
+    for (int i = 0; i < 200; i++)
+        msg[9 + i] = i;
+    r = response_new(1);
+    assert(r->refs == 1 && r->gen == 1);
+    assert(response_addmsg(r, msg, 209));
+    assert(response_addmsg(r, done, sizeof(done)));
+    assert(r->count == 2);
+    /* Invalid messages are not added. */
+    assert(!response_addmsg(r, done, sizeof(done) - 1));
+    assert(!response_addmsg(r, done + 1, sizeof(done) - 1));
+    assert(!response_addmsg(r, done, 5));
+    assert(r->count == 2);
+    /* Messages are the same with the same messageID. */
+    pos = 0;
+    assert(response_getmsg(r, &pos, 1, buf, sizeof(buf)) == 209);
+    assert(!memcmp(buf, msg, 209));
+    assert(response_getmsg(r, &pos, 5, buf, sizeof(buf)) == sizeof(done));
+    assert(!memcmp(buf, done, sizeof(done)));
+    assert(pos == r->len);
+    /* Messages that don't fit are not encoded. */
+    pos = 0;
+    assert(response_getmsg(r, &pos, 1, buf, 208) == 0);
+    assert(pos == 0);
+    /* Larger messageIDs change the lengths. */
+    assert(response_getmsg(r, &pos, 128, buf, sizeof(buf)) == 210);
+    assert(!memcmp(buf, (unsigned char[]) {0x30, 0x81, 0xcf, 0x02, 0x02, 0x00, 0x80, 0x64, 0x81, 0xc8}, 10));
+    assert(!memcmp(buf + 10, msg + 9, 200));
+    assert(response_getmsg(r, &pos, 70000, buf, sizeof(buf)) == sizeof(done) + 2);
+    assert(!memcmp(buf, (unsigned char[]) {0x30, 0x0e, 0x02, 0x03, 0x01, 0x11, 0x70, 0x65, 0x07}, 9));
+    assert(pos == r->len);
+
+    /* Cached responses are found for the same key and generation. */
+    response_cache_init(&cache, 8 * (r->len + 1));
+    assert(!response_cache_get(&cache, "a", 1, 1));
+    response_cache_put(&cache, "a", 1, r);
+    assert(cache.count == 1 && cache.size == r->len + 1);
+    assert(r->refs == 2);
+    assert(!response_cache_get(&cache, "b", 1, 1));
+    assert(response_cache_get(&cache, "a", 1, 1) == r);
+    assert(r->refs == 3);
+    response_unref(r);
+    assert(cache.hits == 1 && cache.misses == 2);
+    /* Stale responses are discarded, but still usable with a reference. */
+    assert(!response_cache_get(&cache, "a", 1, 2));
+    assert(cache.count == 0 && cache.size == 0 && cache.stale == 1);
+    assert(r->refs == 1 && !r->key);
+    pos = 0;
+    assert(response_getmsg(r, &pos, 1, buf, sizeof(buf)) == 209);
+    /* The oldest responses are evicted to fit. */
+    response_cache_put(&cache, "a", 1, r);
+    for (char k = '0'; k < '8'; k++) {
+        r2 = response_new(1);
+        assert(response_addmsg(r2, msg, 209));
+        response_cache_put(&cache, (char[]) {'b', k}, 2, r2);
+        response_unref(r2);
+    }
+    assert(cache.count == 8 && cache.lru != r);
+    assert(cache.size <= cache.max);
+    assert(r->refs == 1 && r2->refs == 1 && cache.lru->prev == r2);
+    /* Responses that are too large are not cached. */
+    response_unref(r);
+    r = response_new(1);
+    for (int i = 0; i < 8; i++)
+        assert(response_addmsg(r, msg, 209));
+    response_cache_put(&cache, "c", 1, r);
+    assert(cache.count == 8 && r->refs == 1);
+    response_unref(r);
+    response_cache_done(&cache);
+    assert(cache.count == 0 && cache.size == 0 && !cache.lru);
+    /* A zero max disables the cache. */
+    response_cache_init(&cache, 0);
+    r = response_new(1);
+    assert(response_addmsg(r, done, sizeof(done)));
+    response_cache_put(&cache, "a", 1, r);
+    assert(!response_cache_get(&cache, "a", 1, 1));
+    assert(cache.count == 0 && cache.misses == 0);
+
+    /* Responses being sent are shared for the same key and generation. */
+    response_flights_init(&flights);
+    assert(!response_flights_get(&flights, "a", 1, 1));
+    response_flights_put(&flights, "a", 1, r);
+    assert(flights.count == 1 && r->refs == 1 && r->flights == &flights);
+    assert(!response_flights_get(&flights, "b", 1, 1));
+    assert(!response_flights_get(&flights, "a", 1, 2));
+    assert(response_flights_get(&flights, "a", 1, 1) == r);
+    assert(r->refs == 2 && flights.joined == 1);
+    /* Each reference sends it at its own pace with its own messageID. */
+    size_t pos1 = 0, pos2 = 0;
+    assert(response_getmsg(r, &pos1, 1, buf, sizeof(buf)) == sizeof(done));
+    assert(response_getmsg(r, &pos2, 2, buf, sizeof(buf)) == sizeof(done));
+    assert(buf[4] == 2 && pos1 == r->len && pos2 == r->len);
+    /* Releasing one reference doesn't affect the others. */
+    response_unref(r);
+    assert(flights.count == 1 && response_flights_get(&flights, "a", 1, 1) == r);
+    response_unref(r);
+    /* A new response replaces one with the same key. */
+    r2 = response_new(1);
+    response_flights_put(&flights, "a", 1, r2);
+    assert(flights.count == 1 && !r->key && !r->flights);
+    assert(response_flights_get(&flights, "a", 1, 1) == r2);
+    response_unref(r2);
+    response_unref(r);
+    /* Responses leave when their last reference is released. */
+    r = response_new(1);
+    response_flights_put(&flights, "b", 1, r);
+    assert(flights.count == 2);
+    response_unref(r2);
+    assert(flights.count == 1 && !response_flights_get(&flights, "a", 1, 1));
+    response_unref(r);
+    assert(flights.count == 0 && !response_flights_get(&flights, "b", 1, 1));
+    assert(flights.joined == 3);
+
+    /* A streamed message is appended in parts and grows to fit. */
+    memset(&stream, 0, sizeof(stream));
+    for (int i = 0; i < 100; i++)
+        assert(response_stream_cb(msg, 209, &stream) == 0);
+    assert(stream.len == 100 * 209 && stream.size >= stream.len && stream.pos == 0);
+    assert(!memcmp(stream.data + 99 * 209, msg, 209));
+    /* It is copied out a part at a time, resuming where the last part ended. */
+    for (pos = 0; (len = response_stream_get(&stream, buf, sizeof(buf))); pos += len) {
+        assert(len == min(sizeof(buf), stream.len - pos) && stream.pos == pos + len);
+        for (size_t i = 0; i < len; i++)
+            assert(buf[i] == msg[(pos + i) % 209]);
+    }
+    assert(pos == stream.len && stream.pos == stream.len);
+    assert(response_stream_get(&stream, buf, sizeof(buf)) == 0);
+    response_stream_done(&stream);
+    assert(!stream.data && !stream.len && !stream.size && !stream.pos);
+
+    /* A message that nearly fills the buffer still fits with a 4 byte messageID. */
+    len = BUFFER_SIZE - RESPONSE_MSGID_GROWTH;
+    memset(big, 0xaa, len);
+    memcpy(big, (unsigned char[]) {0x30, 0x82, (len - 4) >> 8, (len - 4) & 0xff, 0x02, 0x01, 0x01, 0x64, 0x82,
+           (len - 11) >> 8, (len - 11) & 0xff}, 11);
+    r = response_new(1);
+    assert(response_addmsg(r, big, len));
+    pos = 0;
+    assert((n = response_getmsg(r, &pos, 100000, bigbuf, BUFFER_SIZE)) > len && n <= BUFFER_SIZE);
+    assert(bigbuf[5] == 3 && !memcmp(bigbuf + n - (len - 7), big + 7, len - 7));
+    pos = 0;
+    assert((n = response_getmsg(r, &pos, 0x7fffffff, bigbuf, BUFFER_SIZE)) <= BUFFER_SIZE && bigbuf[5] == 4);
+    response_unref(r);
+    return 0;
+}
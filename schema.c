@@ -0,0 +1,187 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "schema.h"
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* The perfect hash table size and function. Note that '| 0x20' lowercases
+ * letters, and other chars are checked by the strncasecmp() anyway. */
+#define SCHEMA_HASH_SIZE 32
+#define schema_hash(s, len) (((len) + ((s)[0] | 0x20) * 5 + ((s)[(len) - 1] | 0x20) * 24) % SCHEMA_HASH_SIZE)
+
+schema_attr schema_attrs[ATTR_MAX] = {
+    [ATTR_OBJECTCLASS] = {"objectClass", ATTR_CASEIGNORE},
+    [ATTR_UID] = {"uid", ATTR_CASEIGNORE},
+    [ATTR_CN] = {"cn", ATTR_CASEIGNORE},
+    [ATTR_USERPASSWORD] = {"userPassword", 0},
+    [ATTR_UIDNUMBER] = {"uidNumber", ATTR_INTEGER},
+    [ATTR_GIDNUMBER] = {"gidNumber", ATTR_INTEGER},
+    [ATTR_GECOS] = {"gecos", ATTR_CASEIGNORE},
+    [ATTR_HOMEDIRECTORY] = {"homeDirectory", 0},
+    [ATTR_LOGINSHELL] = {"loginShell", 0},
+    [ATTR_SHADOWLASTCHANGE] = {"shadowLastChange", ATTR_INTEGER},
+    [ATTR_SHADOWMIN] = {"shadowMin", ATTR_INTEGER},
+    [ATTR_SHADOWMAX] = {"shadowMax", ATTR_INTEGER},
+    [ATTR_SHADOWWARNING] = {"shadowWarning", ATTR_INTEGER},
+    [ATTR_SHADOWINACTIVE] = {"shadowInactive", ATTR_INTEGER},
+    [ATTR_SHADOWEXPIRE] = {"shadowExpire", ATTR_INTEGER},
+    [ATTR_SHADOWFLAG] = {"shadowFlag", ATTR_INTEGER},
+    [ATTR_MEMBERUID] = {"memberUid", 0},
+    [ATTR_MEMBEROF] = {"memberOf", 0},
+    [ATTR_MEMBER] = {"member", 0},
+};
+
+int schema_count = ATTR_COUNT;
+
+/* The attr_id for each hash value. */
+static const attr_id schema_table[SCHEMA_HASH_SIZE] = {
+    ATTR_UNKNOWN, ATTR_CN, ATTR_UIDNUMBER, ATTR_SHADOWEXPIRE,
+    ATTR_UNKNOWN, ATTR_SHADOWINACTIVE, ATTR_LOGINSHELL, ATTR_SHADOWLASTCHANGE,
+    ATTR_SHADOWMAX, ATTR_UNKNOWN, ATTR_MEMBERUID, ATTR_UNKNOWN,
+    ATTR_UID, ATTR_HOMEDIRECTORY, ATTR_UNKNOWN, ATTR_UNKNOWN,
+    ATTR_GECOS, ATTR_SHADOWFLAG, ATTR_UNKNOWN, ATTR_UNKNOWN,
+    ATTR_SHADOWWARNING, ATTR_USERPASSWORD, ATTR_UNKNOWN, ATTR_MEMBER,
+    ATTR_SHADOWMIN, ATTR_MEMBEROF, ATTR_UNKNOWN, ATTR_UNKNOWN,
+    ATTR_GIDNUMBER, ATTR_UNKNOWN, ATTR_OBJECTCLASS, ATTR_UNKNOWN,
+};
+
+attr_id schema_id(const char *name, size_t len)
+{
+    assert(name);
+    attr_id id;
+
+    if (!len)
+        return ATTR_UNKNOWN;
+    id = schema_table[schema_hash((const unsigned char *)name, len)];
+    if (id != ATTR_UNKNOWN && strlen(schema_name(id)) == len && !strncasecmp(schema_name(id), name, len))
+        return id;
+    /* Search any custom attributes. */
+    for (id = ATTR_COUNT; id < schema_count; id++)
+        if (strlen(schema_name(id)) == len && !strncasecmp(schema_name(id), name, len))
+            return id;
+    return ATTR_UNKNOWN;
+}
+
+attr_id schema_add(const char *name, int flags)
+{
+    assert(name);
+    size_t len = strlen(name);
+    attr_id id = schema_id(name, len);
+    char *n;
+
+    if (id != ATTR_UNKNOWN)
+        return id;
+    /* Names are a letter followed by letters, digits, and '-'. */
+    if (!isalpha((unsigned char)name[0]) || strspn(name, "abcdefghijklmnopqrstuvwxyz"
+                                                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != len)
+        return ATTR_UNKNOWN;
+    if (schema_count == ATTR_MAX || !(n = strdup(name)))
+        return ATTR_UNKNOWN;
+    id = schema_count++;
+    schema_attrs[id].name = n;
+    schema_attrs[id].flags = flags;
+    return id;
+}
+
+void schema_fold(attr_id id, char *value, size_t len)
+{
+    assert(0 <= id && id < schema_count);
+    assert(value);
+
+    if (schema_attrs[id].flags & ATTR_CASEIGNORE)
+        for (size_t i = 0; i < len; i++)
+            value[i] = tolower((unsigned char)value[i]);
+}
+
+/* Parse an unsigned range index, advancing s past it. */
+static bool schema_index(const char **s, const char *end, unsigned *v)
+{
+    const char *p = *s;
+
+    for (*v = 0; p < end && isdigit((unsigned char)*p) && *v < RANGE_END / 10; p++)
+        *v = *v * 10 + (*p - '0');
+    if (p == *s || (p < end && isdigit((unsigned char)*p)))
+        return false;
+    *s = p;
+    return true;
+}
+
+attr_id schema_desc(const char *desc, size_t len, attr_range *range)
+{
+    assert(desc);
+    assert(range);
+    const char *opt = memchr(desc, ';', len);
+    const char *end = desc + len;
+
+    range->low = 0;
+    range->high = RANGE_END;
+    if (!opt)
+        return schema_id(desc, len);
+    /* Only the ";range=low-high" option is supported. */
+    const char *s = opt + 7;
+    if (end - opt < 7 || strncasecmp(opt, ";range=", 7) || !schema_index(&s, end, &range->low) || s == end
+        || *s++ != '-')
+        return ATTR_UNKNOWN;
+    if (s < end && *s == '*')
+        s++;
+    else if (!schema_index(&s, end, &range->high) || range->high < range->low)
+        return ATTR_UNKNOWN;
+    if (s != end)
+        return ATTR_UNKNOWN;
+    return schema_id(desc, opt - desc);
+}
+
+bool schema_int(const char *s, size_t len, long *v)
+{
+    assert(s);
+    assert(v);
+    bool neg = len && *s == '-';
+    size_t i = neg;
+    long n = 0;
+
+    if (i == len)
+        return false;
+    /* Accumulate negated so LONG_MIN fits, rejecting values that overflow. */
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char)s[i]))
+            return false;
+        int d = s[i] - '0';
+        if (n < (LONG_MIN + d) / 10)
+            return false;
+        n = n * 10 - d;
+    }
+    if (!neg && n == LONG_MIN)
+        return false;
+    *v = neg ? n : -n;
+    return true;
+}
+
+bool schema_equal(attr_id id, const char *a, size_t alen, const char *b, size_t blen)
+{
+    assert(0 <= id && id < schema_count);
+    assert(a);
+    assert(b);
+    long av, bv;
+
+    if (schema_attrs[id].flags & ATTR_INTEGER)
+        return schema_int(a, alen, &av) && schema_int(b, blen, &bv) && av == bv;
+    return alen == blen && schema_match(id, a, b, alen);
+}
+
+bool schema_match(attr_id id, const char *a, const char *b, size_t len)
+{
+    assert(0 <= id && id < schema_count);
+    assert(a);
+    assert(b);
+
+    if (schema_attrs[id].flags & ATTR_CASEIGNORE)
+        return !strncasecmp(a, b, len);
+    return !memcmp(a, b, len);
+}
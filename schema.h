@@ -0,0 +1,138 @@
+/** \file schema.h
+ * The LDAP schema attributes we export.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * Each known attribute has a small integer attr_id used instead of its name,
+ * so matching attributes is an integer comparison and sets of attributes are
+ * an attr_mask bitmask. Attribute names are case-insensitive and are mapped to
+ * ids using a perfect hash of the length and first and last chars. The hash
+ * constants were found by a brute force search, and schema_test checks it is
+ * still perfect, so they need to be updated when attributes are added.
+ *
+ * Custom attributes for other schemas can be added at startup with
+ * schema_add(), up to ATTR_MAX attributes in total. They get the next free
+ * attr_ids after ATTR_COUNT and are found by a linear search after the
+ * perfect hash misses, so they cost nothing when there are none.
+ *
+ * The memberOf and member DN attributes are generated from the group
+ * memberships when they are needed, so they are ATTR_VIRTUAL attributes that
+ * are only returned when selected by name or with "+". DN values are compared
+ * exactly since they are resolved to case-sensitive user and group names. */
+#ifndef LIGHTLDAPD_SCHEMA_H
+#define LIGHTLDAPD_SCHEMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The attribute ids. */
+typedef enum {
+    ATTR_UNKNOWN = -1,          /**< Not a known attribute. */
+    ATTR_OBJECTCLASS,
+    ATTR_UID,
+    ATTR_CN,
+    ATTR_USERPASSWORD,
+    ATTR_UIDNUMBER,
+    ATTR_GIDNUMBER,
+    ATTR_GECOS,
+    ATTR_HOMEDIRECTORY,
+    ATTR_LOGINSHELL,
+    ATTR_SHADOWLASTCHANGE,
+    ATTR_SHADOWMIN,
+    ATTR_SHADOWMAX,
+    ATTR_SHADOWWARNING,
+    ATTR_SHADOWINACTIVE,
+    ATTR_SHADOWEXPIRE,
+    ATTR_SHADOWFLAG,
+    ATTR_MEMBERUID,
+    ATTR_MEMBEROF,
+    ATTR_MEMBER,
+    ATTR_COUNT                  /**< The number of builtin attributes. */
+} attr_id;
+#define ATTR_MAX 32             /**< The max attributes including custom ones. */
+
+/** A bitmask set of attr_ids. */
+typedef uint32_t attr_mask;
+#define ATTR_BIT(id) ((attr_mask)1 << (id))     /**< The attr_mask for an attr_id. */
+#define ATTR_ALL ((attr_mask)-1)        /**< The attr_mask of all attributes. */
+/** The attr_mask of generated attributes only returned when requested. */
+#define ATTR_VIRTUAL (ATTR_BIT(ATTR_MEMBEROF) | ATTR_BIT(ATTR_MEMBER))
+
+/* Attribute equality matching rule flags. */
+#define ATTR_CASEIGNORE 1       /**< Values are compared ignoring case. */
+#define ATTR_INTEGER 2          /**< Values are compared as integers. */
+
+/** The schema attribute class. */
+typedef struct {
+    const char *name;           /**< The canonical attribute name. */
+    int flags;                  /**< The matching rule flags. */
+} schema_attr;
+extern schema_attr schema_attrs[ATTR_MAX];      /**< The attributes by id. */
+extern int schema_count;        /**< The number of builtin and custom attributes. */
+
+/** Get the attr_id for a case-insensitive attribute name.
+ *
+ * \param name - the attribute name, which need not be '\0' terminated.
+ *
+ * \param len - the length of the attribute name.
+ *
+ * \return the attr_id, or ATTR_UNKNOWN if it is not a known attribute. */
+attr_id schema_id(const char *name, size_t len);
+
+/** The last value index for an attr_range up to the last value. */
+#define RANGE_END ((unsigned)-1)
+
+/** The attr_range class for the range of an attribute's values to return. */
+typedef struct {
+    unsigned low;               /**< The index of the first value. */
+    unsigned high;              /**< The index of the last value, or RANGE_END. */
+} attr_range;
+
+/** Get the attr_id and value range of an attribute description.
+ *
+ * This is an attribute name with an optional ";range=low-high" option for
+ * ranged retrieval of large multi-valued attributes, where high can be "*"
+ * for up to the last value. Without the option the range is all the values.
+ *
+ * \param desc - the attribute description, which need not be '\0' terminated.
+ *
+ * \param len - the length of the attribute description.
+ *
+ * \param range - the attr_range to set.
+ *
+ * \return the attr_id, or ATTR_UNKNOWN if it is not a known attribute or the
+ * option is invalid. */
+attr_id schema_desc(const char *desc, size_t len, attr_range *range);
+
+/** Add a custom attribute to the schema.
+ *
+ * \param name - the attribute name, which is copied.
+ *
+ * \param flags - the matching rule flags.
+ *
+ * \return the new attr_id, the existing attr_id if it is already known, or
+ * ATTR_UNKNOWN if the name is invalid or there are already ATTR_MAX. */
+attr_id schema_add(const char *name, int flags);
+
+/** Get the canonical name for an attr_id. */
+#define schema_name(id) (schema_attrs[id].name)
+
+/** Normalize a value in place for an attribute's matching rule. */
+void schema_fold(attr_id id, char *value, size_t len);
+
+/** Parse a decimal integer value, returning false if it is invalid. */
+bool schema_int(const char *s, size_t len, long *v);
+
+/** Check if two values are equal using an attribute's matching rule. */
+bool schema_equal(attr_id id, const char *a, size_t alen, const char *b, size_t blen);
+
+/** Check if two substrings of the same length match.
+ *
+ * Substrings are compared ignoring case for case-insensitive attributes, and
+ * as strings for integer attributes. */
+bool schema_match(attr_id id, const char *a, const char *b, size_t len);
+
+#endif                          /* LIGHTLDAPD_SCHEMA_H */
@@ -0,0 +1,125 @@
+/* Force DEBUG on so that tests can use assert(). */
+#undef NDEBUG
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include "schema.h"
+
+int main(void)
+{
+    char name[64], num[32];
+
+    /* The hash is perfect and names map to their ids in any case. */
+    for (attr_id id = 0; id < ATTR_COUNT; id++) {
+        const char *n = schema_name(id);
+        size_t len = strlen(n);
+        assert(n && len < sizeof(name));
+        assert(schema_id(n, len) == id);
+        for (size_t i = 0; i <= len; i++)
+            name[i] = toupper(n[i]);
+        assert(schema_id(name, len) == id);
+        for (size_t i = 0; i <= len; i++)
+            name[i] = tolower(n[i]);
+        assert(schema_id(name, len) == id);
+        /* Prefixes don't match. */
+        assert(schema_id(n, len - 1) == ATTR_UNKNOWN);
+    }
+    assert(schema_id("uidNumber", 9) == ATTR_UIDNUMBER);
+    assert(schema_id("uidnumber", 9) == ATTR_UIDNUMBER);
+    /* The name doesn't need to be '\0' terminated. */
+    assert(schema_id("uidNumber=1000", 9) == ATTR_UIDNUMBER);
+    assert(schema_id("cn", 2) == ATTR_CN);
+    assert(schema_id("memberof", 8) == ATTR_MEMBEROF);
+    assert(schema_id("member", 6) == ATTR_MEMBER);
+    assert(schema_id("members", 7) == ATTR_UNKNOWN);
+    assert(schema_id("", 0) == ATTR_UNKNOWN);
+    assert(schema_id("c", 1) == ATTR_UNKNOWN);
+    assert(schema_id("uidNumbe", 8) == ATTR_UNKNOWN);
+    assert(schema_id("mail", 4) == ATTR_UNKNOWN);
+    assert(schema_id("description", 11) == ATTR_UNKNOWN);
+    assert(schema_id("1.1", 3) == ATTR_UNKNOWN);
+    assert(schema_id("*", 1) == ATTR_UNKNOWN);
+    /* Attribute descriptions with ranges. */
+    attr_range r;
+    assert(schema_desc("memberUid", 9, &r) == ATTR_MEMBERUID && r.low == 0 && r.high == RANGE_END);
+    assert(schema_desc("memberUid;range=0-999", 21, &r) == ATTR_MEMBERUID && r.low == 0 && r.high == 999);
+    assert(schema_desc("member;Range=1000-*", 19, &r) == ATTR_MEMBER && r.low == 1000 && r.high == RANGE_END);
+    assert(schema_desc("memberUid;range=5-5,", 19, &r) == ATTR_MEMBERUID && r.low == 5 && r.high == 5);
+    assert(schema_desc("memberUid;range=5-4", 19, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=5", 17, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=5-", 18, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=-5", 18, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=0-1x", 20, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=0-*x", 20, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;range=0-99999999999", 29, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;binary", 16, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("memberUid;", 10, &r) == ATTR_UNKNOWN);
+    assert(schema_desc("members;range=0-1", 17, &r) == ATTR_UNKNOWN);
+    /* Custom attributes. */
+    attr_id mail = schema_add("mail", ATTR_CASEIGNORE);
+    assert(mail == ATTR_COUNT && schema_count == ATTR_COUNT + 1);
+    assert(schema_id("MAIL", 4) == mail && !strcmp(schema_name(mail), "mail"));
+    assert(schema_add("Mail", 0) == mail && schema_attrs[mail].flags == ATTR_CASEIGNORE);
+    assert(schema_add("uidNumber", 0) == ATTR_UIDNUMBER);
+    assert(schema_add("", 0) == ATTR_UNKNOWN);
+    assert(schema_add("1mail", 0) == ATTR_UNKNOWN);
+    assert(schema_add("mail box", 0) == ATTR_UNKNOWN);
+    assert(schema_equal(mail, "Bob@Example.com", 15, "bob@example.com", 15));
+    while (schema_count < ATTR_MAX) {
+        sprintf(name, "custom-%d", schema_count);
+        assert(schema_add(name, 0) == schema_count - 1);
+    }
+    assert(schema_add("toomany", 0) == ATTR_UNKNOWN);
+    assert(schema_id("custom-25", 9) == 25);
+    assert(schema_id("description", 11) == ATTR_UNKNOWN);
+    /* Masks. */
+    assert(ATTR_BIT(ATTR_OBJECTCLASS) == 1);
+    assert(ATTR_ALL & ATTR_BIT(ATTR_MEMBERUID));
+    assert(ATTR_ALL & ATTR_BIT(ATTR_MAX - 1));
+    assert(ATTR_ALL & ATTR_VIRTUAL & ATTR_BIT(ATTR_MEMBEROF));
+    assert(!(ATTR_VIRTUAL & ATTR_BIT(ATTR_MEMBERUID)));
+    /* Folding only changes case-insensitive values. */
+    strcpy(name, "PosixAccount");
+    schema_fold(ATTR_OBJECTCLASS, name, strlen(name));
+    assert(!strcmp(name, "posixaccount"));
+    strcpy(name, "/Home/Bob");
+    schema_fold(ATTR_HOMEDIRECTORY, name, strlen(name));
+    assert(!strcmp(name, "/Home/Bob"));
+    /* Equality uses the matching rules. */
+    assert(schema_equal(ATTR_OBJECTCLASS, "posixAccount", 12, "POSIXACCOUNT", 12));
+    assert(!schema_equal(ATTR_OBJECTCLASS, "posixAccount", 12, "posixAccoun", 11));
+    assert(schema_equal(ATTR_UID, "Bob", 3, "bob", 3));
+    assert(!schema_equal(ATTR_MEMBERUID, "Bob", 3, "bob", 3));
+    assert(schema_equal(ATTR_MEMBERUID, "bob", 3, "bob", 3));
+    assert(!schema_equal(ATTR_USERPASSWORD, "{crypt}X", 8, "{crypt}x", 8));
+    assert(schema_equal(ATTR_UIDNUMBER, "1000", 4, "01000", 5));
+    assert(schema_equal(ATTR_SHADOWEXPIRE, "-1", 2, "-1", 2));
+    assert(!schema_equal(ATTR_UIDNUMBER, "1000", 4, "1001", 4));
+    assert(!schema_equal(ATTR_UIDNUMBER, "1000", 4, "1000a", 5));
+    assert(!schema_equal(ATTR_UIDNUMBER, "", 0, "", 0));
+    assert(!schema_equal(ATTR_UIDNUMBER, "-", 1, "-", 1));
+    /* Integers. */
+    long v;
+    assert(schema_int("-42", 3, &v) && v == -42);
+    assert(schema_int("0100x", 4, &v) && v == 100);
+    assert(!schema_int("0100x", 5, &v));
+    assert(!schema_int("", 0, &v));
+    /* Values outside LONG_MIN..LONG_MAX are rejected, not wrapped. */
+    snprintf(num, sizeof(num), "%ld", LONG_MAX);
+    assert(schema_int(num, strlen(num), &v) && v == LONG_MAX);
+    snprintf(num, sizeof(num), "%ld", LONG_MIN);
+    assert(schema_int(num, strlen(num), &v) && v == LONG_MIN);
+    assert(!schema_int(num + 1, strlen(num + 1), &v));
+    snprintf(num, sizeof(num), "%lu", (unsigned long)LONG_MAX + 2);
+    assert(!schema_int(num, strlen(num), &v));
+    assert(!schema_int("18446744073709552616", 20, &v));
+    assert(!schema_int("-18446744073709552616", 21, &v));
+    assert(!schema_equal(ATTR_UIDNUMBER, "1000", 4, "18446744073709552616", 20));
+    /* Substrings use the case rules but compare integers as strings. */
+    assert(schema_match(ATTR_CN, "Smith", "smi", 3));
+    assert(!schema_match(ATTR_HOMEDIRECTORY, "/Home", "/home", 5));
+    assert(schema_match(ATTR_UIDNUMBER, "1000", "10", 2));
+    assert(!schema_match(ATTR_UIDNUMBER, "01000", "10", 2));
+}
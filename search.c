@@ -0,0 +1,732 @@
+/*=
+ * Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * Licensed under the GPLv3 License. See LICENSE file for details.
+ */
+#include "search.h"
+#include "attrmap.h"
+#include "utils.h"
+
+#define ENTRY filter_plan
+#include "dlist.h"
+
+void entry_init(entry_t *entry, const SearchResultEntry_t *res)
+{
+    assert(entry);
+    assert(res);
+
+    memset(entry, 0, sizeof(*entry));
+    for (int i = 0; i < res->attributes.list.count; i++) {
+        const PartialAttribute_t *a = res->attributes.list.array[i];
+        attr_id id = schema_id((const char *)a->type.buf, a->type.size);
+        if (id != ATTR_UNKNOWN)
+            entry->attr[id] = a;
+    }
+}
+
+/* Get a new '\0' terminated copy of a value normalized for an attribute. */
+static char *value_new(attr_id id, const AssertionValue_t *value)
+{
+    char *v = XNEW(char, value->size + 1);
+
+    memcpy(v, value->buf, value->size);
+    v[value->size] = '\0';
+    if (id != ATTR_UNKNOWN)
+        schema_fold(id, v, value->size);
+    return v;
+}
+
+/* Set a filter_t's attribute and normalized value. */
+static void filter_setvalue(filter_t *f, const AttributeDescription_t *desc, const AssertionValue_t *value)
+{
+    f->id = schema_id((const char *)desc->buf, desc->size);
+    f->len = value->size;
+    f->value = value_new(f->id, value);
+}
+
+/* Set a filter_t's attribute and substrings parts, returning false if they are invalid. */
+static bool filter_setparts(filter_t *f, const SubstringFilter_t *sub, int *param)
+{
+    f->id = schema_id((const char *)sub->type.buf, sub->type.size);
+    f->count = sub->substrings.list.count;
+    f->part = XNEW0(filter_part, f->count);
+    for (int i = 0; i < f->count; i++) {
+        const SubstringValue_t *v = sub->substrings.list.array[i];
+        filter_part *p = &f->part[i];
+        /* Note initial, any, and final all have the same AssertionValue_t type. */
+        p->type = v->present;
+        p->len = v->choice.any.size;
+        p->value = value_new(f->id, &v->choice.any);
+        p->param = (*param)++;
+        /* There must be at least one part, with initial first and final last. */
+        if ((p->type == SubstringValue_PR_initial && i != 0)
+            || (p->type == SubstringValue_PR_final && i != f->count - 1))
+            return false;
+    }
+    return f->count > 0;
+}
+
+/* Compile a Filter into a filter_t, returning false if it is not supported.
+ *
+ * The assertion values are numbered as template parameters in the same order
+ * as filter_template() finds them. */
+static bool filter_compile(filter_t *f, const Filter_t *filter, int *param)
+{
+    Filter_t *const *array;
+
+    memset(f, 0, sizeof(*f));
+    f->op = filter->present;
+    f->id = ATTR_UNKNOWN;
+    f->param = -1;
+    switch (filter->present) {
+    case Filter_PR_and:
+    case Filter_PR_or:
+        if (filter->present == Filter_PR_and) {
+            array = filter->choice.And.list.array;
+            f->count = filter->choice.And.list.count;
+        } else {
+            array = filter->choice.Or.list.array;
+            f->count = filter->choice.Or.list.count;
+        }
+        f->sub = XNEW0(filter_t, f->count);
+        for (int i = 0; i < f->count; i++)
+            if (!filter_compile(&f->sub[i], array[i], param))
+                return false;
+        return true;
+    case Filter_PR_not:
+        f->count = 1;
+        f->sub = XNEW0(filter_t, 1);
+        return filter_compile(f->sub, filter->choice.Not, param);
+    case Filter_PR_equalityMatch:
+        filter_setvalue(f, &filter->choice.equalityMatch.attributeDesc, &filter->choice.equalityMatch.assertionValue);
+        /* The objectClass values are part of the template, not parameters. */
+        if (f->id != ATTR_OBJECTCLASS)
+            f->param = (*param)++;
+        return true;
+    case Filter_PR_present:
+        f->id = schema_id((const char *)filter->choice.present.buf, filter->choice.present.size);
+        return true;
+    case Filter_PR_substrings:
+        return filter_setparts(f, &filter->choice.substrings, param);
+    case Filter_PR_greaterOrEqual:
+    case Filter_PR_lessOrEqual:
+        if (filter->present == Filter_PR_greaterOrEqual)
+            filter_setvalue(f, &filter->choice.greaterOrEqual.attributeDesc,
+                            &filter->choice.greaterOrEqual.assertionValue);
+        else
+            filter_setvalue(f, &filter->choice.lessOrEqual.attributeDesc, &filter->choice.lessOrEqual.assertionValue);
+        f->param = (*param)++;
+        /* Only integer attributes have an ordering, so others never match. */
+        if (f->id == ATTR_UNKNOWN || !(schema_attrs[f->id].flags & ATTR_INTEGER)
+            || !schema_int(f->value, f->len, &f->num))
+            f->op = Filter_PR_NOTHING;
+        return true;
+    case Filter_PR_approxMatch:
+    case Filter_PR_extensibleMatch:
+    default:
+        return false;
+    }
+}
+
+/* Destroy a filter_t freeing its contents only. */
+static void filter_done(filter_t *f)
+{
+    for (int i = 0; f->sub && i < f->count; i++)
+        filter_done(&f->sub[i]);
+    for (int i = 0; f->part && i < f->count; i++)
+        free(f->part[i].value);
+    free(f->sub);
+    free(f->part);
+    free(f->value);
+}
+
+/* Set a filter_t to the constant true or false. */
+static void filter_setconst(filter_t *f, bool value)
+{
+    filter_done(f);
+    memset(f, 0, sizeof(*f));
+    f->op = value ? Filter_PR_and : Filter_PR_or;
+    f->id = ATTR_UNKNOWN;
+    f->param = -1;
+}
+
+/* Check if two filter_t's are the same constant terms without parameters. */
+static bool filter_same(const filter_t *a, const filter_t *b)
+{
+    if (a->op != b->op || a->id != b->id || a->count != b->count || a->param >= 0 || b->param >= 0 || a->part
+        || b->part || a->len != b->len || !a->value != !b->value || (a->value && memcmp(a->value, b->value, a->len)))
+        return false;
+    for (int i = 0; i < a->count; i++)
+        if (!filter_same(&a->sub[i], &b->sub[i]))
+            return false;
+    return true;
+}
+
+/* Get the approximate relative cost of matching a filter_t. */
+static int filter_cost(const filter_t *f)
+{
+    int cost = 1;
+
+    switch (f->op) {
+    case Filter_PR_and:
+    case Filter_PR_or:
+    case Filter_PR_not:
+        for (int i = 0; i < f->count; i++)
+            cost += filter_cost(&f->sub[i]);
+        return cost;
+    case Filter_PR_present:
+        return 1;
+    case Filter_PR_equalityMatch:
+        return f->id == ATTR_OBJECTCLASS ? 2 : 3;
+    case Filter_PR_substrings:
+        return 4 + f->count;
+    default:
+        return 3;
+    }
+}
+
+/* Normalize an and/or filter_t's sub-filters. */
+static void filter_normalize_subs(filter_t *f)
+{
+    const bool isand = f->op == Filter_PR_and;
+    filter_t *sub = f->sub;
+    int count = f->count, n = 0;
+
+    /* Count the sub-filters after flattening nested filters of the same op. */
+    for (int i = 0; i < count; i++)
+        n += sub[i].op == f->op ? sub[i].count : 1;
+    f->sub = XNEW(filter_t, n ? n : 1);
+    f->count = 0;
+    for (int i = 0; i < count; i++) {
+        filter_t *s = sub[i].op == f->op ? sub[i].sub : &sub[i];
+        int m = sub[i].op == f->op ? sub[i].count : 1;
+        for (int j = 0; j < m; j++) {
+            bool dup = false;
+            /* Drop true for and, or false for or, and constant duplicates. */
+            for (int k = 0; !dup && k < f->count; k++)
+                dup = filter_same(&f->sub[k], &s[j]);
+            if (dup || (isand ? filter_istrue(&s[j]) : filter_isfalse(&s[j])))
+                filter_done(&s[j]);
+            else
+                f->sub[f->count++] = s[j];
+        }
+        if (s != &sub[i])
+            free(s);
+    }
+    free(sub);
+    /* Insertion sort the cheapest sub-filters first, keeping the order of equal costs. */
+    for (int i = 1; i < f->count; i++) {
+        filter_t t = f->sub[i];
+        int c = filter_cost(&t), j;
+        for (j = i; j > 0 && filter_cost(&f->sub[j - 1]) > c; j--)
+            f->sub[j] = f->sub[j - 1];
+        f->sub[j] = t;
+    }
+    /* False for and or true for or makes the whole filter constant. */
+    for (int i = 0; i < f->count; i++)
+        if (isand ? filter_isfalse(&f->sub[i]) : filter_istrue(&f->sub[i])) {
+            filter_setconst(f, !isand);
+            return;
+        }
+    /* A single sub-filter can replace the filter. */
+    if (f->count == 1) {
+        sub = f->sub;
+        *f = sub[0];
+        free(sub);
+    }
+}
+
+/* Normalize a compiled filter_t in place. */
+static void filter_normalize(filter_t *f)
+{
+    filter_t *sub;
+
+    for (int i = 0; f->sub && i < f->count; i++)
+        filter_normalize(&f->sub[i]);
+    switch (f->op) {
+    case Filter_PR_and:
+    case Filter_PR_or:
+        filter_normalize_subs(f);
+        break;
+    case Filter_PR_not:
+        if (filter_istrue(f->sub) || filter_isfalse(f->sub)) {
+            filter_setconst(f, filter_isfalse(f->sub));
+        } else if (f->sub->op == Filter_PR_not) {
+            /* Remove double negations. */
+            sub = f->sub;
+            *f = sub->sub[0];
+            free(sub->sub);
+            free(sub);
+        }
+        break;
+    case Filter_PR_equalityMatch:
+        /* All entries are "top", and only the mapped objectClasses exist. */
+        if (f->id == ATTR_UNKNOWN)
+            filter_setconst(f, false);
+        else if (f->id == ATTR_OBJECTCLASS && !strcmp(f->value, "top"))
+            filter_setconst(f, true);
+        else if (f->id == ATTR_OBJECTCLASS && !attrmap_hasclass(&attrmap_passwd, f->value)
+                 && !attrmap_hasclass(&attrmap_group, f->value))
+            filter_setconst(f, false);
+        break;
+    case Filter_PR_present:
+        /* All entries have an objectClass. */
+        if (f->id == ATTR_UNKNOWN || f->id == ATTR_OBJECTCLASS)
+            filter_setconst(f, f->id == ATTR_OBJECTCLASS);
+        break;
+    case Filter_PR_substrings:
+        if (f->id == ATTR_UNKNOWN)
+            filter_setconst(f, false);
+        break;
+    case Filter_PR_NOTHING:
+        filter_setconst(f, false);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Compile and normalize a Filter into a new filter_t, or NULL if it is not supported. */
+static filter_t *filter_plan_compile(const Filter_t *filter)
+{
+    filter_t *f = XNEW(filter_t, 1);
+    int param = 0;
+
+    if (!filter_compile(f, filter, &param)) {
+        filter_free(f);
+        return NULL;
+    }
+    filter_normalize(f);
+    return f;
+}
+
+filter_t *filter_new(const Filter_t *filter)
+{
+    assert(filter);
+
+    return filter_plan_compile(filter);
+}
+
+void filter_free(filter_t *filter)
+{
+    if (filter) {
+        filter_done(filter);
+        free(filter);
+    }
+}
+
+/* Check if a value matches a substrings filter_t's parts. */
+static bool filter_parts_match(const filter_t *filter, const char *v, size_t len)
+{
+    const char *end = v + len;
+
+    for (int i = 0; i < filter->count; i++) {
+        const filter_part *p = &filter->part[i];
+        if (p->len > (size_t)(end - v))
+            return false;
+        switch (p->type) {
+        case SubstringValue_PR_initial:
+            if (!schema_match(filter->id, v, p->value, p->len))
+                return false;
+            v += p->len;
+            break;
+        case SubstringValue_PR_final:
+            if (!schema_match(filter->id, end - p->len, p->value, p->len))
+                return false;
+            v = end;
+            break;
+        default:
+            /* Find the first match for any after the previous parts. */
+            while (!schema_match(filter->id, v, p->value, p->len))
+                if (++v + p->len > end)
+                    return false;
+            v += p->len;
+            break;
+        }
+    }
+    return true;
+}
+
+bool filter_matches(const filter_t *filter, const entry_t *entry)
+{
+    assert(filter);
+    assert(entry);
+    const PartialAttribute_t *attr;
+
+    switch (filter->op) {
+    case Filter_PR_and:
+        for (int i = 0; i < filter->count; i++)
+            if (!filter_matches(&filter->sub[i], entry))
+                return false;
+        return true;
+    case Filter_PR_or:
+        for (int i = 0; i < filter->count; i++)
+            if (filter_matches(&filter->sub[i], entry))
+                return true;
+        return false;
+    case Filter_PR_not:
+        return !filter_matches(filter->sub, entry);
+    case Filter_PR_equalityMatch:
+        if (filter->id == ATTR_UNKNOWN || !(attr = entry->attr[filter->id]))
+            return false;
+        for (int i = 0; i < attr->vals.list.count; i++) {
+            const AttributeValue_t *v = attr->vals.list.array[i];
+            if (schema_equal(filter->id, (const char *)v->buf, v->size, filter->value, filter->len))
+                return true;
+        }
+        return false;
+    case Filter_PR_substrings:
+        if (filter->id == ATTR_UNKNOWN || !(attr = entry->attr[filter->id]))
+            return false;
+        for (int i = 0; i < attr->vals.list.count; i++) {
+            const AttributeValue_t *v = attr->vals.list.array[i];
+            if (filter_parts_match(filter, (const char *)v->buf, v->size))
+                return true;
+        }
+        return false;
+    case Filter_PR_greaterOrEqual:
+    case Filter_PR_lessOrEqual:
+        if (!(attr = entry->attr[filter->id]))
+            return false;
+        for (int i = 0; i < attr->vals.list.count; i++) {
+            const AttributeValue_t *v = attr->vals.list.array[i];
+            long n;
+            if (schema_int((const char *)v->buf, v->size, &n)
+                && (filter->op == Filter_PR_greaterOrEqual ? n >= filter->num : n <= filter->num))
+                return true;
+        }
+        return false;
+    case Filter_PR_present:
+        return filter->id != ATTR_UNKNOWN && entry->attr[filter->id];
+    default:
+        return false;
+    }
+}
+
+attr_mask filter_attrs(const filter_t *filter)
+{
+    assert(filter);
+    attr_mask mask = filter->id != ATTR_UNKNOWN ? ATTR_BIT(filter->id) : 0;
+
+    for (int i = 0; filter->sub && i < filter->count; i++)
+        mask |= filter_attrs(&filter->sub[i]);
+    return mask;
+}
+
+/* The filter template key buffer. */
+typedef struct {
+    char buf[FILTER_KEY_MAX];   /**< The key buffer. */
+    size_t len;                 /**< The key length. */
+    const AssertionValue_t *vals[FILTER_PARAMS_MAX];    /**< The parameter values. */
+    int count;                  /**< The number of parameters. */
+    bool ok;                    /**< If the key and parameters fit. */
+} filter_key;
+
+/* Add data to a filter_key. */
+static void filter_key_add(filter_key *k, const void *data, size_t len)
+{
+    if (k->len + len > sizeof(k->buf))
+        k->ok = false;
+    else {
+        memcpy(k->buf + k->len, data, len);
+        k->len += len;
+    }
+}
+
+/* Add a string to a filter_key. */
+#define filter_key_str(k, s) filter_key_add((k), (s), strlen(s))
+
+/* Add an attribute to a filter_key. */
+static void filter_key_attr(filter_key *k, const AttributeDescription_t *desc)
+{
+    attr_id id = schema_id((const char *)desc->buf, desc->size);
+
+    filter_key_add(k, &id, sizeof(id));
+}
+
+/* Add a parameter to a filter_key with a type char. */
+static void filter_key_param(filter_key *k, char type, const AssertionValue_t *value)
+{
+    filter_key_add(k, &type, 1);
+    if (k->count == FILTER_PARAMS_MAX)
+        k->ok = false;
+    else
+        k->vals[k->count++] = value;
+}
+
+/* Build the template key for a Filter and collect its parameters.
+ *
+ * The key has the structure of the filter with the attribute ids and
+ * everything else that affects the normalized filter, with the assertion values
+ * replaced by parameters in the same order as filter_compile() numbers them. */
+static void filter_template(filter_key *k, const Filter_t *filter)
+{
+    const AttributeValueAssertion_t *ava;
+    const SubstringFilter_t *sub;
+    long num;
+    char c = filter->present;
+
+    filter_key_add(k, &c, 1);
+    switch (filter->present) {
+    case Filter_PR_and:
+        for (int i = 0; i < filter->choice.And.list.count; i++)
+            filter_template(k, filter->choice.And.list.array[i]);
+        filter_key_str(k, ")");
+        break;
+    case Filter_PR_or:
+        for (int i = 0; i < filter->choice.Or.list.count; i++)
+            filter_template(k, filter->choice.Or.list.array[i]);
+        filter_key_str(k, ")");
+        break;
+    case Filter_PR_not:
+        filter_template(k, filter->choice.Not);
+        break;
+    case Filter_PR_equalityMatch:
+        ava = &filter->choice.equalityMatch;
+        filter_key_attr(k, &ava->attributeDesc);
+        if (schema_id((const char *)ava->attributeDesc.buf, ava->attributeDesc.size) == ATTR_OBJECTCLASS) {
+            /* The folded objectClass value is part of the key, ending with a '\0'. */
+            char v[ava->assertionValue.size + 1];
+            memcpy(v, ava->assertionValue.buf, ava->assertionValue.size + 1);
+            schema_fold(ATTR_OBJECTCLASS, v, ava->assertionValue.size);
+            filter_key_add(k, v, sizeof(v));
+        } else
+            filter_key_param(k, '?', &ava->assertionValue);
+        break;
+    case Filter_PR_substrings:
+        sub = &filter->choice.substrings;
+        filter_key_attr(k, &sub->type);
+        for (int i = 0; i < sub->substrings.list.count; i++)
+            filter_key_param(k, sub->substrings.list.array[i]->present, &sub->substrings.list.array[i]->choice.any);
+        filter_key_str(k, ")");
+        break;
+    case Filter_PR_greaterOrEqual:
+    case Filter_PR_lessOrEqual:
+        ava = filter->present == Filter_PR_greaterOrEqual ? &filter->choice.greaterOrEqual : &filter->choice.lessOrEqual;
+        filter_key_attr(k, &ava->attributeDesc);
+        /* Invalid integers never match, so are a different template. */
+        filter_key_param(k, schema_int((const char *)ava->assertionValue.buf, ava->assertionValue.size, &num) ? '?' : '!',
+                         &ava->assertionValue);
+        break;
+    case Filter_PR_present:
+        filter_key_attr(k, &filter->choice.present);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Add a normalized filter_t with its values to a filter_key. */
+static void filter_serial(filter_key *k, const filter_t *f)
+{
+    char c = f->op;
+
+    filter_key_add(k, &c, 1);
+    filter_key_add(k, &f->id, sizeof(f->id));
+    if (f->value)
+        filter_key_add(k, f->value, f->len + 1);
+    for (int i = 0; f->sub && i < f->count; i++)
+        filter_serial(k, &f->sub[i]);
+    for (int i = 0; f->part && i < f->count; i++) {
+        c = f->part[i].type;
+        filter_key_add(k, &c, 1);
+        filter_key_add(k, f->part[i].value, f->part[i].len + 1);
+    }
+    if (f->sub || f->part)
+        filter_key_str(k, ")");
+}
+
+size_t filter_serialize(const filter_t *filter, char *buf, size_t len)
+{
+    assert(filter);
+    assert(buf);
+    filter_key k;
+
+    k.len = k.count = 0;
+    k.ok = true;
+    filter_serial(&k, filter);
+    if (!k.ok || k.len > len)
+        return 0;
+    memcpy(buf, k.buf, k.len);
+    return k.len;
+}
+
+/* Set a filter_t to a copy of a cached filter bound to parameter values. */
+static void filter_bind(filter_t *f, const filter_t *plan, const AssertionValue_t **vals)
+{
+    *f = *plan;
+    if (plan->sub) {
+        f->sub = XNEW(filter_t, plan->count ? plan->count : 1);
+        for (int i = 0; i < plan->count; i++)
+            filter_bind(&f->sub[i], &plan->sub[i], vals);
+    }
+    if (plan->part) {
+        f->part = XNEW(filter_part, plan->count);
+        for (int i = 0; i < plan->count; i++) {
+            f->part[i] = plan->part[i];
+            f->part[i].len = vals[plan->part[i].param]->size;
+            f->part[i].value = value_new(f->id, vals[plan->part[i].param]);
+        }
+    }
+    if (plan->value && plan->param >= 0) {
+        f->len = vals[plan->param]->size;
+        f->value = value_new(f->id, vals[plan->param]);
+        if (f->op == Filter_PR_greaterOrEqual || f->op == Filter_PR_lessOrEqual)
+            schema_int(f->value, f->len, &f->num);
+    } else if (plan->value) {
+        f->value = XNEW(char, plan->len + 1);
+        memcpy(f->value, plan->value, plan->len + 1);
+    }
+}
+
+/* Get the FNV-1a hash of a key. */
+static uint32_t filter_hash(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+/* Destroy and free a filter_plan. */
+static void filter_plan_free(filter_plan *p)
+{
+    filter_free(p->filter);
+    free(p->key);
+    free(p);
+}
+
+void filter_cache_init(filter_cache *cache)
+{
+    assert(cache);
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+void filter_cache_done(filter_cache *cache)
+{
+    assert(cache);
+    filter_plan *p;
+
+    while ((p = cache->lru)) {
+        filter_plan_rem(&cache->lru, p);
+        filter_plan_free(p);
+    }
+    filter_cache_init(cache);
+}
+
+/* Remove the oldest filter_plan from a filter_cache. */
+static void filter_cache_evict(filter_cache *cache)
+{
+    filter_plan *p = cache->lru, **h;
+
+    for (h = &cache->table[p->hash % FILTER_CACHE_SIZE]; *h != p; h = &(*h)->hnext) ;
+    *h = p->hnext;
+    filter_plan_rem(&cache->lru, p);
+    filter_plan_free(p);
+    cache->count--;
+}
+
+filter_t *filter_cache_get(filter_cache *cache, const Filter_t *filter)
+{
+    assert(cache);
+    assert(filter);
+    filter_key k;
+    filter_plan *p;
+    filter_t *f;
+    uint32_t hash;
+
+    k.len = k.count = 0;
+    k.ok = true;
+    filter_template(&k, filter);
+    if (!k.ok) {
+        /* Too big to cache, just compile it. */
+        cache->misses++;
+        return filter_plan_compile(filter);
+    }
+    hash = filter_hash(k.buf, k.len);
+    for (p = cache->table[hash % FILTER_CACHE_SIZE]; p; p = p->hnext)
+        if (p->hash == hash && p->len == k.len && !memcmp(p->key, k.buf, k.len))
+            break;
+    if (p) {
+        cache->hits++;
+        filter_plan_rem(&cache->lru, p);
+    } else {
+        cache->misses++;
+        if (cache->count == FILTER_CACHE_SIZE)
+            filter_cache_evict(cache);
+        p = XNEW0(filter_plan, 1);
+        p->hash = hash;
+        p->len = k.len;
+        p->key = XNEW(char, k.len);
+        memcpy(p->key, k.buf, k.len);
+        p->filter = filter_plan_compile(filter);
+        p->hnext = cache->table[hash % FILTER_CACHE_SIZE];
+        cache->table[hash % FILTER_CACHE_SIZE] = p;
+        cache->count++;
+    }
+    /* Move it to the end of the LRU dlist as the most recently used. */
+    filter_plan_add(&cache->lru, p);
+    if (!p->filter)
+        return NULL;
+    f = XNEW(filter_t, 1);
+    filter_bind(f, p->filter, k.vals);
+    return f;
+}
+
+attr_mask AttributeSelection_mask(const AttributeSelection_t *sel)
+{
+    assert(sel);
+    attr_mask mask = 0;
+
+    /* An empty AttributeSelection means select all non-virtual attributes. */
+    if (!sel->list.count)
+        return ATTR_ALL & ~ATTR_VIRTUAL;
+    for (int i = 0; i < sel->list.count; i++) {
+        const LDAPString_t *s = sel->list.array[i];
+        attr_range r;
+        attr_id id = schema_desc((const char *)s->buf, s->size, &r);
+        if (s->size == 1 && s->buf[0] == '*')
+            mask |= ATTR_ALL & ~ATTR_VIRTUAL;
+        else if (s->size == 1 && s->buf[0] == '+')
+            mask |= ATTR_VIRTUAL;
+        else if (id != ATTR_UNKNOWN)
+            mask |= ATTR_BIT(id);
+    }
+    return mask;
+}
+
+void AttributeSelection_ranges(const AttributeSelection_t *sel, unsigned max, attr_ranges *ranges)
+{
+    assert(sel);
+    assert(ranges);
+    attr_range r;
+
+    ranges->ranged = 0;
+    attr_ranges_all(ranges, ATTR_ALL);
+    for (int i = 0; i < sel->list.count; i++) {
+        const LDAPString_t *s = sel->list.array[i];
+        attr_id id = schema_desc((const char *)s->buf, s->size, &r);
+        if (id != ATTR_UNKNOWN && memchr(s->buf, ';', s->size)) {
+            ranges->range[id] = r;
+            ranges->ranged |= ATTR_BIT(id);
+        }
+    }
+    /* Limit the ranges to the max values. */
+    for (attr_id id = 0; max && id < ATTR_MAX; id++)
+        if (ranges->range[id].high - ranges->range[id].low >= max)
+            ranges->range[id].high = ranges->range[id].low + max - 1;
+}
+
+void attr_ranges_all(attr_ranges *ranges, attr_mask mask)
+{
+    assert(ranges);
+
+    for (attr_id id = 0; id < ATTR_MAX; id++)
+        if (mask & ATTR_BIT(id)) {
+            ranges->range[id].low = 0;
+            ranges->range[id].high = RANGE_END;
+        }
+    ranges->ranged &= ~mask;
+}
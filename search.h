@@ -0,0 +1,147 @@
+/** \file search.h
+ * Compiled search filters and indexed search entries.
+ *
+ * \copyright Copyright (c) 2017 Donovan Baarda <abo@minkirri.apana.org.au>
+ *
+ * \licence Licensed under the GPLv3 License. See LICENSE file for details.
+ *
+ * A SearchRequest Filter is compiled once per request into a filter_t tree
+ * with the attribute names resolved to attr_ids and the assertion values
+ * normalized for the attribute's matching rule. Each candidate entry is
+ * indexed by attr_id into an entry_t, so matching a filter term is an array
+ * lookup instead of a search through the entry's attributes by name.
+ *
+ * Compiled filters are normalized by flattening nested and/or filters,
+ * folding constant terms like (objectClass=top) and unknown attributes, removing
+ * duplicate constant terms, and ordering the cheapest terms first. Since
+ * clients send the same few filters with different assertion values, a
+ * filter_cache keeps the normalized filters in an LRU keyed by the filter's
+ * template, which is the filter with the assertion values replaced by
+ * parameters. A cached filter is bound to a request's assertion values by
+ * copying it with the values substituted. Note objectClass equality values
+ * are part of the template since they are folded into constants. */
+#ifndef LIGHTLDAPD_SEARCH_H
+#define LIGHTLDAPD_SEARCH_H
+
+#include "schema.h"
+#include "asn1/Filter.h"
+#include "asn1/AttributeSelection.h"
+#include "asn1/SearchResultEntry.h"
+#include "asn1/PartialAttribute.h"
+
+/** The entry_t class for a SearchResultEntry indexed by attr_id. */
+typedef struct {
+    const PartialAttribute_t *attr[ATTR_MAX];   /**< The attributes or NULL. */
+} entry_t;
+/** Initialize an entry_t index for a SearchResultEntry. */
+void entry_init(entry_t *entry, const SearchResultEntry_t *res);
+
+/** The filter_part class for a substrings filter part. */
+typedef struct {
+    SubstringValue_PR type;     /**< The initial, any, or final part type. */
+    char *value;                /**< The normalized substring. */
+    size_t len;                 /**< The substring length. */
+    int param;                  /**< The template parameter index. */
+} filter_part;
+
+/** The compiled filter_t class. */
+typedef struct filter_t filter_t;
+struct filter_t {
+    Filter_PR op;               /**< The type of filter. */
+    attr_id id;                 /**< The attribute, or ATTR_UNKNOWN. */
+    char *value;                /**< The normalized assertion value. */
+    size_t len;                 /**< The assertion value length. */
+    long num;                   /**< The integer ordering assertion value. */
+    int param;                  /**< The template parameter index, or -1. */
+    int count;                  /**< The number of sub-filters or parts. */
+    filter_t *sub;              /**< The array of sub-filters. */
+    filter_part *part;          /**< The array of substrings parts. */
+};
+/** Compile a Filter into a new normalized filter_t.
+ *
+ * \param filter - The Filter to compile.
+ *
+ * \return The compiled filter, or NULL if the filter is not supported. */
+filter_t *filter_new(const Filter_t *filter);
+/** Destroy and free a filter_t. */
+void filter_free(filter_t *filter);
+/** Check if a filter_t matches an entry_t. */
+bool filter_matches(const filter_t *filter, const entry_t *entry);
+
+/** Get the attr_mask of attributes used by a filter_t. */
+attr_mask filter_attrs(const filter_t *filter);
+
+/** Serialize a normalized filter_t with its values into a key.
+ *
+ * Filters that normalize to the same filter_t have the same key.
+ *
+ * \return The key length, or 0 if it didn't fit in the buffer. */
+size_t filter_serialize(const filter_t *filter, char *buf, size_t len);
+
+/** Check if a filter_t is the constant true or false.
+ *
+ * These are the empty and and or filters from RFC4526. */
+#define filter_istrue(f) ((f)->op == Filter_PR_and && !(f)->count)
+#define filter_isfalse(f) ((f)->op == Filter_PR_or && !(f)->count)
+
+#define FILTER_CACHE_SIZE 256   /**< The number of cached filters. */
+#define FILTER_KEY_MAX 1024     /**< The max filter template key size. */
+#define FILTER_PARAMS_MAX 64    /**< The max filter template parameters. */
+
+/** The filter_plan class for a cached filter. */
+typedef struct filter_plan filter_plan;
+struct filter_plan {
+    filter_plan *next, *prev;   /**< The LRU dlist pointers. */
+    filter_plan *hnext;         /**< The next in the hash table chain. */
+    uint32_t hash;              /**< The hash of the key. */
+    size_t len;                 /**< The length of the key. */
+    char *key;                  /**< The filter template key. */
+    filter_t *filter;           /**< The normalized filter, or NULL if unsupported. */
+};
+
+/** The filter_cache class. */
+typedef struct {
+    filter_plan *lru;           /**< The LRU dlist with the oldest first. */
+    filter_plan *table[FILTER_CACHE_SIZE];      /**< The hash table. */
+    int count;                  /**< The number of cached filters. */
+    unsigned long hits;         /**< The cache hits counter. */
+    unsigned long misses;       /**< The cache misses counter. */
+} filter_cache;
+/** Initialize an empty filter_cache. */
+void filter_cache_init(filter_cache *cache);
+/** Destroy a filter_cache freeing all cached filters. */
+void filter_cache_done(filter_cache *cache);
+/** Get a new normalized filter_t for a Filter using a filter_cache.
+ *
+ * \return The filter to free with filter_free(), or NULL if the filter is not
+ * supported. */
+filter_t *filter_cache_get(filter_cache *cache, const Filter_t *filter);
+
+/** Get the attr_mask of attributes selected by an AttributeSelection.
+ *
+ * An empty selection or "*" selects all but the ATTR_VIRTUAL attributes, "+"
+ * selects the ATTR_VIRTUAL attributes, and "1.1" or unknown attributes select
+ * nothing. Attributes can be selected with a ";range=low-high" option. */
+attr_mask AttributeSelection_mask(const AttributeSelection_t *sel);
+
+/** The attr_ranges class for the ranges of attribute values to return.
+ *
+ * Attributes selected with a range, or with more values than the max, are
+ * returned with a ";range=low-high" type, where high is "*" if it includes
+ * the last value. Clients get the rest by selecting the next range. */
+typedef struct {
+    attr_mask ranged;           /**< The attributes selected with a range. */
+    attr_range range[ATTR_MAX]; /**< The range of values to return by attr_id. */
+} attr_ranges;
+/** Get the attr_ranges of values selected by an AttributeSelection.
+ *
+ * \param sel - The AttributeSelection to get the ranges from.
+ *
+ * \param max - The max values to return per attribute, or 0 for unlimited.
+ *
+ * \param ranges - The attr_ranges to set. */
+void AttributeSelection_ranges(const AttributeSelection_t *sel, unsigned max, attr_ranges *ranges);
+/** Set the attributes in a mask to return all their values. */
+void attr_ranges_all(attr_ranges *ranges, attr_mask mask);
+
+#endif                          /* LIGHTLDAPD_SEARCH_H */
@@ -17,14 +17,17 @@
 #include <string.h>
 #include <sysexits.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define fail(msg) do { lwarn(msg); return; } while (0);
 #define fail1(msg, ret) do { lwarn(msg); return ret; } while (0);
-#define XNEW(type, n) ({void *_p=malloc(n*sizeof(type)); if (!_p) lerr(EX_OSERR, "malloc"); _p;})
-#define XNEW0(type, n) ({void *_p=calloc(n,sizeof(type)); if (!_p) lerr(EX_OSERR, "calloc"); _p;})
-#define XRENEW(ptr, type, n) ({void *_p=realloc(ptr, n*sizeof(type)); if (!_p) lerr(EX_OSERR, "realloc"); _p;})
+#define XNEW(type, n) ({void *_p=malloc((n)*sizeof(type)); if (!_p) lerr(EX_OSERR, "malloc"); _p;})
+#define XNEW0(type, n) ({void *_p=calloc((n),sizeof(type)); if (!_p) lerr(EX_OSERR, "calloc"); _p;})
+#define XRENEW(ptr, type, n) ({void *_p=realloc((ptr), (n)*sizeof(type)); if (!_p) lerr(EX_OSERR, "realloc"); _p;})
 #define XSTRDUP(s) ({char *_s=strdup(s); if (!_s) lerr(EX_OSERR, "strdup"); _s;})
 #define XSTRNDUP(s, n) ({char *_s=strndup(s,n); if (!_s) lerr(EX_OSERR, "strndup"); _s;})
+#define min(a, b) ({typeof(a) _a=(a); typeof(b) _b=(b); _a < _b ? _a : _b;})
+#define max(a, b) ({typeof(a) _a=(a); typeof(b) _b=(b); _a > _b ? _a : _b;})
 
 /** Get a uid from a user name. */
 #define name2uid(n) ({struct passwd *_p=getpwnam(n); if (!_p) lerrx(EX_OSERR, "User not found: %s", n); _p->pw_uid;})
@@ -38,4 +41,22 @@ static inline bool strends(const char *s, const char *e)
     return el <= sl && strcmp(s + sl - el, e) == 0;
 }
 
+/** Get the monotonic clock time in seconds. */
+static inline double mtime(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1.0e-9;
+}
+
+/** Get the process cpu time used in seconds. */
+static inline double cputime(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1.0e-9;
+}
+
 #endif                          /* LIGHTLDAPD_UTILS_H */